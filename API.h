@@ -1,5 +1,6 @@
 #pragma once
 
+#include <cstdint>
 #include <tuple>
 
 #define GNU_EFI_USE_MS_ABI
@@ -21,6 +22,160 @@ enum class UIUAPITag {
   GetRNG,
   SetVariable,
   LocateHandleBuffer,
+  CreateEvent,
+  CreateEventEx,
+  SetTimer,
+  WaitForEvent,
+  SignalEvent,
+  CloseEvent,
+  CheckEvent,
+  Stall,
+  PollEvents,
+  GetBlockDevice,
+  ReadBlocks,
+  WriteBlocks,
+  FlushBlocks,
+  ReadBlocksEx,
+  WriteBlocksEx,
+  FlushBlocksEx,
+  GetFileSystem,
+  OpenVolume,
+  FileOpen,
+  FileClose,
+  FileDelete,
+  FileRead,
+  FileWrite,
+  FileGetPosition,
+  FileSetPosition,
+  FileGetInfo,
+  FileSetInfo,
+  FileFlush,
+  LoadImage,
+  StartImage,
+  ImageReturned,
+  UnloadImage,
+  GetGraphicsOutput,
+  GetMemoryAttributes,
+  SetMemoryAttributes,
+  ClearMemoryAttributes,
+  SetWatchdogTimer,
+  // Made by stubs that uiu writes to guest memory, not by start.efi
+  Return,
+  HostCall,
+};
+
+// Guest physical addresses of the pages shared between uiu and start.efi.
+// See the memory map in UIU.h.
+constexpr std::uint64_t UIU_NOTIFY_QUEUE_ADDR = 0xf3000;
+constexpr std::uint64_t UIU_CLOCK_PAGE_ADDR = 0xf4000;
+constexpr std::uint64_t UIU_ENTROPY_POOL_ADDR = 0xf5000;
+constexpr std::uint64_t UIU_TIMER_PAGE_ADDR = 0xf8000;
+
+// Event notification functions queued by the host. start.efi calls them
+// when a hypercall returns.
+struct UIUNotifyQueue {
+  struct Entry {
+    EFI_EVENT_NOTIFY function;
+    EFI_EVENT event;
+    VOID* context;
+  };
+
+  static constexpr std::uint32_t size = 128;
+
+  std::uint32_t head;  // advanced by the guest
+  std::uint32_t tail;  // advanced by the host
+  std::uint32_t pending;  // the host has more entries than fit in the ring
+  std::uint32_t dispatching;  // guest-private, notifications do not nest
+  std::uint32_t flush_tlb;  // the host changed the page tables, cleared by the guest
+  Entry entries[size];
+};
+
+static_assert(sizeof(UIUNotifyQueue) <= 0x1000);
+
+// Published by the host before entering the guest, so that start.efi can
+// implement the time services from RDTSC without exiting.
+struct UIUClockPage {
+  std::uint64_t tsc_khz;
+  std::uint64_t tsc_to_ns_mul;  // ns = (tsc - tsc_base) * tsc_to_ns_mul >> 32
+  std::uint64_t tsc_base;
+  std::uint64_t wall_clock_base;  // nanoseconds since the Unix epoch at tsc_base
+  std::uint64_t monotonic_count;  // advanced by the guest
+};
+
+static_assert(sizeof(UIUClockPage) <= 0x1000);
+
+// Refilled by the host on every GetRNG hypercall, start.efi serves small
+// requests from it without exiting.
+struct UIUEntropyPool {
+  std::uint64_t offset;  // first unused byte, advanced by the guest
+  std::uint8_t bytes[0x1000 - sizeof(std::uint64_t)];
+};
+
+static_assert(sizeof(UIUEntropyPool) <= 0x1000);
+
+// Timers of EVT_TIMER events that start.efi runs from the TSC-deadline timer
+// of the local APIC, so that they expire without exiting. The host fills in
+// an entry in CreateEvent and arms it in SetTimer. start.efi calls the
+// notification functions of entries that have one itself and leaves the
+// other expirations to the host, which signals their events.
+struct UIUTimerPage {
+  struct Timer {
+    EFI_EVENT event;  // nullptr for free entries
+    std::uint64_t deadline;  // guest TSC, 0 if not armed
+    std::uint64_t period;  // in TSC ticks, 0 for one-shot timers
+    EFI_EVENT_NOTIFY notify_function;  // only for EVT_NOTIFY_SIGNAL events outside of groups
+    VOID* notify_context;
+    EFI_TPL notify_tpl;
+    std::uint64_t expired;  // the timer expired since its event was last signaled
+  };
+
+  static constexpr std::uint32_t size = 64;
+
+  std::uint32_t enabled;  // set by the host if the vCPU has a TSC-deadline timer
+  std::uint32_t expired;  // an entry without notify_function expired, cleared by the host
+  Timer timers[size];
+};
+
+static_assert(sizeof(UIUTimerPage) <= 0x1000);
+
+// Allocated by start.efi for every block device of the host. The host finds
+// the device of a protocol call from the trailing id.
+struct UIUBlockDevice {
+  EFI_BLOCK_IO_PROTOCOL block_io;
+  EFI_BLOCK_IO2_PROTOCOL block_io2;
+  EFI_BLOCK_IO_MEDIA media;
+  std::uint64_t id;
+};
+
+// Allocated by start.efi for every directory shared by the host.
+struct UIUFileSystem {
+  EFI_SIMPLE_FILE_SYSTEM_PROTOCOL file_system;
+  std::uint64_t id;
+};
+
+// Allocated by start.efi on OpenVolume and Open, freed on Close and Delete.
+struct UIUFile {
+  EFI_FILE_PROTOCOL file;
+  std::uint64_t file_system;
+  std::uint64_t id;
+};
+
+// Allocated by start.efi if the host has a framebuffer. Blt runs in the
+// guest, the host finds changes through dirty page logging.
+struct UIUGraphicsOutput {
+  EFI_GRAPHICS_OUTPUT_PROTOCOL gop;
+  EFI_GRAPHICS_OUTPUT_PROTOCOL_MODE mode;
+  EFI_GRAPHICS_OUTPUT_MODE_INFORMATION info;
+};
+
+// EFI_MEMORY_ATTRIBUTE_PROTOCOL from UEFI 2.10, gnu-efi does not have it
+#define UIU_MEMORY_ATTRIBUTE_PROTOCOL_GUID \
+  {0xf4560cf6, 0x40ec, 0x4b4a, {0xa1, 0x92, 0xbf, 0x1d, 0x57, 0xd0, 0xb1, 0x89}}
+
+struct UIUMemoryAttributeProtocol {
+  EFI_STATUS (EFIAPI *GetMemoryAttributes)(UIUMemoryAttributeProtocol* This, EFI_PHYSICAL_ADDRESS BaseAddress, UINT64 Length, UINT64* Attributes);
+  EFI_STATUS (EFIAPI *SetMemoryAttributes)(UIUMemoryAttributeProtocol* This, EFI_PHYSICAL_ADDRESS BaseAddress, UINT64 Length, UINT64 Attributes);
+  EFI_STATUS (EFIAPI *ClearMemoryAttributes)(UIUMemoryAttributeProtocol* This, EFI_PHYSICAL_ADDRESS BaseAddress, UINT64 Length, UINT64 Attributes);
 };
 
 template <UIUAPITag N>
@@ -97,3 +252,225 @@ struct UIUAPIFn<UIUAPITag::LocateHandleBuffer> {
   using R = EFI_STATUS;
   using Args = std::tuple<EFI_LOCATE_SEARCH_TYPE, EFI_GUID*, VOID*, UINTN*, EFI_HANDLE**>;
 };
+
+template <>
+struct UIUAPIFn<UIUAPITag::CreateEvent> {
+  using R = EFI_STATUS;
+  using Args = std::tuple<UINT32, EFI_TPL, EFI_EVENT_NOTIFY, VOID*, EFI_EVENT*>;
+};
+
+template <>
+struct UIUAPIFn<UIUAPITag::CreateEventEx> {
+  using R = EFI_STATUS;
+  using Args = std::tuple<UINT32, EFI_TPL, EFI_EVENT_NOTIFY, const VOID*, const EFI_GUID*, EFI_EVENT*>;
+};
+
+template <>
+struct UIUAPIFn<UIUAPITag::SetTimer> {
+  using R = EFI_STATUS;
+  using Args = std::tuple<EFI_EVENT, EFI_TIMER_DELAY, UINT64>;
+};
+
+template <>
+struct UIUAPIFn<UIUAPITag::WaitForEvent> {
+  using R = EFI_STATUS;
+  using Args = std::tuple<UINTN, EFI_EVENT*, UINTN*>;
+};
+
+template <>
+struct UIUAPIFn<UIUAPITag::SignalEvent> {
+  using R = EFI_STATUS;
+  using Args = std::tuple<EFI_EVENT>;
+};
+
+template <>
+struct UIUAPIFn<UIUAPITag::CloseEvent> {
+  using R = EFI_STATUS;
+  using Args = std::tuple<EFI_EVENT>;
+};
+
+template <>
+struct UIUAPIFn<UIUAPITag::CheckEvent> {
+  using R = EFI_STATUS;
+  using Args = std::tuple<EFI_EVENT>;
+};
+
+template <>
+struct UIUAPIFn<UIUAPITag::Stall> {
+  using R = EFI_STATUS;
+  using Args = std::tuple<UINTN>;
+};
+
+template <>
+struct UIUAPIFn<UIUAPITag::PollEvents> {
+  using R = EFI_STATUS;
+  using Args = std::tuple<>;
+};
+
+template <>
+struct UIUAPIFn<UIUAPITag::GetBlockDevice> {
+  using R = EFI_STATUS;
+  using Args = std::tuple<UINTN, UIUBlockDevice*>;
+};
+
+template <>
+struct UIUAPIFn<UIUAPITag::ReadBlocks> {
+  using R = EFI_STATUS;
+  using Args = std::tuple<EFI_BLOCK_IO_PROTOCOL*, UINT32, EFI_LBA, UINTN, VOID*>;
+};
+
+template <>
+struct UIUAPIFn<UIUAPITag::WriteBlocks> {
+  using R = EFI_STATUS;
+  using Args = std::tuple<EFI_BLOCK_IO_PROTOCOL*, UINT32, EFI_LBA, UINTN, VOID*>;
+};
+
+template <>
+struct UIUAPIFn<UIUAPITag::FlushBlocks> {
+  using R = EFI_STATUS;
+  using Args = std::tuple<EFI_BLOCK_IO_PROTOCOL*>;
+};
+
+template <>
+struct UIUAPIFn<UIUAPITag::ReadBlocksEx> {
+  using R = EFI_STATUS;
+  using Args = std::tuple<EFI_BLOCK_IO2_PROTOCOL*, UINT32, EFI_LBA, EFI_BLOCK_IO2_TOKEN*, UINTN, VOID*>;
+};
+
+template <>
+struct UIUAPIFn<UIUAPITag::WriteBlocksEx> {
+  using R = EFI_STATUS;
+  using Args = std::tuple<EFI_BLOCK_IO2_PROTOCOL*, UINT32, EFI_LBA, EFI_BLOCK_IO2_TOKEN*, UINTN, VOID*>;
+};
+
+template <>
+struct UIUAPIFn<UIUAPITag::FlushBlocksEx> {
+  using R = EFI_STATUS;
+  using Args = std::tuple<EFI_BLOCK_IO2_PROTOCOL*, EFI_BLOCK_IO2_TOKEN*>;
+};
+
+template <>
+struct UIUAPIFn<UIUAPITag::GetFileSystem> {
+  using R = EFI_STATUS;
+  using Args = std::tuple<UINTN, UIUFileSystem*>;
+};
+
+template <>
+struct UIUAPIFn<UIUAPITag::OpenVolume> {
+  using R = EFI_STATUS;
+  using Args = std::tuple<EFI_SIMPLE_FILE_SYSTEM_PROTOCOL*, UIUFile*>;
+};
+
+template <>
+struct UIUAPIFn<UIUAPITag::FileOpen> {
+  using R = EFI_STATUS;
+  using Args = std::tuple<EFI_FILE_PROTOCOL*, UIUFile*, CHAR16*, UINT64, UINT64>;
+};
+
+template <>
+struct UIUAPIFn<UIUAPITag::FileClose> {
+  using R = EFI_STATUS;
+  using Args = std::tuple<EFI_FILE_PROTOCOL*>;
+};
+
+template <>
+struct UIUAPIFn<UIUAPITag::FileDelete> {
+  using R = EFI_STATUS;
+  using Args = std::tuple<EFI_FILE_PROTOCOL*>;
+};
+
+template <>
+struct UIUAPIFn<UIUAPITag::FileRead> {
+  using R = EFI_STATUS;
+  using Args = std::tuple<EFI_FILE_PROTOCOL*, UINTN*, VOID*>;
+};
+
+template <>
+struct UIUAPIFn<UIUAPITag::FileWrite> {
+  using R = EFI_STATUS;
+  using Args = std::tuple<EFI_FILE_PROTOCOL*, UINTN*, VOID*>;
+};
+
+template <>
+struct UIUAPIFn<UIUAPITag::FileGetPosition> {
+  using R = EFI_STATUS;
+  using Args = std::tuple<EFI_FILE_PROTOCOL*, UINT64*>;
+};
+
+template <>
+struct UIUAPIFn<UIUAPITag::FileSetPosition> {
+  using R = EFI_STATUS;
+  using Args = std::tuple<EFI_FILE_PROTOCOL*, UINT64>;
+};
+
+template <>
+struct UIUAPIFn<UIUAPITag::FileGetInfo> {
+  using R = EFI_STATUS;
+  using Args = std::tuple<EFI_FILE_PROTOCOL*, EFI_GUID*, UINTN*, VOID*>;
+};
+
+template <>
+struct UIUAPIFn<UIUAPITag::FileSetInfo> {
+  using R = EFI_STATUS;
+  using Args = std::tuple<EFI_FILE_PROTOCOL*, EFI_GUID*, UINTN, VOID*>;
+};
+
+template <>
+struct UIUAPIFn<UIUAPITag::FileFlush> {
+  using R = EFI_STATUS;
+  using Args = std::tuple<EFI_FILE_PROTOCOL*>;
+};
+
+template <>
+struct UIUAPIFn<UIUAPITag::LoadImage> {
+  using R = EFI_STATUS;
+  using Args = std::tuple<BOOLEAN, EFI_HANDLE, EFI_DEVICE_PATH*, VOID*, UINTN, EFI_HANDLE*, EFI_SYSTEM_TABLE*>;
+};
+
+template <>
+struct UIUAPIFn<UIUAPITag::StartImage> {
+  using R = EFI_STATUS;
+  using Args = std::tuple<EFI_HANDLE, EFI_IMAGE_ENTRY_POINT*>;
+};
+
+template <>
+struct UIUAPIFn<UIUAPITag::ImageReturned> {
+  using R = EFI_STATUS;
+  using Args = std::tuple<EFI_HANDLE, EFI_STATUS>;
+};
+
+template <>
+struct UIUAPIFn<UIUAPITag::UnloadImage> {
+  using R = EFI_STATUS;
+  using Args = std::tuple<EFI_HANDLE, BOOLEAN>;
+};
+
+template <>
+struct UIUAPIFn<UIUAPITag::GetGraphicsOutput> {
+  using R = EFI_STATUS;
+  using Args = std::tuple<UIUGraphicsOutput*>;
+};
+
+template <>
+struct UIUAPIFn<UIUAPITag::GetMemoryAttributes> {
+  using R = EFI_STATUS;
+  using Args = std::tuple<UIUMemoryAttributeProtocol*, EFI_PHYSICAL_ADDRESS, UINT64, UINT64*>;
+};
+
+template <>
+struct UIUAPIFn<UIUAPITag::SetMemoryAttributes> {
+  using R = EFI_STATUS;
+  using Args = std::tuple<UIUMemoryAttributeProtocol*, EFI_PHYSICAL_ADDRESS, UINT64, UINT64>;
+};
+
+template <>
+struct UIUAPIFn<UIUAPITag::ClearMemoryAttributes> {
+  using R = EFI_STATUS;
+  using Args = std::tuple<UIUMemoryAttributeProtocol*, EFI_PHYSICAL_ADDRESS, UINT64, UINT64>;
+};
+
+template <>
+struct UIUAPIFn<UIUAPITag::SetWatchdogTimer> {
+  using R = EFI_STATUS;
+  using Args = std::tuple<UINTN, UINT64, UINTN, CHAR16*>;
+};
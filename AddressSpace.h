@@ -0,0 +1,193 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fmt/format.h>
+#include <span>
+#include <stdexcept>
+#include <vector>
+
+extern "C" {
+#include <linux/kvm.h>
+}
+
+#include "CR0.h"
+#include "CR4.h"
+#include "EFER.h"
+#include "Machine.h"
+#include "PageTables.h"
+
+// A guest address that the host cannot access on behalf of the guest
+class GuestFault : public std::runtime_error {
+public:
+  GuestFault(std::uint64_t address, const char* reason)
+      : std::runtime_error(fmt::format("guest address {:#x} {}", address, reason)), address(address) {}
+
+  std::uint64_t address;
+};
+
+// The host memory behind a guest buffer, one span per run of pages that
+// are contiguous in guest physical memory
+struct GuestBuffer {
+  void copy_to(std::span<std::byte> destination) const {
+    for (auto span : spans) {
+      std::memcpy(destination.data(), span.data(), span.size());
+      destination = destination.subspan(span.size());
+    }
+  }
+
+  void copy_from(std::span<const std::byte> source) const {
+    for (auto span : spans) {
+      std::memcpy(span.data(), source.data(), span.size());
+      source = source.subspan(span.size());
+    }
+  }
+
+  std::vector<std::span<std::byte>> spans;
+};
+
+// Translates the virtual addresses that the guest passes to hypercalls into
+// guest physical ones. Under uiu's own page tables they are the same. Once
+// the guest loads page tables of its own, they are walked from CR3, and the
+// results kept in a small TLB for the rest of the hypercall. The guest may
+// change its tables between hypercalls without reloading CR3.
+class AddressSpace {
+public:
+  static constexpr std::uint64_t page_size = PageTables::page_size;
+
+  AddressSpace(Machine& machine) : machine(machine) {
+    flush();
+  }
+
+  // Picks up the paging state of the vCPU, on every hypercall
+  void update(const kvm_sregs& sregs) {
+    // A 64-bit guest cannot leave long mode, without paging nothing changes
+    bool paging = (sregs.cr0 & CR0::PG) && (sregs.efer & EFER::LMA);
+    root = paging ? sregs.cr3 & address_mask : 0;
+    la57 = paging && (sregs.cr4 & CR4::LA57);
+    identity = root == 0 || root == PageTables::pml4_address;
+    // The TLB is not used under uiu's own tables
+    if (!identity) {
+      flush();
+    }
+  }
+
+  void flush() {
+    std::ranges::fill(tlb, TLBEntry{});
+  }
+
+  // The guest physical address of the size bytes at address, which have to
+  // be contiguous in guest physical memory. With write, the host has to be
+  // able to write to them, see Machine::writable.
+  std::uint64_t translate(std::uint64_t address, std::uint64_t size, bool write = false) {
+    if (identity) {
+      check_bounds(address, size);
+      check_writable(address, address, size, write);
+      return address;
+    }
+    auto physical = frame(address) + address % page_size;
+    for (std::uint64_t offset = page_size - address % page_size; offset < size; offset += page_size) {
+      if (frame(address + offset) != physical + offset) {
+        throw GuestFault(address, "spans pages that are not contiguous");
+      }
+    }
+    check_writable(address, physical, size, write);
+    return physical;
+  }
+
+  GuestBuffer gather(std::uint64_t address, std::uint64_t size, bool write = false) {
+    GuestBuffer buffer;
+    if (size == 0) {
+      return buffer;
+    }
+    if (identity) {
+      check_bounds(address, size);
+      check_writable(address, address, size, write);
+      buffer.spans.push_back(machine.memory.subspan(address, size));
+      return buffer;
+    }
+    while (size > 0) {
+      auto n = std::min(size, page_size - address % page_size);
+      auto physical = frame(address) + address % page_size;
+      check_writable(address, physical, n, write);
+      auto* data = machine.memory.data() + physical;
+      if (!buffer.spans.empty() && buffer.spans.back().data() + buffer.spans.back().size() == data) {
+        buffer.spans.back() = {buffer.spans.back().data(), buffer.spans.back().size() + n};
+      } else {
+        buffer.spans.push_back({data, n});
+      }
+      address += n;
+      size -= n;
+    }
+    return buffer;
+  }
+
+private:
+  enum : std::uint64_t {
+    PRESENT = 1 << 0,
+    LARGE = 1 << 7,
+  };
+
+  static constexpr std::uint64_t address_mask = 0x000f'ffff'ffff'f000;
+  static constexpr std::size_t tlb_size = 64;
+
+  struct TLBEntry {
+    std::uint64_t page = ~std::uint64_t{0};
+    std::uint64_t frame = 0;
+  };
+
+  void check_bounds(std::uint64_t address, std::uint64_t size) const {
+    if (address >= machine.memory.size() || size > machine.memory.size() - address) {
+      throw GuestFault(address, "is not in memory");
+    }
+  }
+
+  // Like the copies in the image cache, which the host maps read-only
+  void check_writable(std::uint64_t address, std::uint64_t physical, std::uint64_t size, bool write) const {
+    if (write && !machine.writable(physical, size)) {
+      throw GuestFault(address, "is read-only");
+    }
+  }
+
+  // The guest physical address of the page that contains address
+  std::uint64_t frame(std::uint64_t address) {
+    auto page = address / page_size;
+    auto& entry = tlb[page % tlb_size];
+    if (entry.page != page) {
+      entry = {page, walk(address)};
+    }
+    return entry.frame;
+  }
+
+  std::uint64_t walk(std::uint64_t address) const {
+    std::uint64_t table = root;
+    for (int level = la57 ? 5 : 4; level > 0; level--) {
+      int shift = 12 + 9 * (level - 1);
+      std::uint64_t entry_address = table + (address >> shift) % 512 * sizeof(std::uint64_t);
+      check_bounds(entry_address, sizeof(std::uint64_t));
+      std::uint64_t entry;
+      std::memcpy(&entry, machine.memory.data() + entry_address, sizeof(entry));
+      if (!(entry & PRESENT)) {
+        throw GuestFault(address, "is not mapped");
+      }
+      // 1 GiB and 2 MiB pages
+      if (level == 1 || (level <= 3 && (entry & LARGE))) {
+        std::uint64_t mapped = std::uint64_t{1} << shift;
+        auto physical = (entry & address_mask & ~(mapped - 1)) | (address & (mapped - 1) & ~(page_size - 1));
+        check_bounds(physical, page_size);
+        return physical;
+      }
+      table = entry & address_mask;
+    }
+    return 0;  // unreachable
+  }
+
+  Machine& machine;
+  std::uint64_t root = 0;  // 0 without paging
+  bool la57 = false;
+  bool identity = true;
+  std::array<TLBEntry, tlb_size> tlb;
+};
@@ -0,0 +1,95 @@
+#pragma once
+
+#include <chrono>
+#include <mutex>
+#include <optional>
+#include <system_error>
+
+extern "C" {
+#include <linux/kvm.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+}
+
+// Only defined by glibc 2.41 and later
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+// Stops the vCPU that the calling thread runs at a point in time. A timer
+// signal sets immediate_exit, so KVM_RUN returns as soon as possible, also
+// if the signal arrived while the thread handled a hypercall.
+class Alarm {
+public:
+  using Clock = std::chrono::steady_clock;
+
+  Alarm() {
+    static std::once_flag handler_installed;
+    std::call_once(handler_installed, [] {
+      struct sigaction action{};
+      action.sa_handler = [](int) {
+        if (target != nullptr) {
+          target->immediate_exit = 1;
+        }
+      };
+      action.sa_flags = SA_RESTART;
+      sigemptyset(&action.sa_mask);
+      if (sigaction(SIGALRM, &action, nullptr) == -1) {
+        throw std::system_error(errno, std::generic_category());
+      }
+    });
+
+    sigevent event{};
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGALRM;
+    event.sigev_notify_thread_id = gettid();
+    if (timer_create(CLOCK_MONOTONIC, &event, &timer) == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+  }
+
+  ~Alarm() {
+    timer_delete(timer);
+  }
+
+  Alarm(const Alarm&) = delete;
+  Alarm& operator=(const Alarm&) = delete;
+
+  // Replaces the alarm of the calling thread, times in the past ring at once
+  static void set(kvm_run& run, Clock::time_point when) {
+    auto& alarm = of_thread();
+    if (!alarm) {
+      alarm.emplace();
+    }
+    target = &run;
+    auto nanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(when.time_since_epoch()).count();
+    itimerspec spec{
+      // Zero would disarm it
+      .it_value = {.tv_sec = nanoseconds / 1'000'000'000, .tv_nsec = std::max<long>(nanoseconds % 1'000'000'000, 1)},
+    };
+    // steady_clock is CLOCK_MONOTONIC
+    if (timer_settime(alarm->timer, TIMER_ABSTIME, &spec, nullptr) == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+  }
+
+  static void cancel() {
+    auto& alarm = of_thread();
+    if (!alarm) {
+      return;
+    }
+    itimerspec spec{};
+    timer_settime(alarm->timer, 0, &spec, nullptr);
+    target = nullptr;
+  }
+
+private:
+  static std::optional<Alarm>& of_thread() {
+    static thread_local std::optional<Alarm> alarm;
+    return alarm;
+  }
+
+  static inline thread_local kvm_run* volatile target = nullptr;
+  timer_t timer;
+};
@@ -0,0 +1,258 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fmt/format.h>
+#include <fstream>
+#include <map>
+#include <optional>
+#include <random>
+#include <ranges>
+#include <span>
+#include <string>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include <linux/kvm.h>
+}
+
+#define GNU_EFI_USE_MS_ABI
+extern "C" {
+#include <efi.h>
+}
+
+#include "Unwinder.h"
+
+inline auto format_as(const EFI_MEMORY_TYPE& memory_type) {
+  switch (memory_type) {
+  case EfiReservedMemoryType:
+    return "EfiReservedMemoryType";
+  case EfiLoaderCode:
+    return "EfiLoaderCode";
+  case EfiLoaderData:
+    return "EfiLoaderData";
+  case EfiBootServicesCode:
+    return "EfiBootServicesCode";
+  case EfiBootServicesData:
+    return "EfiBootServicesData";
+  case EfiRuntimeServicesCode:
+    return "EfiRuntimeServicesCode";
+  case EfiRuntimeServicesData:
+    return "EfiRuntimeServicesData";
+  case EfiConventionalMemory:
+    return "EfiConventionalMemory";
+  case EfiUnusableMemory:
+    return "EfiUnusableMemory";
+  case EfiACPIReclaimMemory:
+    return "EfiACPIReclaimMemory";
+  case EfiACPIMemoryNVS:
+    return "EfiACPIMemoryNVS";
+  case EfiMemoryMappedIO:
+    return "EfiMemoryMappedIO";
+  case EfiMemoryMappedIOPortSpace:
+    return "EfiMemoryMappedIOPortSpace";
+  case EfiPalCode:
+    return "EfiPalCode";
+  case EfiPersistentMemory:
+    return "EfiPersistentMemory";
+  case EfiUnacceptedMemoryType:
+    return "EfiUnacceptedMemoryType";
+  case EfiMaxMemoryType:
+    return "EfiMaxMemoryType";
+  }
+  return "<unknown>";
+}
+
+// Attributes the pool allocations of the guest to the code that made them.
+// Every allocation is counted per memory type. Per call site, only a sample
+// of them is: the stacks of allocations are walked on average once every
+// rate bytes, and a sampled allocation stands for the allocations it is
+// expected to represent, like in the heap profiler of tcmalloc. A rate of 1
+// walks the stack of every allocation.
+class AllocationProfiler {
+public:
+  using Frame = Unwinder::Frame;
+
+  struct Totals {
+    std::uint64_t allocations = 0;
+    std::uint64_t frees = 0;
+    std::uint64_t bytes = 0;  // of all allocations so far
+    std::uint64_t live_allocations = 0;
+    std::uint64_t live_bytes = 0;
+    std::uint64_t peak_bytes = 0;
+  };
+
+  // Estimated from the sampled allocations
+  struct Site {
+    double allocations = 0;
+    double bytes = 0;
+    double live_allocations = 0;
+    double live_bytes = 0;
+  };
+
+  // The memory type and the stack of the call, innermost frame first
+  using SiteKey = std::pair<EFI_MEMORY_TYPE, std::vector<Frame>>;
+
+  struct Snapshot {
+    Totals total;
+    std::map<SiteKey, Site> sites;
+  };
+
+  AllocationProfiler(const Unwinder& unwinder, std::span<const std::byte> memory, std::uint64_t rate, std::size_t depth)
+      : unwinder(unwinder), memory(memory), rate(rate), depth(depth) {
+    until_sample = next_sample();
+  }
+
+  // regs() has the registers of the vCPU at the call, it is only called for
+  // sampled allocations
+  template <typename F>
+  void allocated(std::uint64_t address, std::uint64_t size, EFI_MEMORY_TYPE type, F&& regs) {
+    for (auto* totals : {&types[type], &total}) {
+      totals->allocations++;
+      totals->bytes += size;
+      totals->live_allocations++;
+      totals->live_bytes += size;
+      totals->peak_bytes = std::max(totals->peak_bytes, totals->live_bytes);
+    }
+    Live allocation{size, type};
+    until_sample -= static_cast<std::int64_t>(size);
+    if (until_sample <= 0) {
+      until_sample = next_sample();
+      allocation.weight = rate <= 1 ? 1.0 : 1.0 / -std::expm1(-double(size) / rate);
+      allocation.site = &sites[{type, unwinder.call_site(regs(), memory, depth)}];
+      allocation.site->allocations += allocation.weight;
+      allocation.site->bytes += allocation.weight * size;
+      allocation.site->live_allocations += allocation.weight;
+      allocation.site->live_bytes += allocation.weight * size;
+      samples++;
+    }
+    live[address] = allocation;
+  }
+
+  void freed(std::uint64_t address) {
+    auto it = live.find(address);
+    if (it == live.end()) {
+      return;
+    }
+    const auto& allocation = it->second;
+    for (auto* totals : {&types[allocation.type], &total}) {
+      totals->frees++;
+      totals->live_allocations--;
+      totals->live_bytes -= allocation.size;
+    }
+    if (allocation.site != nullptr) {
+      allocation.site->live_allocations -= allocation.weight;
+      allocation.site->live_bytes -= allocation.weight * allocation.size;
+    }
+    live.erase(it);
+  }
+
+  // An allocation of size failed, the first such failure keeps a snapshot
+  void exhausted(std::uint64_t size) {
+    if (!at_exhaustion) {
+      at_exhaustion = snapshot();
+      exhausted_by = size;
+    }
+  }
+
+  Snapshot snapshot() const {
+    return {total, sites};
+  }
+
+  // Writes the live bytes of the snapshot as collapsed stacks for
+  // flamegraph.pl, below a frame for their memory type
+  void write_snapshot(const std::filesystem::path& path, const Snapshot& snapshot) const {
+    std::map<std::string, std::uint64_t> lines;
+    for (const auto& [key, site] : snapshot.sites) {
+      std::string line = format_as(key.first);
+      for (const auto& frame : key.second | std::views::reverse) {
+        line += ';';
+        line += unwinder.frame_name(frame);
+      }
+      if (auto bytes = std::llround(site.live_bytes); bytes > 0) {
+        lines[std::move(line)] += bytes;
+      }
+    }
+    std::ofstream out{path};
+    for (const auto& [line, bytes] : lines) {
+      out << fmt::format("{} {}\n", line, bytes);
+    }
+    if (!out) {
+      throw std::system_error(errno, std::generic_category(), path.string());
+    }
+  }
+
+  // Prints the totals per memory type and the call sites of the most
+  // memory still allocated, which at exit are the leaks
+  void report(std::size_t top = 10) const {
+    auto totals = [](const Totals& totals) {
+      return fmt::format("{} allocations of {} bytes, {} with {} bytes live, peak {} bytes",
+                         totals.allocations, totals.bytes, totals.live_allocations, totals.live_bytes, totals.peak_bytes);
+    };
+    fmt::println("Allocations: {}", totals(total));
+    for (const auto& [type, type_totals] : types) {
+      fmt::println("Allocations: {}: {}", format_as(type), totals(type_totals));
+    }
+    if (at_exhaustion) {
+      fmt::println("Allocations: the pool ran out at an allocation of {} bytes, with {} bytes live", exhausted_by, at_exhaustion->total.live_bytes);
+    }
+
+    std::vector<std::pair<const SiteKey*, const Site*>> leaks;
+    for (const auto& [key, site] : sites) {
+      if (std::llround(site.live_bytes) > 0) {
+        leaks.emplace_back(&key, &site);
+      }
+    }
+    if (leaks.empty()) {
+      return;
+    }
+    std::ranges::sort(leaks, std::greater{}, [](const auto& leak) { return leak.second->live_bytes; });
+    fmt::println("Allocations: live at exit by call site, estimated from {} samples:", samples);
+    for (const auto& [key, site] : leaks | std::views::take(top)) {
+      std::string stack;
+      for (const auto& frame : key->second) {
+        stack += stack.empty() ? "" : " <- ";
+        stack += unwinder.frame_name(frame);
+      }
+      fmt::println("  {} bytes in {} allocations of {}: {}", std::llround(site->live_bytes), std::llround(site->live_allocations), format_as(key->first), stack);
+    }
+  }
+
+  Totals total;
+  std::map<EFI_MEMORY_TYPE, Totals> types;
+  std::map<SiteKey, Site> sites;
+  std::uint64_t samples = 0;
+  std::optional<Snapshot> at_exhaustion;
+  std::uint64_t exhausted_by = 0;  // the size of the allocation that failed
+
+private:
+  struct Live {
+    std::uint64_t size;
+    EFI_MEMORY_TYPE type;
+    Site* site = nullptr;  // if sampled
+    double weight = 0;
+  };
+
+  // The distance to the next sampled byte is exponentially distributed,
+  // which makes every byte equally likely to be sampled
+  std::int64_t next_sample() {
+    if (rate <= 1) {
+      return 0;
+    }
+    return 1 + static_cast<std::int64_t>(std::exponential_distribution<double>{1.0 / rate}(random));
+  }
+
+  const Unwinder& unwinder;
+  std::span<const std::byte> memory;
+  std::uint64_t rate;
+  std::size_t depth;
+  std::int64_t until_sample;
+  std::mt19937_64 random;  // seeded the same every run, so that runs sample alike
+  std::unordered_map<std::uint64_t, Live> live;  // by address
+};
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+
+extern "C" {
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+#include "CowOverlay.h"
+
+#define GNU_EFI_USE_MS_ABI
+extern "C" {
+#include <efi.h>
+}
+
+// A host image file, block device or copy-on-write overlay exposed as
+// EFI_BLOCK_IO_PROTOCOL and EFI_BLOCK_IO2_PROTOCOL.
+class BlockDevice {
+public:
+  // Overlays are accessed through the page cache only, so that the base
+  // image is cached once for all VMs sharing it.
+  explicit BlockDevice(CowOverlay&& cow)
+      : read_only(false), block_count(cow.size() / block_size), overlay(std::move(cow)) {
+    if (block_count == 0) {
+      throw std::runtime_error("base image is smaller than one block");
+    }
+  }
+
+  BlockDevice(const std::string& path, bool read_only) : read_only(read_only) {
+    int flags = (read_only ? O_RDONLY : O_RDWR) | O_CLOEXEC;
+    buffered_fd = open(path.c_str(), flags);
+    if (buffered_fd == -1) {
+      throw std::system_error(errno, std::generic_category(), path);
+    }
+    // Not every file system supports O_DIRECT, those files are only accessed
+    // through the page cache.
+    direct_fd = open(path.c_str(), flags | O_DIRECT);
+    if (direct_fd == -1 && errno != EINVAL) {
+      int error = errno;
+      close(buffered_fd);
+      throw std::system_error(error, std::generic_category(), path);
+    }
+
+    struct stat st;
+    if (fstat(buffered_fd, &st) == -1) {
+      int error = errno;
+      close_fds();
+      throw std::system_error(error, std::generic_category(), path);
+    }
+    std::uint64_t size = st.st_size;
+    if (S_ISBLK(st.st_mode)) {
+      int logical_block_size;
+      if (ioctl(buffered_fd, BLKGETSIZE64, &size) == -1 || ioctl(buffered_fd, BLKSSZGET, &logical_block_size) == -1) {
+        int error = errno;
+        close_fds();
+        throw std::system_error(error, std::generic_category(), path);
+      }
+      block_size = logical_block_size;
+    } else if (direct_fd != -1) {
+      // O_DIRECT on files needs what their file system needs, 4 KiB on
+      // some. Kernels that do not tell keep 512.
+      struct statx stx;
+      if (statx(buffered_fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 && (stx.stx_mask & STATX_DIOALIGN)) {
+        if (stx.stx_dio_offset_align == 0) {
+          close(direct_fd);
+          direct_fd = -1;
+        } else {
+          block_size = std::max({block_size, stx.stx_dio_offset_align, stx.stx_dio_mem_align});
+        }
+      }
+    }
+    block_count = size / block_size;
+    if (block_count == 0) {
+      close_fds();
+      throw std::runtime_error(path + " is smaller than one block");
+    }
+  }
+
+  ~BlockDevice() {
+    close_fds();
+  }
+
+  BlockDevice(const BlockDevice&) = delete;
+  BlockDevice& operator=(const BlockDevice&) = delete;
+
+  BlockDevice(BlockDevice&& other) noexcept
+      : read_only(other.read_only), block_size(other.block_size), block_count(other.block_count),
+        direct_fd(other.direct_fd), buffered_fd(other.buffered_fd), overlay(std::move(other.overlay)) {
+    other.direct_fd = -1;
+    other.buffered_fd = -1;
+  }
+
+  BlockDevice& operator=(BlockDevice&& other) noexcept {
+    std::swap(read_only, other.read_only);
+    std::swap(block_size, other.block_size);
+    std::swap(block_count, other.block_count);
+    std::swap(direct_fd, other.direct_fd);
+    std::swap(buffered_fd, other.buffered_fd);
+    std::swap(overlay, other.overlay);
+    return *this;
+  }
+
+  // Calls f(fd, file_offset, length, direct) for every part of the transfer
+  // of length bytes at offset to or from buffer. direct is set for O_DIRECT
+  // descriptors. Returns false if an overlay could not make room for a
+  // write.
+  template <typename F>
+  bool map(std::uint64_t offset, std::uint64_t length, const void* buffer, bool write, F&& f) {
+    if (overlay) {
+      return overlay->map(offset, length, write, [&](int fd, std::uint64_t file_offset, std::uint64_t n) {
+        f(fd, file_offset, n, false);
+      });
+    }
+    // O_DIRECT transfers need a buffer aligned to the logical block size,
+    // requests for other buffers go through the page cache.
+    if (direct_fd != -1 && reinterpret_cast<std::uintptr_t>(buffer) % block_size == 0) {
+      f(direct_fd, offset, length, true);
+    } else {
+      f(buffered_fd, offset, length, false);
+    }
+    return true;
+  }
+
+  // The descriptor writes end up in, for flushing
+  int flush_fd() const {
+    return overlay ? overlay->get_overlay_fd() : buffered_fd;
+  }
+
+  EFI_BLOCK_IO_MEDIA media() const {
+    return {
+      .MediaId = media_id,
+      .RemovableMedia = FALSE,
+      .MediaPresent = TRUE,
+      .LogicalPartition = FALSE,
+      .ReadOnly = read_only,
+      .WriteCaching = FALSE,
+      .BlockSize = block_size,
+      .IoAlign = direct_fd != -1 ? block_size : 0,
+      .LastBlock = block_count - 1,
+      .LowestAlignedLba = 0,
+      .LogicalBlocksPerPhysicalBlock = 1,
+      .OptimalTransferLengthGranularity = 0,
+    };
+  }
+
+  static constexpr UINT32 media_id = 0;
+
+  bool read_only;
+  std::uint32_t block_size = 512;
+  std::uint64_t block_count;
+
+private:
+  void close_fds() {
+    if (direct_fd != -1) {
+      close(direct_fd);
+    }
+    if (buffered_fd != -1) {
+      close(buffered_fd);
+    }
+  }
+
+  int direct_fd = -1;
+  int buffered_fd = -1;
+  std::optional<CowOverlay> overlay;
+};
+
+// An in-flight transfer, possibly split into several io_uring operations.
+// An io_uring operation of a BlockRequest, whose user_data is its key in
+// UIU::block_operations
+struct BlockOperation {
+  std::uint64_t request;
+  std::uint32_t length;  // that a complete transfer returns
+};
+
+struct BlockRequest {
+  std::uint64_t token;  // guest address of the EFI_BLOCK_IO2_TOKEN, 0 for blocking requests
+  std::size_t remaining = 0;  // outstanding io_uring operations
+  EFI_STATUS status = EFI_SUCCESS;
+};
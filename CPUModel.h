@@ -0,0 +1,94 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+extern "C" {
+#include <linux/kvm.h>
+}
+
+#include "KVM.h"
+
+// The CPUID the guest sees: what KVM supports on this host, so that the
+// guest gets the host's SIMD extensions, without the features uiu does not
+// set up for it. The local APIC of the in-kernel irqchip is announced with
+// x2APIC and, if KVM emulates it, the TSC-deadline timer.
+class CPUModel {
+public:
+  enum : std::uint64_t {
+    XFEATURE_X87 = 1 << 0,
+    XFEATURE_SSE = 1 << 1,
+    XFEATURE_AVX = 1 << 2,
+    XFEATURE_OPMASK = 1 << 5,
+    XFEATURE_ZMM_HI256 = 1 << 6,
+    XFEATURE_HI16_ZMM = 1 << 7,
+  };
+
+  // MPX, PKRU and AMX state need more than XCR0 and are left out
+  static constexpr std::uint64_t xcr0_mask = XFEATURE_X87|XFEATURE_SSE|XFEATURE_AVX|XFEATURE_OPMASK|XFEATURE_ZMM_HI256|XFEATURE_HI16_ZMM;
+
+  explicit CPUModel(KVM& kvm) : entries(kvm.get_supported_cpuid()) {
+    struct Feature {
+      std::uint32_t function;
+      std::uint32_t reg;  // 0 to 3 for eax, ebx, ecx, edx
+      std::uint32_t bit;
+    };
+    constexpr std::array<Feature, 4> hidden = {{
+      {0x1, 2, 3},  // MONITOR, there is nothing to wait for
+      {0x7, 1, 14},  // MPX
+      {0x7, 2, 3},  // PKU
+      {0x7, 2, 5},  // WAITPKG
+    }};
+    for (auto& entry : entries) {
+      std::array<std::uint32_t*, 4> regs = {&entry.eax, &entry.ebx, &entry.ecx, &entry.edx};
+      for (const auto& feature : hidden) {
+        if (entry.function == feature.function && entry.index == 0) {
+          *regs[feature.reg] &= ~(std::uint32_t{1} << feature.bit);
+        }
+      }
+    }
+
+    // KVM_GET_SUPPORTED_CPUID leaves the TSC-deadline timer to
+    // KVM_CAP_TSC_DEADLINE_TIMER
+    if (auto* leaf = find(0x1, 0)) {
+      leaf->ecx |= 1 << 21;
+      if (kvm.check_extension(KVM_CAP_TSC_DEADLINE_TIMER)) {
+        leaf->ecx |= 1 << 24;
+        tsc_deadline_timer = true;
+      }
+    }
+
+    if (auto* leaf = find(0x1, 0); leaf == nullptr || !(leaf->ecx & (1 << 26))) {
+      return;
+    }
+    auto* xsave = find(0xd, 0);
+    if (xsave == nullptr) {
+      return;
+    }
+    xcr0 = ((std::uint64_t{xsave->edx} << 32) | xsave->eax) & xcr0_mask;
+    xsave->eax = xcr0;
+    xsave->edx = xcr0 >> 32;
+    // Supervisor states are not enabled either
+    if (auto* leaf = find(0xd, 1)) {
+      leaf->ecx = 0;
+      leaf->edx = 0;
+    }
+    std::erase_if(entries, [&](const auto& entry) {
+      return entry.function == 0xd && entry.index >= 2 && entry.index < 64 && !(xcr0 & (std::uint64_t{1} << entry.index));
+    });
+  }
+
+  kvm_cpuid_entry2* find(std::uint32_t function, std::uint32_t index) {
+    for (auto& entry : entries) {
+      if (entry.function == function && entry.index == index) {
+        return &entry;
+      }
+    }
+    return nullptr;
+  }
+
+  std::vector<kvm_cpuid_entry2> entries;
+  std::uint64_t xcr0 = 0;  // 0 without XSAVE
+  bool tsc_deadline_timer = false;
+};
@@ -38,7 +38,7 @@ struct CR4 {
   }
 
   constexpr CR4& set_vme() {
-    value &= VME;
+    value |= VME;
     return *this;
   }
 
@@ -0,0 +1,131 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+extern "C" {
+#include <linux/kvm.h>
+}
+
+// The hypercalls of a run, with what their handlers saw of the guest: its
+// registers, and the pages the guest wrote since the call before. Replaying
+// it runs the handlers without a guest, see UIU::replay_calls.
+//
+// Entries are framed like those of a Journal, a kind, their size as LEB128
+// and their contents.
+class CallTrace {
+public:
+  enum class Kind : std::uint8_t {
+    executable,  // a hash of it
+    memory,  // the host address of guest memory
+    pages,  // the guest physical address and contents of each page
+    call,  // a Call
+  };
+
+  struct Call {
+    std::int16_t nr;
+    kvm_regs regs;
+    kvm_sregs sregs;
+  };
+
+  static CallTrace record(const std::string& path, std::uint64_t executable, const void* memory) {
+    CallTrace trace{path};
+    trace.out.open(path, std::ios::binary|std::ios::trunc);
+    trace.out.write(magic, sizeof(magic));
+    trace.write(Kind::executable, std::as_bytes(std::span{&executable, 1}));
+    trace.write(Kind::memory, std::as_bytes(std::span{&memory, 1}));
+    return trace;
+  }
+
+  static CallTrace replay(const std::string& path, std::uint64_t executable) {
+    CallTrace trace{path};
+    trace.in.open(path, std::ios::binary);
+    char header[sizeof(magic)];
+    if (!trace.in.read(header, sizeof(header)) || std::memcmp(header, magic, sizeof(magic)) != 0) {
+      throw std::runtime_error(path + ": not a uiu call trace");
+    }
+    std::vector<std::byte> recorded;
+    if (trace.read(recorded) != Kind::executable || recorded.size() != sizeof(executable) || std::memcmp(recorded.data(), &executable, sizeof(executable)) != 0) {
+      throw std::runtime_error(path + ": recorded with another executable");
+    }
+    if (trace.read(recorded) != Kind::memory || recorded.size() != sizeof(trace.memory)) {
+      throw std::runtime_error(path + ": malformed");
+    }
+    std::memcpy(&trace.memory, recorded.data(), sizeof(trace.memory));
+    return trace;
+  }
+
+  CallTrace(CallTrace&&) = default;
+  CallTrace& operator=(CallTrace&&) = default;
+
+  ~CallTrace() {
+    if (out.is_open()) {
+      out.flush();
+    }
+  }
+
+  void write(Kind kind, std::span<const std::byte> data) {
+    out.put(static_cast<char>(kind));
+    auto size = data.size();
+    do {
+      out.put(static_cast<char>((size & 0x7f) | (size > 0x7f ? 0x80 : 0)));
+      size >>= 7;
+    } while (size != 0);
+    out.write(reinterpret_cast<const char*>(data.data()), data.size());
+    if (!out) {
+      throw std::runtime_error(path + ": cannot be written");
+    }
+  }
+
+  // The kind of the next entry, whose contents replace data, or nothing at
+  // the end of the trace
+  std::optional<Kind> read(std::vector<std::byte>& data) {
+    int kind = in.get();
+    if (kind == std::ifstream::traits_type::eof()) {
+      return std::nullopt;
+    }
+    std::uint64_t size = 0;
+    for (int shift = 0;; shift += 7) {
+      int byte = in.get();
+      if (byte == std::ifstream::traits_type::eof() || shift > 63) {
+        throw std::runtime_error(path + ": truncated");
+      }
+      size |= std::uint64_t(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) {
+        break;
+      }
+    }
+    data.resize(size);
+    if (!in.read(reinterpret_cast<char*>(data.data()), size)) {
+      throw std::runtime_error(path + ": truncated");
+    }
+    if (kind > int(Kind::call) || (kind == int(Kind::call) && size != sizeof(Call))) {
+      throw std::runtime_error(path + ": malformed");
+    }
+    return Kind{std::uint8_t(kind)};
+  }
+
+  const std::string& get_path() const {
+    return path;
+  }
+
+  // Where guest memory was in the recording
+  void* memory = nullptr;
+
+private:
+  static constexpr char magic[8] = {'U', 'I', 'U', 'C', 'A', 'L', 'L', '1'};
+
+  CallTrace(std::string path) : path(std::move(path)) {}
+
+  std::string path;
+  std::ofstream out;
+  std::ifstream in;
+};
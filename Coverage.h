@@ -0,0 +1,242 @@
+#pragma once
+
+#include <algorithm>
+#include <cerrno>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fmt/format.h>
+#include <fstream>
+#include <map>
+#include <set>
+#include <span>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include "Instructions.h"
+#include "Module.h"
+
+// Basic-block coverage of an image. The first byte of every block is
+// replaced with an int3, and when the guest runs into one, the byte is put
+// back and the block counted as covered. A block costs one exit the first
+// time it runs and nothing after that.
+//
+// Blocks are found by following the control flow from the entry point, the
+// functions of the .pdata and the function symbols. Code that is only
+// reached through indirect jumps, like those of jump tables, or function
+// pointers is not found, and neither is code in images loaded by LoadImage.
+// A guest that reads its own code sees the breakpoints that are left.
+class Coverage {
+public:
+  static constexpr std::byte int3{0xcc};
+
+  Coverage(Module module) : module(std::move(module)) {
+    find_blocks();
+  }
+
+  // Plants the breakpoints of the blocks that are not covered yet into the
+  // image at base, so that coverage accumulates over runs
+  void arm(std::span<std::byte> memory, std::uint64_t image_base) {
+    base = image_base;
+    for (auto& block : blocks) {
+      if (!block.covered) {
+        block.original = memory[base + block.rva];
+        memory[base + block.rva] = int3;
+      }
+    }
+  }
+
+  // Takes the breakpoint at address out and returns true, or returns false
+  // if it is not one of the blocks
+  bool hit(std::span<std::byte> memory, std::uint64_t address) {
+    if (address < base) {
+      return false;
+    }
+    auto it = std::ranges::lower_bound(blocks, address - base, {}, &Block::rva);
+    if (it == blocks.end() || it->rva != address - base || it->covered) {
+      return false;
+    }
+    memory[address] = it->original;
+    it->covered = true;
+    covered++;
+    return true;
+  }
+
+  std::size_t size() const {
+    return blocks.size();
+  }
+
+  std::size_t covered = 0;
+
+  // One bit per block, in the order of their RVAs, least significant first
+  void write_bitmap(const std::filesystem::path& path) const {
+    std::vector<std::uint8_t> bitmap((blocks.size() + 7) / 8);
+    for (std::size_t i = 0; i < blocks.size(); i++) {
+      bitmap[i / 8] |= blocks[i].covered << i % 8;
+    }
+    std::ofstream out{path, std::ios::binary};
+    out.write(reinterpret_cast<const char*>(bitmap.data()), bitmap.size());
+    check(out, path);
+  }
+
+  // There is no line information, so the line numbers are the RVAs of the
+  // blocks. Functions are named after their symbols.
+  void write_lcov(const std::filesystem::path& path) const {
+    std::map<std::uint32_t, std::pair<std::string, bool>> functions;  // rva, name and hit
+    for (const auto& block : blocks) {
+      const auto* symbol = module.symbol(block.rva);
+      if (symbol != nullptr) {
+        auto& function = functions.try_emplace(symbol->rva, symbol->name, false).first->second;
+        function.second |= block.covered;
+      }
+    }
+    std::ofstream out{path};
+    out << fmt::format("TN:\nSF:{}\n", module.name);
+    std::size_t functions_hit = 0;
+    for (const auto& [rva, function] : functions) {
+      out << fmt::format("FN:{},{}\n", rva, function.first);
+    }
+    for (const auto& [rva, function] : functions) {
+      out << fmt::format("FNDA:{},{}\n", int{function.second}, function.first);
+      functions_hit += function.second;
+    }
+    out << fmt::format("FNF:{}\nFNH:{}\n", functions.size(), functions_hit);
+    for (const auto& block : blocks) {
+      out << fmt::format("DA:{},{}\n", block.rva, int{block.covered});
+    }
+    out << fmt::format("LF:{}\nLH:{}\nend_of_record\n", blocks.size(), covered);
+    check(out, path);
+  }
+
+  // The format of DynamoRIO's drcov, which Lighthouse and bncov read
+  void write_drcov(const std::filesystem::path& path) const {
+    std::ofstream out{path, std::ios::binary};
+    out << "DRCOV VERSION: 2\nDRCOV FLAVOR: drcov\n";
+    out << "Module Table: version 2, count 1\n";
+    out << "Columns: id, base, end, entry, checksum, timestamp, path\n";
+    out << fmt::format("  0, {:#018x}, {:#018x}, {:#018x}, 0x00000000, 0x00000000, {}\n",
+                       base, base + module.image.size, base + module.image.entry_point, module.name);
+    out << fmt::format("BB Table: {} bbs\n", covered);
+    for (const auto& block : blocks) {
+      if (!block.covered) {
+        continue;
+      }
+      struct [[gnu::packed]] {
+        std::uint32_t start;
+        std::uint16_t size;
+        std::uint16_t module;
+      } entry{block.rva, static_cast<std::uint16_t>(std::min<std::uint32_t>(block.size, UINT16_MAX)), 0};
+      out.write(reinterpret_cast<const char*>(&entry), sizeof(entry));
+    }
+    check(out, path);
+  }
+
+private:
+  struct Block {
+    std::uint32_t rva;
+    std::uint32_t size;
+    std::byte original{};
+    bool covered = false;
+  };
+
+  static void check(const std::ofstream& out, const std::filesystem::path& path) {
+    if (!out) {
+      throw std::system_error(errno, std::generic_category(), path.string());
+    }
+  }
+
+  // The end of the executable section that contains rva, or 0
+  std::uint64_t code_end(std::uint64_t rva) const {
+    for (const auto& section : module.image.sections) {
+      if ((section.Characteristics & IMAGE_SCN_MEM_EXECUTE) && rva >= section.VirtualAddress &&
+          rva < section.VirtualAddress + section.Misc.VirtualSize) {
+        return std::min<std::uint64_t>(section.VirtualAddress + section.Misc.VirtualSize, module.image.contents.size());
+      }
+    }
+    return 0;
+  }
+
+  void find_blocks() {
+    std::set<std::uint32_t> starts;
+    std::vector<std::uint32_t> pending;
+    auto add = [&](std::uint64_t rva) {
+      if (code_end(rva) > rva && starts.insert(rva).second) {
+        pending.push_back(rva);
+      }
+    };
+    add(module.image.entry_point);
+    for (const auto& function : module.functions) {
+      add(function.begin);
+    }
+    for (const auto& symbol : module.symbols) {
+      if (symbol.function) {
+        add(symbol.rva);
+      }
+    }
+
+    // rva, instruction
+    std::map<std::uint32_t, Instruction> instructions;
+    std::span<const std::byte> contents = module.image.contents;
+    while (!pending.empty()) {
+      std::uint64_t rva = pending.back();
+      pending.pop_back();
+      for (auto end = code_end(rva); rva < end && !instructions.contains(rva); ) {
+        auto instruction = Instruction::decode(contents.subspan(rva, end - rva), rva);
+        if (!instruction) {
+          break;
+        }
+        instructions.emplace(rva, *instruction);
+        auto next = rva + instruction->length;
+        if (instruction->flow == Instruction::Flow::next) {
+          rva = next;
+          continue;
+        }
+        if (instruction->flow != Instruction::Flow::stop) {
+          add(instruction->target);
+        }
+        if (instruction->flow == Instruction::Flow::branch || instruction->flow == Instruction::Flow::call) {
+          add(next);
+        }
+        break;
+      }
+    }
+
+    // A breakpoint inside of an instruction would change it, so starts in
+    // overlapping instructions, which are data decoded as code, are dropped
+    std::set<std::uint32_t> overlapping;
+    std::uint64_t furthest = 0;  // the end of the instructions so far
+    std::uint32_t furthest_start = 0;
+    for (const auto& [rva, instruction] : instructions) {
+      if (rva < furthest) {
+        overlapping.insert(rva);
+        overlapping.insert(furthest_start);
+      }
+      if (rva + instruction.length > furthest) {
+        furthest = rva + instruction.length;
+        furthest_start = rva;
+      }
+    }
+
+    for (auto start : starts) {
+      // Padding between functions never runs
+      if (!instructions.contains(start) || overlapping.contains(start) || contents[start] == int3) {
+        continue;
+      }
+      // A block ends after a branch or before the next block
+      std::uint32_t end = start;
+      for (auto it = instructions.find(start); it != instructions.end() && it->first == end; ++it) {
+        end += it->second.length;
+        if (it->second.flow != Instruction::Flow::next || starts.contains(end)) {
+          break;
+        }
+      }
+      blocks.push_back({start, end - start});
+    }
+  }
+
+  Module module;
+  std::vector<Block> blocks;  // sorted by rva
+  std::uint64_t base = 0;
+};
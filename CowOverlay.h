@@ -0,0 +1,341 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include <fcntl.h>
+#include <linux/fs.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+}
+
+// Header of a copy-on-write overlay file. The overlay holds the clusters a
+// VM wrote to, everything else is read from the read-only base image, so
+// any number of VMs can share one base through the page cache.
+//
+// LAYOUT
+//
+// 0x0000        header
+// bitmap_offset allocation bitmap, one bit per cluster
+// table_offset  cluster table, one slot number per cluster
+// data_offset   cluster data, slot n is at data_offset + (n-1) * cluster_size
+//
+// Everything up to data_offset is mapped into memory. A new overlay is
+// created sparse, so creating one does not depend on the size of the base.
+struct CowHeader {
+  static constexpr char magic_value[8] = {'U', 'I', 'U', 'C', 'O', 'W', '1', '\0'};
+
+  char magic[8];
+  std::uint64_t virtual_size;
+  std::uint32_t cluster_size;
+  std::uint32_t allocated;  // number of slots in use
+  std::uint64_t bitmap_offset;
+  std::uint64_t table_offset;
+  std::uint64_t data_offset;
+  char base_path[0x1000 - 48];
+};
+
+static_assert(sizeof(CowHeader) == 0x1000);
+
+class CowOverlay {
+public:
+  static constexpr std::uint32_t default_cluster_size = 64 << 10;
+
+  // Opens overlay_path as the delta of base_path and creates it if it is
+  // empty or does not exist. An empty overlay_path keeps the delta in
+  // anonymous memory, it is discarded when the overlay is closed.
+  CowOverlay(const std::string& base_path, const std::string& overlay_path) {
+    try {
+      base_fd = open(base_path.c_str(), O_RDONLY|O_CLOEXEC);
+      if (base_fd == -1) {
+        throw std::system_error(errno, std::generic_category(), base_path);
+      }
+      auto base_size = file_size(base_fd, base_path);
+
+      if (overlay_path.empty()) {
+        overlay_fd = memfd_create("uiu-overlay", MFD_CLOEXEC);
+      } else {
+        overlay_fd = open(overlay_path.c_str(), O_RDWR|O_CREAT|O_CLOEXEC, 0644);
+      }
+      if (overlay_fd == -1) {
+        throw std::system_error(errno, std::generic_category(), overlay_path);
+      }
+
+      CowHeader existing;
+      if (file_size(overlay_fd, overlay_path) == 0) {
+        if (base_path.size() >= sizeof(existing.base_path)) {
+          throw std::runtime_error(base_path + ": path too long for an overlay header");
+        }
+        std::uint64_t page_size = sysconf(_SC_PAGESIZE);
+        std::uint64_t clusters = (base_size + default_cluster_size - 1) / default_cluster_size;
+        existing = {
+          .virtual_size = base_size,
+          .cluster_size = default_cluster_size,
+          .allocated = 0,
+          .bitmap_offset = sizeof(CowHeader),
+        };
+        std::memcpy(existing.magic, CowHeader::magic_value, sizeof(existing.magic));
+        std::memcpy(existing.base_path, base_path.c_str(), base_path.size() + 1);
+        existing.table_offset = existing.bitmap_offset + round_up((clusters + 7) / 8, page_size);
+        existing.data_offset = round_up(existing.table_offset + clusters * sizeof(std::uint32_t), default_cluster_size);
+        if (ftruncate(overlay_fd, existing.data_offset) == -1) {
+          throw std::system_error(errno, std::generic_category(), overlay_path);
+        }
+        if (pwrite(overlay_fd, &existing, sizeof(existing), 0) != sizeof(existing)) {
+          throw std::system_error(errno, std::generic_category(), overlay_path);
+        }
+      } else {
+        if (pread(overlay_fd, &existing, sizeof(existing), 0) != sizeof(existing)) {
+          throw std::runtime_error(overlay_path + ": truncated overlay header");
+        }
+        if (std::memcmp(existing.magic, CowHeader::magic_value, sizeof(existing.magic)) != 0) {
+          throw std::runtime_error(overlay_path + ": not an overlay");
+        }
+        if (std::string(existing.base_path, strnlen(existing.base_path, sizeof(existing.base_path))) != base_path ||
+            existing.virtual_size != base_size) {
+          throw std::runtime_error(overlay_path + ": overlay was created for a different base image");
+        }
+      }
+
+      metadata_size = existing.data_offset;
+      metadata = static_cast<std::byte*>(mmap(nullptr, metadata_size, PROT_READ|PROT_WRITE, MAP_SHARED, overlay_fd, 0));
+      if (metadata == MAP_FAILED) {
+        metadata = nullptr;
+        throw std::system_error(errno, std::generic_category(), overlay_path);
+      }
+      header = reinterpret_cast<CowHeader*>(metadata);
+      bitmap = reinterpret_cast<std::uint8_t*>(metadata + header->bitmap_offset);
+      table = reinterpret_cast<std::uint32_t*>(metadata + header->table_offset);
+      clusters = (header->virtual_size + header->cluster_size - 1) / header->cluster_size;
+    } catch (...) {
+      release();
+      throw;
+    }
+  }
+
+  ~CowOverlay() {
+    release();
+  }
+
+  CowOverlay(const CowOverlay&) = delete;
+  CowOverlay& operator=(const CowOverlay&) = delete;
+
+  CowOverlay(CowOverlay&& other) noexcept {
+    *this = std::move(other);
+  }
+
+  CowOverlay& operator=(CowOverlay&& other) noexcept {
+    std::swap(base_fd, other.base_fd);
+    std::swap(overlay_fd, other.overlay_fd);
+    std::swap(metadata, other.metadata);
+    std::swap(metadata_size, other.metadata_size);
+    std::swap(header, other.header);
+    std::swap(bitmap, other.bitmap);
+    std::swap(table, other.table);
+    std::swap(clusters, other.clusters);
+    std::swap(extents, other.extents);
+    return *this;
+  }
+
+  std::uint64_t size() const {
+    return header->virtual_size;
+  }
+
+  int get_overlay_fd() const {
+    return overlay_fd;
+  }
+
+  // Calls f(fd, file_offset, length) for every run of [offset, offset+length)
+  // that lives in one file. Clusters that are about to be written are moved
+  // into the overlay first, copying their base contents unless the write
+  // covers them completely. Returns false if that copy fails, f has then
+  // been called for the runs before the cluster.
+  template <typename F>
+  bool map(std::uint64_t offset, std::uint64_t length, bool write, F&& f) {
+    const std::uint64_t cluster_size = header->cluster_size;
+    while (length > 0) {
+      auto cluster = offset / cluster_size;
+      auto within = offset % cluster_size;
+      if (write && slot_of(cluster) == 0 && !allocate(cluster, within != 0 || length < cluster_size)) {
+        return false;
+      }
+      auto extent = find_extent(cluster);
+      auto n = std::min(length, (extent.first + extent.count) * cluster_size - offset);
+      if (extent.slot == 0) {
+        f(base_fd, offset, n);
+      } else {
+        auto slot = extent.slot + (cluster - extent.first);
+        f(overlay_fd, header->data_offset + (slot - 1) * cluster_size + within, n);
+      }
+      offset += n;
+      length -= n;
+    }
+    return true;
+  }
+
+private:
+  // A run of clusters that are either all in the base (slot 0) or stored in
+  // consecutive overlay slots.
+  struct Extent {
+    std::uint64_t first;
+    std::uint64_t count;
+    std::uint32_t slot;
+  };
+
+  static constexpr std::uint64_t max_extent_clusters = 4096;
+
+  static std::uint64_t round_up(std::uint64_t value, std::uint64_t alignment) {
+    return (value + alignment - 1) / alignment * alignment;
+  }
+
+  static std::uint64_t file_size(int fd, const std::string& path) {
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+      throw std::system_error(errno, std::generic_category(), path);
+    }
+    std::uint64_t size = st.st_size;
+    if (S_ISBLK(st.st_mode) && ioctl(fd, BLKGETSIZE64, &size) == -1) {
+      throw std::system_error(errno, std::generic_category(), path);
+    }
+    return size;
+  }
+
+  std::uint32_t slot_of(std::uint64_t cluster) const {
+    if ((bitmap[cluster / 8] & (1 << (cluster % 8))) == 0) {
+      return 0;
+    }
+    return table[cluster];
+  }
+
+  Extent find_extent(std::uint64_t cluster) {
+    auto next = extents.upper_bound(cluster);
+    if (next != extents.begin()) {
+      auto it = std::prev(next);
+      if (cluster < it->first + it->second.count) {
+        return {it->first, it->second.count, it->second.slot};
+      }
+    }
+    auto limit = std::min(clusters, cluster + max_extent_clusters);
+    if (next != extents.end()) {
+      limit = std::min(limit, next->first);
+    }
+    auto slot = slot_of(cluster);
+    std::uint64_t count = 1;
+    while (cluster + count < limit && slot_of(cluster + count) == (slot == 0 ? 0 : slot + count)) {
+      count++;
+    }
+    // A cached extent that goes on from this one joins it
+    if (next != extents.end() && cluster + count == next->first && next->second.slot == (slot == 0 ? 0 : slot + count) &&
+        count + next->second.count <= max_extent_clusters) {
+      count += next->second.count;
+      extents.erase(next);
+    }
+    extents.emplace(cluster, CachedExtent{count, slot});
+    return {cluster, count, slot};
+  }
+
+  // The slot is only taken once its contents are in place, a failed copy
+  // leaves it free for the next allocation.
+  bool allocate(std::uint64_t cluster, bool copy) {
+    const std::uint64_t cluster_size = header->cluster_size;
+    auto slot = header->allocated + 1;
+    if (copy) {
+      loff_t in = cluster * cluster_size;
+      loff_t out = header->data_offset + (slot - 1) * cluster_size;
+      if (!copy_range(in, out, std::min(cluster_size, header->virtual_size - in))) {
+        return false;
+      }
+    }
+    header->allocated = slot;
+    table[cluster] = slot;
+    bitmap[cluster / 8] |= 1 << (cluster % 8);
+
+    auto next = extents.upper_bound(cluster);
+    if (next != extents.begin() && cluster < std::prev(next)->first + std::prev(next)->second.count) {
+      extents.erase(std::prev(next));
+    }
+    // An extent that ends in the slot before now goes on into this one
+    if (next != extents.begin()) {
+      auto it = std::prev(next);
+      if (it->second.slot != 0 && it->first + it->second.count == cluster && it->second.slot + it->second.count == slot) {
+        extents.erase(it);
+      }
+    }
+    return true;
+  }
+
+  // Copies base contents into the overlay, in the kernel when possible.
+  // Returns false on an I/O error.
+  bool copy_range(loff_t in, loff_t out, std::uint64_t length) {
+    while (length > 0) {
+      auto ret = copy_file_range(base_fd, &in, overlay_fd, &out, length, 0);
+      if (ret > 0) {
+        length -= ret;
+        continue;
+      }
+      if (ret == -1 && errno == EINTR) {
+        continue;
+      }
+      if (ret == -1 && errno != EXDEV && errno != EINVAL && errno != EOPNOTSUPP) {
+        return false;
+      }
+      break;
+    }
+
+    std::vector<std::byte> buffer(std::min<std::uint64_t>(length, header->cluster_size));
+    while (length > 0) {
+      auto ret = pread(base_fd, buffer.data(), std::min<std::uint64_t>(length, buffer.size()), in);
+      if (ret <= 0) {
+        if (ret == -1 && errno == EINTR) {
+          continue;
+        }
+        return false;
+      }
+      if (pwrite(overlay_fd, buffer.data(), ret, out) != ret) {
+        return false;
+      }
+      in += ret;
+      out += ret;
+      length -= ret;
+    }
+    return true;
+  }
+
+  void release() {
+    if (metadata != nullptr) {
+      munmap(metadata, metadata_size);
+    }
+    if (overlay_fd != -1) {
+      close(overlay_fd);
+    }
+    if (base_fd != -1) {
+      close(base_fd);
+    }
+  }
+
+  struct CachedExtent {
+    std::uint64_t count;
+    std::uint32_t slot;
+  };
+
+  int base_fd = -1;
+  int overlay_fd = -1;
+  std::byte* metadata = nullptr;
+  std::size_t metadata_size = 0;
+  CowHeader* header = nullptr;
+  std::uint8_t* bitmap = nullptr;
+  std::uint32_t* table = nullptr;
+  std::uint64_t clusters = 0;
+  std::map<std::uint64_t, CachedExtent> extents;  // keyed by the first cluster
+};
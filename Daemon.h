@@ -0,0 +1,310 @@
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <fmt/format.h>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+extern "C" {
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+}
+
+#include "Image.h"
+#include "KVM.h"
+#include "Placement.h"
+#include "Scheduler.h"
+#include "UIU.h"
+
+// Sent by a client together with its console as SCM_RIGHTS, followed by
+// image_size bytes of the image.
+struct DaemonRequest {
+  std::uint64_t image_size;
+};
+
+// The exit status of the application, or why it did not run to the end
+struct DaemonReply {
+  std::uint64_t status;
+  std::uint8_t exited;
+};
+
+// Runs applications for clients of a Unix socket on a Scheduler. Instances
+// are prepared with start.efi before a client arrives, and reset and
+// prepared again after the client got its reply. There can be more of them
+// than cores, as instances that wait do not hold on to a core.
+class Daemon {
+public:
+  Daemon(KVM& kvm, const std::string& path, const PEImage& start, UIU::Budget budget = {})
+      : kvm(kvm), start(start), budget(budget) {
+    sockaddr_un address{.sun_family = AF_UNIX};
+    if (path.size() >= sizeof(address.sun_path)) {
+      throw std::system_error(ENAMETOOLONG, std::generic_category(), path);
+    }
+    path.copy(address.sun_path, path.size());
+    listener = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (listener == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+    unlink(path.c_str());
+    if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1 || listen(listener, 64) == -1) {
+      throw std::system_error(errno, std::generic_category(), path);
+    }
+  }
+
+  ~Daemon() {
+    close(listener);
+  }
+
+  Daemon(const Daemon&) = delete;
+  Daemon& operator=(const Daemon&) = delete;
+
+  // Prepares an instance for every placement and runs them on a worker for
+  // every core, never returns
+  void serve(std::span<const Placement> placements, std::span<const Placement> cores, std::chrono::nanoseconds slice) {
+    Scheduler scheduler{cores, slice};
+    for (const auto& placement : placements) {
+      release(create_instance(placement));
+    }
+    for (;;) {
+      int client = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+      if (client == -1) {
+        if (errno == EINTR || errno == ECONNABORTED) {
+          continue;
+        }
+        throw std::system_error(errno, std::generic_category());
+      }
+      // Slow clients must not hold up the others
+      std::thread{[this, &scheduler, client] { serve_client(scheduler, client); }}.detach();
+    }
+  }
+
+  // Runs image in the daemon at path, with console as its console
+  static DaemonReply submit(const std::string& path, std::span<const std::byte> image, int console) {
+    sockaddr_un address{.sun_family = AF_UNIX};
+    if (path.size() >= sizeof(address.sun_path)) {
+      throw std::system_error(ENAMETOOLONG, std::generic_category(), path);
+    }
+    path.copy(address.sun_path, path.size());
+    int fd = socket(AF_UNIX, SOCK_STREAM|SOCK_CLOEXEC, 0);
+    if (fd == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+    try {
+      if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == -1) {
+        throw std::system_error(errno, std::generic_category(), path);
+      }
+      DaemonRequest request{.image_size = image.size()};
+      iovec iov{&request, sizeof(request)};
+      alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+      msghdr message{
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control,
+        .msg_controllen = sizeof(control),
+      };
+      auto* header = CMSG_FIRSTHDR(&message);
+      header->cmsg_level = SOL_SOCKET;
+      header->cmsg_type = SCM_RIGHTS;
+      header->cmsg_len = CMSG_LEN(sizeof(int));
+      std::memcpy(CMSG_DATA(header), &console, sizeof(int));
+      if (sendmsg(fd, &message, MSG_NOSIGNAL) != sizeof(request)) {
+        throw std::system_error(errno, std::generic_category());
+      }
+      transfer(fd, {const_cast<std::byte*>(image.data()), image.size()}, true);
+
+      DaemonReply reply;
+      transfer(fd, std::as_writable_bytes(std::span{&reply, 1}), false);
+      close(fd);
+      return reply;
+    } catch (...) {
+      close(fd);
+      throw;
+    }
+  }
+
+private:
+  std::unique_ptr<UIU> create_instance(const Placement& placement) {
+    auto uiu = std::make_unique<UIU>(kvm, placement);
+    uiu->budget = budget;
+    uiu->prepare(start);
+    return uiu;
+  }
+
+  // Waits for a prepared instance
+  std::unique_ptr<UIU> acquire() {
+    std::unique_lock lock{mutex};
+    released.wait(lock, [&] { return !instances.empty(); });
+    auto uiu = std::move(instances.back());
+    instances.pop_back();
+    return uiu;
+  }
+
+  void release(std::unique_ptr<UIU> uiu) {
+    {
+      std::lock_guard lock{mutex};
+      instances.push_back(std::move(uiu));
+    }
+    released.notify_one();
+  }
+
+  void serve_client(Scheduler& scheduler, int client) {
+    bool submitted = false;
+    try {
+      submitted = receive(scheduler, client);
+    } catch (const std::exception& e) {
+      fmt::println("Dropping a client: {}", e.what());
+    }
+    if (!submitted) {
+      close(client);
+    }
+  }
+
+  // Receives an application and submits it to scheduler, which closes
+  // client once it replied. Returns false if it did not get that far.
+  bool receive(Scheduler& scheduler, int client) {
+    DaemonRequest request;
+    iovec iov{&request, sizeof(request)};
+    alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+    msghdr message{
+      .msg_iov = &iov,
+      .msg_iovlen = 1,
+      .msg_control = control,
+      .msg_controllen = sizeof(control),
+    };
+    auto received = recvmsg(client, &message, MSG_CMSG_CLOEXEC|MSG_WAITALL);
+    auto* header = CMSG_FIRSTHDR(&message);
+    int console_fd = -1;
+    if (header != nullptr && header->cmsg_level == SOL_SOCKET && header->cmsg_type == SCM_RIGHTS && header->cmsg_len == CMSG_LEN(sizeof(int))) {
+      std::memcpy(&console_fd, CMSG_DATA(header), sizeof(int));
+    }
+    if (received != sizeof(request) || console_fd == -1) {
+      if (console_fd != -1) {
+        close(console_fd);
+      }
+      return false;
+    }
+    // Applications are loaded below the 1 GiB of guest memory
+    constexpr std::uint64_t max_image_size = 0x4000'0000 - UIU::application_base;
+    Console console{fdopen(console_fd, "w"), &std::fclose};
+    if (!console) {
+      close(console_fd);
+      throw std::system_error(errno, std::generic_category());
+    }
+
+    if (request.image_size > max_image_size) {
+      reply(client, {.status = EFI_OUT_OF_RESOURCES, .exited = false});
+      return false;
+    }
+    std::vector<std::byte> file(request.image_size);
+    transfer(client, file, false);
+    PEImage image;
+    if (auto status = PEImage::parse(file, image); status != EFI_SUCCESS) {
+      reply(client, {.status = status, .exited = false});
+      return false;
+    }
+    auto uiu = acquire();
+    EFI_STATUS status;
+    try {
+      status = uiu->load_application(image);
+    } catch (...) {
+      // The instance may be half loaded, a new one replaces it
+      release(create_instance(uiu->placement));
+      throw;
+    }
+    if (status != EFI_SUCCESS) {
+      // Nothing ran, the instance is still as prepared
+      release(std::move(uiu));
+      reply(client, {.status = status, .exited = false});
+      return false;
+    }
+    uiu->console = console.get();
+    auto& instance = *uiu;
+    scheduler.submit(instance, [this, uiu = std::move(uiu), client, console = std::move(console)](UIU::RunState state, std::exception_ptr error) mutable {
+      uiu->console = stdout;
+      console.reset();
+      auto placement = uiu->placement;
+      try {
+        if (error) {
+          std::rethrow_exception(error);
+        }
+        DaemonReply result{.status = uiu->exit_status.value_or(EFI_ABORTED), .exited = uiu->exit_status.has_value()};
+        if (state == UIU::RunState::out_of_budget || state == UIU::RunState::watchdog) {
+          result.status = EFI_TIMEOUT;
+        }
+        try {
+          reply(client, result);
+        } catch (const std::exception& e) {
+          fmt::println("Dropping a client: {}", e.what());
+        }
+        close(client);
+        uiu->reset();
+        uiu->prepare(start);
+        release(std::move(uiu));
+        return;
+      } catch (const std::exception& e) {
+        fmt::println("Dropping an instance: {}", e.what());
+      } catch (...) {
+        fmt::println("Dropping an instance");
+      }
+      if (error) {
+        close(client);
+      }
+      // The instance may be in any state, a new one replaces it. Without
+      // one, there is a slot less, this runs on a worker of scheduler and
+      // must not throw.
+      try {
+        release(create_instance(placement));
+      } catch (const std::exception& e) {
+        fmt::println("Dropping an instance slot: {}", e.what());
+      } catch (...) {
+        fmt::println("Dropping an instance slot");
+      }
+    });
+    return true;
+  }
+
+  static void reply(int client, const DaemonReply& result) {
+    // The padding is sent too, it must not carry bytes of the daemon's stack
+    DaemonReply reply;
+    std::memset(&reply, 0, sizeof(reply));
+    reply.status = result.status;
+    reply.exited = result.exited;
+    transfer(client, std::as_writable_bytes(std::span{&reply, 1}), true);
+  }
+
+  // Sends or receives all of buffer, clients that go away make it throw
+  static void transfer(int fd, std::span<std::byte> buffer, bool send) {
+    while (!buffer.empty()) {
+      auto ret = send ? ::send(fd, buffer.data(), buffer.size(), MSG_NOSIGNAL) : recv(fd, buffer.data(), buffer.size(), 0);
+      if (ret == -1 && errno == EINTR) {
+        continue;
+      }
+      if (ret <= 0) {
+        throw std::system_error(ret == 0 ? ECONNRESET : errno, std::generic_category());
+      }
+      buffer = buffer.subspan(ret);
+    }
+  }
+
+  using Console = std::unique_ptr<std::FILE, decltype(&std::fclose)>;
+
+  KVM& kvm;
+  const PEImage& start;
+  UIU::Budget budget;
+  int listener = -1;
+  std::mutex mutex;
+  std::condition_variable released;
+  std::vector<std::unique_ptr<UIU>> instances;  // prepared and unused
+};
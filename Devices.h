@@ -0,0 +1,168 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <fmt/format.h>
+#include <functional>
+#include <iterator>
+#include <optional>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+// Handlers of the accesses to a range of I/O ports or MMIO addresses, with
+// offsets from the start of the range. Accesses are 1 to 8 bytes wide.
+struct Device {
+  std::function<std::uint64_t(std::uint64_t offset, std::uint32_t size)> read;
+  std::function<void(std::uint64_t offset, std::uint32_t size, std::uint64_t value)> write;
+};
+
+// The devices of one address space, sorted by address so that an access
+// finds its device with a binary search.
+class DeviceBus {
+public:
+  void add(std::uint64_t base, std::uint64_t size, Device device) {
+    auto it = std::ranges::upper_bound(ranges, base, {}, &Range::base);
+    if ((it != ranges.end() && it->base < base + size) ||
+        (it != ranges.begin() && std::prev(it)->base + std::prev(it)->size > base)) {
+      throw std::runtime_error(fmt::format("device at {:#x} overlaps another one", base));
+    }
+    ranges.insert(it, {base, size, std::move(device)});
+  }
+
+  // Nothing if no device claims address
+  std::optional<std::uint64_t> read(std::uint64_t address, std::uint32_t size) {
+    auto* range = find(address);
+    if (range == nullptr || !range->device.read) {
+      return {};
+    }
+    return range->device.read(address - range->base, size);
+  }
+
+  bool write(std::uint64_t address, std::uint32_t size, std::uint64_t value) {
+    auto* range = find(address);
+    if (range == nullptr || !range->device.write) {
+      return false;
+    }
+    range->device.write(address - range->base, size, value);
+    return true;
+  }
+
+private:
+  struct Range {
+    std::uint64_t base;
+    std::uint64_t size;
+    Device device;
+  };
+
+  Range* find(std::uint64_t address) {
+    auto it = std::ranges::upper_bound(ranges, address, {}, &Range::base);
+    if (it == ranges.begin() || address - std::prev(it)->base >= std::prev(it)->size) {
+      return nullptr;
+    }
+    return &*std::prev(it);
+  }
+
+  std::vector<Range> ranges;
+};
+
+// A 16550 UART that only transmits. The transmitter is always ready and no
+// interrupts are raised, guests poll LSR and write THR.
+class Serial {
+public:
+  static constexpr std::uint16_t port = 0x3f8;
+  static constexpr std::uint16_t size = 8;
+  static constexpr std::uint16_t transmit = 0;  // THR, DLL with DLAB set
+
+  void reset() {
+    *this = {};
+  }
+
+  std::uint8_t read(std::uint64_t offset) {
+    switch (offset) {
+    case 0:
+      return dlab() ? divisor : 0;
+    case 1:
+      return dlab() ? divisor >> 8 : ier;
+    case 2:
+      return fcr & FIFO_ENABLE ? 0xc1 : 0x01;  // no interrupt pending
+    case 3:
+      return lcr;
+    case 4:
+      return mcr;
+    case 5:
+      return LSR_THRE|LSR_TEMT;
+    case 6:
+      if (mcr & MCR_LOOP) {
+        // DTR, RTS, OUT1 and OUT2 come back as DSR, CTS, RI and DCD
+        return (mcr & 0x01) << 5 | (mcr & 0x02) << 3 | (mcr & 0x0c) << 4;
+      }
+      return MSR_CTS|MSR_DSR|MSR_DCD;
+    default:
+      return scr;
+    }
+  }
+
+  // Returns the byte to transmit, if any
+  std::optional<std::uint8_t> write(std::uint64_t offset, std::uint8_t value) {
+    switch (offset) {
+    case 0:
+      if (dlab()) {
+        divisor = (divisor & 0xff00) | value;
+      } else if (!(mcr & MCR_LOOP)) {
+        return value;
+      }
+      break;
+    case 1:
+      if (dlab()) {
+        divisor = (divisor & 0x00ff) | value << 8;
+      } else {
+        ier = value & 0x0f;
+      }
+      break;
+    case 2:
+      fcr = value;
+      break;
+    case 3:
+      lcr = value;
+      break;
+    case 4:
+      mcr = value & 0x1f;
+      break;
+    case 7:
+      scr = value;
+      break;
+    }
+    return {};
+  }
+
+private:
+  enum : std::uint8_t {
+    FIFO_ENABLE = 1 << 0,
+    LCR_DLAB = 1 << 7,
+    MCR_LOOP = 1 << 4,
+    LSR_THRE = 1 << 5,
+    LSR_TEMT = 1 << 6,
+    MSR_CTS = 1 << 4,
+    MSR_DSR = 1 << 5,
+    MSR_DCD = 1 << 7,
+  };
+
+  bool dlab() const {
+    return lcr & LCR_DLAB;
+  }
+
+  std::uint16_t divisor = 12;  // 9600 baud
+  std::uint8_t ier = 0;
+  std::uint8_t fcr = 0;
+  std::uint8_t lcr = 0x03;  // 8N1
+  std::uint8_t mcr = 0;
+  std::uint8_t scr = 0;
+};
+
+// The debug console of QEMU, which OVMF logs to: writes are characters, and
+// reads return a magic value that tells the guest that it is there.
+struct DebugConsole {
+  static constexpr std::uint16_t port = 0x402;
+  static constexpr std::uint8_t readback = 0xe9;
+};
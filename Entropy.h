@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <random>
+#include <span>
+#include <system_error>
+
+extern "C" {
+#include <sys/random.h>
+}
+
+// Source of the bytes handed out by EFI_RNG_PROTOCOL. Uses getrandom() by
+// default, or a seeded PRNG to make runs reproducible.
+class Entropy {
+public:
+  Entropy() = default;
+
+  explicit Entropy(std::uint64_t seed) : prng(std::in_place, seed) {}
+
+  void fill(std::span<std::byte> buffer) {
+    if (prng) {
+      while (!buffer.empty()) {
+        auto value = (*prng)();
+        auto n = std::min(buffer.size(), sizeof(value));
+        std::memcpy(buffer.data(), &value, n);
+        buffer = buffer.subspan(n);
+      }
+      return;
+    }
+    while (!buffer.empty()) {
+      auto ret = getrandom(buffer.data(), buffer.size(), 0);
+      if (ret == -1) {
+        if (errno == EINTR) {
+          continue;
+        }
+        throw std::system_error(errno, std::generic_category());
+      }
+      buffer = buffer.subspan(ret);
+    }
+  }
+
+private:
+  std::optional<std::mt19937_64> prng;
+};
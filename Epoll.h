@@ -0,0 +1,265 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <span>
+#include <system_error>
+#include <utility>
+
+extern "C" {
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+#include <unistd.h>
+}
+
+inline timespec to_timespec(std::chrono::nanoseconds ns) {
+  return {
+    .tv_sec = static_cast<time_t>(ns.count() / 1'000'000'000),
+    .tv_nsec = static_cast<long>(ns.count() % 1'000'000'000),
+  };
+}
+
+class TimerFD {
+public:
+  TimerFD() = default;
+
+  static TimerFD create() {
+    int ret = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK|TFD_CLOEXEC);
+    if (ret == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+    return TimerFD(ret);
+  }
+
+  ~TimerFD() {
+    if (*this) {
+      close(fd);
+    }
+  }
+
+  TimerFD(const TimerFD&) = delete;
+  TimerFD& operator=(const TimerFD&) = delete;
+
+  TimerFD(TimerFD&& other) noexcept : fd(other.fd) {
+    other.fd = -1;
+  }
+
+  TimerFD& operator=(TimerFD&& other) noexcept {
+    std::swap(fd, other.fd);
+    if (other.fd != -1) {
+      close(other.fd);
+      other.fd = -1;
+    }
+    return *this;
+  }
+
+  // A zero interval arms a one-shot timer, a zero value disarms it.
+  void set(std::chrono::nanoseconds value, std::chrono::nanoseconds interval = {}) {
+    itimerspec spec{
+      .it_interval = to_timespec(interval),
+      .it_value = to_timespec(value),
+    };
+    int ret = timerfd_settime(fd, 0, &spec, nullptr);
+    if (ret == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+  }
+
+  // Returns the number of expirations since the last call, 0 if none.
+  std::uint64_t expirations() {
+    std::uint64_t count = 0;
+    int ret = read(fd, &count, sizeof(count));
+    if (ret == -1) {
+      if (errno == EAGAIN) {
+        return 0;
+      }
+      throw std::system_error(errno, std::generic_category());
+    }
+    return count;
+  }
+
+  operator bool() const {
+    return fd != -1;
+  }
+
+  int get_fd() const {
+    return fd;
+  }
+
+private:
+  TimerFD(int fd) : fd{fd} {}
+
+  int fd = -1;
+};
+
+class EventFD {
+public:
+  EventFD() = default;
+
+  static EventFD create() {
+    int ret = eventfd(0, EFD_NONBLOCK|EFD_CLOEXEC);
+    if (ret == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+    return EventFD(ret);
+  }
+
+  ~EventFD() {
+    if (*this) {
+      close(fd);
+    }
+  }
+
+  EventFD(const EventFD&) = delete;
+  EventFD& operator=(const EventFD&) = delete;
+
+  EventFD(EventFD&& other) noexcept : fd(other.fd) {
+    other.fd = -1;
+  }
+
+  EventFD& operator=(EventFD&& other) noexcept {
+    std::swap(fd, other.fd);
+    if (other.fd != -1) {
+      close(other.fd);
+      other.fd = -1;
+    }
+    return *this;
+  }
+
+  // Adds one to the counter, which makes the fd readable.
+  void notify() {
+    std::uint64_t one = 1;
+    if (write(fd, &one, sizeof(one)) == -1 && errno != EAGAIN) {
+      throw std::system_error(errno, std::generic_category());
+    }
+  }
+
+  // Resets the counter, returns its previous value.
+  std::uint64_t clear() {
+    std::uint64_t count = 0;
+    int ret = read(fd, &count, sizeof(count));
+    if (ret == -1) {
+      if (errno == EAGAIN) {
+        return 0;
+      }
+      throw std::system_error(errno, std::generic_category());
+    }
+    return count;
+  }
+
+  operator bool() const {
+    return fd != -1;
+  }
+
+  int get_fd() const {
+    return fd;
+  }
+
+private:
+  EventFD(int fd) : fd{fd} {}
+
+  int fd = -1;
+};
+
+class Epoll {
+public:
+  Epoll() {
+    fd = epoll_create1(EPOLL_CLOEXEC);
+    if (fd == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+  }
+
+  ~Epoll() {
+    if (*this) {
+      close(fd);
+    }
+  }
+
+  Epoll(const Epoll&) = delete;
+  Epoll& operator=(const Epoll&) = delete;
+
+  Epoll(Epoll&& other) noexcept : fd(other.fd) {
+    other.fd = -1;
+  }
+
+  Epoll& operator=(Epoll&& other) noexcept {
+    std::swap(fd, other.fd);
+    if (other.fd != -1) {
+      close(other.fd);
+      other.fd = -1;
+    }
+    return *this;
+  }
+
+  void add(int watched, std::uint64_t data, std::uint32_t events = EPOLLIN) {
+    epoll_event event{
+      .events = events,
+      .data = {.u64 = data},
+    };
+    int ret = epoll_ctl(fd, EPOLL_CTL_ADD, watched, &event);
+    if (ret == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+  }
+
+  void remove(int watched) {
+    int ret = epoll_ctl(fd, EPOLL_CTL_DEL, watched, nullptr);
+    if (ret == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+  }
+
+  // Blocks for at most timeout milliseconds, -1 blocks until an event is
+  // ready. Returns the ready events, which is empty on timeout or when
+  // interrupted by a signal.
+  std::span<epoll_event> wait(std::span<epoll_event> ready, int timeout) {
+    int ret = epoll_wait(fd, ready.data(), ready.size(), timeout);
+    if (ret == -1) {
+      if (errno == EINTR) {
+        return {};
+      }
+      throw std::system_error(errno, std::generic_category());
+    }
+    return ready.first(ret);
+  }
+
+  // The same with a timeout in nanoseconds, nullopt blocks until an event is
+  // ready. Kernels before 5.11 round it up to milliseconds.
+  std::span<epoll_event> wait(std::span<epoll_event> ready, std::optional<std::chrono::nanoseconds> timeout) {
+    timespec spec;
+    if (timeout) {
+      spec = to_timespec(*timeout);
+    }
+    int ret = epoll_pwait2(fd, ready.data(), ready.size(), timeout ? &spec : nullptr, nullptr);
+    if (ret == -1) {
+      if (errno == ENOSYS) {
+        int milliseconds = -1;
+        if (timeout) {
+          milliseconds = std::min<std::int64_t>(std::chrono::ceil<std::chrono::milliseconds>(*timeout).count(), std::numeric_limits<int>::max());
+        }
+        return wait(ready, milliseconds);
+      }
+      if (errno == EINTR) {
+        return {};
+      }
+      throw std::system_error(errno, std::generic_category());
+    }
+    return ready.first(ret);
+  }
+
+  operator bool() const {
+    return fd != -1;
+  }
+
+  int get_fd() const {
+    return fd;
+  }
+
+private:
+  int fd = -1;
+};
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <optional>
+
+#include "Epoll.h"
+
+#define GNU_EFI_USE_MS_ABI
+extern "C" {
+#include <efi.h>
+}
+
+struct Event {
+  // Period of TimerPeriodic timers with a TriggerTime of 0
+  static constexpr std::chrono::nanoseconds timer_tick = std::chrono::milliseconds(10);
+
+  bool is_notify_signal() const {
+    return (type & EVT_NOTIFY_SIGNAL) == EVT_NOTIFY_SIGNAL;
+  }
+
+  bool is_notify_wait() const {
+    return (type & EVT_NOTIFY_WAIT) == EVT_NOTIFY_WAIT;
+  }
+
+  bool is_timer() const {
+    return (type & EVT_TIMER) == EVT_TIMER;
+  }
+
+  UINT32 type;
+  EFI_TPL notify_tpl;
+  EFI_EVENT_NOTIFY notify_function;
+  VOID* notify_context;
+  std::optional<EFI_GUID> group;
+  bool signaled = false;
+
+  // Only used by EVT_TIMER events. Timers that start.efi runs have an entry
+  // in UIUTimerPage, the others a timerfd.
+  std::optional<std::uint32_t> guest_timer;
+  TimerFD timer;
+  bool armed = false;
+  bool periodic = false;
+};
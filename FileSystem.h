@@ -0,0 +1,522 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <codecvt>  // std::codecvt_utf8
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <locale>  // std::wstring_convert
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
+}
+
+#define GNU_EFI_USE_MS_ABI
+extern "C" {
+#include <efi.h>
+}
+
+inline EFI_TIME to_efi_time(const timespec& ts) {
+  using namespace std::chrono;
+  sys_seconds time{seconds{ts.tv_sec}};
+  auto day = floor<days>(time);
+  year_month_day ymd{day};
+  hh_mm_ss hms{time - day};
+  return {
+    .Year = static_cast<UINT16>(static_cast<int>(ymd.year())),
+    .Month = static_cast<UINT8>(static_cast<unsigned>(ymd.month())),
+    .Day = static_cast<UINT8>(static_cast<unsigned>(ymd.day())),
+    .Hour = static_cast<UINT8>(hms.hours().count()),
+    .Minute = static_cast<UINT8>(hms.minutes().count()),
+    .Second = static_cast<UINT8>(hms.seconds().count()),
+    .Nanosecond = static_cast<UINT32>(ts.tv_nsec),
+    .TimeZone = EFI_UNSPECIFIED_TIMEZONE,
+  };
+}
+
+// A directory of the host exposed as EFI_SIMPLE_FILE_SYSTEM_PROTOCOL. Paths
+// from the guest are resolved lexically, ".." never leaves the root.
+// Symbolic links inside the directory are followed as long as they stay in
+// it, paths that lead out of the root are not found.
+class HostFileSystem {
+public:
+  struct File {
+    File() = default;
+
+    ~File() {
+      if (fd != -1) {
+        close(fd);
+      }
+    }
+
+    File(const File&) = delete;
+    File& operator=(const File&) = delete;
+
+    File(File&& other) noexcept {
+      *this = std::move(other);
+    }
+
+    File& operator=(File&& other) noexcept {
+      std::swap(path, other.path);
+      std::swap(fd, other.fd);
+      std::swap(directory, other.directory);
+      std::swap(writable, other.writable);
+      std::swap(position, other.position);
+      std::swap(entries, other.entries);
+      return *this;
+    }
+
+    std::filesystem::path path;  // relative to the root, empty for the root
+    int fd = -1;  // only for regular files
+    bool directory = false;
+    bool writable = false;
+    std::uint64_t position = 0;  // index into entries for directories
+    std::vector<std::filesystem::path> entries;
+  };
+
+  // Reads of at least this size into page-aligned buffers map the file
+  // instead of copying it.
+  static constexpr std::uint64_t remap_threshold = 2 << 20;
+
+  explicit HostFileSystem(std::filesystem::path root) : root(std::filesystem::canonical(root)) {
+    if (!std::filesystem::is_directory(this->root)) {
+      throw std::runtime_error(this->root.string() + " is not a directory");
+    }
+  }
+
+  std::uint64_t open_volume() {
+    File file;
+    file.directory = true;
+    return insert(std::move(file));
+  }
+
+  EFI_STATUS open(std::uint64_t parent_id, std::u16string_view name, UINT64 mode, UINT64 attributes, std::uint64_t& new_id) {
+    if (mode != EFI_FILE_MODE_READ && mode != (EFI_FILE_MODE_READ|EFI_FILE_MODE_WRITE) &&
+        mode != (EFI_FILE_MODE_READ|EFI_FILE_MODE_WRITE|EFI_FILE_MODE_CREATE)) {
+      return EFI_INVALID_PARAMETER;
+    }
+    auto* parent_file = find(parent_id);
+    if (parent_file == nullptr) {
+      return EFI_INVALID_PARAMETER;
+    }
+    const auto& parent = *parent_file;
+    auto path = resolve(parent.directory ? parent.path : parent.path.parent_path(), name);
+    auto host_path = contained(path);
+    if (!host_path) {
+      return EFI_NOT_FOUND;
+    }
+
+    std::error_code ec;
+    auto status = std::filesystem::status(*host_path, ec);
+    if (!std::filesystem::exists(status)) {
+      if (!(mode & EFI_FILE_MODE_CREATE)) {
+        return EFI_NOT_FOUND;
+      }
+      if (attributes & EFI_FILE_DIRECTORY) {
+        if (!std::filesystem::create_directory(*host_path, ec)) {
+          return EFI_ACCESS_DENIED;
+        }
+        status = std::filesystem::status(*host_path, ec);
+      }
+    }
+
+    File file;
+    file.path = path;
+    file.writable = mode & EFI_FILE_MODE_WRITE;
+    if (std::filesystem::is_directory(status)) {
+      file.directory = true;
+    } else {
+      int flags = (file.writable ? O_RDWR : O_RDONLY) | O_CLOEXEC;
+      if (mode & EFI_FILE_MODE_CREATE) {
+        // A dangling symbolic link would create its target, which may be
+        // anywhere
+        flags |= O_CREAT|(std::filesystem::exists(status) ? 0 : O_NOFOLLOW);
+      }
+      file.fd = ::open(host_path->c_str(), flags, 0644);
+      if (file.fd == -1) {
+        return errno == ENOENT ? EFI_NOT_FOUND : EFI_ACCESS_DENIED;
+      }
+    }
+    new_id = insert(std::move(file));
+    return EFI_SUCCESS;
+  }
+
+  EFI_STATUS close_file(std::uint64_t id) {
+    return files.erase(id) == 1 ? EFI_SUCCESS : EFI_INVALID_PARAMETER;
+  }
+
+  EFI_STATUS delete_file(std::uint64_t id) {
+    auto* file = find(id);
+    if (file == nullptr) {
+      return EFI_INVALID_PARAMETER;
+    }
+    auto path = contained(file->path);
+    bool is_root = file->path.empty();
+    files.erase(id);
+    std::error_code ec;
+    if (is_root || !path || !std::filesystem::remove(*path, ec)) {
+      return EFI_WARN_DELETE_FAILURE;
+    }
+    return EFI_SUCCESS;
+  }
+
+  // For regular files, buffer is guest memory. With allow_remap, large
+  // page-aligned reads replace the pages of buffer with a private mapping of
+  // the file, and remapped is set.
+  EFI_STATUS read(std::uint64_t id, std::span<std::byte> buffer, bool allow_remap, UINTN& size, bool& remapped) {
+    auto* found = find(id);
+    if (found == nullptr) {
+      return EFI_INVALID_PARAMETER;
+    }
+    auto& file = *found;
+    if (file.directory) {
+      return read_directory(file, buffer, size);
+    }
+
+    struct stat st;
+    if (fstat(file.fd, &st) == -1) {
+      return EFI_DEVICE_ERROR;
+    }
+    std::uint64_t file_size = st.st_size;
+    if (file.position > file_size) {
+      return EFI_DEVICE_ERROR;
+    }
+    std::uint64_t n = std::min<std::uint64_t>(buffer.size(), file_size - file.position);
+
+    std::uint64_t page_size = sysconf(_SC_PAGESIZE);
+    std::uint64_t done = 0;
+    if (allow_remap && !file.writable && n >= remap_threshold &&
+        reinterpret_cast<std::uintptr_t>(buffer.data()) % page_size == 0 && file.position % page_size == 0) {
+      std::uint64_t length = n / page_size * page_size;
+      void* ret = mmap(buffer.data(), length, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_PRIVATE|MAP_FIXED, file.fd, file.position);
+      if (ret != MAP_FAILED) {
+        done = length;
+        remapped = true;
+      }
+    }
+    while (done < n) {
+      auto ret = pread(file.fd, buffer.data() + done, n - done, file.position + done);
+      if (ret == -1 && errno == EINTR) {
+        continue;
+      }
+      if (ret <= 0) {
+        return EFI_DEVICE_ERROR;
+      }
+      done += ret;
+    }
+    file.position += n;
+    size = n;
+    return EFI_SUCCESS;
+  }
+
+  EFI_STATUS write(std::uint64_t id, std::span<const std::byte> buffer, UINTN& size) {
+    auto* found = find(id);
+    if (found == nullptr) {
+      return EFI_INVALID_PARAMETER;
+    }
+    auto& file = *found;
+    if (file.directory) {
+      return EFI_UNSUPPORTED;
+    }
+    if (!file.writable) {
+      return EFI_ACCESS_DENIED;
+    }
+    std::size_t done = 0;
+    while (done < buffer.size()) {
+      auto ret = pwrite(file.fd, buffer.data() + done, buffer.size() - done, file.position + done);
+      if (ret == -1 && errno == EINTR) {
+        continue;
+      }
+      if (ret <= 0) {
+        size = done;
+        file.position += done;
+        return errno == ENOSPC ? EFI_VOLUME_FULL : EFI_DEVICE_ERROR;
+      }
+      done += ret;
+    }
+    file.position += done;
+    size = done;
+    return EFI_SUCCESS;
+  }
+
+  EFI_STATUS get_position(std::uint64_t id, UINT64& position) {
+    auto* found = find(id);
+    if (found == nullptr) {
+      return EFI_INVALID_PARAMETER;
+    }
+    const auto& file = *found;
+    if (file.directory) {
+      return EFI_UNSUPPORTED;
+    }
+    position = file.position;
+    return EFI_SUCCESS;
+  }
+
+  EFI_STATUS set_position(std::uint64_t id, UINT64 position) {
+    auto* found = find(id);
+    if (found == nullptr) {
+      return EFI_INVALID_PARAMETER;
+    }
+    auto& file = *found;
+    if (file.directory) {
+      if (position != 0) {
+        return EFI_UNSUPPORTED;
+      }
+      file.position = 0;
+      file.entries.clear();
+      return EFI_SUCCESS;
+    }
+    if (position == UINT64(-1)) {
+      struct stat st;
+      if (fstat(file.fd, &st) == -1) {
+        return EFI_DEVICE_ERROR;
+      }
+      position = st.st_size;
+    }
+    file.position = position;
+    return EFI_SUCCESS;
+  }
+
+  // Writes an EFI_FILE_INFO for the file into buffer, size is set to the
+  // size it needs.
+  EFI_STATUS get_file_info(std::uint64_t id, std::span<std::byte> buffer, UINTN& size) {
+    auto* found = find(id);
+    if (found == nullptr) {
+      return EFI_INVALID_PARAMETER;
+    }
+    const auto& file = *found;
+    return file_info(file.path, buffer, size);
+  }
+
+  // Supports changing the size and renaming within the volume. Attributes and
+  // times are ignored.
+  EFI_STATUS set_file_info(std::uint64_t id, std::span<const std::byte> buffer) {
+    auto* found = find(id);
+    if (found == nullptr) {
+      return EFI_INVALID_PARAMETER;
+    }
+    auto& file = *found;
+    EFI_FILE_INFO info;
+    if (buffer.size() < offsetof(EFI_FILE_INFO, FileName) + sizeof(char16_t)) {
+      return EFI_BAD_BUFFER_SIZE;
+    }
+    std::memcpy(&info, buffer.data(), offsetof(EFI_FILE_INFO, FileName));
+    std::u16string name((buffer.size() - offsetof(EFI_FILE_INFO, FileName)) / sizeof(char16_t), u'\0');
+    std::memcpy(name.data(), buffer.data() + offsetof(EFI_FILE_INFO, FileName), name.size() * sizeof(char16_t));
+    name.resize(std::char_traits<char16_t>::length(name.c_str()));
+
+    if (!file.writable) {
+      return EFI_ACCESS_DENIED;
+    }
+    if (!file.directory && ftruncate(file.fd, info.FileSize) == -1) {
+      return EFI_DEVICE_ERROR;
+    }
+    auto path = resolve(file.path.parent_path(), name);
+    if (path != file.path) {
+      if (file.path.empty()) {
+        return EFI_ACCESS_DENIED;
+      }
+      auto from = contained(file.path);
+      auto to = contained(path);
+      std::error_code ec;
+      if (!from || !to || std::filesystem::exists(*to, ec)) {
+        return EFI_ACCESS_DENIED;
+      }
+      std::filesystem::rename(*from, *to, ec);
+      if (ec) {
+        return EFI_DEVICE_ERROR;
+      }
+      file.path = path;
+    }
+    return EFI_SUCCESS;
+  }
+
+  EFI_STATUS get_file_system_info(std::span<std::byte> buffer, UINTN& size) {
+    constexpr std::u16string_view label = u"UIU";
+    size = offsetof(EFI_FILE_SYSTEM_INFO, VolumeLabel) + (label.size() + 1) * sizeof(char16_t);
+    if (buffer.size() < size) {
+      return EFI_BUFFER_TOO_SMALL;
+    }
+    struct statvfs st;
+    if (statvfs(root.c_str(), &st) == -1) {
+      return EFI_DEVICE_ERROR;
+    }
+    EFI_FILE_SYSTEM_INFO info{
+      .Size = size,
+      .ReadOnly = (st.f_flag & ST_RDONLY) != 0,
+      .VolumeSize = st.f_blocks * st.f_frsize,
+      .FreeSpace = st.f_bavail * st.f_frsize,
+      .BlockSize = static_cast<UINT32>(st.f_bsize),
+    };
+    std::memcpy(buffer.data(), &info, offsetof(EFI_FILE_SYSTEM_INFO, VolumeLabel));
+    std::memcpy(buffer.data() + offsetof(EFI_FILE_SYSTEM_INFO, VolumeLabel), label.data(), (label.size() + 1) * sizeof(char16_t));
+    return EFI_SUCCESS;
+  }
+
+  EFI_STATUS flush(std::uint64_t id) {
+    auto* found = find(id);
+    if (found == nullptr) {
+      return EFI_INVALID_PARAMETER;
+    }
+    const auto& file = *found;
+    if (file.fd != -1 && fsync(file.fd) == -1) {
+      return EFI_DEVICE_ERROR;
+    }
+    return EFI_SUCCESS;
+  }
+
+  // Reads a whole regular file, for LoadImage.
+  EFI_STATUS read_file(std::u16string_view name, std::vector<std::byte>& contents) {
+    auto host_path = contained(resolve({}, name));
+    if (!host_path) {
+      return EFI_NOT_FOUND;
+    }
+    int fd = ::open(host_path->c_str(), O_RDONLY|O_CLOEXEC);
+    if (fd == -1) {
+      return EFI_NOT_FOUND;
+    }
+    struct stat st;
+    if (fstat(fd, &st) == -1 || !S_ISREG(st.st_mode)) {
+      close(fd);
+      return EFI_NOT_FOUND;
+    }
+    contents.resize(st.st_size);
+    std::size_t done = 0;
+    while (done < contents.size()) {
+      auto ret = pread(fd, contents.data() + done, contents.size() - done, done);
+      if (ret == -1 && errno == EINTR) {
+        continue;
+      }
+      if (ret <= 0) {
+        close(fd);
+        return EFI_DEVICE_ERROR;
+      }
+      done += ret;
+    }
+    close(fd);
+    return EFI_SUCCESS;
+  }
+
+private:
+  static std::filesystem::path resolve(std::filesystem::path base, std::u16string_view name) {
+    if (name.starts_with(u'\\')) {
+      base.clear();
+    }
+    std::filesystem::path path = base;
+    while (!name.empty()) {
+      auto separator = name.find(u'\\');
+      auto component = name.substr(0, separator);
+      name = separator == name.npos ? std::u16string_view{} : name.substr(separator + 1);
+      if (component.empty() || component == u".") {
+        continue;
+      }
+      if (component == u"..") {
+        path = path.parent_path();
+        continue;
+      }
+      path /= std::wstring_convert<std::codecvt_utf8<char16_t>, char16_t>{}.to_bytes(component.begin(), component.end());
+    }
+    return path;
+  }
+
+  // The host path of a path relative to the root, nothing if symbolic links
+  // lead it out of the root. Links that the host changes between this
+  // check and the use of the path are not caught.
+  std::optional<std::filesystem::path> contained(const std::filesystem::path& path) const {
+    auto host_path = root / path;
+    std::error_code ec;
+    auto resolved = std::filesystem::weakly_canonical(host_path, ec);
+    if (ec || std::mismatch(root.begin(), root.end(), resolved.begin(), resolved.end()).first != root.end()) {
+      return std::nullopt;
+    }
+    return host_path;
+  }
+
+  EFI_STATUS file_info(const std::filesystem::path& path, std::span<std::byte> buffer, UINTN& size) {
+    auto name = std::wstring_convert<std::codecvt_utf8<char16_t>, char16_t>{}.from_bytes(path.filename().string());
+    size = offsetof(EFI_FILE_INFO, FileName) + (name.size() + 1) * sizeof(char16_t);
+    if (buffer.size() < size) {
+      return EFI_BUFFER_TOO_SMALL;
+    }
+    auto host_path = contained(path);
+    struct stat st;
+    if (!host_path || stat(host_path->c_str(), &st) == -1) {
+      return EFI_DEVICE_ERROR;
+    }
+    UINT64 attribute = 0;
+    if (S_ISDIR(st.st_mode)) {
+      attribute |= EFI_FILE_DIRECTORY;
+    }
+    if (access(host_path->c_str(), W_OK) == -1) {
+      attribute |= EFI_FILE_READ_ONLY;
+    }
+    EFI_FILE_INFO info{
+      .Size = size,
+      .FileSize = static_cast<UINT64>(st.st_size),
+      .PhysicalSize = static_cast<UINT64>(st.st_blocks) * 512,
+      .CreateTime = to_efi_time(st.st_ctim),
+      .LastAccessTime = to_efi_time(st.st_atim),
+      .ModificationTime = to_efi_time(st.st_mtim),
+      .Attribute = attribute,
+    };
+    std::memcpy(buffer.data(), &info, offsetof(EFI_FILE_INFO, FileName));
+    std::memcpy(buffer.data() + offsetof(EFI_FILE_INFO, FileName), name.c_str(), (name.size() + 1) * sizeof(char16_t));
+    return EFI_SUCCESS;
+  }
+
+  // Returns one EFI_FILE_INFO per call, and a size of 0 after the last entry.
+  EFI_STATUS read_directory(File& file, std::span<std::byte> buffer, UINTN& size) {
+    if (file.position == 0 && file.entries.empty()) {
+      std::error_code ec;
+      if (auto host_path = contained(file.path)) {
+        for (const auto& entry : std::filesystem::directory_iterator(*host_path, ec)) {
+          // Symbolic links out of the root are left out
+          if (contained(file.path / entry.path().filename())) {
+            file.entries.push_back(file.path / entry.path().filename());
+          }
+        }
+      }
+      std::sort(file.entries.begin(), file.entries.end());
+    }
+    if (file.position >= file.entries.size()) {
+      size = 0;
+      return EFI_SUCCESS;
+    }
+    auto status = file_info(file.entries[file.position], buffer, size);
+    if (status == EFI_SUCCESS) {
+      file.position++;
+    }
+    return status;
+  }
+
+  // Ids come from guest memory, they may be stale or made up
+  File* find(std::uint64_t id) {
+    auto it = files.find(id);
+    return it != files.end() ? &it->second : nullptr;
+  }
+
+  std::uint64_t insert(File&& file) {
+    auto id = file_counter++;
+    files.emplace(id, std::move(file));
+    return id;
+  }
+
+  std::filesystem::path root;
+  std::unordered_map<std::uint64_t, File> files;
+  std::uint64_t file_counter = 0;
+};
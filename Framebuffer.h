@@ -0,0 +1,148 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <fmt/format.h>
+#include <fstream>
+#include <optional>
+#include <span>
+#include <system_error>
+#include <vector>
+
+extern "C" {
+#include <sys/mman.h>
+}
+
+#include "KVM.h"
+
+// A linear 32 bpp BGRX framebuffer in its own memslot. KVM logs the pages
+// the guest writes to, so a capture only converts the rows on those pages
+// and never compares whole frames.
+class Framebuffer {
+public:
+  static constexpr std::uint32_t slot = 1;
+  static constexpr std::uint64_t guest_address = 0x4000'0000;
+  static constexpr std::uint64_t page_size = 0x1000;
+  // Frames are captured at most this often while the guest runs
+  static constexpr std::chrono::milliseconds capture_interval{33};
+
+  Framebuffer(VM& vm, std::uint32_t width, std::uint32_t height)
+      : width(width), height(height), vm(vm) {
+    std::uint64_t size = (std::uint64_t{width} * height * 4 + page_size - 1) / page_size * page_size;
+    memory = {static_cast<std::byte*>(mmap(0, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_ANONYMOUS, -1, 0)), size};
+    if (memory.data() == MAP_FAILED) {
+      throw std::system_error(errno, std::generic_category());
+    }
+    vm.set_user_memory_region({
+      .slot = slot,
+      .flags = KVM_MEM_LOG_DIRTY_PAGES,
+      .guest_phys_addr = guest_address,
+      .memory_size = size,
+      .userspace_addr = std::bit_cast<std::uint64_t>(memory.data()),
+    });
+    dirty_pages.resize((size / page_size + 63) / 64);
+    frame.resize(std::size_t{width} * height * 3);
+  }
+
+  ~Framebuffer() {
+    munmap(memory.data(), memory.size());
+  }
+
+  Framebuffer(const Framebuffer&) = delete;
+  Framebuffer& operator=(const Framebuffer&) = delete;
+
+  // Writes every changed frame to directory/frame-NNNNNN.ppm
+  void capture_to_directory(std::filesystem::path directory) {
+    capture_directory = std::move(directory);
+  }
+
+  // Appends every changed frame to a stream of PPM images, which e.g. ffmpeg
+  // reads with -f image2pipe -c:v ppm.
+  void capture_to_stream(const std::filesystem::path& path) {
+    capture_stream.emplace(path, std::ios::binary|std::ios::trunc);
+    if (!*capture_stream) {
+      throw std::system_error(errno, std::generic_category(), path.string());
+    }
+  }
+
+  // Captures a frame if the guest drew something since the last capture and
+  // capture_interval has passed, or force is set.
+  void poll(bool force = false) {
+    if (!capture_directory && !capture_stream) {
+      return;
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (!force && now < next_capture) {
+      return;
+    }
+    next_capture = now + capture_interval;
+
+    vm.get_dirty_log(slot, dirty_pages);
+    std::uint64_t stride = std::uint64_t{width} * 4;
+    bool changed = false;
+    for (std::size_t i = 0; i < dirty_pages.size(); i++) {
+      for (auto bits = dirty_pages[i]; bits != 0; bits &= bits - 1) {
+        std::uint64_t page = i * 64 + std::countr_zero(bits);
+        std::uint64_t first_row = page * page_size / stride;
+        std::uint64_t last_row = std::min<std::uint64_t>(((page + 1) * page_size - 1) / stride, height - 1);
+        for (auto row = first_row; row <= last_row; row++) {
+          convert_row(row);
+        }
+        changed = true;
+      }
+    }
+    if (changed) {
+      write_frame();
+    }
+  }
+
+  std::uint64_t size() const {
+    return memory.size();
+  }
+
+  std::uint32_t width;
+  std::uint32_t height;
+
+private:
+  void convert_row(std::uint64_t row) {
+    const auto* source = reinterpret_cast<const std::uint8_t*>(memory.data()) + row * width * 4;
+    auto* destination = frame.data() + row * width * 3;
+    for (std::uint32_t x = 0; x < width; x++) {
+      destination[3 * x + 0] = source[4 * x + 2];
+      destination[3 * x + 1] = source[4 * x + 1];
+      destination[3 * x + 2] = source[4 * x + 0];
+    }
+  }
+
+  void write_frame() {
+    auto header = fmt::format("P6\n{} {}\n255\n", width, height);
+    if (capture_directory) {
+      auto path = *capture_directory / fmt::format("frame-{:06}.ppm", frame_counter);
+      std::ofstream out{path, std::ios::binary};
+      out.write(header.data(), header.size());
+      out.write(reinterpret_cast<const char*>(frame.data()), frame.size());
+      if (!out) {
+        fmt::println("Unable to write {}", path.string());
+      }
+    }
+    if (capture_stream) {
+      capture_stream->write(header.data(), header.size());
+      capture_stream->write(reinterpret_cast<const char*>(frame.data()), frame.size());
+      capture_stream->flush();
+    }
+    frame_counter++;
+  }
+
+  VM& vm;
+  std::span<std::byte> memory;
+  std::vector<std::uint64_t> dirty_pages;
+  std::vector<std::uint8_t> frame;  // RGB, as written to the PPM files
+  std::optional<std::filesystem::path> capture_directory;
+  std::optional<std::ofstream> capture_stream;
+  std::chrono::steady_clock::time_point next_capture;
+  std::uint64_t frame_counter = 0;
+};
@@ -0,0 +1,304 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <fmt/format.h>
+#include <initializer_list>
+#include <map>
+#include <memory_resource>
+#include <new>
+#include <optional>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include <linux/kvm.h>
+}
+
+#include "PageTables.h"
+#include "Unwinder.h"
+
+// Finds misuses of the pool by the guest, like AddressSanitizer does for
+// malloc. Allocations are surrounded by redzones filled with a pattern, and
+// freed allocations are filled with another one and kept in a quarantine
+// before their memory is reused. FreePool checks the redzones of what it
+// frees, and allocations that leave the quarantine are checked for writes
+// after they were freed.
+//
+// With guard pages, allocations end right before a page that is not
+// present, and quarantined allocations are not present, so that overflows
+// and uses after free fault where they happen, see fault. Their contents
+// are still checked, for the writes of hypercalls, which the host makes
+// without the guest's page tables.
+//
+// What the sanitizer knows about the pool is kept on the host, out of the
+// reach of the guest's bugs.
+class HeapSanitizer {
+public:
+  using Frame = Unwinder::Frame;
+
+  struct Options {
+    std::uint64_t redzone = 16;  // bytes on either side, at least
+    std::uint64_t quarantine = 16 << 20;  // bytes
+    bool guard_pages = false;
+    std::size_t depth = 8;  // frames of the stacks in reports
+  };
+
+  // Allocations come from pool, or from pages with guard pages. Memory of
+  // pages is never given back, guard pages stay guard pages.
+  HeapSanitizer(std::span<std::byte> memory, const Unwinder& unwinder, PageTables& page_tables, std::pmr::memory_resource& pool, std::pmr::memory_resource& pages, Options options)
+      : memory(memory), unwinder(unwinder), page_tables(page_tables), pool(pool), pages(pages), options(options) {
+    this->options.redzone = std::max<std::uint64_t>((options.redzone + 7) & ~7, 8);
+  }
+
+  // Returns the guest address of size bytes, aligned to 8. regs() has the
+  // registers of the vCPU at the call. Throws std::bad_alloc if the pool is
+  // used up even without the quarantine.
+  template <typename F>
+  std::uint64_t allocate(std::uint64_t size, F&& regs) {
+    Chunk chunk;
+    try {
+      chunk = carve(size);
+    } catch (const std::bad_alloc&) {
+      while (!quarantined.empty()) {
+        release();
+      }
+      chunk = carve(size);
+    }
+    chunk.allocated_at = unwinder.call_site(regs(), memory, options.depth);
+    fill(chunk.block, chunk.address - chunk.block, redzone_byte);
+    fill(chunk.address + size, chunk.block + chunk.block_size - chunk.address - size, redzone_byte);
+    auto address = chunk.address;
+    chunks.emplace(chunk.block, std::move(chunk));
+    return address;
+  }
+
+  // Returns false for frees that are reported as errors, whose memory stays
+  // as it is
+  template <typename F>
+  bool free(std::uint64_t address, F&& regs) {
+    auto stack = unwinder.call_site(regs(), memory, options.depth);
+    auto* chunk = find(address);
+    if (chunk == nullptr || chunk->address != address) {
+      if (chunk == nullptr) {
+        report(fmt::format("bad-free of {:#x}, which is not a pool allocation", address), {{"freed", &stack}});
+      } else {
+        report(fmt::format("bad-free of {:#x}, {}", address, where(*chunk, address)), {{"freed", &stack}, {"allocated", &chunk->allocated_at}});
+      }
+      return false;
+    }
+    if (chunk->freed) {
+      report(fmt::format("double-free of the {}-byte region at {:#x}", chunk->size, address),
+             {{"freed", &stack}, {"allocated", &chunk->allocated_at}, {"first freed", &chunk->freed_at}});
+      return false;
+    }
+    if (!check_redzones(*chunk, "FreePool", &stack)) {
+      return false;
+    }
+    chunk->freed = true;
+    chunk->freed_at = std::move(stack);
+    fill(chunk->address, chunk->size, freed_byte);
+    if (options.guard_pages) {
+      page_tables.change(chunk->block, chunk->block_size, EFI_MEMORY_RP, 0);
+      tables_changed = true;
+    }
+    quarantined.push_back(chunk->block);
+    quarantine_size += chunk->block_size;
+    while (quarantine_size > options.quarantine) {
+      release();
+    }
+    return true;
+  }
+
+  // Reports the page fault at address if it hit a guard page or a
+  // quarantined allocation, regs are those at the fault
+  bool fault(std::uint64_t address, const kvm_regs& regs) {
+    if (!options.guard_pages) {
+      return false;
+    }
+    auto* chunk = find(address);
+    if (chunk == nullptr) {
+      return false;
+    }
+    auto stack = unwinder.walk(regs, memory, options.depth);
+    if (chunk->freed) {
+      report(fmt::format("heap-use-after-free at {:#x}, {}", address, where(*chunk, address)),
+             {{"accessed", &stack}, {"allocated", &chunk->allocated_at}, {"freed", &chunk->freed_at}});
+    } else {
+      report(fmt::format("heap-buffer-overflow at {:#x}, {}", address, where(*chunk, address)),
+             {{"accessed", &stack}, {"allocated", &chunk->allocated_at}});
+    }
+    return true;
+  }
+
+  // Checks the redzones of the live allocations and the contents of the
+  // quarantined ones, for the writes that no FreePool saw. Runs stop at
+  // their first error, there is nothing to check after one.
+  void check() {
+    if (errors != 0) {
+      return;
+    }
+    for (auto& [block, chunk] : chunks) {
+      if (!chunk.freed) {
+        check_redzones(chunk, "the check at exit", nullptr);
+      } else {
+        check_freed(chunk, "the check at exit");
+      }
+    }
+  }
+
+  std::uint64_t errors = 0;
+  // Pages became not present, which the guest's TLB may not know yet
+  bool tables_changed = false;
+
+private:
+  static constexpr std::byte redzone_byte{0xfa};
+  static constexpr std::byte freed_byte{0xfd};
+
+  struct Chunk {
+    std::uint64_t block;  // the memory from the pool
+    std::uint64_t block_size;  // without the guard page
+    std::uint64_t address;
+    std::uint64_t size;
+    bool freed = false;
+    std::vector<Frame> allocated_at;
+    std::vector<Frame> freed_at;
+  };
+
+  Chunk carve(std::uint64_t size) {
+    if (size > memory.size()) {
+      throw std::bad_alloc();
+    }
+    Chunk chunk{.size = size};
+    if (!options.guard_pages) {
+      chunk.block_size = ((size + 7) & ~7) + 2 * options.redzone;
+      chunk.block = guest_address(pool.allocate(chunk.block_size, 8));
+      chunk.address = chunk.block + options.redzone;
+      return chunk;
+    }
+    constexpr auto page_size = PageTables::page_size;
+    chunk.block_size = (size + options.redzone + page_size - 1) / page_size * page_size;
+    auto& reusable = free_blocks[chunk.block_size];
+    if (!reusable.empty()) {
+      chunk.block = reusable.back();
+      reusable.pop_back();
+    } else {
+      chunk.block = guest_address(pages.allocate(chunk.block_size + page_size, page_size));
+      page_tables.change(chunk.block + chunk.block_size, page_size, EFI_MEMORY_RP, 0);
+      tables_changed = true;
+    }
+    chunk.address = (chunk.block + chunk.block_size - size) & ~std::uint64_t{7};
+    return chunk;
+  }
+
+  // Gives the oldest allocation in the quarantine back to the pool
+  void release() {
+    auto it = chunks.find(quarantined.front());
+    quarantined.pop_front();
+    auto& chunk = it->second;
+    quarantine_size -= chunk.block_size;
+    check_freed(chunk, "the quarantine");
+    if (options.guard_pages) {
+      page_tables.change(chunk.block, chunk.block_size, 0, EFI_MEMORY_RP);
+      free_blocks[chunk.block_size].push_back(chunk.block);
+    } else {
+      pool.deallocate(memory.data() + chunk.block, chunk.block_size, 8);
+    }
+    chunks.erase(it);
+  }
+
+  bool check_redzones(const Chunk& chunk, const char* found_by, const std::vector<Frame>* stack) {
+    auto written = first_not(chunk.block, chunk.address - chunk.block, redzone_byte);
+    if (!written) {
+      auto end = chunk.address + chunk.size;
+      written = first_not(end, chunk.block + chunk.block_size - end, redzone_byte);
+    }
+    if (!written) {
+      return true;
+    }
+    auto what = fmt::format("heap-buffer-overflow, write at {:#x}, {}, found by {}", *written, where(chunk, *written), found_by);
+    if (stack != nullptr) {
+      report(what, {{"found", stack}, {"allocated", &chunk.allocated_at}});
+    } else {
+      report(what, {{"allocated", &chunk.allocated_at}});
+    }
+    return false;
+  }
+
+  void check_freed(const Chunk& chunk, const char* found_by) {
+    if (auto written = first_not(chunk.address, chunk.size, freed_byte)) {
+      report(fmt::format("heap-use-after-free, write at {:#x}, {}, found by {}", *written, where(chunk, *written), found_by),
+             {{"allocated", &chunk.allocated_at}, {"freed", &chunk.freed_at}});
+    }
+  }
+
+  // Where address is relative to the allocation
+  static std::string where(const Chunk& chunk, std::uint64_t address) {
+    std::string position;
+    if (address < chunk.address) {
+      position = fmt::format("{} bytes before", chunk.address - address);
+    } else if (address >= chunk.address + chunk.size) {
+      position = fmt::format("{} bytes after", address - chunk.address - chunk.size);
+    } else {
+      position = fmt::format("{} bytes inside", address - chunk.address);
+    }
+    return fmt::format("{} the {}-byte region [{:#x}, {:#x})", position, chunk.size, chunk.address, chunk.address + chunk.size);
+  }
+
+  void report(const std::string& what, std::initializer_list<std::pair<const char*, const std::vector<Frame>*>> stacks) {
+    errors++;
+    fmt::println("HeapSanitizer: {}", what);
+    for (const auto& [name, stack] : stacks) {
+      std::string frames;
+      for (const auto& frame : *stack) {
+        frames += frames.empty() ? "" : " <- ";
+        frames += unwinder.frame_name(frame);
+      }
+      fmt::println("  {} at {}", name, frames.empty() ? "<unknown>" : frames);
+    }
+  }
+
+  // The allocation whose block or guard page contains address
+  Chunk* find(std::uint64_t address) {
+    auto it = chunks.upper_bound(address);
+    if (it == chunks.begin()) {
+      return nullptr;
+    }
+    --it;
+    auto end = it->first + it->second.block_size + (options.guard_pages ? PageTables::page_size : 0);
+    return address < end ? &it->second : nullptr;
+  }
+
+  std::uint64_t guest_address(void* pointer) const {
+    return static_cast<std::byte*>(pointer) - memory.data();
+  }
+
+  void fill(std::uint64_t address, std::uint64_t size, std::byte value) {
+    std::memset(memory.data() + address, std::to_integer<int>(value), size);
+  }
+
+  std::optional<std::uint64_t> first_not(std::uint64_t address, std::uint64_t size, std::byte value) const {
+    auto range = memory.subspan(address, size);
+    auto it = std::ranges::find_if(range, [&](auto byte) { return byte != value; });
+    if (it == range.end()) {
+      return std::nullopt;
+    }
+    return address + (it - range.begin());
+  }
+
+  std::span<std::byte> memory;
+  const Unwinder& unwinder;
+  PageTables& page_tables;
+  std::pmr::memory_resource& pool;
+  std::pmr::memory_resource& pages;
+  Options options;
+  std::map<std::uint64_t, Chunk> chunks;  // by block
+  std::deque<std::uint64_t> quarantined;  // blocks, oldest first
+  std::uint64_t quarantine_size = 0;
+  std::map<std::uint64_t, std::vector<std::uint64_t>> free_blocks;  // by size, with guard pages
+};
@@ -0,0 +1,179 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <span>
+#include <system_error>
+#include <vector>
+
+extern "C" {
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+}
+
+// Thin wrapper around the raw io_uring system calls, so that uiu does not
+// need liburing.
+class IOUring {
+public:
+  explicit IOUring(unsigned entries) {
+    io_uring_params params{};
+    fd = syscall(__NR_io_uring_setup, entries, &params);
+    if (fd == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+    try {
+      sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(std::uint32_t);
+      cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+      bool single_mmap = params.features & IORING_FEAT_SINGLE_MMAP;
+      if (single_mmap) {
+        sq_ring_size = cq_ring_size = std::max(sq_ring_size, cq_ring_size);
+      }
+      sq_ring = map(sq_ring_size, IORING_OFF_SQ_RING);
+      cq_ring = single_mmap ? sq_ring : map(cq_ring_size, IORING_OFF_CQ_RING);
+      sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+      sqes = static_cast<io_uring_sqe*>(map(sqes_size, IORING_OFF_SQES));
+    } catch (...) {
+      release();
+      throw;
+    }
+
+    sq_head = reinterpret_cast<unsigned*>(static_cast<std::byte*>(sq_ring) + params.sq_off.head);
+    sq_tail = reinterpret_cast<unsigned*>(static_cast<std::byte*>(sq_ring) + params.sq_off.tail);
+    sq_mask = *reinterpret_cast<unsigned*>(static_cast<std::byte*>(sq_ring) + params.sq_off.ring_mask);
+    sq_array = reinterpret_cast<unsigned*>(static_cast<std::byte*>(sq_ring) + params.sq_off.array);
+    sq_entries = params.sq_entries;
+    sq_tail_local = *sq_tail;
+
+    cq_head = reinterpret_cast<unsigned*>(static_cast<std::byte*>(cq_ring) + params.cq_off.head);
+    cq_tail = reinterpret_cast<unsigned*>(static_cast<std::byte*>(cq_ring) + params.cq_off.tail);
+    cq_mask = *reinterpret_cast<unsigned*>(static_cast<std::byte*>(cq_ring) + params.cq_off.ring_mask);
+    cqes = reinterpret_cast<io_uring_cqe*>(static_cast<std::byte*>(cq_ring) + params.cq_off.cqes);
+  }
+
+  ~IOUring() {
+    release();
+  }
+
+  IOUring(const IOUring&) = delete;
+  IOUring& operator=(const IOUring&) = delete;
+  IOUring(IOUring&&) noexcept = delete;
+  IOUring& operator=(IOUring&&) noexcept = delete;
+
+  // Returns a zeroed submission queue entry, or nullptr if the queue is full.
+  // Entries are handed to the kernel by the next call to submit().
+  io_uring_sqe* get_sqe() {
+    unsigned head = std::atomic_ref(*sq_head).load(std::memory_order_acquire);
+    if (sq_tail_local - head == sq_entries) {
+      return nullptr;
+    }
+    unsigned index = sq_tail_local & sq_mask;
+    sq_array[index] = index;
+    sqes[index] = {};
+    sq_tail_local++;
+    return &sqes[index];
+  }
+
+  // Submits all prepared entries and waits for at least wait_nr completions.
+  // A signal may cut the wait short.
+  void submit(unsigned wait_nr = 0) {
+    std::atomic_ref(*sq_tail).store(sq_tail_local, std::memory_order_release);
+    unsigned to_submit = sq_tail_local - std::atomic_ref(*sq_head).load(std::memory_order_acquire);
+    int ret = syscall(__NR_io_uring_enter, fd, to_submit, wait_nr, wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+    if (ret == -1 && errno != EINTR) {
+      throw std::system_error(errno, std::generic_category());
+    }
+  }
+
+  // Calls f for every available completion. The completions are consumed
+  // before f runs, so f may submit new requests.
+  template <typename F>
+  void reap(F&& f) {
+    unsigned head = *cq_head;
+    unsigned tail = std::atomic_ref(*cq_tail).load(std::memory_order_acquire);
+    completions.clear();
+    for (; head != tail; head++) {
+      completions.push_back(cqes[head & cq_mask]);
+    }
+    std::atomic_ref(*cq_head).store(head, std::memory_order_release);
+    for (const auto& cqe : completions) {
+      f(cqe);
+    }
+  }
+
+  void register_buffers(std::span<const iovec> buffers) {
+    int ret = syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, buffers.data(), buffers.size());
+    if (ret == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+  }
+
+  void unregister_buffers() {
+    int ret = syscall(__NR_io_uring_register, fd, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+    if (ret == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+  }
+
+  void register_eventfd(int eventfd) {
+    int ret = syscall(__NR_io_uring_register, fd, IORING_REGISTER_EVENTFD, &eventfd, 1);
+    if (ret == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+  }
+
+  int get_fd() const {
+    return fd;
+  }
+
+private:
+  void* map(std::size_t size, off_t offset) {
+    void* ret = mmap(nullptr, size, PROT_READ|PROT_WRITE, MAP_SHARED|MAP_POPULATE, fd, offset);
+    if (ret == MAP_FAILED) {
+      throw std::system_error(errno, std::generic_category());
+    }
+    return ret;
+  }
+
+  void release() {
+    if (sqes != nullptr) {
+      munmap(sqes, sqes_size);
+    }
+    if (cq_ring != nullptr && cq_ring != sq_ring) {
+      munmap(cq_ring, cq_ring_size);
+    }
+    if (sq_ring != nullptr) {
+      munmap(sq_ring, sq_ring_size);
+    }
+    if (fd != -1) {
+      close(fd);
+    }
+  }
+
+  int fd = -1;
+
+  void* sq_ring = nullptr;
+  std::size_t sq_ring_size = 0;
+  unsigned* sq_head;
+  unsigned* sq_tail;
+  unsigned sq_mask;
+  unsigned* sq_array;
+  unsigned sq_entries;
+  unsigned sq_tail_local;
+
+  io_uring_sqe* sqes = nullptr;
+  std::size_t sqes_size = 0;
+
+  void* cq_ring = nullptr;
+  std::size_t cq_ring_size = 0;
+  unsigned* cq_head;
+  unsigned* cq_tail;
+  unsigned cq_mask;
+  io_uring_cqe* cqes;
+
+  std::vector<io_uring_cqe> completions;
+};
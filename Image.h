@@ -0,0 +1,233 @@
+#pragma once
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <map>
+#include <optional>
+#include <span>
+#include <vector>
+
+#define GNU_EFI_USE_MS_ABI
+extern "C" {
+#include <efi.h>
+#include <x86_64/pe.h>
+}
+
+// A PE32+ image, parsed once. load() writes it to guest memory relocated for
+// any base, pages listed in shared never contain a relocation and can be
+// mapped from an earlier copy instead.
+struct PEImage {
+  static constexpr std::uint64_t page_size = 0x1000;
+  static constexpr std::uint64_t max_size = 0x800'0000;  // the size of the guest regions for images
+
+  // Returns EFI_LOAD_ERROR for malformed images, EFI_UNSUPPORTED for images
+  // that are not x86-64 EFI applications or drivers and EFI_OUT_OF_RESOURCES
+  // for images larger than max_size.
+  static EFI_STATUS parse(std::span<const std::byte> file, PEImage& image) {
+    IMAGE_DOS_HEADER dos_header;
+    if (file.size() < sizeof(dos_header)) {
+      return EFI_LOAD_ERROR;
+    }
+    std::memcpy(&dos_header, file.data(), sizeof(dos_header));
+    if (dos_header.e_magic != IMAGE_DOS_SIGNATURE) {
+      return EFI_LOAD_ERROR;
+    }
+
+    IMAGE_NT_HEADERS pe_header{};
+    constexpr auto fixed_size = offsetof(IMAGE_NT_HEADERS, OptionalHeader) + offsetof(IMAGE_OPTIONAL_HEADER, DataDirectory);
+    if (dos_header.e_lfanew > file.size() || file.size() - dos_header.e_lfanew < fixed_size) {
+      return EFI_LOAD_ERROR;
+    }
+    std::memcpy(&pe_header, file.data() + dos_header.e_lfanew, fixed_size);
+    const auto& optional_header = pe_header.OptionalHeader;
+    if (pe_header.Signature != IMAGE_NT_SIGNATURE || optional_header.Magic != 0x20b) {
+      return EFI_LOAD_ERROR;
+    }
+    if (pe_header.FileHeader.Machine != IMAGE_FILE_MACHINE_AMD64) {
+      return EFI_UNSUPPORTED;
+    }
+    switch (optional_header.Subsystem) {
+    case IMAGE_SUBSYSTEM_EFI_APPLICATION:
+    case IMAGE_SUBSYSTEM_EFI_BOOT_SERVICE_DRIVER:
+    case IMAGE_SUBSYSTEM_EFI_RUNTIME_DRIVER:
+      break;
+    default:
+      return EFI_UNSUPPORTED;
+    }
+
+    std::size_t directories = std::min<std::size_t>(optional_header.NumberOfRvaAndSizes, IMAGE_NUMBEROF_DIRECTORY_ENTRIES);
+    std::size_t optional_header_size = offsetof(IMAGE_OPTIONAL_HEADER, DataDirectory) + directories * sizeof(IMAGE_DATA_DIRECTORY);
+    std::size_t section_table = dos_header.e_lfanew + offsetof(IMAGE_NT_HEADERS, OptionalHeader) + pe_header.FileHeader.SizeOfOptionalHeader;
+    std::size_t section_count = pe_header.FileHeader.NumberOfSections;
+    if (pe_header.FileHeader.SizeOfOptionalHeader < optional_header_size ||
+        section_table > file.size() || (file.size() - section_table) / sizeof(IMAGE_SECTION_HEADER) < section_count) {
+      return EFI_LOAD_ERROR;
+    }
+    std::memcpy(&pe_header.OptionalHeader.DataDirectory, file.data() + dos_header.e_lfanew + fixed_size, directories * sizeof(IMAGE_DATA_DIRECTORY));
+
+    image = {};
+    image.size = (std::uint64_t{optional_header.SizeOfImage} + page_size - 1) / page_size * page_size;
+    image.preferred_base = optional_header.ImageBase;
+    image.entry_point = optional_header.AddressOfEntryPoint;
+    image.subsystem = optional_header.Subsystem;
+    std::copy_n(optional_header.DataDirectory, directories, image.directories.begin());
+    image.symbol_table = pe_header.FileHeader.PointerToSymbolTable;
+    image.symbol_count = pe_header.FileHeader.NumberOfSymbols;
+    if (image.size > max_size) {
+      return EFI_OUT_OF_RESOURCES;
+    }
+    if (optional_header.SizeOfHeaders > file.size() || optional_header.SizeOfHeaders > image.size ||
+        image.entry_point >= image.size) {
+      return EFI_LOAD_ERROR;
+    }
+    image.contents.resize(image.size);
+    std::copy_n(file.data(), optional_header.SizeOfHeaders, image.contents.data());
+
+    std::vector<IMAGE_SECTION_HEADER> sections(section_count);
+    std::memcpy(sections.data(), file.data() + section_table, section_count * sizeof(IMAGE_SECTION_HEADER));
+    for (const auto& section : sections) {
+      std::uint64_t virtual_size = section.Misc.VirtualSize != 0 ? section.Misc.VirtualSize : section.SizeOfRawData;
+      std::uint64_t raw_size = std::min<std::uint64_t>(section.SizeOfRawData, virtual_size);
+      if (section.VirtualAddress > image.size || virtual_size > image.size - section.VirtualAddress ||
+          section.PointerToRawData > file.size() || raw_size > file.size() - section.PointerToRawData) {
+        return EFI_LOAD_ERROR;
+      }
+      std::copy_n(file.data() + section.PointerToRawData, raw_size, image.contents.data() + section.VirtualAddress);
+    }
+
+    if (directories > IMAGE_DIRECTORY_ENTRY_BASERELOC) {
+      auto status = image.parse_relocations(optional_header.DataDirectory[IMAGE_DIRECTORY_ENTRY_BASERELOC]);
+      if (status != EFI_SUCCESS) {
+        return status;
+      }
+    }
+
+    // Sections are padded to SectionAlignment, so with page-sized alignment
+    // every page belongs to at most one section.
+    image.shared.resize(image.size / page_size);
+    if (optional_header.SectionAlignment % page_size == 0) {
+      for (const auto& section : sections) {
+        if ((section.Characteristics & IMAGE_SCN_MEM_EXECUTE) && !(section.Characteristics & IMAGE_SCN_MEM_WRITE)) {
+          std::uint64_t virtual_size = section.Misc.VirtualSize != 0 ? section.Misc.VirtualSize : section.SizeOfRawData;
+          std::uint64_t end = (section.VirtualAddress + virtual_size + page_size - 1) / page_size;
+          std::fill(image.shared.begin() + section.VirtualAddress / page_size, image.shared.begin() + end, true);
+        }
+      }
+    }
+    for (auto relocation : image.relocations) {
+      image.shared[relocation / page_size] = false;
+      image.shared[(relocation + sizeof(std::uint64_t) - 1) / page_size] = false;
+    }
+    image.sections = std::move(sections);
+    return EFI_SUCCESS;
+  }
+
+  // Writes the image to memory, which is mapped at base in the guest.
+  void load(std::span<std::byte> memory, std::uint64_t base) const {
+    std::copy(contents.begin(), contents.end(), memory.begin());
+    relocate(memory, base - preferred_base);
+  }
+
+  // Adds delta to every relocated address of an image in memory.
+  void relocate(std::span<std::byte> memory, std::uint64_t delta) const {
+    for (auto relocation : relocations) {
+      std::uint64_t value;
+      std::memcpy(&value, memory.data() + relocation, sizeof(value));
+      value += delta;
+      std::memcpy(memory.data() + relocation, &value, sizeof(value));
+    }
+  }
+
+  std::uint64_t size;  // SizeOfImage rounded up to pages
+  std::uint64_t preferred_base;
+  std::uint32_t entry_point;
+  std::uint16_t subsystem;
+  std::vector<std::byte> contents;  // as loaded at preferred_base
+  std::vector<std::uint32_t> relocations;  // RVAs of IMAGE_REL_BASED_DIR64 fixups
+  std::vector<bool> shared;  // per page
+  std::array<IMAGE_DATA_DIRECTORY, IMAGE_NUMBEROF_DIRECTORY_ENTRIES> directories{};
+  std::vector<IMAGE_SECTION_HEADER> sections;
+  std::uint32_t symbol_table;  // file offset of the COFF symbol table, or 0
+  std::uint32_t symbol_count;
+
+private:
+  EFI_STATUS parse_relocations(const IMAGE_DATA_DIRECTORY& directory) {
+    if (directory.VirtualAddress > size || directory.Size > size - directory.VirtualAddress) {
+      return EFI_LOAD_ERROR;
+    }
+    auto blocks = std::span{contents}.subspan(directory.VirtualAddress, directory.Size);
+    while (blocks.size() >= sizeof(IMAGE_BASE_RELOCATION)) {
+      IMAGE_BASE_RELOCATION block;
+      std::memcpy(&block, blocks.data(), sizeof(block));
+      if (block.SizeOfBlock < sizeof(block) || block.SizeOfBlock > blocks.size()) {
+        return EFI_LOAD_ERROR;
+      }
+      for (std::size_t i = sizeof(block); i + sizeof(std::uint16_t) <= block.SizeOfBlock; i += sizeof(std::uint16_t)) {
+        std::uint16_t entry;
+        std::memcpy(&entry, blocks.data() + i, sizeof(entry));
+        std::uint64_t rva = std::uint64_t{block.VirtualAddress} + (entry & 0xfff);
+        switch (entry >> 12) {
+        case IMAGE_REL_BASED_ABSOLUTE:
+          break;
+        case IMAGE_REL_BASED_DIR64:
+          if (rva > size - sizeof(std::uint64_t)) {
+            return EFI_LOAD_ERROR;
+          }
+          relocations.push_back(rva);
+          break;
+        default:
+          return EFI_UNSUPPORTED;
+        }
+      }
+      blocks = blocks.subspan(block.SizeOfBlock);
+    }
+    return EFI_SUCCESS;
+  }
+};
+
+// First-fit allocator for page-aligned ranges of guest memory.
+class PageAllocator {
+public:
+  PageAllocator(std::uint64_t start, std::uint64_t size) {
+    free_ranges.emplace(start, size);
+  }
+
+  std::optional<std::uint64_t> allocate(std::uint64_t size) {
+    size = (size + PEImage::page_size - 1) / PEImage::page_size * PEImage::page_size;
+    for (auto it = free_ranges.begin(); it != free_ranges.end(); ++it) {
+      auto [start, length] = *it;
+      if (length >= size) {
+        free_ranges.erase(it);
+        if (length > size) {
+          free_ranges.emplace(start + size, length - size);
+        }
+        return start;
+      }
+    }
+    return std::nullopt;
+  }
+
+  void free(std::uint64_t start, std::uint64_t size) {
+    size = (size + PEImage::page_size - 1) / PEImage::page_size * PEImage::page_size;
+    auto next = free_ranges.lower_bound(start);
+    if (next != free_ranges.end() && start + size == next->first) {
+      size += next->second;
+      next = free_ranges.erase(next);
+    }
+    if (next != free_ranges.begin()) {
+      auto previous = std::prev(next);
+      if (previous->first + previous->second == start) {
+        previous->second += size;
+        return;
+      }
+    }
+    free_ranges.emplace(start, size);
+  }
+
+private:
+  std::map<std::uint64_t, std::uint64_t> free_ranges;  // start, size
+};
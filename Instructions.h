@@ -0,0 +1,272 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <span>
+
+// An x86-64 instruction, decoded only as far as needed to find basic
+// blocks: its length and where execution can go after it.
+struct Instruction {
+  enum class Flow {
+    next,    // to the next instruction
+    jump,    // to target
+    branch,  // to target or the next instruction
+    call,    // to target, which returns to the next instruction
+    stop,    // nowhere known: returns, indirect jumps, ud2, int3
+  };
+
+  static constexpr std::size_t max_length = 15;
+
+  // Nothing for code that is invalid in 64-bit mode or cut off
+  static std::optional<Instruction> decode(std::span<const std::byte> code, std::uint64_t address) {
+    // Padded, so that decoding may run past the end before checking it
+    std::uint8_t b[max_length + 16] = {};
+    std::memcpy(b, code.data(), std::min(code.size(), max_length));
+
+    std::size_t i = 0;
+    bool operand16 = false;
+    bool address32 = false;
+    bool rex_w = false;
+    for (;; i++) {
+      if (i == max_length) {
+        return std::nullopt;
+      }
+      if (b[i] == 0x66) {
+        operand16 = true;
+      } else if (b[i] == 0x67) {
+        address32 = true;
+      } else if (b[i] != 0xf0 && b[i] != 0xf2 && b[i] != 0xf3 && b[i] != 0x2e && b[i] != 0x36 &&
+                 b[i] != 0x3e && b[i] != 0x26 && b[i] != 0x64 && b[i] != 0x65) {
+        break;
+      }
+    }
+    if ((b[i] & 0xf0) == 0x40) {
+      rex_w = b[i] & 0x08;
+      i++;
+    }
+    std::size_t z = operand16 && !rex_w ? 2 : 4;
+
+    Instruction instruction{.flow = Flow::next};
+    bool modrm = true;
+    std::size_t immediate = 0;
+    bool relative = false;  // the immediate is a branch displacement
+    std::uint8_t op = b[i++];
+
+    if (op == 0xc4 || op == 0xc5 || op == 0x62) {
+      // VEX and EVEX, whose payload selects the opcode map
+      int map = 1;
+      if (op == 0xc4) {
+        map = b[i] & 0x1f;
+        i += 2;
+      } else if (op == 0x62) {
+        map = b[i] & 0x07;
+        i += 3;
+      } else {
+        i += 1;
+      }
+      op = b[i++];
+      if (map == 1) {
+        modrm = op != 0x77;  // vzeroupper and vzeroall
+        immediate = (op >= 0x70 && op <= 0x73) || (op >= 0xc4 && op <= 0xc6) || op == 0xc2;
+      } else if (map == 3) {
+        immediate = 1;
+      } else if (map != 2 && map != 5 && map != 6) {
+        return std::nullopt;
+      }
+    } else if (op == 0x0f) {
+      op = b[i++];
+      if (op == 0x38) {
+        i++;
+      } else if (op == 0x3a) {
+        i++;
+        immediate = 1;
+      } else {
+        switch (op) {
+        case 0x0b:  // ud2
+          instruction.flow = Flow::stop;
+          [[fallthrough]];
+        case 0x05: case 0x06: case 0x07: case 0x08: case 0x09: case 0x0e:
+        case 0x30: case 0x31: case 0x32: case 0x33: case 0x34: case 0x35: case 0x37:
+        case 0x77: case 0xa0: case 0xa1: case 0xa2: case 0xa8: case 0xa9: case 0xaa:
+        case 0xc8: case 0xc9: case 0xca: case 0xcb: case 0xcc: case 0xcd: case 0xce: case 0xcf:
+          modrm = false;
+          break;
+        case 0x70: case 0x71: case 0x72: case 0x73:
+        case 0xa4: case 0xac: case 0xba: case 0xc2: case 0xc4: case 0xc5: case 0xc6:
+        case 0x0f:  // 3DNow! has its opcode in the place of an immediate
+          immediate = 1;
+          break;
+        case 0x04: case 0x0a: case 0x0c: case 0x24: case 0x25: case 0x26: case 0x27:
+        case 0x36: case 0x39: case 0x3b: case 0x3c: case 0x3d: case 0x3e: case 0x3f:
+          return std::nullopt;
+        case 0xff:  // ud0
+          instruction.flow = Flow::stop;
+          break;
+        default:
+          if (op >= 0x80 && op <= 0x8f) {  // jcc rel32
+            modrm = false;
+            immediate = 4;
+            relative = true;
+            instruction.flow = Flow::branch;
+          }
+          break;
+        }
+      }
+    } else if (op < 0x40) {
+      switch (op & 7) {
+      case 4:
+        modrm = false;
+        immediate = 1;
+        break;
+      case 5:
+        modrm = false;
+        immediate = z;
+        break;
+      case 6:
+      case 7:
+        // push and pop of segment registers, daa and the like
+        return std::nullopt;
+      }
+    } else {
+      modrm = false;
+      switch (op) {
+      case 0x63: case 0x84: case 0x85: case 0x86: case 0x87: case 0x88: case 0x89: case 0x8a:
+      case 0x8b: case 0x8c: case 0x8d: case 0x8e: case 0x8f: case 0xd0: case 0xd1: case 0xd2:
+      case 0xd3: case 0xd8: case 0xd9: case 0xda: case 0xdb: case 0xdc: case 0xdd: case 0xde:
+      case 0xdf: case 0xfe:
+        modrm = true;
+        break;
+      case 0x69: case 0x81: case 0xc7:
+        modrm = true;
+        immediate = z;
+        break;
+      case 0x6b: case 0x80: case 0x83: case 0xc0: case 0xc1: case 0xc6:
+        modrm = true;
+        immediate = 1;
+        break;
+      case 0x68:
+        immediate = z;
+        break;
+      case 0x6a: case 0xa8: case 0xcd: case 0xe4: case 0xe5: case 0xe6: case 0xe7:
+        immediate = 1;
+        break;
+      case 0xa9:
+        immediate = z;
+        break;
+      case 0xa0: case 0xa1: case 0xa2: case 0xa3:
+        immediate = address32 ? 4 : 8;
+        break;
+      case 0xc8:  // enter
+        immediate = 3;
+        break;
+      case 0xc2: case 0xca:  // ret imm16
+        immediate = 2;
+        instruction.flow = Flow::stop;
+        break;
+      case 0xc3: case 0xcb: case 0xcc: case 0xcf:
+        instruction.flow = Flow::stop;
+        break;
+      case 0xe0: case 0xe1: case 0xe2: case 0xe3:  // loop and jrcxz
+        immediate = 1;
+        relative = true;
+        instruction.flow = Flow::branch;
+        break;
+      case 0xe8:
+        immediate = 4;
+        relative = true;
+        instruction.flow = Flow::call;
+        break;
+      case 0xe9:
+        immediate = 4;
+        relative = true;
+        instruction.flow = Flow::jump;
+        break;
+      case 0xeb:
+        immediate = 1;
+        relative = true;
+        instruction.flow = Flow::jump;
+        break;
+      case 0xf6:
+        modrm = true;
+        immediate = (b[i] >> 3 & 7) < 2;
+        break;
+      case 0xf7:
+        modrm = true;
+        immediate = (b[i] >> 3 & 7) < 2 ? z : 0;
+        break;
+      case 0xff: {
+        modrm = true;
+        auto reg = b[i] >> 3 & 7;
+        if (reg == 4 || reg == 5) {
+          instruction.flow = Flow::stop;
+        } else if (reg == 7) {
+          return std::nullopt;
+        }
+        break;
+      }
+      case 0x60: case 0x61: case 0x82: case 0x9a: case 0xce: case 0xd4: case 0xd5: case 0xd6:
+      case 0xea:
+        return std::nullopt;
+      default:
+        if (op >= 0x40 && op <= 0x4f) {
+          return std::nullopt;  // a REX prefix that is not right before the opcode
+        } else if (op >= 0x70 && op <= 0x7f) {  // jcc rel8
+          immediate = 1;
+          relative = true;
+          instruction.flow = Flow::branch;
+        } else if (op >= 0xb0 && op <= 0xb7) {
+          immediate = 1;
+        } else if (op >= 0xb8 && op <= 0xbf) {
+          immediate = rex_w ? 8 : z;
+        }
+        break;
+      }
+    }
+
+    if (modrm) {
+      std::uint8_t mod = b[i] >> 6;
+      std::uint8_t rm = b[i] & 7;
+      i++;
+      if (mod != 3) {
+        if (rm == 4 && mod == 0 && (b[i] & 7) == 5) {
+          i += 4;  // SIB without a base
+        }
+        if (rm == 4) {
+          i++;
+        }
+        if (mod == 0 && rm == 5) {
+          i += 4;  // RIP-relative
+        } else if (mod == 1) {
+          i += 1;
+        } else if (mod == 2) {
+          i += 4;
+        }
+      }
+    }
+    i += immediate;
+    if (i > max_length || i > code.size()) {
+      return std::nullopt;
+    }
+    instruction.length = i;
+
+    if (relative) {
+      std::int64_t displacement;
+      if (immediate == 1) {
+        displacement = static_cast<std::int8_t>(b[i - 1]);
+      } else {
+        std::int32_t value;
+        std::memcpy(&value, b + i - 4, sizeof(value));
+        displacement = value;
+      }
+      instruction.target = address + i + displacement;
+    }
+    return instruction;
+  }
+
+  std::uint8_t length;
+  Flow flow;
+  std::uint64_t target = 0;  // of jumps, branches and calls
+};
@@ -0,0 +1,177 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fmt/format.h>
+#include <fstream>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// The nondeterministic inputs of a run, in the order in which the guest
+// saw them. When recording, every exchange appends the value of this run
+// to the log. When replaying, it replaces the value with the one from the
+// log instead, so that the hypercall handlers see exactly the inputs of the
+// recorded run. The log also has the hypercalls the guest made, a replay
+// that takes another path stops with an error.
+//
+// Entries are a kind, their size as LEB128 and their contents.
+class Journal {
+public:
+  enum class Kind : std::uint8_t {
+    executable,  // a hash of it
+    call,
+    entropy,
+    clock,
+    variables,
+    events,
+    block_status,
+  };
+
+  static Journal record(const std::string& path) {
+    Journal journal{path, false};
+    journal.out.open(path, std::ios::binary|std::ios::trunc);
+    journal.out.write(magic, sizeof(magic));
+    if (!journal.out) {
+      throw std::runtime_error(path + ": cannot be written");
+    }
+    return journal;
+  }
+
+  static Journal replay(const std::string& path) {
+    Journal journal{path, true};
+    journal.in.open(path, std::ios::binary);
+    char header[sizeof(magic)];
+    if (!journal.in.read(header, sizeof(header)) || std::memcmp(header, magic, sizeof(magic)) != 0) {
+      throw std::runtime_error(path + ": not a uiu journal");
+    }
+    return journal;
+  }
+
+  Journal(Journal&&) = default;
+  Journal& operator=(Journal&&) = default;
+
+  ~Journal() {
+    if (out.is_open()) {
+      out.flush();
+    }
+  }
+
+  bool replaying() const {
+    return replay_mode;
+  }
+
+  // Whether a replay used up the whole log
+  bool finished() {
+    return in.peek() == std::ifstream::traits_type::eof();
+  }
+
+  void exchange(Kind kind, std::span<std::byte> data) {
+    if (!replay_mode) {
+      write(kind, data);
+      return;
+    }
+    auto size = read_header(kind);
+    if (size != data.size()) {
+      throw diverged(kind, fmt::format("the log has {} bytes, not {}", size, data.size()));
+    }
+    read_contents(data);
+  }
+
+  template <typename T>
+    requires std::is_trivially_copyable_v<T>
+  void exchange(Kind kind, T& value) {
+    exchange(kind, std::as_writable_bytes(std::span{&value, 1}));
+  }
+
+  template <typename T>
+    requires std::is_trivially_copyable_v<T>
+  void exchange(Kind kind, std::vector<T>& values) {
+    if (!replay_mode) {
+      write(kind, std::as_writable_bytes(std::span{values}));
+      return;
+    }
+    auto size = read_header(kind);
+    if (size % sizeof(T) != 0) {
+      throw diverged(kind, fmt::format("{} bytes", size));
+    }
+    values.resize(size / sizeof(T));
+    read_contents(std::as_writable_bytes(std::span{values}));
+  }
+
+  // Like exchange, but a replay has to have the same value
+  template <typename T>
+    requires std::is_trivially_copyable_v<T>
+  void expect(Kind kind, T value) {
+    auto recorded = value;
+    auto entry = entries;
+    exchange(kind, recorded);
+    if (std::memcmp(&recorded, &value, sizeof(value)) != 0) {
+      entries = entry;
+      throw diverged(kind, "a different value");
+    }
+  }
+
+  // For contents of the log that do not fit the replay, at entries
+  std::runtime_error diverged(Kind kind, const std::string& what) const {
+    return std::runtime_error(fmt::format("{}: replay diverged at entry {} of kind {}: {}", path, entries, int(kind), what));
+  }
+
+  std::uint64_t entries = 0;
+
+private:
+  static constexpr char magic[8] = {'U', 'I', 'U', 'J', 'R', 'N', 'L', '1'};
+
+  Journal(std::string path, bool replay_mode) : path(std::move(path)), replay_mode(replay_mode) {}
+
+  void write(Kind kind, std::span<const std::byte> data) {
+    out.put(static_cast<char>(kind));
+    auto size = data.size();
+    do {
+      out.put(static_cast<char>((size & 0x7f) | (size > 0x7f ? 0x80 : 0)));
+      size >>= 7;
+    } while (size != 0);
+    out.write(reinterpret_cast<const char*>(data.data()), data.size());
+    if (!out) {
+      throw std::runtime_error(path + ": cannot be written");
+    }
+    entries++;
+  }
+
+  std::uint64_t read_header(Kind kind) {
+    int recorded = in.get();
+    if (recorded == std::ifstream::traits_type::eof()) {
+      throw diverged(kind, "the log ends here");
+    }
+    if (recorded != int(kind)) {
+      throw diverged(kind, fmt::format("the log has kind {}", recorded));
+    }
+    std::uint64_t size = 0;
+    for (int shift = 0;; shift += 7) {
+      int byte = in.get();
+      if (byte == std::ifstream::traits_type::eof() || shift > 63) {
+        throw std::runtime_error(path + ": truncated");
+      }
+      size |= std::uint64_t(byte & 0x7f) << shift;
+      if (!(byte & 0x80)) {
+        break;
+      }
+    }
+    return size;
+  }
+
+  void read_contents(std::span<std::byte> data) {
+    if (!in.read(reinterpret_cast<char*>(data.data()), data.size())) {
+      throw std::runtime_error(path + ": truncated");
+    }
+    entries++;
+  }
+
+  std::string path;
+  bool replay_mode;
+  std::ofstream out;
+  std::ifstream in;
+};
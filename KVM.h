@@ -1,6 +1,14 @@
 #pragma once
 
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <fmt/format.h>
+#include <span>
+#include <stdexcept>
 #include <system_error>
+#include <type_traits>
+#include <vector>
 
 extern "C" {
 #include <fcntl.h>
@@ -12,44 +20,111 @@ extern "C" {
 
 #include "Rflags.h"
 
+// What the classes below use instead of the system calls on /dev/kvm and the
+// file descriptors it hands out. The kernel's KVM, or MockBackend for code
+// that only needs the state of a vCPU and not a running guest.
+class Backend {
+public:
+  virtual ~Backend() = default;
+
+  // Like open, ioctl, close and mmap, with -1 or MAP_FAILED and errno on
+  // failure
+  virtual int open() = 0;
+  virtual int control(int fd, unsigned long request, unsigned long arg) = 0;
+  virtual int close(int fd) = 0;
+  virtual void* map_run(int fd, std::size_t size) = 0;
+  virtual void unmap_run(void* run, std::size_t size) = 0;
+  // Of the memfd behind guest memory
+  virtual void* map_memory(int fd, std::size_t size) = 0;
+
+  template <typename T>
+  int ioctl(int fd, unsigned long request, T arg) {
+    if constexpr (std::is_pointer_v<T>) {
+      return control(fd, request, reinterpret_cast<unsigned long>(arg));
+    } else {
+      return control(fd, request, static_cast<unsigned long>(arg));
+    }
+  }
+
+  static Backend& kernel();
+};
+
+class KernelBackend final : public Backend {
+public:
+  int open() override {
+    return ::open("/dev/kvm", O_CLOEXEC);
+  }
+
+  int control(int fd, unsigned long request, unsigned long arg) override {
+    return ::ioctl(fd, request, arg);
+  }
+
+  int close(int fd) override {
+    return ::close(fd);
+  }
+
+  void* map_run(int fd, std::size_t size) override {
+    return mmap(0, size, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_SHARED, fd, 0);
+  }
+
+  void unmap_run(void* run, std::size_t size) override {
+    munmap(run, size);
+  }
+
+  void* map_memory(int fd, std::size_t size) override {
+    return mmap(0, size, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_SHARED, fd, 0);
+  }
+};
+
+inline Backend& Backend::kernel() {
+  static KernelBackend backend;
+  return backend;
+}
+
 class VCPU {
 public:
   VCPU() = default;
 
-  VCPU(int fd) : fd{fd} {}
+  VCPU(Backend& backend, int fd) : backend(&backend), fd{fd} {}
 
   ~VCPU() {
     if (*this) {
-      close(fd);
+      backend->close(fd);
     }
   }
 
   VCPU(const VCPU&) = delete;
   VCPU& operator=(const VCPU&) = delete;
 
-  VCPU(VCPU&& other) noexcept : fd(other.fd) {
+  VCPU(VCPU&& other) noexcept : backend(other.backend), fd(other.fd) {
     other.fd = -1;
   }
 
   VCPU& operator=(VCPU&& other) noexcept {
+    std::swap(backend, other.backend);
     std::swap(fd, other.fd);
     if (other.fd != -1) {
-      close(other.fd);
+      other.backend->close(other.fd);
       other.fd = -1;
     }
     return *this;
   }
 
-  void run() {
-    int ret = ioctl(fd, KVM_RUN, 0);
+  // Returns false if a signal or immediate_exit interrupted the vCPU
+  bool run() {
+    int ret = backend->ioctl(fd, KVM_RUN, 0);
     if (ret == -1) {
+      if (errno == EINTR) {
+        return false;
+      }
       throw std::system_error(errno, std::generic_category());
     }
+    return true;
   }
 
   kvm_sregs get_sregs() {
     kvm_sregs sregs;
-    int ret = ioctl(fd, KVM_GET_SREGS, &sregs);
+    int ret = backend->ioctl(fd, KVM_GET_SREGS, &sregs);
     if (ret == -1) {
       throw std::system_error(errno, std::generic_category());
     }
@@ -57,7 +132,7 @@ public:
   }
 
   void set_sregs(const kvm_sregs& sregs) {
-    int ret = ioctl(fd, KVM_SET_SREGS, &sregs);
+    int ret = backend->ioctl(fd, KVM_SET_SREGS, &sregs);
     if (ret == -1) {
       throw std::system_error(errno, std::generic_category());
     }
@@ -65,7 +140,7 @@ public:
 
   kvm_regs get_regs() {
     kvm_regs regs;
-    int ret = ioctl(fd, KVM_GET_REGS, &regs);
+    int ret = backend->ioctl(fd, KVM_GET_REGS, &regs);
     if (ret == -1) {
       throw std::system_error(errno, std::generic_category());
     }
@@ -73,7 +148,112 @@ public:
   }
 
   void set_regs(const kvm_regs& regs) {
-    int ret = ioctl(fd, KVM_SET_REGS, &regs);
+    int ret = backend->ioctl(fd, KVM_SET_REGS, &regs);
+    if (ret == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+  }
+
+  void set_fpu(const kvm_fpu& fpu) {
+    int ret = backend->ioctl(fd, KVM_SET_FPU, &fpu);
+    if (ret == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+  }
+
+  // Only the legacy 4 KiB area, enough for XSAVE components up to AVX-512
+  void set_xsave(const kvm_xsave& xsave) {
+    int ret = backend->ioctl(fd, KVM_SET_XSAVE, &xsave);
+    if (ret == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+  }
+
+  // Requires KVM_CAP_XCRS
+  void set_xcrs(const kvm_xcrs& xcrs) {
+    int ret = backend->ioctl(fd, KVM_SET_XCRS, &xcrs);
+    if (ret == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+  }
+
+  // Has to happen before the first KVM_RUN, KVM refuses changes after that
+  void set_cpuid(std::span<const kvm_cpuid_entry2> entries) {
+    std::vector<std::byte> buffer(sizeof(kvm_cpuid2) + entries.size_bytes());
+    auto* cpuid = reinterpret_cast<kvm_cpuid2*>(buffer.data());
+    cpuid->nent = entries.size();
+    std::ranges::copy(entries, cpuid->entries);
+    int ret = backend->ioctl(fd, KVM_SET_CPUID2, cpuid);
+    if (ret == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+  }
+
+  // Requires the in-kernel irqchip
+  kvm_lapic_state get_lapic() {
+    kvm_lapic_state lapic;
+    int ret = backend->ioctl(fd, KVM_GET_LAPIC, &lapic);
+    if (ret == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+    return lapic;
+  }
+
+  void set_lapic(const kvm_lapic_state& lapic) {
+    int ret = backend->ioctl(fd, KVM_SET_LAPIC, &lapic);
+    if (ret == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+  }
+
+  std::uint64_t get_msr(std::uint32_t index) {
+    alignas(kvm_msrs) std::byte buffer[sizeof(kvm_msrs) + sizeof(kvm_msr_entry)] = {};
+    auto* msrs = reinterpret_cast<kvm_msrs*>(buffer);
+    msrs->nmsrs = 1;
+    msrs->entries[0].index = index;
+    int ret = backend->ioctl(fd, KVM_GET_MSRS, msrs);
+    if (ret == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+    if (ret != 1) {
+      throw std::runtime_error(fmt::format("MSR {:#x} could not be read", index));
+    }
+    return msrs->entries[0].data;
+  }
+
+  void set_msr(std::uint32_t index, std::uint64_t data) {
+    alignas(kvm_msrs) std::byte buffer[sizeof(kvm_msrs) + sizeof(kvm_msr_entry)] = {};
+    auto* msrs = reinterpret_cast<kvm_msrs*>(buffer);
+    msrs->nmsrs = 1;
+    msrs->entries[0].index = index;
+    msrs->entries[0].data = data;
+    int ret = backend->ioctl(fd, KVM_SET_MSRS, msrs);
+    if (ret == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+    if (ret != 1) {
+      throw std::runtime_error(fmt::format("MSR {:#x} could not be written", index));
+    }
+  }
+
+  std::uint32_t get_tsc_khz() {
+    int ret = backend->ioctl(fd, KVM_GET_TSC_KHZ, 0);
+    if (ret == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+    return ret;
+  }
+
+  // Requires KVM_CAP_TSC_CONTROL
+  void set_tsc_khz(std::uint32_t tsc_khz) {
+    int ret = backend->ioctl(fd, KVM_SET_TSC_KHZ, tsc_khz);
+    if (ret == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+  }
+
+  void set_guest_debug(const kvm_guest_debug& debug) {
+    int ret = backend->ioctl(fd, KVM_SET_GUEST_DEBUG, &debug);
     if (ret == -1) {
       throw std::system_error(errno, std::generic_category());
     }
@@ -88,6 +268,7 @@ public:
   }
 
 private:
+  Backend* backend = nullptr;
   int fd = -1;
 };
 
@@ -95,46 +276,94 @@ class VM {
 public:
   VM() = default;
 
-  VM(int fd) : fd{fd} {}
+  VM(Backend& backend, int fd) : backend(&backend), fd{fd} {}
 
   ~VM() {
     if (*this) {
-      close(fd);
+      backend->close(fd);
     }
   }
 
   VM(const VM&) = delete;
   VM& operator=(const VM&) = delete;
 
-  VM(VM&& other) noexcept : fd(other.fd) {
+  VM(VM&& other) noexcept : backend(other.backend), fd(other.fd) {
     other.fd = -1;
   }
 
   VM& operator=(VM&& other) noexcept {
+    std::swap(backend, other.backend);
     std::swap(fd, other.fd);
     if (other.fd != -1) {
-      close(other.fd);
+      other.backend->close(other.fd);
       other.fd = -1;
     }
     return *this;
   }
 
   void set_user_memory_region(const kvm_userspace_memory_region& region) {
-    int ret = ioctl(fd, KVM_SET_USER_MEMORY_REGION, &region);
+    int ret = backend->ioctl(fd, KVM_SET_USER_MEMORY_REGION, &region);
+    if (ret == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+  }
+
+  // Fills bitmap with the pages of slot written since the last call, which
+  // needs KVM_MEM_LOG_DIRTY_PAGES on the slot.
+  void get_dirty_log(std::uint32_t slot, std::span<std::uint64_t> bitmap) {
+    kvm_dirty_log log{
+      .slot = slot,
+      .dirty_bitmap = bitmap.data(),
+    };
+    int ret = backend->ioctl(fd, KVM_GET_DIRTY_LOG, &log);
+    if (ret == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+  }
+
+  void enable_cap(const kvm_enable_cap& cap) {
+    int ret = backend->ioctl(fd, KVM_ENABLE_CAP, &cap);
+    if (ret == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+  }
+
+  // Writes to the zone are queued in the coalesced MMIO ring instead of
+  // exiting to userspace
+  void register_coalesced_mmio(const kvm_coalesced_mmio_zone& zone) {
+    int ret = backend->ioctl(fd, KVM_REGISTER_COALESCED_MMIO, &zone);
+    if (ret == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+  }
+
+  // Guest accesses to the MSRs that the filter denies fail, or exit with
+  // KVM_CAP_X86_USER_SPACE_MSR
+  void set_msr_filter(const kvm_msr_filter& filter) {
+    int ret = backend->ioctl(fd, KVM_X86_SET_MSR_FILTER, &filter);
+    if (ret == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+  }
+
+  // Emulates the PIC, the I/O APIC and a local APIC for every vCPU in the
+  // kernel, has to happen before the vCPUs are created
+  void create_irqchip() {
+    int ret = backend->ioctl(fd, KVM_CREATE_IRQCHIP, 0);
     if (ret == -1) {
       throw std::system_error(errno, std::generic_category());
     }
   }
 
   VCPU create_vcpu(int vcpuid) {
-    int ret = ioctl(fd, KVM_CREATE_VCPU, vcpuid);
+    int ret = backend->ioctl(fd, KVM_CREATE_VCPU, vcpuid);
     if (ret == -1) {
       throw std::system_error(errno, std::generic_category());
     }
     if (fcntl(ret, F_SETFD, FD_CLOEXEC) == -1) {
       throw std::system_error(errno, std::generic_category());
     }
-    return VCPU(ret);
+    return VCPU(*backend, ret);
   }
 
   operator bool() const {
@@ -146,39 +375,49 @@ public:
   }
 
 private:
+  Backend* backend = nullptr;
   int fd = -1;
 };
 
 class KVM {
 public:
-  KVM() {
-    fd = open("/dev/kvm", O_CLOEXEC);
-  };
+  explicit KVM(Backend& backend = Backend::kernel()) : backend(&backend) {
+    fd = backend.open();
+  }
 
   ~KVM() {
     if (*this) {
-      close(fd);
+      backend->close(fd);
     }
   }
 
   KVM(const KVM&) = delete;
   KVM& operator=(const KVM&) = delete;
 
-  KVM(KVM&& other) noexcept : fd(other.fd) {
+  KVM(KVM&& other) noexcept : backend(other.backend), fd(other.fd) {
     other.fd = -1;
   }
 
   KVM& operator=(KVM&& other) noexcept {
+    std::swap(backend, other.backend);
     std::swap(fd, other.fd);
     if (other.fd != -1) {
-      close(other.fd);
+      other.backend->close(other.fd);
       other.fd = -1;
     }
     return *this;
   }
 
+  int check_extension(int extension) {
+    int ret = backend->ioctl(fd, KVM_CHECK_EXTENSION, extension);
+    if (ret == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+    return ret;
+  }
+
   int get_api_version() {
-    int ret = ioctl(fd, KVM_GET_API_VERSION, 0);
+    int ret = backend->ioctl(fd, KVM_GET_API_VERSION, 0);
     if (ret == -1) {
       throw std::system_error(errno, std::generic_category());
     }
@@ -186,18 +425,34 @@ public:
   }
 
   VM create_vm() {
-    int ret = ioctl(fd, KVM_CREATE_VM, 0 /* KVM_X86_DEFAULT_VM */);
+    int ret = backend->ioctl(fd, KVM_CREATE_VM, 0 /* KVM_X86_DEFAULT_VM */);
     if (ret == -1) {
       throw std::system_error(errno, std::generic_category());
     }
     if (fcntl(ret, F_SETFD, FD_CLOEXEC) == -1) {
       throw std::system_error(errno, std::generic_category());
     }
-    return VM(ret);
+    return VM(*backend, ret);
+  }
+
+  std::vector<kvm_cpuid_entry2> get_supported_cpuid() {
+    for (std::size_t nent = 64;; nent *= 2) {
+      std::vector<std::byte> buffer(sizeof(kvm_cpuid2) + nent * sizeof(kvm_cpuid_entry2));
+      auto* cpuid = reinterpret_cast<kvm_cpuid2*>(buffer.data());
+      cpuid->nent = nent;
+      int ret = backend->ioctl(fd, KVM_GET_SUPPORTED_CPUID, cpuid);
+      if (ret == -1 && errno == E2BIG) {
+        continue;
+      }
+      if (ret == -1) {
+        throw std::system_error(errno, std::generic_category());
+      }
+      return {cpuid->entries, cpuid->entries + cpuid->nent};
+    }
   }
 
   int get_vcpu_mmap_size() {
-    int ret = ioctl(fd, KVM_GET_VCPU_MMAP_SIZE, 0);
+    int ret = backend->ioctl(fd, KVM_GET_VCPU_MMAP_SIZE, 0);
     if (ret == -1) {
       throw std::system_error(errno, std::generic_category());
     }
@@ -212,7 +467,12 @@ public:
     return fd;
   }
 
+  Backend& get_backend() const {
+    return *backend;
+  }
+
 private:
+  Backend* backend = nullptr;
   int fd = -1;
 };
 
@@ -220,9 +480,9 @@ class KVMRun {
 public:
   KVMRun() = default;
 
-  KVMRun(KVM& kvm, VCPU& vcpu) {
+  KVMRun(KVM& kvm, VCPU& vcpu) : backend(&kvm.get_backend()) {
     vcpu_run_size = kvm.get_vcpu_mmap_size();
-    data = (kvm_run*)mmap(0, vcpu_run_size, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_SHARED, vcpu.get_fd(), 0);
+    data = (kvm_run*)backend->map_run(vcpu.get_fd(), vcpu_run_size);
     if (data == MAP_FAILED) {
       throw std::system_error(errno, std::generic_category());
     }
@@ -230,22 +490,23 @@ public:
 
   ~KVMRun() {
     if (data != nullptr) {
-      munmap(data, vcpu_run_size);
+      backend->unmap_run(data, vcpu_run_size);
     }
   }
 
   KVMRun(const KVMRun&) = delete;
   KVMRun& operator=(const KVMRun&) = delete;
 
-  KVMRun(KVMRun&& other) noexcept : vcpu_run_size(other.vcpu_run_size), data(other.data) {
+  KVMRun(KVMRun&& other) noexcept : backend(other.backend), vcpu_run_size(other.vcpu_run_size), data(other.data) {
     other.data = nullptr;
   }
 
   KVMRun& operator=(KVMRun&& other) noexcept {
+    std::swap(backend, other.backend);
     std::swap(vcpu_run_size, other.vcpu_run_size);
     std::swap(data, other.data);
     if (other.data != nullptr) {
-      munmap(other.data, other.vcpu_run_size);
+      other.backend->unmap_run(other.data, other.vcpu_run_size);
       other.data = nullptr;
     }
     return *this;
@@ -260,6 +521,7 @@ public:
   }
 
 private:
+  Backend* backend = nullptr;
   int vcpu_run_size;
   kvm_run* data = nullptr;
 };
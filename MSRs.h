@@ -0,0 +1,196 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <fmt/format.h>
+#include <fstream>
+#include <map>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include <linux/kvm.h>
+}
+
+#include "KVM.h"
+
+// MSRs that uiu emulates instead of KVM, from a file with one MSR per line:
+//
+//   # index     value       options
+//   0x1a0       0x850089    read-only
+//   0x3a        0x5         read-only log-once
+//   0xc0011029  -           log
+//
+// Reads return the value, writes change it unless the MSR is read-only.
+// With a value of -, the MSR does not exist and accesses raise #GP, as do
+// writes to read-only MSRs. log prints every access, log-once the first.
+// Only these MSRs exit to userspace, KVM keeps handling all others.
+class MSRs {
+public:
+  static MSRs load(const std::string& path) {
+    std::ifstream file{path};
+    if (!file) {
+      throw std::runtime_error(path + ": cannot be read");
+    }
+    MSRs msrs;
+    std::string line;
+    for (int number = 1; std::getline(file, line); number++) {
+      auto fail = [&](const std::string& reason) {
+        return std::runtime_error(fmt::format("{}:{}: {}", path, number, reason));
+      };
+      line = line.substr(0, line.find('#'));
+      std::istringstream words{line};
+      std::string index, value, option;
+      if (!(words >> index)) {
+        continue;
+      }
+      if (!(words >> value)) {
+        throw fail("missing value");
+      }
+      MSR msr;
+      std::uint64_t parsed;
+      try {
+        parsed = std::stoull(index, nullptr, 0);
+        if (value != "-") {
+          msr.initial = std::stoull(value, nullptr, 0);
+        }
+      } catch (const std::logic_error&) {
+        throw fail("malformed number");
+      }
+      if (parsed > UINT32_MAX) {
+        throw fail("malformed number");
+      }
+      if (msrs.msrs.contains(parsed)) {
+        throw fail("listed twice");
+      }
+      while (words >> option) {
+        if (option == "read-only") {
+          msr.read_only = true;
+        } else if (option == "log") {
+          msr.log = Log::always;
+        } else if (option == "log-once") {
+          msr.log = Log::once;
+        } else {
+          throw fail("unknown option " + option);
+        }
+      }
+      msr.value = msr.initial;
+      msrs.msrs.emplace(parsed, msr);
+    }
+    return msrs;
+  }
+
+  // Makes guest accesses to these MSRs exit to userspace
+  void install(VM& vm) const {
+    vm.enable_cap({
+      .cap = KVM_CAP_X86_USER_SPACE_MSR,
+      .args = {KVM_MSR_EXIT_REASON_FILTER},
+    });
+
+    // KVM takes up to 16 ranges with a bitmap each, in which MSRs that stay
+    // in the kernel are set. MSRs that are close together share a range.
+    std::vector<std::pair<std::uint32_t, std::uint32_t>> ranges;  // first, last
+    for (const auto& [index, msr] : msrs) {
+      ranges.emplace_back(index, index);
+    }
+    while (ranges.size() > KVM_MSR_FILTER_MAX_RANGES) {
+      auto closest = ranges.end();
+      for (auto it = ranges.begin(); it + 1 != ranges.end(); ++it) {
+        if ((it + 1)->second - it->first >= max_range_msrs) {
+          continue;
+        }
+        if (closest == ranges.end() || (it + 1)->first - it->second < (closest + 1)->first - closest->second) {
+          closest = it;
+        }
+      }
+      if (closest == ranges.end()) {
+        throw std::runtime_error("the MSRs are too far apart for an MSR filter");
+      }
+      closest->second = (closest + 1)->second;
+      ranges.erase(closest + 1);
+    }
+
+    kvm_msr_filter filter{.flags = KVM_MSR_FILTER_DEFAULT_ALLOW};
+    std::vector<std::vector<std::uint8_t>> bitmaps;
+    for (std::size_t i = 0; i < ranges.size(); i++) {
+      auto [first, last] = ranges[i];
+      std::uint32_t count = last - first + 1;
+      auto& bitmap = bitmaps.emplace_back((count + 7) / 8, 0xff);
+      for (auto it = msrs.lower_bound(first); it != msrs.end() && it->first <= last; ++it) {
+        bitmap[(it->first - first) / 8] &= ~(1 << (it->first - first) % 8);
+      }
+      filter.ranges[i] = {
+        .flags = KVM_MSR_FILTER_READ|KVM_MSR_FILTER_WRITE,
+        .nmsrs = count,
+        .base = first,
+        .bitmap = bitmap.data(),
+      };
+    }
+    vm.set_msr_filter(filter);
+  }
+
+  // Returns false for accesses that raise #GP
+  bool read(std::uint32_t index, std::uint64_t& value) {
+    auto& msr = msrs.at(index);
+    log(index, msr, "rdmsr", msr.value);
+    if (!msr.value) {
+      return false;
+    }
+    value = *msr.value;
+    return true;
+  }
+
+  bool write(std::uint32_t index, std::uint64_t value) {
+    auto& msr = msrs.at(index);
+    log(index, msr, "wrmsr", value);
+    if (!msr.value || msr.read_only) {
+      return false;
+    }
+    msr.value = value;
+    return true;
+  }
+
+  // Back to the values from the file, for the next application
+  void reset() {
+    for (auto& [index, msr] : msrs) {
+      msr.value = msr.initial;
+      msr.logged = false;
+    }
+  }
+
+private:
+  // The largest bitmap that KVM accepts
+  static constexpr std::uint32_t max_range_msrs = 0x600 * 8;
+
+  enum class Log {
+    never,
+    once,
+    always,
+  };
+
+  struct MSR {
+    std::optional<std::uint64_t> initial;  // nothing if the MSR does not exist
+    std::optional<std::uint64_t> value;
+    bool read_only = false;
+    Log log = Log::never;
+    bool logged = false;
+  };
+
+  static void log(std::uint32_t index, MSR& msr, const char* access, std::optional<std::uint64_t> value) {
+    if (msr.log == Log::never || (msr.log == Log::once && msr.logged)) {
+      return;
+    }
+    msr.logged = true;
+    if (value) {
+      fmt::println("{} {:#x} {:#x}", access, index, *value);
+    } else {
+      fmt::println("{} {:#x} #GP", access, index);
+    }
+  }
+
+  std::map<std::uint32_t, MSR> msrs;
+};
@@ -1,15 +1,21 @@
 #pragma once
 
+#include <bit>
 #include <cstddef>
 #include <cstdint>
+#include <iterator>
+#include <map>
 #include <span>
 #include <system_error>
 
 extern "C" {
+#include <fcntl.h>
 #include <sys/mman.h>
+#include <unistd.h>
 }
 
 #include "KVM.h"
+#include "Placement.h"
 
 template <typename T>
 struct MachinePtr {
@@ -42,6 +48,14 @@ struct MachinePtr {
     return *value;
   }
 
+  const T* operator->() const {
+    return value;
+  }
+
+  T* operator->() {
+    return value;
+  }
+
   const T* get() const {
     return value;
   }
@@ -72,20 +86,57 @@ struct MachinePtr {
 };
 
 struct Machine {
-  Machine(KVM& kvm) {
+  Machine(KVM& kvm, const Placement& placement = {}) {
     vm = kvm.create_vm();
+    if (placement.dedicated_core) {
+      // Only allowed before the vCPUs are created
+      vm.enable_cap({
+        .cap = KVM_CAP_X86_DISABLE_EXITS,
+        .args = {KVM_X86_DISABLE_EXITS_HLT|KVM_X86_DISABLE_EXITS_PAUSE},
+      });
+    }
+    // Gives the guest a local APIC, whose timer interrupts never leave the
+    // kernel
+    vm.create_irqchip();
     vcpu = vm.create_vcpu(0);
     vcpu_run = KVMRun(kvm, vcpu);
-    memory = {static_cast<std::byte*>(mmap(0, 0x4000'0000, PROT_READ|PROT_WRITE|PROT_EXEC, MAP_SHARED|MAP_ANONYMOUS, -1, 0)), 0x4000'0000};
+    // The ring is a page of the kvm_run mapping, at the offset KVM reports
+    if (int page = kvm.check_extension(KVM_CAP_COALESCED_MMIO); page > 0) {
+      coalesced_ring = reinterpret_cast<kvm_coalesced_mmio_ring*>(reinterpret_cast<std::byte*>(vcpu_run.get()) + page * sysconf(_SC_PAGESIZE));
+      coalesced_entries = (sysconf(_SC_PAGESIZE) - sizeof(kvm_coalesced_mmio_ring)) / sizeof(kvm_coalesced_mmio);
+      coalesced_pio = kvm.check_extension(KVM_CAP_COALESCED_PIO);
+    }
+    // Backed by a memfd so that guest pages can be mapped at more than one
+    // guest address, see alias_memory.
+    memory_fd = memfd_create("uiu-guest-memory", MFD_CLOEXEC);
+    if (memory_fd == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+    if (ftruncate(memory_fd, 0x4000'0000) == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+    memory = {static_cast<std::byte*>(kvm.get_backend().map_memory(memory_fd, 0x4000'0000)), 0x4000'0000};
     if (memory.data() == MAP_FAILED) {
       throw std::system_error(errno, std::generic_category());
     }
+    if (placement.bind_memory_to_node) {
+      Placement::bind_memory(memory.data(), memory.size(), placement.node());
+    }
+    vm.set_user_memory_region({
+      .slot = 0,
+      .guest_phys_addr = 0,
+      .memory_size = memory.size(),
+      .userspace_addr = std::bit_cast<std::uint64_t>(memory.data()),
+    });
   }
 
   ~Machine() {
     if (memory.data() != nullptr) {
       munmap(memory.data(), memory.size());
     }
+    if (memory_fd != -1) {
+      close(memory_fd);
+    }
   }
 
   Machine(const Machine&) = delete;
@@ -104,9 +155,101 @@ struct Machine {
     return MachinePtr<T>(memory.data(), value);
   }
 
+  // Lets KVM queue writes to the range in coalesced_ring instead of exiting
+  // for each of them. Returns false where it cannot.
+  bool coalesce_writes(std::uint64_t address, std::uint32_t size, bool pio) {
+    if (coalesced_ring == nullptr || (pio && !coalesced_pio)) {
+      return false;
+    }
+    vm.register_coalesced_mmio({.addr = address, .size = size, .pio = pio});
+    return true;
+  }
+
+  // Makes KVM track the pages of guest memory that the guest writes, for
+  // VM::get_dirty_log on slot 0
+  void log_dirty_pages() {
+    vm.set_user_memory_region({
+      .slot = 0,
+      .flags = KVM_MEM_LOG_DIRTY_PAGES,
+      .guest_phys_addr = 0,
+      .memory_size = memory.size(),
+      .userspace_addr = std::bit_cast<std::uint64_t>(memory.data()),
+    });
+  }
+
+  // Makes the page-aligned guest range at destination show the pages at
+  // source. KVM picks up the new host mapping through its MMU notifier.
+  void alias_memory(std::uint64_t destination, std::uint64_t source, std::uint64_t size, int prot) {
+    void* ret = mmap(memory.data() + destination, size, prot, MAP_SHARED|MAP_FIXED, memory_fd, source);
+    if (ret == MAP_FAILED) {
+      throw std::system_error(errno, std::generic_category());
+    }
+    unprotect(destination, size);
+    if (!(prot & PROT_WRITE)) {
+      read_only.emplace(destination, destination + size);
+    }
+  }
+
+  // Makes the page-aligned guest range read-only on the host until it is
+  // restored, see restore_memory.
+  void protect_memory(std::uint64_t address, std::uint64_t size) {
+    if (mprotect(memory.data() + address, size, PROT_READ) == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+    unprotect(address, size);
+    read_only.emplace(address, address + size);
+  }
+
+  // Whether the host can write to the size bytes at address, which are in
+  // memory
+  bool writable(std::uint64_t address, std::uint64_t size) const {
+    auto it = read_only.lower_bound(address + size);
+    return size == 0 || it == read_only.begin() || std::prev(it)->second <= address;
+  }
+
+  // Undoes alias_memory, and any other mapping placed over guest memory.
+  void restore_memory(std::uint64_t address, std::uint64_t size) {
+    alias_memory(address, address, size, PROT_READ|PROT_WRITE|PROT_EXEC);
+  }
+
+  // Drops all aliases and returns the guest memory to the kernel, which
+  // reads as zeroes afterwards.
+  void clear_memory() {
+    restore_memory(0, memory.size());
+    if (fallocate(memory_fd, FALLOC_FL_PUNCH_HOLE|FALLOC_FL_KEEP_SIZE, 0, memory.size()) == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+  }
+
   VM vm;
   VCPU vcpu;
   KVMRun vcpu_run;
+  kvm_coalesced_mmio_ring* coalesced_ring = nullptr;
+  std::uint32_t coalesced_entries = 0;
+  bool coalesced_pio = false;
 
+  int memory_fd = -1;
   std::span<std::byte> memory;
+
+private:
+  // Takes the range out of read_only
+  void unprotect(std::uint64_t address, std::uint64_t size) {
+    auto end = address + size;
+    auto it = read_only.lower_bound(address);
+    if (it != read_only.begin() && std::prev(it)->second > address) {
+      --it;
+    }
+    while (it != read_only.end() && it->first < end) {
+      auto [first, last] = *it;
+      it = read_only.erase(it);
+      if (first < address) {
+        read_only.emplace(first, address);
+      }
+      if (last > end) {
+        read_only.emplace(end, last);
+      }
+    }
+  }
+
+  std::map<std::uint64_t, std::uint64_t> read_only;  // ends by start
 };
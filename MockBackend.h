@@ -0,0 +1,230 @@
+#pragma once
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
+extern "C" {
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/kvm.h>
+#include <sys/mman.h>
+#include <unistd.h>
+}
+
+#include "KVM.h"
+
+// A KVM without /dev/kvm. vCPUs keep the registers, MSRs and local APIC that
+// are set, and a TSC that follows the host's monotonic clock, but they never
+// run: KVM_RUN fails with ENOSYS. Guest memory is plain host memory. This is
+// enough for the hypercall handlers, which only see guest memory and
+// registers.
+class MockBackend final : public Backend {
+public:
+  static constexpr std::uint32_t tsc_khz = 1'000'000;
+
+  int open() override {
+    return create(Object::kvm);
+  }
+
+  int control(int fd, unsigned long request, unsigned long arg) override {
+    std::unique_lock lock{mutex};
+    auto it = objects.find(fd);
+    if (it == objects.end()) {
+      errno = EBADF;
+      return -1;
+    }
+    auto& object = it->second;
+    lock.unlock();
+    switch (object.type) {
+    case Object::kvm:
+      return control_kvm(request, arg);
+    case Object::vm:
+      return control_vm(object, request, arg);
+    case Object::vcpu:
+      return control_vcpu(object, request, arg);
+    }
+    errno = ENOTTY;
+    return -1;
+  }
+
+  int close(int fd) override {
+    {
+      std::lock_guard lock{mutex};
+      objects.erase(fd);
+    }
+    return ::close(fd);
+  }
+
+  void* map_run(int, std::size_t size) override {
+    return mmap(0, size, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+  }
+
+  void unmap_run(void* run, std::size_t size) override {
+    munmap(run, size);
+  }
+
+  void* map_memory(int fd, std::size_t size) override {
+    return mmap(memory_address, size, PROT_READ|PROT_WRITE, MAP_SHARED|(memory_address ? MAP_FIXED_NOREPLACE : 0), fd, 0);
+  }
+
+  // Where guest memory goes if not nullptr. The allocators of the host keep
+  // host pointers in guest memory, a replay of a trace needs them to be
+  // where they were.
+  void* memory_address = nullptr;
+
+private:
+  struct Object {
+    enum Type {
+      kvm,
+      vm,
+      vcpu,
+    } type;
+
+    // vm
+    std::map<std::uint32_t, std::uint64_t> slot_sizes;
+
+    // vcpu
+    kvm_regs regs{};
+    kvm_sregs sregs{};
+    kvm_lapic_state lapic{};
+    std::map<std::uint32_t, std::uint64_t> msrs;
+    std::int64_t tsc_offset = 0;
+  };
+
+  static constexpr std::uint32_t IA32_TIME_STAMP_COUNTER = 0x10;
+
+  // The objects are backed by descriptors of /dev/null, which keeps their
+  // numbers unique and lets callers treat them like those of KVM
+  int create(Object::Type type) {
+    int fd = ::open("/dev/null", O_RDONLY|O_CLOEXEC);
+    if (fd == -1) {
+      return -1;
+    }
+    std::lock_guard lock{mutex};
+    objects[fd].type = type;
+    return fd;
+  }
+
+  int control_kvm(unsigned long request, unsigned long arg) {
+    switch (request) {
+    case KVM_GET_API_VERSION:
+      return KVM_API_VERSION;
+    case KVM_CHECK_EXTENSION:
+      return 0;
+    case KVM_CREATE_VM:
+      return create(Object::vm);
+    case KVM_GET_VCPU_MMAP_SIZE:
+      return sysconf(_SC_PAGESIZE);
+    case KVM_GET_SUPPORTED_CPUID: {
+      // A CPU with SSE2 and a TSC, but no XSAVE
+      auto* cpuid = reinterpret_cast<kvm_cpuid2*>(arg);
+      if (cpuid->nent < 2) {
+        errno = E2BIG;
+        return -1;
+      }
+      cpuid->nent = 2;
+      cpuid->entries[0] = {.function = 0x0, .eax = 0x1, .ebx = 0x4d554955, .ecx = 0x20555043, .edx = 0x206b636f};  // "UIUMock CPU "
+      cpuid->entries[1] = {.function = 0x1, .eax = 0x000906a0, .ecx = 1 << 0, .edx = 1 << 0 | 1 << 4 | 1 << 5 | 1 << 9 | 1 << 15 | 1 << 24 | 1 << 25 | 1 << 26};
+      return 0;
+    }
+    }
+    errno = ENOTTY;
+    return -1;
+  }
+
+  int control_vm(Object& vm, unsigned long request, unsigned long arg) {
+    switch (request) {
+    case KVM_SET_USER_MEMORY_REGION: {
+      const auto& region = *reinterpret_cast<const kvm_userspace_memory_region*>(arg);
+      vm.slot_sizes[region.slot] = region.memory_size;
+      return 0;
+    }
+    case KVM_GET_DIRTY_LOG: {
+      // Nothing writes guest memory behind the host's back
+      const auto& log = *reinterpret_cast<const kvm_dirty_log*>(arg);
+      auto pages = vm.slot_sizes[log.slot] / sysconf(_SC_PAGESIZE);
+      std::memset(log.dirty_bitmap, 0, (pages + 63) / 64 * 8);
+      return 0;
+    }
+    case KVM_ENABLE_CAP:
+    case KVM_REGISTER_COALESCED_MMIO:
+    case KVM_X86_SET_MSR_FILTER:
+    case KVM_CREATE_IRQCHIP:
+      return 0;
+    case KVM_CREATE_VCPU:
+      return create(Object::vcpu);
+    }
+    errno = ENOTTY;
+    return -1;
+  }
+
+  static std::uint64_t host_tsc() {
+    auto now = std::chrono::steady_clock::now().time_since_epoch();
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(now).count() * (tsc_khz / 1'000'000);
+  }
+
+  int control_vcpu(Object& vcpu, unsigned long request, unsigned long arg) {
+    switch (request) {
+    case KVM_RUN:
+      errno = ENOSYS;
+      return -1;
+    case KVM_GET_REGS:
+      *reinterpret_cast<kvm_regs*>(arg) = vcpu.regs;
+      return 0;
+    case KVM_SET_REGS:
+      vcpu.regs = *reinterpret_cast<const kvm_regs*>(arg);
+      return 0;
+    case KVM_GET_SREGS:
+      *reinterpret_cast<kvm_sregs*>(arg) = vcpu.sregs;
+      return 0;
+    case KVM_SET_SREGS:
+      vcpu.sregs = *reinterpret_cast<const kvm_sregs*>(arg);
+      return 0;
+    case KVM_GET_LAPIC:
+      *reinterpret_cast<kvm_lapic_state*>(arg) = vcpu.lapic;
+      return 0;
+    case KVM_SET_LAPIC:
+      vcpu.lapic = *reinterpret_cast<const kvm_lapic_state*>(arg);
+      return 0;
+    case KVM_GET_MSRS: {
+      auto* msrs = reinterpret_cast<kvm_msrs*>(arg);
+      for (std::uint32_t i = 0; i < msrs->nmsrs; i++) {
+        auto& entry = msrs->entries[i];
+        entry.data = entry.index == IA32_TIME_STAMP_COUNTER ? host_tsc() + vcpu.tsc_offset : vcpu.msrs[entry.index];
+      }
+      return msrs->nmsrs;
+    }
+    case KVM_SET_MSRS: {
+      const auto* msrs = reinterpret_cast<const kvm_msrs*>(arg);
+      for (std::uint32_t i = 0; i < msrs->nmsrs; i++) {
+        const auto& entry = msrs->entries[i];
+        if (entry.index == IA32_TIME_STAMP_COUNTER) {
+          vcpu.tsc_offset = entry.data - host_tsc();
+        } else {
+          vcpu.msrs[entry.index] = entry.data;
+        }
+      }
+      return msrs->nmsrs;
+    }
+    case KVM_GET_TSC_KHZ:
+      return tsc_khz;
+    // Nothing reads these back
+    case KVM_SET_FPU:
+    case KVM_SET_XSAVE:
+    case KVM_SET_XCRS:
+    case KVM_SET_CPUID2:
+    case KVM_SET_GUEST_DEBUG:
+      return 0;
+    }
+    errno = ENOTTY;
+    return -1;
+  }
+
+  std::mutex mutex;
+  std::unordered_map<int, Object> objects;
+};
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <optional>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "Image.h"
+
+// What the debugging tools know about a PE image: its functions from the
+// .pdata, its COFF symbols and the PDB that has the rest.
+struct Module {
+  struct RuntimeFunction {
+    std::uint32_t begin;
+    std::uint32_t end;
+    std::uint32_t unwind_info;
+  };
+
+  struct Symbol {
+    std::uint32_t rva;
+    std::string name;
+    bool function;  // by its type, others may be labels within functions
+  };
+
+  // Layout of the COFF symbol table entries, which are not aligned
+  struct [[gnu::packed]] CoffSymbol {
+    char name[8];
+    std::uint32_t value;
+    std::int16_t section;
+    std::uint16_t type;
+    std::uint8_t storage_class;
+    std::uint8_t aux_count;
+  };
+
+  struct DebugDirectory {
+    std::uint32_t characteristics;
+    std::uint32_t time_date_stamp;
+    std::uint16_t major_version;
+    std::uint16_t minor_version;
+    std::uint32_t type;
+    std::uint32_t size;
+    std::uint32_t rva;
+    std::uint32_t file_offset;
+  };
+
+  std::string name;
+  PEImage image;
+  std::vector<RuntimeFunction> functions;  // sorted
+  std::vector<Symbol> symbols;  // sorted by rva
+  std::string pdb;  // from the CodeView debug entry
+
+  // Nothing if file is not a valid image
+  static std::optional<Module> parse(std::string name, std::span<const std::byte> file) {
+    Module module{.name = std::move(name)};
+    if (PEImage::parse(file, module.image) != EFI_SUCCESS) {
+      return std::nullopt;
+    }
+    module.read_functions();
+    module.read_symbols(file);
+    module.read_debug_directory(file);
+    return module;
+  }
+
+  template <typename T>
+  std::optional<T> read(std::uint64_t rva) const {
+    if (rva > image.contents.size() || image.contents.size() - rva < sizeof(T)) {
+      return std::nullopt;
+    }
+    T value;
+    std::memcpy(&value, image.contents.data() + rva, sizeof(T));
+    return value;
+  }
+
+  void read_functions() {
+    const auto& directory = image.directories[IMAGE_DIRECTORY_ENTRY_EXCEPTION];
+    for (std::uint64_t i = 0; i + sizeof(RuntimeFunction) <= directory.Size; i += sizeof(RuntimeFunction)) {
+      auto function = read<RuntimeFunction>(directory.VirtualAddress + i);
+      if (!function) {
+        break;
+      }
+      functions.push_back(*function);
+    }
+    std::ranges::sort(functions, {}, &RuntimeFunction::begin);
+  }
+
+  const RuntimeFunction* function(std::uint64_t rva) const {
+    auto it = std::ranges::upper_bound(functions, rva, {}, &RuntimeFunction::begin);
+    if (it == functions.begin() || rva >= std::prev(it)->end) {
+      return nullptr;
+    }
+    return &*std::prev(it);
+  }
+
+  // The symbol at or before rva, nullptr if there is none
+  const Symbol* symbol(std::uint64_t rva) const {
+    auto it = std::ranges::upper_bound(symbols, rva, {}, &Symbol::rva);
+    if (it == symbols.begin()) {
+      return nullptr;
+    }
+    return &*std::prev(it);
+  }
+
+  // Keeps the function symbols of the code sections
+  void read_symbols(std::span<const std::byte> file) {
+    std::uint64_t table = image.symbol_table;
+    std::uint64_t size = std::uint64_t{image.symbol_count} * sizeof(CoffSymbol);
+    if (table == 0 || table > file.size() || size > file.size() - table) {
+      return;
+    }
+    auto strings = file.subspan(table + size);
+    for (std::uint64_t i = 0; i < image.symbol_count; i++) {
+      CoffSymbol symbol;
+      std::memcpy(&symbol, file.data() + table + i * sizeof(CoffSymbol), sizeof(symbol));
+      i += symbol.aux_count;
+      // External and static symbols without auxiliary entries, the others
+      // are sections and files.
+      if ((symbol.storage_class != 2 && symbol.storage_class != 3) || symbol.aux_count != 0 ||
+          symbol.section <= 0 || std::size_t(symbol.section) > image.sections.size()) {
+        continue;
+      }
+      const auto& section = image.sections[symbol.section - 1];
+      if (!(section.Characteristics & IMAGE_SCN_MEM_EXECUTE)) {
+        continue;
+      }
+      std::string name;
+      std::uint32_t zeroes;
+      std::memcpy(&zeroes, symbol.name, sizeof(zeroes));
+      if (zeroes == 0) {
+        std::uint32_t offset;
+        std::memcpy(&offset, symbol.name + 4, sizeof(offset));
+        if (offset >= strings.size()) {
+          continue;
+        }
+        auto rest = strings.subspan(offset);
+        auto end = std::ranges::find(rest, std::byte{0});
+        name.assign(reinterpret_cast<const char*>(rest.data()), end - rest.begin());
+      } else {
+        name.assign(symbol.name, strnlen(symbol.name, sizeof(symbol.name)));
+      }
+      constexpr std::uint16_t function_type = 0x20;  // DT_FCN << 4
+      symbols.push_back({section.VirtualAddress + symbol.value, std::move(name), symbol.type == function_type});
+    }
+    std::ranges::sort(symbols, {}, &Symbol::rva);
+  }
+
+  // The record need not be loaded, so it is read from the file
+  void read_debug_directory(std::span<const std::byte> file) {
+    const auto& directory = image.directories[IMAGE_DIRECTORY_ENTRY_DEBUG];
+    for (std::uint64_t i = 0; i + sizeof(DebugDirectory) <= directory.Size; i += sizeof(DebugDirectory)) {
+      auto entry = read<DebugDirectory>(directory.VirtualAddress + i);
+      if (!entry) {
+        break;
+      }
+      // An RSDS record: signature, GUID, age and the path of the PDB
+      constexpr std::uint32_t codeview = 2;
+      constexpr std::uint32_t header_size = 24;
+      if (entry->type != codeview || entry->size <= header_size ||
+          entry->file_offset > file.size() || entry->size > file.size() - entry->file_offset ||
+          std::memcmp(file.data() + entry->file_offset, "RSDS", 4) != 0) {
+        continue;
+      }
+      const auto* path = reinterpret_cast<const char*>(file.data() + entry->file_offset + header_size);
+      pdb.assign(path, strnlen(path, entry->size - header_size));
+    }
+  }
+};
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cstddef>
+#include <optional>
+#include <string_view>
+#include <system_error>
+#include <type_traits>
+#include <vector>
+
+// Parses a whole option value, integers may be hexadecimal with 0x.
+// Returns nothing if it is malformed or out of range.
+template <typename T>
+std::optional<T> parse_number(std::string_view number) {
+  T value;
+  std::from_chars_result result;
+  if constexpr (std::is_integral_v<T>) {
+    int base = 10;
+    if (number.starts_with("0x") || number.starts_with("0X")) {
+      number.remove_prefix(2);
+      base = 16;
+    }
+    result = std::from_chars(number.data(), number.data() + number.size(), value, base);
+  } else {
+    result = std::from_chars(number.data(), number.data() + number.size(), value);
+  }
+  if (result.ec != std::errc{} || result.ptr != number.data() + number.size()) {
+    return {};
+  }
+  return value;
+}
+
+// Parses a list of CPUs like 0-3,8, returns nothing if it is malformed
+inline std::optional<std::vector<int>> parse_cpu_list(std::string_view list) {
+  auto parse = [](std::string_view number, int& value) {
+    auto [end, ec] = std::from_chars(number.data(), number.data() + number.size(), value);
+    return ec == std::errc{} && end == number.data() + number.size();
+  };
+  std::vector<int> cpus;
+  for (std::size_t start = 0; start <= list.size();) {
+    auto comma = std::min(list.find(',', start), list.size());
+    auto range = list.substr(start, comma - start);
+    start = comma + 1;
+    int first, last;
+    auto dash = range.find('-');
+    if (dash == range.npos) {
+      if (!parse(range, first)) {
+        return {};
+      }
+      last = first;
+    } else if (!parse(range.substr(0, dash), first) || !parse(range.substr(dash + 1), last) || last < first) {
+      return {};
+    }
+    for (int cpu = first; cpu <= last; cpu++) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
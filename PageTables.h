@@ -0,0 +1,199 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <vector>
+
+#include "Framebuffer.h"
+#include "Image.h"
+#include "Machine.h"
+
+#define GNU_EFI_USE_MS_ABI
+extern "C" {
+#include <efi.h>
+}
+
+#ifndef EFI_MEMORY_RO
+#define EFI_MEMORY_RO 0x20000
+#endif
+
+// Identity-maps guest memory with permissions per page, given as the
+// EFI_MEMORY_RP, EFI_MEMORY_XP and EFI_MEMORY_RO attributes. 2 MiB ranges
+// whose pages share their permissions are mapped with one large page, the
+// framebuffer with a 1 GiB page. The guest has to reload CR3 after changes.
+class PageTables {
+public:
+  static constexpr std::uint64_t page_size = PEImage::page_size;
+  static constexpr std::uint64_t large_page_size = 0x20'0000;
+  static constexpr std::uint64_t attribute_mask = EFI_MEMORY_RP|EFI_MEMORY_XP|EFI_MEMORY_RO;
+
+  static constexpr std::uint64_t pml4_address = 0xf1000;
+  static constexpr std::uint64_t pdpt_address = 0xf2000;
+  static constexpr std::uint64_t pd_address = 0xf6000;
+  static constexpr std::uint64_t pt_address = 0x10'0000;  // one per 2 MiB range
+
+  PageTables(Machine& machine)
+      : machine(machine), pages(machine.memory.size() / page_size) {}
+
+  // Maps all of memory as read-write data, except for the page tables.
+  void reset() {
+    std::ranges::fill(pages, pack(EFI_MEMORY_XP));
+    auto protect_tables = [&](std::uint64_t address, std::uint64_t size) {
+      std::fill_n(pages.begin() + address / page_size, size / page_size, pack(EFI_MEMORY_RO|EFI_MEMORY_XP));
+    };
+    protect_tables(pml4_address, page_size);
+    protect_tables(pdpt_address, page_size);
+    protect_tables(pd_address, page_size);
+    protect_tables(pt_address, pt_size());
+
+    auto pml4 = machine.create_ptr<std::uint64_t>(pml4_address);
+    auto pdpt = machine.create_ptr<std::uint64_t>(pdpt_address);
+    pml4[0] = PRESENT|WRITABLE|USER|pdpt_address;
+    pdpt[0] = PRESENT|WRITABLE|USER|pd_address;
+    pdpt[1] = PRESENT|WRITABLE|USER|LARGE|NO_EXECUTE|Framebuffer::guest_address;
+    update(0, machine.memory.size());
+  }
+
+  // Code sections become read-only and executable, writable sections
+  // read-write data and everything else, like the headers, read-only data.
+  // Pages of more than one section get the permissions of all of them, so
+  // only images whose sections are not page-aligned, or that have writable
+  // code, end up with pages that are both writable and executable.
+  void map_image(const PEImage& image, std::uint64_t base) {
+    auto first = pages.begin() + base / page_size;
+    std::fill_n(first, image.size / page_size, pack(EFI_MEMORY_RO|EFI_MEMORY_XP));
+    for (const auto& section : image.sections) {
+      std::uint64_t virtual_size = section.Misc.VirtualSize != 0 ? section.Misc.VirtualSize : section.SizeOfRawData;
+      if (virtual_size == 0) {
+        continue;
+      }
+      std::uint64_t attributes = 0;
+      if (!(section.Characteristics & IMAGE_SCN_MEM_WRITE)) {
+        attributes |= EFI_MEMORY_RO;
+      }
+      if (!(section.Characteristics & IMAGE_SCN_MEM_EXECUTE)) {
+        attributes |= EFI_MEMORY_XP;
+      }
+      std::uint64_t end = (section.VirtualAddress + virtual_size + page_size - 1) / page_size;
+      for (std::uint64_t page = section.VirtualAddress / page_size; page < end; page++) {
+        first[page] &= pack(attributes);
+      }
+    }
+    update(base, image.size);
+  }
+
+  // Ranges have to be page-aligned and within memory
+  void set(std::uint64_t address, std::uint64_t size, std::uint64_t attributes) {
+    std::fill_n(pages.begin() + address / page_size, size / page_size, pack(attributes));
+    update(address, size);
+  }
+
+  void change(std::uint64_t address, std::uint64_t size, std::uint64_t set, std::uint64_t clear) {
+    auto first = pages.begin() + address / page_size;
+    for (auto it = first; it != first + size / page_size; ++it) {
+      *it = (*it | pack(set)) & ~pack(clear);
+    }
+    update(address, size);
+  }
+
+  // Returns nothing if the pages of the range differ
+  std::optional<std::uint64_t> get(std::uint64_t address, std::uint64_t size) const {
+    auto first = pages.begin() + address / page_size;
+    if (std::any_of(first, first + size / page_size, [&](auto page) { return page != *first; })) {
+      return {};
+    }
+    return unpack(*first);
+  }
+
+  bool contains(std::uint64_t address, std::uint64_t size) const {
+    return address % page_size == 0 && size % page_size == 0 && size != 0 &&
+           address < machine.memory.size() && size <= machine.memory.size() - address;
+  }
+
+  // The guest must not change the tables themselves
+  bool overlaps_tables(std::uint64_t address, std::uint64_t size) {
+    auto overlaps = [&](std::uint64_t start, std::uint64_t length) {
+      return address < start + length && start < address + size;
+    };
+    return overlaps(pml4_address, page_size) || overlaps(pdpt_address, page_size) ||
+           overlaps(pd_address, page_size) || overlaps(pt_address, pt_size());
+  }
+
+  // For diagnostics of page faults
+  std::string describe(std::uint64_t address) const {
+    if (address >= machine.memory.size()) {
+      return "not in memory";
+    }
+    auto attributes = unpack(pages[address / page_size]);
+    if (attributes & EFI_MEMORY_RP) {
+      return "not present";
+    }
+    std::string result = attributes & EFI_MEMORY_RO ? "read-only" : "read-write";
+    result += attributes & EFI_MEMORY_XP ? ", not executable" : ", executable";
+    return result;
+  }
+
+private:
+  enum : std::uint64_t {
+    PRESENT = 1 << 0,
+    WRITABLE = 1 << 1,
+    USER = 1 << 2,
+    LARGE = 1 << 7,
+    NO_EXECUTE = std::uint64_t{1} << 63,
+  };
+
+  std::uint64_t pt_size() const {
+    return machine.memory.size() / large_page_size * page_size;
+  }
+
+  // Only the bits of attribute_mask are kept, shifted into a byte
+  static constexpr std::uint8_t pack(std::uint64_t attributes) {
+    return (attributes & attribute_mask) >> 13;
+  }
+
+  static constexpr std::uint64_t unpack(std::uint8_t page) {
+    return std::uint64_t{page} << 13;
+  }
+
+  static constexpr std::uint64_t entry_bits(std::uint8_t page) {
+    auto attributes = unpack(page);
+    if (attributes & EFI_MEMORY_RP) {
+      return 0;
+    }
+    std::uint64_t bits = PRESENT|USER;
+    if (!(attributes & EFI_MEMORY_RO)) {
+      bits |= WRITABLE;
+    }
+    if (attributes & EFI_MEMORY_XP) {
+      bits |= NO_EXECUTE;
+    }
+    return bits;
+  }
+
+  // Rewrites the entries of the 2 MiB ranges that contain the range
+  void update(std::uint64_t address, std::uint64_t size) {
+    constexpr std::uint64_t pages_per_range = large_page_size / page_size;
+    auto pd = machine.create_ptr<std::uint64_t>(pd_address);
+    for (std::uint64_t range = address / large_page_size; range * large_page_size < address + size; range++) {
+      auto first = pages.begin() + range * pages_per_range;
+      if (std::all_of(first, first + pages_per_range, [&](auto page) { return page == *first; })) {
+        auto bits = entry_bits(*first);
+        pd[range] = bits != 0 ? bits|LARGE|range * large_page_size : 0;
+        continue;
+      }
+      std::uint64_t table = pt_address + range * page_size;
+      auto pt = machine.create_ptr<std::uint64_t>(table);
+      for (std::uint64_t i = 0; i < pages_per_range; i++) {
+        auto bits = entry_bits(first[i]);
+        pt[i] = bits != 0 ? bits|(range * pages_per_range + i) * page_size : 0;
+      }
+      pd[range] = PRESENT|WRITABLE|USER|table;
+    }
+  }
+
+  Machine& machine;
+  std::vector<std::uint8_t> pages;
+};
@@ -0,0 +1,200 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <fmt/format.h>
+#include <map>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <tuple>
+#include <utility>
+
+extern "C" {
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+}
+
+// A group of hardware counters on the calling thread that only count while
+// it runs the guest, or only while it does not. Events the PMU does not
+// have are left out.
+class PerfCounters {
+public:
+  static constexpr std::size_t count = 5;
+  static constexpr std::array<std::string_view, count> names = {
+    "cycles", "instructions", "cache-misses", "branch-misses", "dTLB-misses",
+  };
+  using Values = std::array<std::uint64_t, count>;
+
+  explicit PerfCounters(bool guest) {
+    constexpr std::array<std::pair<std::uint32_t, std::uint64_t>, count> events = {{
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+      {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+      {PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_DTLB | PERF_COUNT_HW_CACHE_OP_READ << 8 | PERF_COUNT_HW_CACHE_RESULT_MISS << 16},
+    }};
+    for (std::size_t i = 0; i < count; i++) {
+      perf_event_attr attr{
+        .type = events[i].first,
+        .size = sizeof(perf_event_attr),
+        .config = events[i].second,
+        .read_format = PERF_FORMAT_GROUP|PERF_FORMAT_TOTAL_TIME_ENABLED|PERF_FORMAT_TOTAL_TIME_RUNNING,
+      };
+      attr.disabled = leader == -1;
+      attr.exclude_hv = 1;
+      attr.exclude_host = guest;
+      attr.exclude_guest = !guest;
+      int fd = syscall(__NR_perf_event_open, &attr, 0, -1, leader, PERF_FLAG_FD_CLOEXEC);
+      if (fd == -1) {
+        continue;
+      }
+      if (leader == -1) {
+        leader = fd;
+      }
+      fds[i] = fd;
+      slots[i] = members++;
+    }
+  }
+
+  ~PerfCounters() {
+    for (int fd : fds) {
+      if (fd != -1) {
+        close(fd);
+      }
+    }
+  }
+
+  PerfCounters(const PerfCounters&) = delete;
+  PerfCounters& operator=(const PerfCounters&) = delete;
+
+  void enable() {
+    if (leader != -1 && ioctl(leader, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP) == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+  }
+
+  // Values are scaled up if the kernel had to multiplex the counters
+  Values read() const {
+    Values values{};
+    if (leader == -1) {
+      return values;
+    }
+    std::uint64_t buffer[3 + count];
+    if (::read(leader, buffer, sizeof(buffer)) == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+    auto [nr, enabled, running] = std::tuple{buffer[0], buffer[1], buffer[2]};
+    for (std::size_t i = 0; i < count; i++) {
+      if (fds[i] != -1 && slots[i] < nr && running != 0) {
+        values[i] = static_cast<unsigned __int128>(buffer[3 + slots[i]]) * enabled / running;
+      }
+    }
+    return values;
+  }
+
+  bool supported(std::size_t i) const {
+    return fds[i] != -1;
+  }
+
+  explicit operator bool() const {
+    return leader != -1;
+  }
+
+private:
+  std::array<int, count> fds = {-1, -1, -1, -1, -1};
+  std::array<std::uint64_t, count> slots{};  // position in the group's read buffer
+  std::uint64_t members = 0;
+  int leader = -1;
+};
+
+// Guest counters for a whole run, and host counters split into the windows
+// in which hypercall handlers run. What the host spends outside of them is
+// mostly KVM_RUN itself, i.e. VM exits and entries.
+class VCPUCounters {
+public:
+  VCPUCounters() : guest(true), host(false) {}
+
+  void start() {
+    guest.enable();
+    host.enable();
+    start_time = std::chrono::steady_clock::now();
+    guest_start = guest.read();
+    host_start = host.read();
+  }
+
+  void begin_handler() {
+    handler_start = host.read();
+  }
+
+  void end_handler(std::string_view name) {
+    auto values = host.read();
+    auto& window = handlers[name];
+    window.calls++;
+    for (std::size_t i = 0; i < PerfCounters::count; i++) {
+      window.values[i] += values[i] - handler_start[i];
+    }
+  }
+
+  void report() const {
+    auto wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start_time);
+    fmt::println("Wall-clock time: {:.6f} s", wall.count());
+    if (!guest && !host) {
+      fmt::println("Hardware performance counters are not available");
+      return;
+    }
+    auto guest_values = guest.read();
+    auto host_values = host.read();
+    PerfCounters::Values in_handlers{};
+    for (const auto& [name, window] : handlers) {
+      for (std::size_t i = 0; i < PerfCounters::count; i++) {
+        in_handlers[i] += window.values[i];
+      }
+    }
+    PerfCounters::Values guest_total, outside_handlers;
+    for (std::size_t i = 0; i < PerfCounters::count; i++) {
+      guest_total[i] = guest_values[i] - guest_start[i];
+      outside_handlers[i] = host_values[i] - host_start[i] - in_handlers[i];
+    }
+
+    std::string header = fmt::format("{:<32} {:>8}", "", "calls");
+    for (auto name : PerfCounters::names) {
+      header += fmt::format(" {:>14}", name);
+    }
+    fmt::println("{} {:>6}", header, "IPC");
+    print_row("guest", "", guest, guest_total);
+    print_row("host, outside handlers", "", host, outside_handlers);
+    for (const auto& [name, window] : handlers) {
+      print_row(fmt::format("host, {}", name), fmt::format("{}", window.calls), host, window.values);
+    }
+  }
+
+private:
+  struct Window {
+    std::uint64_t calls = 0;
+    PerfCounters::Values values{};
+  };
+
+  static void print_row(std::string_view name, std::string_view calls, const PerfCounters& counters, const PerfCounters::Values& values) {
+    std::string row = fmt::format("{:<32} {:>8}", name, calls);
+    for (std::size_t i = 0; i < PerfCounters::count; i++) {
+      row += counters.supported(i) ? fmt::format(" {:>14}", values[i]) : fmt::format(" {:>14}", "-");
+    }
+    if (counters.supported(0) && counters.supported(1) && values[0] != 0) {
+      row += fmt::format(" {:>6.2f}", double(values[1]) / values[0]);
+    }
+    fmt::println("{}", row);
+  }
+
+  PerfCounters guest;
+  PerfCounters host;
+  std::chrono::steady_clock::time_point start_time;
+  PerfCounters::Values guest_start{};
+  PerfCounters::Values host_start{};
+  PerfCounters::Values handler_start{};
+  std::map<std::string_view, Window> handlers;
+};
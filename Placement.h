@@ -0,0 +1,66 @@
+#pragma once
+
+#include <climits>
+#include <cstddef>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <system_error>
+#include <vector>
+
+extern "C" {
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+}
+
+// Where an instance runs on the host. Without a CPU, the scheduler moves
+// the vCPU thread around and guest memory comes from whichever node the
+// thread happens to touch it from.
+struct Placement {
+  // Pins the calling thread to cpu
+  void pin_current_thread() const {
+    if (!cpu) {
+      return;
+    }
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(*cpu, &set);
+    if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+      throw std::system_error(errno, std::generic_category(), "sched_setaffinity");
+    }
+  }
+
+  // The NUMA node of cpu, from sysfs, 0 on hosts without NUMA
+  int node() const {
+    std::error_code ec;
+    std::filesystem::directory_iterator it{"/sys/devices/system/cpu/cpu" + std::to_string(cpu.value_or(0)), ec};
+    for (; !ec && it != std::filesystem::directory_iterator{}; it.increment(ec)) {
+      auto name = it->path().filename().string();
+      if (name.starts_with("node") && name.size() > 4) {
+        return std::stoi(name.substr(4));
+      }
+    }
+    return 0;
+  }
+
+  // Makes the pages of memory come from node, moving the ones that already
+  // exist. The policy stays with the memfd, so pages that are dropped and
+  // faulted in again later land there as well.
+  static void bind_memory(void* memory, std::size_t size, int node) {
+    constexpr std::size_t bits = sizeof(unsigned long) * CHAR_BIT;
+    std::vector<unsigned long> mask(node / bits + 1);
+    mask[node / bits] |= 1ul << (node % bits);
+    // The kernel ignores the last bit of maxnode
+    if (syscall(SYS_mbind, memory, size, MPOL_BIND, mask.data(), mask.size() * bits + 1, MPOL_MF_MOVE) == -1) {
+      throw std::system_error(errno, std::generic_category(), "mbind");
+    }
+  }
+
+  std::optional<int> cpu;  // host CPU of the vCPU thread
+  bool bind_memory_to_node = false;  // guest memory on the node of cpu
+  // The vCPU thread has cpu to itself: HLT and PAUSE do not exit, and the
+  // thread busy-polls where it would otherwise sleep
+  bool dedicated_core = false;
+};
@@ -0,0 +1,140 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fmt/format.h>
+#include <fstream>
+#include <map>
+#include <optional>
+#include <span>
+#include <string>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include <linux/kvm.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+}
+
+#include "Unwinder.h"
+
+// Only defined by glibc 2.41 and later
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+// Samples the guest's call stacks at a fixed rate. A timer signal sets
+// immediate_exit, so KVM_RUN returns as soon as possible, also if the signal
+// arrived while the host handled a hypercall. Time the host spends in a
+// hypercall is thus charged to the guest code that made it.
+//
+// The stacks are walked by an Unwinder and written as collapsed stacks for
+// flamegraph.pl.
+class Profiler {
+public:
+  static constexpr std::size_t max_depth = 128;
+
+  Profiler(kvm_run& run, std::uint32_t frequency, const Unwinder& unwinder)
+      : interval(std::chrono::nanoseconds{1'000'000'000 / frequency}), unwinder(unwinder) {
+    interrupted_run = &run;
+    struct sigaction action{};
+    action.sa_handler = [](int) {
+      interrupted_run->immediate_exit = 1;
+    };
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, &previous_action) == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+
+    // The signal has to interrupt the thread that runs the vCPU
+    sigevent event{};
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_notify_thread_id = gettid();
+    if (timer_create(CLOCK_MONOTONIC, &event, &timer) == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+    auto nanoseconds = interval.count();
+    itimerspec spec{
+      .it_interval = {.tv_sec = nanoseconds / 1'000'000'000, .tv_nsec = nanoseconds % 1'000'000'000},
+      .it_value = {.tv_sec = nanoseconds / 1'000'000'000, .tv_nsec = nanoseconds % 1'000'000'000},
+    };
+    if (timer_settime(timer, 0, &spec, nullptr) == -1) {
+      throw std::system_error(errno, std::generic_category());
+    }
+    last_sample = std::chrono::steady_clock::now();
+  }
+
+  ~Profiler() {
+    timer_delete(timer);
+    sigaction(SIGPROF, &previous_action, nullptr);
+    interrupted_run = nullptr;
+  }
+
+  Profiler(const Profiler&) = delete;
+  Profiler& operator=(const Profiler&) = delete;
+
+  // Records the stack of the guest at regs. A sample stands for all the
+  // time since the previous one, which is more than one interval if the
+  // host blocked.
+  void sample(const kvm_regs& regs, std::span<const std::byte> memory) {
+    auto now = std::chrono::steady_clock::now();
+    std::uint64_t weight = std::max<std::uint64_t>(1, (now - last_sample + interval / 2) / interval);
+    last_sample = now;
+
+    auto stack = unwinder.walk(regs, memory, max_depth);
+    std::ranges::reverse(stack);
+    stacks[std::move(stack)] += weight;
+    samples += weight;
+  }
+
+  // Writes one line per distinct stack, outermost frame first. Stacks are
+  // kept by address and only merged by name here.
+  void write_collapsed(const std::filesystem::path& path) const {
+    std::map<std::string, std::uint64_t> lines;
+    for (const auto& [stack, count] : stacks) {
+      std::string line;
+      for (const auto& frame : stack) {
+        if (!line.empty()) {
+          line += ';';
+        }
+        line += unwinder.frame_name(frame);
+      }
+      lines[std::move(line)] += count;
+    }
+    std::ofstream out{path};
+    for (const auto& [line, count] : lines) {
+      out << fmt::format("{} {}\n", line, count);
+    }
+    if (!out) {
+      throw std::system_error(errno, std::generic_category(), path.string());
+    }
+    fmt::println("Profile: {} samples written to {}", samples, path.string());
+    for (const auto& module : unwinder.modules) {
+      if (module.symbols.empty() && !module.pdb.empty()) {
+        fmt::println("Profile: {} has no symbol table, its symbols are in {}", module.name, module.pdb);
+      }
+    }
+  }
+
+  std::uint64_t samples = 0;
+
+private:
+  using Frame = Unwinder::Frame;
+
+  static inline kvm_run* volatile interrupted_run = nullptr;
+  std::chrono::nanoseconds interval;
+  std::chrono::steady_clock::time_point last_sample;
+  struct sigaction previous_action;
+  timer_t timer;
+  const Unwinder& unwinder;
+  std::map<std::vector<Frame>, std::uint64_t> stacks;  // sample counts
+};
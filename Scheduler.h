@@ -0,0 +1,174 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <limits>
+#include <memory>
+#include <mutex>
+#include <span>
+#include <thread>
+#include <vector>
+
+#include "Epoll.h"
+#include "Placement.h"
+#include "UIU.h"
+
+// Runs more instances than there are cores. A worker thread per core takes
+// the next instance from a queue and runs it for a time slice, then puts it
+// at the back again. Instances that wait for an event or stall leave the
+// queue until their events are ready or the time is up, so that workers
+// only run instances that get something done.
+class Scheduler {
+public:
+  using Clock = std::chrono::steady_clock;
+  // Called on a worker once run returned something else than preempted or
+  // waiting, or threw error
+  using Done = std::move_only_function<void(UIU::RunState state, std::exception_ptr error)>;
+
+  Scheduler(std::span<const Placement> cores, std::chrono::nanoseconds slice)
+      : slice(slice), wakeup(EventFD::create()) {
+    epoll.add(wakeup.get_fd(), 0);
+    waker = std::thread([this] { wake_waiting(); });
+    for (const auto& placement : cores) {
+      workers.emplace_back([this, placement] { work(placement); });
+    }
+  }
+
+  ~Scheduler() {
+    {
+      std::lock_guard lock{mutex};
+      stopping = true;
+    }
+    runnable_changed.notify_all();
+    wakeup.notify();
+    for (auto& worker : workers) {
+      worker.join();
+    }
+    waker.join();
+  }
+
+  Scheduler(const Scheduler&) = delete;
+  Scheduler& operator=(const Scheduler&) = delete;
+
+  // Runs uiu, which has an application loaded, until it is done
+  void submit(UIU& uiu, Done done) {
+    {
+      std::lock_guard lock{mutex};
+      runnable.push_back(std::make_unique<Task>(uiu, std::move(done)));
+    }
+    runnable_changed.notify_one();
+  }
+
+private:
+  struct Task {
+    UIU& uiu;
+    Done done;
+    bool watched = false;  // the event_epoll of uiu is in epoll
+    bool ready = false;
+  };
+
+  void work(const Placement& placement) {
+    placement.pin_current_thread();
+    std::unique_lock lock{mutex};
+    for (;;) {
+      runnable_changed.wait(lock, [&] { return stopping || !runnable.empty(); });
+      if (stopping) {
+        return;
+      }
+      auto task = std::move(runnable.front());
+      runnable.pop_front();
+      lock.unlock();
+
+      auto state = UIU::RunState::finished;
+      std::exception_ptr error;
+      task->uiu.slice_end = Clock::now() + slice;
+      try {
+        state = task->uiu.run();
+      } catch (...) {
+        error = std::current_exception();
+      }
+      if (error || (state != UIU::RunState::preempted && state != UIU::RunState::waiting)) {
+        task->uiu.slice_end.reset();
+        task->done(state, error);
+        lock.lock();
+        continue;
+      }
+
+      lock.lock();
+      if (state == UIU::RunState::preempted) {
+        runnable.push_back(std::move(task));
+      } else {
+        waiting.push_back(std::move(task));
+        wakeup.notify();
+      }
+    }
+  }
+
+  // Moves waiting instances back into the queue once they are ready
+  void wake_waiting() {
+    epoll_event ready[64];
+    std::unique_lock lock{mutex};
+    while (!stopping) {
+      auto until = Clock::time_point::max();
+      for (auto& task : waiting) {
+        if (task->uiu.wait->events && !task->watched) {
+          epoll.add(task->uiu.event_epoll.get_fd(), reinterpret_cast<std::uint64_t>(task.get()));
+          task->watched = true;
+        }
+        until = std::min(until, task->uiu.wait->until);
+      }
+      int timeout = -1;
+      if (until != Clock::time_point::max()) {
+        auto left = std::chrono::ceil<std::chrono::milliseconds>(until - Clock::now()).count();
+        timeout = std::clamp<std::int64_t>(left, 0, std::numeric_limits<int>::max());
+      }
+      lock.unlock();
+      auto events_ready = epoll.wait(ready, timeout);
+      lock.lock();
+
+      for (const auto& e : events_ready) {
+        if (e.data.u64 == 0) {
+          wakeup.clear();
+        } else {
+          reinterpret_cast<Task*>(e.data.u64)->ready = true;
+        }
+      }
+      auto now = Clock::now();
+      bool woken = false;
+      for (auto it = waiting.begin(); it != waiting.end();) {
+        auto& task = *it;
+        if (!task->ready && task->uiu.wait->until > now) {
+          ++it;
+          continue;
+        }
+        if (task->watched) {
+          epoll.remove(task->uiu.event_epoll.get_fd());
+        }
+        task->watched = false;
+        task->ready = false;
+        runnable.push_back(std::move(task));
+        it = waiting.erase(it);
+        woken = true;
+      }
+      if (woken) {
+        runnable_changed.notify_all();
+      }
+    }
+  }
+
+  std::chrono::nanoseconds slice;
+  std::mutex mutex;
+  std::condition_variable runnable_changed;
+  std::deque<std::unique_ptr<Task>> runnable;
+  std::vector<std::unique_ptr<Task>> waiting;
+  bool stopping = false;
+  Epoll epoll;  // of the waiting instances and wakeup
+  EventFD wakeup;  // tells the waker about new waiting instances
+  std::thread waker;
+  std::vector<std::thread> workers;
+};
@@ -1,19 +1,58 @@
 #pragma once
 
 #include <algorithm>
+#include <bit>
+#include <chrono>
 #include <codecvt>  // std::codecvt_utf8
+#include <cstddef>
 #include <cstdint>
+#include <cstdio>
 #include <cstring>
+#include <deque>
 #include <fmt/format.h>
+#include <functional>
+#include <limits>
 #include <locale>  // std::wstring_convert
 #include <memory_resource>
+#include <optional>
+#include <span>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <thread>
 #include <unordered_map>
 #include <utility>
 #include <vector>
 
 #include "API.h"
+#include "AddressSpace.h"
+#include "Alarm.h"
+#include "AllocationProfiler.h"
+#include "CallTrace.h"
+#include "BlockDevice.h"
+#include "Coverage.h"
+#include "CPUModel.h"
+#include "CR0.h"
+#include "CR4.h"
+#include "Devices.h"
+#include "EFER.h"
+#include "Entropy.h"
+#include "Epoll.h"
+#include "Events.h"
+#include "FileSystem.h"
+#include "Framebuffer.h"
+#include "HeapSanitizer.h"
+#include "Image.h"
+#include "IOUring.h"
+#include "Journal.h"
 #include "Machine.h"
+#include "MSRs.h"
+#include "PageTables.h"
+#include "PerfCounters.h"
+#include "Placement.h"
+#include "Profiler.h"
+#include "Rflags.h"
+#include "Unwinder.h"
 
 #define GNU_EFI_USE_MS_ABI
 extern "C" {
@@ -47,7 +86,7 @@ inline auto format_as(const EFI_GUID& guid) {
     str += " (EFI_RNG_PROTOCOL_GUID)";
   } else if (guid == EFI_GUID(EFI_LOADED_IMAGE_PROTOCOL_GUID)) {
     str += " (EFI_LOADED_IMAGE_PROTOCOL_GUID)";
-  } else if (guid == EFI_GUID{0xf4560cf6, 0x40ec, 0x4b4a, {0xa1, 0x92, 0xbf, 0x1d, 0x57, 0xd0, 0xb1, 0x89}}) {
+  } else if (guid == EFI_GUID(UIU_MEMORY_ATTRIBUTE_PROTOCOL_GUID)) {
     str += " (EFI_MEMORY_ATTRIBUTE_PROTOCOL_GUID)";
   } else if (guid == EFI_GUID{0x607f766c, 0x7455, 0x42be, {0x93, 0x0b, 0xe4, 0xd7, 0x6d, 0xb2, 0x72, 0x0f}}) {
     str += " (EFI_TCG2_PROTOCOL_GUID)";
@@ -57,46 +96,119 @@ inline auto format_as(const EFI_GUID& guid) {
     str += " (EFI_UGA_PROTOCOL_GUID)";
   } else if (guid == EFI_GUID(EFI_PCI_IO_PROTOCOL_GUID)) {
     str += " (EFI_PCI_IO_PROTOCOL_GUID)";
+  } else if (guid == EFI_GUID(EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID)) {
+    str += " (EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID)";
   }
   return str;
 }
 
-inline auto format_as(const EFI_MEMORY_TYPE& memory_type) {
-  switch (memory_type) {
-  case EfiReservedMemoryType:
-    return "EfiReservedMemoryType";
-  case EfiLoaderCode:
-    return "EfiLoaderCode";
-  case EfiLoaderData:
-    return "EfiLoaderData";
-  case EfiBootServicesCode:
-    return "EfiBootServicesCode";
-  case EfiBootServicesData:
-    return "EfiBootServicesData";
-  case EfiRuntimeServicesCode:
-    return "EfiRuntimeServicesCode";
-  case EfiRuntimeServicesData:
-    return "EfiRuntimeServicesData";
-  case EfiConventionalMemory:
-    return "EfiConventionalMemory";
-  case EfiUnusableMemory:
-    return "EfiUnusableMemory";
-  case EfiACPIReclaimMemory:
-    return "EfiACPIReclaimMemory";
-  case EfiACPIMemoryNVS:
-    return "EfiACPIMemoryNVS";
-  case EfiMemoryMappedIO:
-    return "EfiMemoryMappedIO";
-  case EfiMemoryMappedIOPortSpace:
-    return "EfiMemoryMappedIOPortSpace";
-  case EfiPalCode:
-    return "EfiPalCode";
-  case EfiPersistentMemory:
-    return "EfiPersistentMemory";
-  case EfiUnacceptedMemoryType:
-    return "EfiUnacceptedMemoryType";
-  case EfiMaxMemoryType:
-    return "EfiMaxMemoryType";
+inline auto format_as(UIUAPITag tag) {
+  using enum UIUAPITag;
+  switch (tag) {
+  case Trap:
+    return "Trap";
+  case Exit:
+    return "Exit";
+  case HandleProtocol:
+    return "HandleProtocol";
+  case GetVariable:
+    return "GetVariable";
+  case AllocatePool:
+    return "AllocatePool";
+  case FreePool:
+    return "FreePool";
+  case LocateHandle:
+    return "LocateHandle";
+  case OutputString:
+    return "OutputString";
+  case LocateProtocol:
+    return "LocateProtocol";
+  case InstallProtocolInterface:
+    return "InstallProtocolInterface";
+  case GetRNG:
+    return "GetRNG";
+  case SetVariable:
+    return "SetVariable";
+  case LocateHandleBuffer:
+    return "LocateHandleBuffer";
+  case CreateEvent:
+    return "CreateEvent";
+  case CreateEventEx:
+    return "CreateEventEx";
+  case SetTimer:
+    return "SetTimer";
+  case WaitForEvent:
+    return "WaitForEvent";
+  case SignalEvent:
+    return "SignalEvent";
+  case CloseEvent:
+    return "CloseEvent";
+  case CheckEvent:
+    return "CheckEvent";
+  case Stall:
+    return "Stall";
+  case PollEvents:
+    return "PollEvents";
+  case GetBlockDevice:
+    return "GetBlockDevice";
+  case ReadBlocks:
+    return "ReadBlocks";
+  case WriteBlocks:
+    return "WriteBlocks";
+  case FlushBlocks:
+    return "FlushBlocks";
+  case ReadBlocksEx:
+    return "ReadBlocksEx";
+  case WriteBlocksEx:
+    return "WriteBlocksEx";
+  case FlushBlocksEx:
+    return "FlushBlocksEx";
+  case GetFileSystem:
+    return "GetFileSystem";
+  case OpenVolume:
+    return "OpenVolume";
+  case FileOpen:
+    return "FileOpen";
+  case FileClose:
+    return "FileClose";
+  case FileDelete:
+    return "FileDelete";
+  case FileRead:
+    return "FileRead";
+  case FileWrite:
+    return "FileWrite";
+  case FileGetPosition:
+    return "FileGetPosition";
+  case FileSetPosition:
+    return "FileSetPosition";
+  case FileGetInfo:
+    return "FileGetInfo";
+  case FileSetInfo:
+    return "FileSetInfo";
+  case FileFlush:
+    return "FileFlush";
+  case LoadImage:
+    return "LoadImage";
+  case StartImage:
+    return "StartImage";
+  case ImageReturned:
+    return "ImageReturned";
+  case UnloadImage:
+    return "UnloadImage";
+  case GetGraphicsOutput:
+    return "GetGraphicsOutput";
+  case GetMemoryAttributes:
+    return "GetMemoryAttributes";
+  case SetMemoryAttributes:
+    return "SetMemoryAttributes";
+  case ClearMemoryAttributes:
+    return "ClearMemoryAttributes";
+  case SetWatchdogTimer:
+    return "SetWatchdogTimer";
+  case Return:
+    return "Return";
+  case HostCall:
+    return "HostCall";
   }
   return "<unknown>";
 }
@@ -104,17 +216,53 @@ class UIU {
 public:
   // MEMORY MAP
   //
+  // 0x00000000 0x00000fff Trap for applications that return, return stub
+  // 0x00001000 0x0000ffff Stubs of protocols implemented by the host
   // 0x00010000 ...        Start
   // 0x000f1000 0x000f1fff PML4
   // 0x000f2000 0x000f2fff PDPT
+  // 0x000f3000 0x000f3fff Notify queue
+  // 0x000f4000 0x000f4fff Clock page
+  // 0x000f5000 0x000f5fff Entropy pool
+  // 0x000f6000 0x000f6fff PD
+  // 0x000f7000 0x000f7fff GDT
+  // 0x000f8000 0x000f8fff Timer page
+  // 0x00100000 0x002fffff Page tables
   // ...        0x1ffffff0 Stack
-  // 0x20000000 0x37ffffff Pool
+  // 0x20000000 0x2fffffff Pool
+  // 0x30000000 0x37ffffff Images loaded with LoadImage
   // 0x38000000 0x3fffffff App
+  // 0x40000000 ...        Framebuffer, in its own memslot
 
-  UIU(KVM& kvm)
-      : machine(kvm),
-        mbr(machine.create_ptr<void*>(0x2000'0000).get(), 0x3800'0000 - 0x2000'0000),
-        upr(&mbr) {}
+  static constexpr std::uint64_t start_base = 0x1'0000;
+  static constexpr std::uint64_t application_base = 0x3800'0000;
+  static constexpr std::uint64_t gdt_address = 0xf7000;
+  static constexpr std::uint64_t return_stub_address = 0x8;
+  static constexpr std::uint64_t host_stubs_address = 0x1000;
+  static constexpr std::uint64_t host_stubs_size = 0xf000;
+  static constexpr std::size_t host_stub_size = 48;
+
+  UIU(KVM& kvm, const Placement& placement = {})
+      : placement(placement),
+        machine(kvm, placement),
+        page_tables(machine),
+        address_space(machine),
+        cpu_model(kvm),
+        // Allocations fail with std::bad_alloc once the region is used up
+        mbr(machine.create_ptr<void*>(0x2000'0000).get(), 0x3000'0000 - 0x2000'0000, std::pmr::null_memory_resource()),
+        upr(&mbr),
+        image_pages(0x3000'0000, 0x3800'0000 - 0x3000'0000) {
+    machine.vcpu.set_cpuid(cpu_model.entries);
+    // KVM stores the segment and control registers in kvm_run on every exit,
+    // which saves an ioctl per hypercall
+    sync_sregs = kvm.check_extension(KVM_CAP_SYNC_REGS) & KVM_SYNC_X86_SREGS;
+    if (sync_sregs) {
+      machine.vcpu_run.get()->kvm_valid_regs = KVM_SYNC_X86_SREGS;
+    }
+    lapic_at_reset = machine.vcpu.get_lapic();
+    apic_base_at_reset = machine.vcpu.get_msr(IA32_APIC_BASE);
+    add_devices();
+  }
 
   MachinePtr<void> allocate(std::size_t size, std::size_t align = 8) {
     auto alloc = machine.create_ptr<std::uint64_t>(upr.allocate(size+8, std::min(8zu, align)));
@@ -139,25 +287,589 @@ public:
     deallocate(ptr.template cast<void>());
   }
 
-  void run() {
+  // Pointers from the guest are virtual addresses, they throw GuestFault if
+  // the guest has not mapped them to memory, or if T is not const and the
+  // host cannot write there
+  template <typename T>
+  MachinePtr<T> guest_ptr(const void* address, std::uint64_t count = 1) {
+    return machine.create_ptr<T>(address_space.translate((std::uint64_t)address, sizeof(T) * count, !std::is_const_v<T>));
+  }
+
+  // Read a page at a time, since the string may continue on a page that is
+  // not contiguous
+  std::u16string guest_string(const CHAR16* string) {
+    std::u16string result;
+    auto address = (std::uint64_t)string;
+    for (;;) {
+      std::uint64_t count = std::max<std::uint64_t>((AddressSpace::page_size - address % AddressSpace::page_size) / sizeof(char16_t), 1);
+      auto* chars = guest_ptr<const char16_t>((const void*)address, count).get();
+      auto* end = std::find(chars, chars + count, u'\0');
+      result.append(chars, end);
+      if (end != chars + count) {
+        return result;
+      }
+      address += count * sizeof(char16_t);
+    }
+  }
+
+  // Calls f(span, direct) with the guest buffer as one span, which f writes
+  // to if write is set. Buffers that the guest's page tables scatter over
+  // memory go through a copy, then direct is false.
+  template <typename F>
+  auto with_guest_buffer(const VOID* address, std::uint64_t size, bool write, F&& f) {
+    auto buffer = address_space.gather((std::uint64_t)address, size, write);
+    if (buffer.spans.size() <= 1) {
+      return f(buffer.spans.empty() ? std::span<std::byte>{} : buffer.spans[0], true);
+    }
+    std::vector<std::byte> copy(size);
+    buffer.copy_to(copy);
+    auto result = f(std::span{copy}, false);
+    if (write) {
+      buffer.copy_from(copy);
+    }
+    return result;
+  }
+
+  // Samples the guest TSC together with the wall clock, start.efi
+  // extrapolates the time from there.
+  void publish_clock() {
+    auto& clock = *machine.create_ptr<UIUClockPage>(UIU_CLOCK_PAGE_ADDR);
+    auto before = std::chrono::system_clock::now();
+    clock.tsc_base = machine.vcpu.get_msr(IA32_TIME_STAMP_COUNTER);
+    auto after = std::chrono::system_clock::now();
+    auto now = std::chrono::duration_cast<std::chrono::nanoseconds>((before + (after - before) / 2).time_since_epoch());
+
+    clock.tsc_khz = machine.vcpu.get_tsc_khz();
+    clock.tsc_to_ns_mul = (std::uint64_t{1'000'000} << 32) / clock.tsc_khz;
+    clock.wall_clock_base = now.count();
+    // There is no persistent storage for the high 32 bits, using the seconds
+    // since the epoch keeps them increasing across runs.
+    clock.monotonic_count = std::uint64_t(std::chrono::duration_cast<std::chrono::seconds>(now).count()) << 32;
+    if (journal) {
+      journal->exchange(Journal::Kind::clock, clock);
+      if (journal->replaying()) {
+        // Guest time starts where it did, but still runs at the speed of
+        // this host
+        machine.vcpu.set_msr(IA32_TIME_STAMP_COUNTER, clock.tsc_base);
+      }
+    }
+  }
+
+  void attach_block_device(BlockDevice&& device) {
+    if (!io_uring) {
+      io_uring.emplace(128);
+      // Lets O_DIRECT transfers use guest memory as a registered buffer. This
+      // needs a large enough RLIMIT_MEMLOCK, without it transfers still go
+      // straight to guest memory but the kernel maps the pages every time.
+      try {
+        iovec guest_memory{machine.memory.data(), machine.memory.size()};
+        io_uring->register_buffers({&guest_memory, 1});
+        io_uring_fixed_buffers = true;
+      } catch (const std::system_error&) {
+        io_uring_fixed_buffers = false;
+      }
+      block_io_completion = EventFD::create();
+      io_uring->register_eventfd(block_io_completion.get_fd());
+      event_epoll.add(block_io_completion.get_fd(), block_io_completion_key);
+    }
+    block_devices.push_back(std::move(device));
+  }
+
+  Framebuffer& attach_framebuffer(std::uint32_t width, std::uint32_t height) {
+    return framebuffer.emplace(machine.vm, width, height);
+  }
+
+  VCPUCounters& attach_perf_counters() {
+    return counters.emplace();
+  }
+
+  MSRs& emulate_msrs(MSRs table) {
+    table.install(machine.vm);
+    return msrs.emplace(std::move(table));
+  }
+
+  // Records the nondeterministic inputs of the application or replays them,
+  // has to come before prepare. Timers then run in the host and block I/O
+  // completes within the hypercall that submits it, so that both happen at
+  // the same points of every run.
+  Journal& attach_journal(Journal log) {
+    return journal.emplace(std::move(log));
+  }
+
+  // Records the hypercalls of the application for replay_calls
+  CallTrace& attach_call_trace(CallTrace trace) {
+    machine.log_dirty_pages();
+    dirty_pages.assign((machine.memory.size() / AddressSpace::page_size + 63) / 64, 0);
+    return call_trace.emplace(std::move(trace));
+  }
+
+  // Feeds the hypercalls of a trace to their handlers without running the
+  // guest, each with the registers and guest memory of the recorded call,
+  // and calls measured(tag, time) with the time its handler took. The
+  // instance has to be prepared with the start.efi and application of the
+  // recording, on a MockBackend or a vCPU that does not run otherwise.
+  // Waits end at once, as with a Scheduler whose slice is over.
+  template <typename F>
+  void replay_calls(CallTrace& trace, F&& measured) {
+    publish_clock();
+    refill_entropy_pool();
+    slice_end = std::chrono::steady_clock::time_point::min();
+    std::vector<std::byte> contents;
+    while (auto kind = trace.read(contents)) {
+      if (*kind == CallTrace::Kind::pages) {
+        constexpr auto entry_size = sizeof(std::uint64_t) + AddressSpace::page_size;
+        for (std::size_t offset = 0; offset + entry_size <= contents.size(); offset += entry_size) {
+          std::uint64_t address;
+          std::memcpy(&address, contents.data() + offset, sizeof(address));
+          if (address % AddressSpace::page_size != 0 || address >= machine.memory.size()) {
+            throw std::runtime_error(trace.get_path() + ": malformed");
+          }
+          std::memcpy(machine.memory.data() + address, contents.data() + offset + sizeof(address), AddressSpace::page_size);
+        }
+        continue;
+      }
+      if (*kind != CallTrace::Kind::call) {
+        throw std::runtime_error(trace.get_path() + ": malformed");
+      }
+      CallTrace::Call call;
+      std::memcpy(&call, contents.data(), sizeof(call));
+      machine.vcpu.set_regs(call.regs);
+      machine.vcpu.set_sregs(call.sregs);
+      wait.reset();
+      auto begin = std::chrono::steady_clock::now();
+      auto status = dispatch_io_call(*this, call.nr);
+      measured(UIUAPITag{call.nr}, std::chrono::steady_clock::now() - begin);
+      if (status != IOExitStatus::Continue) {
+        break;
+      }
+    }
+    slice_end.reset();
+    wait.reset();
+  }
+
+  // Handles the hypercall tag with its arguments at the guest address args,
+  // as if the guest had made it, and returns its status. For tests on a
+  // MockBackend, whose vCPU never runs.
+  EFI_STATUS hypercall(UIUAPITag tag, std::uint64_t args) {
+    auto regs = machine.vcpu.get_regs();
+    regs.rdx = args;
+    machine.vcpu.set_regs(regs);
+    dispatch_io_call(*this, static_cast<short>(tag));
+    return machine.vcpu.get_regs().rax;
+  }
+
+  Profiler& attach_profiler(std::uint32_t frequency) {
+    return profiler.emplace(*machine.vcpu_run.get(), frequency, unwinder);
+  }
+
+  // Attributes AllocatePool to the guest's call sites, see
+  // AllocationProfiler for rate. The stacks have up to depth frames.
+  AllocationProfiler& attach_allocation_profiler(std::uint64_t rate, std::size_t depth) {
+    return allocations.emplace(unwinder, machine.memory, rate, depth);
+  }
+
+  // Makes AllocatePool and FreePool check the guest's use of the pool
+  HeapSanitizer& attach_heap_sanitizer(const HeapSanitizer::Options& options) {
+    return sanitizer.emplace(machine.memory, unwinder, page_tables, upr, mbr, options);
+  }
+
+  // Collects the coverage of the application, has to come before
+  // load_application
+  Coverage& attach_coverage(Module application) {
+    machine.vcpu.set_guest_debug({.control = KVM_GUESTDBG_ENABLE|KVM_GUESTDBG_USE_SW_BP});
+    return coverage.emplace(std::move(application));
+  }
+
+  void attach_file_system(HostFileSystem&& file_system) {
+    file_systems.push_back(std::move(file_system));
+  }
+
+  void fill_entropy(std::span<std::byte> buffer) {
+    if (!journal || !journal->replaying()) {
+      entropy.fill(buffer);
+    }
+    if (journal) {
+      journal->exchange(Journal::Kind::entropy, buffer);
+    }
+  }
+
+  void refill_entropy_pool() {
+    auto& pool = *machine.create_ptr<UIUEntropyPool>(UIU_ENTROPY_POOL_ADDR);
+    fill_entropy(std::as_writable_bytes(std::span{pool.bytes}));
+    pool.offset = 0;
+  }
+
+  // Writes the page tables and start.efi to guest memory and puts the vCPU
+  // in long mode. load_application has to follow before run.
+  void prepare(const PEImage& start) {
+    if (start.size > 0xf1000 - start_base) {
+      throw std::runtime_error("start.efi does not fit below the page tables");
+    }
+    page_tables.reset();
+
+    auto sregs = machine.vcpu.get_sregs();
+    sregs.cr0 = CR0{}.set_pe()
+                     .set_mp()
+                     .set_et()
+                     .set_ne()
+                     .set_wp()
+                     .set_am()
+                     .set_pg();
+
+    sregs.cr3 = PageTables::pml4_address;
+
+    auto cr4 = CR4{}.set_pae()
+                    .set_pge()
+                    .set_osfxsr()
+                    .set_osxmmexcpt();
+    if (cpu_model.xcr0 != 0) {
+      cr4.set_osxsave();
+    }
+    sregs.cr4 = cr4;
+
+    sregs.efer = EFER{}.set_lme()
+                       .set_lma()
+                       .set_nxe();
+
+    kvm_segment seg{
+      .base = 0,
+      .limit = 0x3fff'ffff,
+      .selector = 1<<3,
+      .type = 11,
+      .present = 1,
+      .dpl = 0,
+      .db = 0,
+      .s = 1,
+      .l = 1,
+      .g = 1,
+    };
+    sregs.cs = seg;
+    seg.type = 3;
+    seg.selector = 2<<3;
+    sregs.ds = sregs.es = sregs.fs = sregs.gs = sregs.ss = seg;
+    // The descriptors of these selectors, which interrupts and IRETQ load.
+    // Their accessed bits are set, so that the CPU never writes to the GDT.
+    auto gdt = machine.create_ptr<std::uint64_t>(gdt_address);
+    gdt[0] = 0;
+    gdt[1] = 0x00af'9b00'0000'ffff;
+    gdt[2] = 0x00cf'9300'0000'ffff;
+    page_tables.set(gdt_address, PageTables::page_size, EFI_MEMORY_RO|EFI_MEMORY_XP);
+    sregs.gdt = {.base = gdt_address, .limit = 3 * 8 - 1};
+    sregs.idt = {};  // start.efi installs its own
+    machine.vcpu.set_sregs(sregs);
+    // The tables of an earlier application may have been at the same place
+    address_space.flush();
+    serial.reset();
+    if (msrs) {
+      msrs->reset();
+    }
+    // An earlier application may have left the local APIC in x2APIC mode
+    // with a timer armed
+    machine.vcpu.set_msr(IA32_APIC_BASE, apic_base_at_reset);
+    machine.vcpu.set_lapic(lapic_at_reset);
+    machine.create_ptr<UIUTimerPage>(UIU_TIMER_PAGE_ADDR)->enabled = cpu_model.tsc_deadline_timer && !journal;
+    // The state at power-on, nothing of an earlier application survives
+    if (cpu_model.xcr0 != 0) {
+      kvm_xcrs xcrs{.nr_xcrs = 1};
+      xcrs.xcrs[0] = {.xcr = 0, .value = cpu_model.xcr0};
+      machine.vcpu.set_xcrs(xcrs);
+      // Components missing from XSTATE_BV are in their initial state
+      kvm_xsave xsave{};
+      constexpr std::uint16_t fcw = 0x37f;
+      constexpr std::uint32_t mxcsr = 0x1f80;
+      std::memcpy(reinterpret_cast<std::byte*>(xsave.region), &fcw, sizeof(fcw));
+      std::memcpy(reinterpret_cast<std::byte*>(xsave.region) + 24, &mxcsr, sizeof(mxcsr));
+      xsave.region[512 / 4] = CPUModel::XFEATURE_X87|CPUModel::XFEATURE_SSE;
+      machine.vcpu.set_xsave(xsave);
+    } else {
+      machine.vcpu.set_fpu({.fcw = 0x37f, .mxcsr = 0x1f80});
+    }
+
+    start.load(machine.memory.subspan(start_base, start.size), start_base);
+    page_tables.map_image(start, start_base);
+    start_entry_point = start_base + start.entry_point;
+    // Applications that return to address 0 trap. A hlt would wait for an
+    // interrupt in the kernel forever.
+    constexpr std::uint8_t trap[] = {
+      0x31, 0xc0,  // xor %eax, %eax
+      0x66, 0xe7, 0xff,  // out %ax, $0xff
+    };
+    std::memcpy(machine.memory.data(), trap, sizeof(trap));
+    // Functions that call makes return here, with their result in rdx
+    constexpr std::uint8_t return_stub[] = {
+      0x48, 0x89, 0xc2,  // mov %rax, %rdx
+      0xb8, std::uint8_t(UIUAPITag::Return), 0, 0, 0,  // mov $Return, %eax
+      0x66, 0xe7, 0xff,  // out %ax, $0xff
+    };
+    std::memcpy(machine.memory.data() + return_stub_address, return_stub, sizeof(return_stub));
+    page_tables.set(0, PageTables::page_size, EFI_MEMORY_RO);
+    page_tables.set(host_stubs_address, host_stubs_size, EFI_MEMORY_RO);
+  }
+
+  // A member of a protocol that install_host_protocol implements in the
+  // host. It gets the first arguments of the guest's call, which for UEFI
+  // protocols begin with the interface, and returns rax.
+  struct HostFunction {
+    std::size_t arguments;
+    std::function<std::uint64_t(std::span<const std::uint64_t> arguments)> call;
+  };
+
+  // Installs a protocol on a new handle whose interface is a table of
+  // pointers to stubs, one per function, that make a HostCall. Returns the
+  // guest address of the interface.
+  std::uint64_t install_host_protocol(const EFI_GUID& guid, std::vector<HostFunction> functions, EFI_HANDLE& handle) {
+    if ((host_functions.size() + functions.size()) * host_stub_size > host_stubs_size) {
+      throw std::runtime_error("no room for the stubs of another host protocol");
+    }
+    MachinePtr<std::uint64_t> interface;
+    try {
+      interface = allocate(std::max<std::size_t>(functions.size(), 1) * sizeof(std::uint64_t)).cast<std::uint64_t>();
+    } catch (const std::bad_alloc&) {
+      throw std::runtime_error("no room in the pool for the interface of another host protocol");
+    }
+    for (std::size_t i = 0; i < functions.size(); i++) {
+      std::uint32_t id = host_functions.size();
+      auto address = host_stubs_address + id * host_stub_size;
+      // The arguments in registers go to the home space of the caller,
+      // which the arguments on the stack follow, so that they are an array
+      const std::uint8_t stub[] = {
+        0x48, 0x89, 0x4c, 0x24, 0x08,  // mov %rcx, 0x8(%rsp)
+        0x48, 0x89, 0x54, 0x24, 0x10,  // mov %rdx, 0x10(%rsp)
+        0x4c, 0x89, 0x44, 0x24, 0x18,  // mov %r8, 0x18(%rsp)
+        0x4c, 0x89, 0x4c, 0x24, 0x20,  // mov %r9, 0x20(%rsp)
+        0x48, 0x8d, 0x54, 0x24, 0x08,  // lea 0x8(%rsp), %rdx
+        0xb9, std::uint8_t(id), std::uint8_t(id >> 8), std::uint8_t(id >> 16), std::uint8_t(id >> 24),  // mov $id, %ecx
+        0xb8, std::uint8_t(UIUAPITag::HostCall), 0, 0, 0,  // mov $HostCall, %eax
+        0x66, 0xe7, 0xff,  // out %ax, $0xff
+        0xc3,  // ret
+      };
+      static_assert(sizeof(stub) <= host_stub_size);
+      std::memcpy(machine.memory.data() + address, stub, sizeof(stub));
+      interface[i] = address;
+      host_functions.push_back(std::move(functions[i]));
+    }
+    handle = (EFI_HANDLE)(handle_counter++);
+    handle_db[handle].insert({guid, interface.cast<void>()});
+    return std::uint64_t{interface};
+  }
+
+  // The interface of the first handle with the protocol
+  std::optional<std::uint64_t> find_protocol(const EFI_GUID& guid) {
+    for (auto& [handle, guids] : handle_db) {
+      if (auto it = guids.find(guid); it != guids.end()) {
+        return std::uint64_t{it->second};
+      }
+    }
+    return std::nullopt;
+  }
+
+  // Calls a function of the guest with the Microsoft x64 calling convention
+  // once the application exited, with the boot services it left behind. The
+  // function runs on the stack below the frames of start.efi. Returns
+  // nothing if it did not return, like when it trapped or called Exit.
+  std::optional<std::uint64_t> call(std::uint64_t function, std::span<const std::uint64_t> arguments) {
+    if (!call_stack) {
+      throw std::runtime_error("functions can only be called after the application exited");
+    }
+    // The return address, then home space for four arguments or all of them
+    std::size_t slots = std::max<std::size_t>(arguments.size(), 4);
+    std::uint64_t rsp = ((*call_stack - slots * 8) & ~std::uint64_t{0xf}) - 8;
+    auto frame = machine.create_ptr<std::uint64_t>(rsp);
+    frame[0] = return_stub_address;
+    for (std::size_t i = 0; i < slots; i++) {
+      frame[1 + i] = i < arguments.size() ? arguments[i] : 0;
+    }
+    kvm_regs regs{
+      .rcx = arguments.size() > 0 ? arguments[0] : 0,
+      .rdx = arguments.size() > 1 ? arguments[1] : 0,
+      .rsp = rsp,
+      .r8 = arguments.size() > 2 ? arguments[2] : 0,
+      .r9 = arguments.size() > 3 ? arguments[3] : 0,
+      .rip = function,
+      .rflags = Rflags{},
+    };
+    machine.vcpu.set_regs(regs);
+    call_result.reset();
+    auto status = exit_status;
+    run();
+    // The application's status stays, also if the function called Exit
+    exit_status = status;
+    return call_result;
+  }
+
+  // start.efi calls the entry point of application once the vCPU runs
+  EFI_STATUS load_application(const PEImage& application) {
+    if (application.size > machine.memory.size() - application_base) {
+      return EFI_OUT_OF_RESOURCES;
+    }
+    application.load(machine.memory.subspan(application_base, application.size), application_base);
+    page_tables.map_image(application, application_base);
+    if (coverage) {
+      coverage->arm(machine.memory, application_base);
+    }
+    kvm_regs regs{
+      .rax = 2,
+      .rbx = 2,
+      .rcx = application_base + application.entry_point,
+      // As if _start was called, its stack frames are 16-byte aligned and a
+      // return ends at the trap at address 0
+      .rsp = 0x1fff'ffe8,
+      .rip = start_entry_point,
+      .rflags = Rflags{},
+    };
+    machine.vcpu.set_regs(regs);
+    return EFI_SUCCESS;
+  }
+
+  // Forgets everything the last application did, so that the instance can
+  // be prepared for the next one. Attached devices stay attached.
+  void reset() {
+    // In-flight transfers still write to guest memory
+    while (std::ranges::any_of(block_requests, [](const auto& request) { return request.second.remaining > 0; })) {
+      wait_for_block_completions();
+    }
+    block_requests.clear();
+    block_operations.clear();
+    handle_db.clear();
+    handle_counter = 1;
+    variables.clear();
+    events.clear();
+    event_counter = 1;
+    armed_timers = 0;
+    wait_notified = false;
+    pending_notifications.clear();
+    image_cache.clear();
+    images.clear();
+    image_pages = PageAllocator(0x3000'0000, 0x3800'0000 - 0x3000'0000);
+    upr.release();
+    mbr.release();
+    exit_status.reset();
+    host_functions.clear();
+    call_stack.reset();
+    call_result.reset();
+    running = false;
+    wait.reset();
+    watchdog.reset();
+
+    machine.clear_memory();
+    if (io_uring_fixed_buffers) {
+      // The registration still points to the pages from before
+      io_uring->unregister_buffers();
+      iovec guest_memory{machine.memory.data(), machine.memory.size()};
+      io_uring->register_buffers({&guest_memory, 1});
+    }
+  }
+
+  // How a call of run ended
+  enum class RunState {
+    finished,       // the application exited or the vCPU stopped
+    preempted,      // at slice_end
+    waiting,        // for wait
+    out_of_budget,
+    watchdog,       // the watchdog timer of the application expired
+  };
+
+  // Limits of a run, a run that exceeds them is stopped
+  struct Budget {
+    std::optional<std::chrono::nanoseconds> wall_clock;
+    std::optional<std::chrono::nanoseconds> cpu_time;  // of the vCPU thread
+  };
+
+  // What the application waits for until run is called again
+  struct Wait {
+    std::chrono::steady_clock::time_point until;  // max if there is no timeout
+    bool events;  // whether an event of event_epoll ends it early
+  };
+
+  // Runs the application until it exits. A Scheduler sets slice_end, then
+  // run also returns when the slice ends or the application waits, and the
+  // next call continues where it left off.
+  RunState run() {
+    wait.reset();
+    if (!running) {
+      running = true;
+      started_at = std::chrono::steady_clock::now();
+      cpu_used = {};
+      if (!slice_end) {
+        placement.pin_current_thread();
+      }
+      if (journal) {
+        exchange_variables();
+      }
+      publish_clock();
+      refill_entropy_pool();
+      if (counters) {
+        counters->start();
+      }
+    }
+    cpu_at_resume = thread_cpu_time();
+    set_alarm();
+    auto state = run_vcpu();
+    Alarm::cancel();
+    cpu_used += thread_cpu_time() - cpu_at_resume;
+    if (state == RunState::preempted || state == RunState::waiting) {
+      return state;
+    }
+    running = false;
+    if (framebuffer) {
+      framebuffer->poll(true);
+    }
+    return state;
+  }
+
+private:
+  RunState run_vcpu() {
     for (;;) {
-      machine.vcpu.run();
+      if (!machine.vcpu.run()) {
+        machine.vcpu_run.get()->immediate_exit = 0;
+        if (profiler) {
+          profiler->sample(machine.vcpu.get_regs(), machine.memory);
+        }
+        if (auto state = deadline_passed()) {
+          return *state;
+        }
+        continue;
+      }
 
       kvm_run& vcpu_run = *machine.vcpu_run.get();
+      // Writes that KVM queued happened before this exit
+      drain_coalesced_writes();
 
       if (vcpu_run.exit_reason == KVM_EXIT_IO) {
         const auto& io = vcpu_run.io;
         if (io.direction == KVM_EXIT_IO_OUT && io.port == 0xff) {
           auto status = dispatch_io_call(*this, *(short*)(machine.vcpu_run.io_data()));
           if (status == IOExitStatus::Continue) {
+            if (wait) {
+              return RunState::waiting;
+            }
             continue;
           } else if (status == IOExitStatus::Exit) {
-            break;
+            return RunState::finished;
           } else {
             // trap
           }
+        } else if (port_io(io)) {
+          continue;
         }
       }
+      if (vcpu_run.exit_reason == KVM_EXIT_MMIO && mmio(vcpu_run.mmio)) {
+        continue;
+      }
+      // Only the MSRs of the filter exit
+      if (vcpu_run.exit_reason == KVM_EXIT_X86_RDMSR) {
+        std::uint64_t value = 0;
+        vcpu_run.msr.error = !msrs->read(vcpu_run.msr.index, value);
+        vcpu_run.msr.data = value;
+        continue;
+      }
+      if (vcpu_run.exit_reason == KVM_EXIT_X86_WRMSR) {
+        vcpu_run.msr.error = !msrs->write(vcpu_run.msr.index, vcpu_run.msr.data);
+        continue;
+      }
+      if (vcpu_run.exit_reason == KVM_EXIT_DEBUG && coverage_breakpoint(vcpu_run.debug.arch)) {
+        continue;
+      }
       switch (vcpu_run.exit_reason) {
       case KVM_EXIT_IO:
         fmt::println("KVM_EXIT_IO");
@@ -168,9 +880,21 @@ public:
       case KVM_EXIT_MMIO:
         fmt::println("KVM_EXIT_MMIO");
         break;
-      case KVM_EXIT_SHUTDOWN:
+      case KVM_EXIT_DEBUG:
+        fmt::println("KVM_EXIT_DEBUG, exception {}", vcpu_run.debug.arch.exception);
+        break;
+      case KVM_EXIT_SHUTDOWN: {
         fmt::println("KVM_EXIT_SHUTDOWN");
+        // Exceptions have no gates in the IDT, page faults end up here
+        auto cr2 = machine.vcpu.get_sregs().cr2;
+        if (cr2 != 0) {
+          fmt::println("last page fault at {:#x}, {}", cr2, page_tables.describe(cr2));
+          if (sanitizer) {
+            sanitizer->fault(cr2, machine.vcpu.get_regs());
+          }
+        }
         break;
+      }
       default:
         fmt::println("unknown exit reason {}", vcpu_run.exit_reason);
         break;
@@ -183,11 +907,174 @@ public:
         auto line = machine.create_ptr<std::uint64_t>(regs.rsp);
         fmt::println("{:#018x} {:#x}", (std::uint64_t)(line+i), line[i]);
       }
-      break;
+      return RunState::finished;
+    }
+  }
+
+  static std::chrono::nanoseconds thread_cpu_time() {
+    timespec time;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &time);
+    return std::chrono::seconds{time.tv_sec} + std::chrono::nanoseconds{time.tv_nsec};
+  }
+
+  // Stops the vCPU at the earliest of the deadlines. CPU time passes no
+  // faster than wall-clock time, so its deadline is checked again then.
+  void set_alarm() {
+    auto now = std::chrono::steady_clock::now();
+    std::optional<std::chrono::steady_clock::time_point> earliest;
+    auto consider = [&](std::chrono::steady_clock::time_point deadline) {
+      if (!earliest || deadline < *earliest) {
+        earliest = deadline;
+      }
+    };
+    if (slice_end) {
+      consider(*slice_end);
+    }
+    if (budget.wall_clock) {
+      consider(started_at + *budget.wall_clock);
+    }
+    if (budget.cpu_time) {
+      consider(now + *budget.cpu_time - cpu_used - (thread_cpu_time() - cpu_at_resume));
+    }
+    if (watchdog) {
+      consider(*watchdog);
+    }
+    if (earliest) {
+      Alarm::set(*machine.vcpu_run.get(), *earliest);
+    } else {
+      Alarm::cancel();
+    }
+  }
+
+  // When a wait of the application for duration, or forever without one,
+  // has to end: no later than the deadlines that stop the run. Blocking
+  // sleeps and spins do not see the alarm, see set_alarm.
+  std::chrono::steady_clock::time_point wait_until(std::optional<std::chrono::microseconds> duration) const {
+    auto now = std::chrono::steady_clock::now();
+    auto until = std::chrono::steady_clock::time_point::max();
+    if (duration && *duration < std::chrono::duration_cast<std::chrono::microseconds>(until - now)) {
+      until = now + *duration;
+    }
+    if (budget.wall_clock) {
+      until = std::min(until, started_at + *budget.wall_clock);
+    }
+    if (watchdog) {
+      until = std::min(until, *watchdog);
+    }
+    return until;
+  }
+
+  // Called when the vCPU stopped early, also by other signals
+  std::optional<RunState> deadline_passed() {
+    auto now = std::chrono::steady_clock::now();
+    if (budget.wall_clock && now >= started_at + *budget.wall_clock) {
+      return RunState::out_of_budget;
+    }
+    if (budget.cpu_time && cpu_used + (thread_cpu_time() - cpu_at_resume) >= *budget.cpu_time) {
+      return RunState::out_of_budget;
+    }
+    if (watchdog && now >= *watchdog) {
+      return RunState::watchdog;
+    }
+    if (slice_end && now >= *slice_end) {
+      return RunState::preempted;
+    }
+    set_alarm();
+    return std::nullopt;
+  }
+
+  static constexpr std::uint32_t IA32_TIME_STAMP_COUNTER = 0x10;
+  static constexpr std::uint32_t IA32_APIC_BASE = 0x1b;
+
+  void add_devices() {
+    port_bus.add(Serial::port, Serial::size, {
+      .read = [this](std::uint64_t offset, std::uint32_t) -> std::uint64_t {
+        return serial.read(offset);
+      },
+      .write = [this](std::uint64_t offset, std::uint32_t, std::uint64_t value) {
+        if (auto byte = serial.write(offset, value)) {
+          std::fputc(*byte, console);
+        }
+      },
+    });
+    port_bus.add(DebugConsole::port, 1, {
+      .read = [](std::uint64_t, std::uint32_t) -> std::uint64_t {
+        return DebugConsole::readback;
+      },
+      .write = [this](std::uint64_t, std::uint32_t, std::uint64_t value) {
+        std::fputc(value & 0xff, console);
+      },
+    });
+    // Nothing waits for these writes, so the guest need not either
+    machine.coalesce_writes(Serial::port + Serial::transmit, 1, true);
+    machine.coalesce_writes(DebugConsole::port, 1, true);
+  }
+
+  // An int3 of Coverage, the vCPU continues with the original instruction
+  bool coverage_breakpoint(const kvm_debug_exit_arch& debug) {
+    if (!coverage || debug.exception != BP_VECTOR) {
+      return false;
+    }
+    address_space.update(sync_sregs ? machine.vcpu_run.get()->s.regs.sregs : machine.vcpu.get_sregs());
+    try {
+      return coverage->hit(machine.memory, address_space.translate(debug.pc, 1));
+    } catch (const GuestFault&) {
+      return false;
+    }
+  }
+
+  // Passes an IN or OUT, also a REP INS or OUTS, to the device at the port.
+  // Returns false if there is none.
+  bool port_io(const decltype(kvm_run::io)& io) {
+    auto* data = static_cast<std::byte*>(machine.vcpu_run.io_data());
+    for (std::uint32_t i = 0; i < io.count; i++, data += io.size) {
+      if (io.direction == KVM_EXIT_IO_OUT) {
+        std::uint64_t value = 0;
+        std::memcpy(&value, data, io.size);
+        if (!port_bus.write(io.port, io.size, value)) {
+          return false;
+        }
+      } else {
+        auto value = port_bus.read(io.port, io.size);
+        if (!value) {
+          return false;
+        }
+        std::memcpy(data, &*value, io.size);
+      }
+    }
+    return true;
+  }
+
+  bool mmio(decltype(kvm_run::mmio)& access) {
+    if (access.is_write) {
+      std::uint64_t value = 0;
+      std::memcpy(&value, access.data, access.len);
+      return mmio_bus.write(access.phys_addr, access.len, value);
+    }
+    auto value = mmio_bus.read(access.phys_addr, access.len);
+    if (!value) {
+      return false;
+    }
+    std::memcpy(access.data, &*value, access.len);
+    return true;
+  }
+
+  // Replays the writes queued in the coalesced ring, in order. The vCPU is
+  // stopped, so no entries are added meanwhile.
+  void drain_coalesced_writes() {
+    auto* ring = machine.coalesced_ring;
+    if (ring == nullptr) {
+      return;
+    }
+    while (ring->first != ring->last) {
+      const auto& entry = ring->coalesced_mmio[ring->first];
+      std::uint64_t value = 0;
+      std::memcpy(&value, entry.data, std::min<std::size_t>(entry.len, sizeof(value)));
+      (entry.pio ? port_bus : mmio_bus).write(entry.phys_addr, entry.len, value);
+      ring->first = (ring->first + 1) % machine.coalesced_entries;
     }
   }
 
-private:
   enum class IOExitStatus {
     Continue,
     Exit,
@@ -195,13 +1082,32 @@ private:
   };
 
   IOExitStatus dispatch_io_call(UIU& uiu, short nr) {
+    if (counters) {
+      counters->begin_handler();
+    }
+    if (call_trace) {
+      trace_call(nr);
+    }
+    address_space.update(sync_sregs ? machine.vcpu_run.get()->s.regs.sregs : machine.vcpu.get_sregs());
+    if (journal) {
+      journal->expect(Journal::Kind::call, nr);
+    }
     auto handle_io_call = [&]<UIUAPITag T>(auto callable) {
       auto regs = machine.vcpu.get_regs();
-      std::uint64_t* params = machine.create_ptr<std::uint64_t>(regs.rdx).get();
       using Fn = UIUAPIFn<T>;
-      regs.rax = [&]<auto... Is>(std::index_sequence<Is...>){
-        return (this->*callable)(std::tuple_element_t<Is, typename Fn::Args>(params[Is])...);
-      }(std::make_index_sequence<std::tuple_size_v<typename Fn::Args>>{});
+      constexpr auto arity = std::tuple_size_v<typename Fn::Args>;
+      try {
+        const std::uint64_t* params = nullptr;
+        if constexpr (arity > 0) {
+          params = guest_ptr<const std::uint64_t>((const void*)regs.rdx, arity).get();
+        }
+        regs.rax = [&]<auto... Is>(std::index_sequence<Is...>){
+          return (this->*callable)(std::tuple_element_t<Is, typename Fn::Args>(params[Is])...);
+        }(std::make_index_sequence<arity>{});
+      } catch (const GuestFault& fault) {
+        fmt::println("{}: {}", format_as(T), fault.what());
+        regs.rax = EFI_INVALID_PARAMETER;
+      }
       machine.vcpu.set_regs(regs);
     };
 
@@ -209,8 +1115,19 @@ private:
     switch (UIUAPITag{nr}) {
     case Trap:
       return IOExitStatus::Trap;
-    case Exit:
+    case Exit: {
+      auto regs = machine.vcpu.get_regs();
+      exit_status = *guest_ptr<const EFI_STATUS>((const void*)regs.rdx);
+      // Nothing below the frames of start.efi is used anymore
+      call_stack = regs.rsp;
       return IOExitStatus::Exit;
+    }
+    case Return:
+      call_result = machine.vcpu.get_regs().rdx;
+      return IOExitStatus::Exit;
+    case HostCall:
+      host_call();
+      break;
     case HandleProtocol:
       handle_io_call.operator()<HandleProtocol>(&UIU::handle_protocol);
       break;
@@ -244,55 +1161,528 @@ private:
     case LocateHandleBuffer:
       handle_io_call.operator()<LocateHandleBuffer>(&UIU::locate_handle_buffer);
       break;
+    case CreateEvent:
+      handle_io_call.operator()<CreateEvent>(&UIU::create_event);
+      break;
+    case CreateEventEx:
+      handle_io_call.operator()<CreateEventEx>(&UIU::create_event_ex);
+      break;
+    case SetTimer:
+      handle_io_call.operator()<SetTimer>(&UIU::set_timer);
+      break;
+    case WaitForEvent:
+      handle_io_call.operator()<WaitForEvent>(&UIU::wait_for_event);
+      break;
+    case SignalEvent:
+      handle_io_call.operator()<SignalEvent>(&UIU::signal_event);
+      break;
+    case CloseEvent:
+      handle_io_call.operator()<CloseEvent>(&UIU::close_event);
+      break;
+    case CheckEvent:
+      handle_io_call.operator()<CheckEvent>(&UIU::check_event);
+      break;
+    case Stall:
+      handle_io_call.operator()<Stall>(&UIU::stall);
+      break;
+    case PollEvents:
+      handle_io_call.operator()<PollEvents>(&UIU::poll_events);
+      break;
+    case GetBlockDevice:
+      handle_io_call.operator()<GetBlockDevice>(&UIU::get_block_device);
+      break;
+    case ReadBlocks:
+      handle_io_call.operator()<ReadBlocks>(&UIU::read_blocks);
+      break;
+    case WriteBlocks:
+      handle_io_call.operator()<WriteBlocks>(&UIU::write_blocks);
+      break;
+    case FlushBlocks:
+      handle_io_call.operator()<FlushBlocks>(&UIU::flush_blocks);
+      break;
+    case ReadBlocksEx:
+      handle_io_call.operator()<ReadBlocksEx>(&UIU::read_blocks_ex);
+      break;
+    case WriteBlocksEx:
+      handle_io_call.operator()<WriteBlocksEx>(&UIU::write_blocks_ex);
+      break;
+    case FlushBlocksEx:
+      handle_io_call.operator()<FlushBlocksEx>(&UIU::flush_blocks_ex);
+      break;
+    case GetFileSystem:
+      handle_io_call.operator()<GetFileSystem>(&UIU::get_file_system);
+      break;
+    case OpenVolume:
+      handle_io_call.operator()<OpenVolume>(&UIU::open_volume);
+      break;
+    case FileOpen:
+      handle_io_call.operator()<FileOpen>(&UIU::file_open);
+      break;
+    case FileClose:
+      handle_io_call.operator()<FileClose>(&UIU::file_close);
+      break;
+    case FileDelete:
+      handle_io_call.operator()<FileDelete>(&UIU::file_delete);
+      break;
+    case FileRead:
+      handle_io_call.operator()<FileRead>(&UIU::file_read);
+      break;
+    case FileWrite:
+      handle_io_call.operator()<FileWrite>(&UIU::file_write);
+      break;
+    case FileGetPosition:
+      handle_io_call.operator()<FileGetPosition>(&UIU::file_get_position);
+      break;
+    case FileSetPosition:
+      handle_io_call.operator()<FileSetPosition>(&UIU::file_set_position);
+      break;
+    case FileGetInfo:
+      handle_io_call.operator()<FileGetInfo>(&UIU::file_get_info);
+      break;
+    case FileSetInfo:
+      handle_io_call.operator()<FileSetInfo>(&UIU::file_set_info);
+      break;
+    case FileFlush:
+      handle_io_call.operator()<FileFlush>(&UIU::file_flush);
+      break;
+    case LoadImage:
+      handle_io_call.operator()<LoadImage>(&UIU::load_image);
+      break;
+    case StartImage:
+      handle_io_call.operator()<StartImage>(&UIU::start_image);
+      break;
+    case ImageReturned:
+      handle_io_call.operator()<ImageReturned>(&UIU::image_returned);
+      break;
+    case UnloadImage:
+      handle_io_call.operator()<UnloadImage>(&UIU::unload_image);
+      break;
+    case GetGraphicsOutput:
+      handle_io_call.operator()<GetGraphicsOutput>(&UIU::get_graphics_output);
+      break;
+    case GetMemoryAttributes:
+      handle_io_call.operator()<GetMemoryAttributes>(&UIU::get_memory_attributes);
+      break;
+    case SetMemoryAttributes:
+      handle_io_call.operator()<SetMemoryAttributes>(&UIU::set_memory_attributes);
+      break;
+    case ClearMemoryAttributes:
+      handle_io_call.operator()<ClearMemoryAttributes>(&UIU::clear_memory_attributes);
+      break;
+    case SetWatchdogTimer:
+      handle_io_call.operator()<SetWatchdogTimer>(&UIU::set_watchdog_timer);
+      break;
     default:
       std::terminate();
     }
-    return IOExitStatus::Continue;
-  }
-
-  EFI_STATUS handle_protocol(EFI_HANDLE Handle, EFI_GUID* Protocol, VOID** Interface) {
-    if (Handle == nullptr || Protocol == nullptr || Interface == nullptr) {
-      return EFI_INVALID_PARAMETER;
+    deliver_notifications();
+    if (framebuffer) {
+      framebuffer->poll();
     }
-    if (!handle_db.contains(Handle)) {
-      // This case is actually not defined by the specification
-      return EFI_UNSUPPORTED;
+    if (counters) {
+      counters->end_handler(format_as(UIUAPITag{nr}));
     }
-    const auto& protocol = *machine.create_ptr<EFI_GUID>((std::uint64_t)Protocol);
-    if (!handle_db[Handle].contains(protocol)) {
-      return EFI_UNSUPPORTED;
+    if (sanitizer) {
+      if (std::exchange(sanitizer->tables_changed, false)) {
+        machine.create_ptr<UIUNotifyQueue>(UIU_NOTIFY_QUEUE_ADDR)->flush_tlb = 1;
+      }
+      // Like AddressSanitizer, the run ends at the first error
+      if (sanitizer->errors != 0) {
+        return IOExitStatus::Exit;
+      }
     }
-    auto*& interface = *machine.create_ptr<void*>((std::uint64_t)Interface);
-    interface = (void*)(std::uint64_t)handle_db[Handle][protocol];
-    return EFI_SUCCESS;
+    return IOExitStatus::Continue;
   }
 
-  EFI_STATUS locate_protocol(EFI_GUID* Protocol, VOID* Registration, VOID** Interface) {
-    if (Registration != nullptr) {
-      // not implemented
-      std::terminate();
+  // Writes the pages the guest wrote since the last call, then the call
+  void trace_call(short nr) {
+    machine.vm.get_dirty_log(0, dirty_pages);
+    std::vector<std::byte> pages;
+    for (std::size_t i = 0; i < dirty_pages.size(); i++) {
+      for (auto bits = dirty_pages[i]; bits != 0; bits &= bits - 1) {
+        std::uint64_t address = (i * 64 + std::countr_zero(bits)) * AddressSpace::page_size;
+        auto* page = machine.memory.data() + address;
+        pages.insert(pages.end(), reinterpret_cast<const std::byte*>(&address), reinterpret_cast<const std::byte*>(&address + 1));
+        pages.insert(pages.end(), page, page + AddressSpace::page_size);
+      }
     }
-    if (Protocol == nullptr || Interface == nullptr) {
-      return EFI_INVALID_PARAMETER;
+    if (!pages.empty()) {
+      call_trace->write(CallTrace::Kind::pages, pages);
     }
-    auto protocol = *machine.create_ptr<EFI_GUID>((std::uint64_t)Protocol);
-    for (auto& [handle, guids] : handle_db) {
-      if (auto it = guids.find(protocol); it != guids.end()) {
-        *machine.create_ptr<void*>((std::uint64_t)Interface) = (void*)(std::uint64_t)it->second;
-        return EFI_SUCCESS;
+    CallTrace::Call call{
+      .nr = nr,
+      .regs = machine.vcpu.get_regs(),
+      .sregs = sync_sregs ? machine.vcpu_run.get()->s.regs.sregs : machine.vcpu.get_sregs(),
+    };
+    call_trace->write(CallTrace::Kind::call, std::as_bytes(std::span{&call, 1}));
+  }
+
+  void host_call() {
+    auto regs = machine.vcpu.get_regs();
+    if (regs.rcx >= host_functions.size()) {
+      regs.rax = EFI_UNSUPPORTED;
+    } else {
+      const auto& function = host_functions[regs.rcx];
+      std::vector<std::uint64_t> arguments(function.arguments);
+      try {
+        address_space.gather(regs.rdx, arguments.size() * sizeof(std::uint64_t)).copy_to(std::as_writable_bytes(std::span{arguments}));
+        regs.rax = function.call(arguments);
+      } catch (const GuestFault& fault) {
+        fmt::println("HostCall: {}", fault.what());
+        regs.rax = EFI_INVALID_PARAMETER;
+      } catch (const std::exception& e) {
+        // Host functions come from the embedder, the guest sees their
+        // failures as its call failing
+        fmt::println("HostCall: {}", e.what());
+        regs.rax = EFI_DEVICE_ERROR;
+      } catch (...) {
+        fmt::println("HostCall: unknown exception");
+        regs.rax = EFI_DEVICE_ERROR;
       }
     }
-    return EFI_NOT_FOUND;
+    machine.vcpu.set_regs(regs);
   }
 
-  EFI_STATUS install_protocol_interface(EFI_HANDLE* Handle, EFI_GUID* Protocol, EFI_INTERFACE_TYPE InterfaceType, VOID* Interface) {
+  // Collects expired timers and finished block I/O and signals their events.
+  // timeout is passed on to epoll_wait, so -1 parks the vCPU thread until one
+  // of them is ready. A dedicated core polls for the same time instead.
+  // Waits at most timeout for an event, nullopt waits until one is ready
+  void process_events(std::optional<std::chrono::nanoseconds> timeout) {
+    if (journal && journal->replaying()) {
+      // The timers that expired at this point of the recorded run
+      std::vector<EFI_EVENT> expired;
+      auto entry = journal->entries;
+      journal->exchange(Journal::Kind::events, expired);
+      for (auto handle : expired) {
+        auto it = events.find(handle);
+        if (it == events.end() || !it->second.armed) {
+          journal->entries = entry;
+          throw journal->diverged(Journal::Kind::events, fmt::format("event {} is not an armed timer", (void*)handle));
+        }
+        expire_timer(handle, it->second);
+      }
+      return;
+    }
+    epoll_event ready[16];
+    std::span<epoll_event> events_ready;
+    std::optional<std::chrono::microseconds> duration;
+    if (timeout) {
+      duration = std::chrono::ceil<std::chrono::microseconds>(*timeout);
+    }
+    if (slice_end && timeout != std::chrono::nanoseconds::zero()) {
+      // The Scheduler runs other instances until an event is ready
+      events_ready = event_epoll.wait(ready, 0);
+      if (events_ready.empty()) {
+        wait = Wait{wait_until(duration), true};
+      }
+    } else if (placement.dedicated_core && timeout != std::chrono::nanoseconds::zero()) {
+      // Spins instead of sleeping, nothing else wants the core
+      auto end = wait_until(duration);
+      do {
+        events_ready = event_epoll.wait(ready, 0);
+      } while (events_ready.empty() && std::chrono::steady_clock::now() < end);
+    } else {
+      events_ready = event_epoll.wait(ready, timeout);
+    }
+    std::vector<EFI_EVENT> expired;
+    for (const auto& e : events_ready) {
+      if (e.data.u64 == block_io_completion_key) {
+        block_io_completion.clear();
+        process_block_completions();
+        continue;
+      }
+      auto handle = reinterpret_cast<EFI_EVENT>(e.data.u64);
+      auto it = events.find(handle);
+      if (it == events.end() || it->second.timer.expirations() == 0) {
+        continue;
+      }
+      expired.push_back(handle);
+      expire_timer(handle, it->second);
+    }
+    if (journal) {
+      journal->exchange(Journal::Kind::events, expired);
+    }
+  }
+
+  void expire_timer(EFI_EVENT handle, Event& event) {
+    if (!event.periodic) {
+      event.armed = false;
+      armed_timers--;
+    }
+    signal(handle);
+  }
+
+  // Signals the events of the timers that expired in start.efi
+  void collect_guest_timers() {
+    auto& page = *machine.create_ptr<UIUTimerPage>(UIU_TIMER_PAGE_ADDR);
+    if (!page.expired) {
+      return;
+    }
+    page.expired = 0;
+    for (auto& timer : page.timers) {
+      if (timer.event != nullptr && timer.notify_function == nullptr && timer.expired) {
+        timer.expired = 0;
+        signal(timer.event);
+      }
+    }
+  }
+
+  // The earliest deadline of the timers start.efi runs, 0 if none is armed
+  std::uint64_t next_guest_deadline() {
+    std::uint64_t next = 0;
+    for (const auto& timer : machine.create_ptr<UIUTimerPage>(UIU_TIMER_PAGE_ADDR)->timers) {
+      if (timer.deadline != 0 && (next == 0 || timer.deadline < next)) {
+        next = timer.deadline;
+      }
+    }
+    return next;
+  }
+
+  void queue_notification(EFI_EVENT handle, const Event& event) {
+    pending_notifications.push_back({
+      .function = event.notify_function,
+      .event = handle,
+      .context = event.notify_context,
+    });
+  }
+
+  void signal(EFI_EVENT handle) {
+    auto signal_one = [&](EFI_EVENT handle, Event& event) {
+      if (event.is_notify_signal()) {
+        queue_notification(handle, event);
+      } else {
+        event.signaled = true;
+      }
+    };
+    // Handles in the timer page come from the guest
+    auto it = events.find(handle);
+    if (it == events.end()) {
+      return;
+    }
+    auto& event = it->second;
+    if (!event.group) {
+      signal_one(handle, event);
+      return;
+    }
+    for (auto& [member_handle, member] : events) {
+      if (member.group == event.group) {
+        signal_one(member_handle, member);
+      }
+    }
+  }
+
+  io_uring_sqe* next_sqe() {
+    io_uring_sqe* sqe;
+    while ((sqe = io_uring->get_sqe()) == nullptr) {
+      wait_for_block_completions();
+    }
+    return sqe;
+  }
+
+  // Queues a transfer between the device and guest memory, one or more
+  // operations per span of the buffer. Large transfers are split up, so that
+  // they keep several requests in flight.
+  std::uint64_t submit_block_io(BlockDevice& device, std::uint8_t opcode, EFI_LBA lba, const GuestBuffer& buffer, std::uint64_t token) {
+    constexpr std::uint64_t chunk_size = 1 << 20;
+
+    auto id = block_request_counter++;
+    auto& request = block_requests[id];
+    request.token = token;
+    request.remaining = 1;  // held until all operations are queued
+
+    if (opcode == IORING_OP_FSYNC) {
+      auto* sqe = next_sqe();
+      sqe->opcode = IORING_OP_FSYNC;
+      sqe->fd = device.flush_fd();
+      sqe->user_data = add_block_operation(id, 0);
+      request.remaining++;
+    }
+
+    auto position = lba * device.block_size;
+    for (auto span : buffer.spans) {
+      auto* data = span.data();
+      std::uint64_t done = 0;
+      bool mapped = device.map(position, span.size(), data, opcode == IORING_OP_WRITE, [&](int fd, std::uint64_t offset, std::uint64_t length, bool direct) {
+        bool fixed = io_uring_fixed_buffers && direct;
+        for (std::uint64_t chunk = 0; chunk < length; chunk += chunk_size) {
+          auto* sqe = next_sqe();
+          if (opcode == IORING_OP_READ) {
+            sqe->opcode = fixed ? IORING_OP_READ_FIXED : IORING_OP_READ;
+          } else {
+            sqe->opcode = fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+          }
+          sqe->fd = fd;
+          sqe->addr = reinterpret_cast<std::uint64_t>(data + done + chunk);
+          sqe->len = std::min(chunk_size, length - chunk);
+          sqe->off = offset + chunk;
+          sqe->buf_index = 0;
+          sqe->user_data = add_block_operation(id, sqe->len);
+          request.remaining++;
+        }
+        done += length;
+      });
+      if (!mapped) {
+        request.status = EFI_DEVICE_ERROR;
+        break;
+      }
+      position += span.size();
+    }
+
+    io_uring->submit();
+    if (--request.remaining == 0) {
+      complete_block_request(id);
+    }
+    return id;
+  }
+
+  std::uint64_t add_block_operation(std::uint64_t request, std::uint32_t length) {
+    auto key = block_operation_counter++;
+    block_operations[key] = {request, length};
+    return key;
+  }
+
+  void complete_block_request(std::uint64_t id) {
+    auto it = block_requests.find(id);
+    if (journal) {
+      journal->exchange(Journal::Kind::block_status, it->second.status);
+    }
+    if (it->second.token == 0) {
+      // the blocking caller collects the result
+      return;
+    }
+    auto& token = *machine.create_ptr<EFI_BLOCK_IO2_TOKEN>(it->second.token);
+    token.TransactionStatus = it->second.status;
+    if (events.contains(token.Event)) {
+      signal(token.Event);
+    }
+    block_requests.erase(it);
+  }
+
+  void process_block_completions() {
+    io_uring->reap([&](const io_uring_cqe& cqe) {
+      auto operation = block_operations.extract(cqe.user_data).mapped();
+      auto& request = block_requests.at(operation.request);
+      // A short transfer ran into the end of the file or a failing device
+      if (cqe.res < 0 || std::uint32_t(cqe.res) < operation.length) {
+        request.status = EFI_DEVICE_ERROR;
+      }
+      if (--request.remaining == 0) {
+        complete_block_request(operation.request);
+      }
+    });
+  }
+
+  // Sleeps until a transfer finishes, or polls for it on a dedicated core
+  void wait_for_block_completions() {
+    io_uring->submit(placement.dedicated_core ? 0 : 1);
+    process_block_completions();
+  }
+
+  EFI_STATUS wait_for_block_request(std::uint64_t id) {
+    while (block_requests.at(id).remaining > 0) {
+      wait_for_block_completions();
+    }
+    auto status = block_requests.at(id).status;
+    block_requests.erase(id);
+    return status;
+  }
+
+  // Validates a transfer and submits it. Without a token or event the
+  // request completes before this returns.
+  EFI_STATUS block_io(std::uint64_t device_id, std::uint8_t opcode, UINT32 MediaId, EFI_LBA Lba, EFI_BLOCK_IO2_TOKEN* Token, UINTN BufferSize, VOID* Buffer) {
+    if (device_id >= block_devices.size()) {
+      return EFI_INVALID_PARAMETER;
+    }
+    auto& device = block_devices[device_id];
+    if (opcode == IORING_OP_WRITE && device.read_only) {
+      return EFI_WRITE_PROTECTED;
+    }
+    if (opcode != IORING_OP_FSYNC) {
+      if (MediaId != BlockDevice::media_id) {
+        return EFI_MEDIA_CHANGED;
+      }
+      if (BufferSize % device.block_size != 0) {
+        return EFI_BAD_BUFFER_SIZE;
+      }
+      if (Buffer == nullptr || Lba >= device.block_count || BufferSize / device.block_size > device.block_count - Lba) {
+        return EFI_INVALID_PARAMETER;
+      }
+    }
+    std::uint64_t token = 0;
+    if (Token != nullptr && guest_ptr<const EFI_BLOCK_IO2_TOKEN>(Token)->Event != nullptr) {
+      // Completions may arrive under other page tables
+      token = address_space.translate((std::uint64_t)Token, sizeof(EFI_BLOCK_IO2_TOKEN), true);
+    }
+    auto id = submit_block_io(device, opcode, Lba, address_space.gather((std::uint64_t)Buffer, BufferSize, opcode == IORING_OP_READ), token);
+    if (token != 0) {
+      // A journal needs the completion at a point that every run has
+      while (journal && block_requests.contains(id)) {
+        wait_for_block_completions();
+      }
+      return EFI_SUCCESS;
+    }
+    return wait_for_block_request(id);
+  }
+
+  // Moves queued notification functions into the guest's notify queue, they
+  // run when the current hypercall returns.
+  void deliver_notifications() {
+    collect_guest_timers();
+    if (armed_timers > 0 || !block_requests.empty()) {
+      process_events(std::chrono::nanoseconds::zero());
+    }
+    auto& queue = *machine.create_ptr<UIUNotifyQueue>(UIU_NOTIFY_QUEUE_ADDR);
+    while (!pending_notifications.empty() && queue.tail - queue.head < UIUNotifyQueue::size) {
+      queue.entries[queue.tail % UIUNotifyQueue::size] = pending_notifications.front();
+      queue.tail++;
+      pending_notifications.pop_front();
+    }
+    queue.pending = !pending_notifications.empty();
+  }
+
+  EFI_STATUS handle_protocol(EFI_HANDLE Handle, EFI_GUID* Protocol, VOID** Interface) {
+    if (Handle == nullptr || Protocol == nullptr || Interface == nullptr) {
+      return EFI_INVALID_PARAMETER;
+    }
+    if (!handle_db.contains(Handle)) {
+      // This case is actually not defined by the specification
+      return EFI_UNSUPPORTED;
+    }
+    const auto& protocol = *guest_ptr<const EFI_GUID>(Protocol);
+    if (!handle_db[Handle].contains(protocol)) {
+      return EFI_UNSUPPORTED;
+    }
+    auto*& interface = *guest_ptr<void*>(Interface);
+    interface = (void*)(std::uint64_t)handle_db[Handle][protocol];
+    return EFI_SUCCESS;
+  }
+
+  EFI_STATUS locate_protocol(EFI_GUID* Protocol, VOID* Registration, VOID** Interface) {
+    if (Registration != nullptr) {
+      // not implemented
+      std::terminate();
+    }
+    if (Protocol == nullptr || Interface == nullptr) {
+      return EFI_INVALID_PARAMETER;
+    }
+    auto protocol = *guest_ptr<const EFI_GUID>(Protocol);
+    for (auto& [handle, guids] : handle_db) {
+      if (auto it = guids.find(protocol); it != guids.end()) {
+        *guest_ptr<void*>(Interface) = (void*)(std::uint64_t)it->second;
+        return EFI_SUCCESS;
+      }
+    }
+    return EFI_NOT_FOUND;
+  }
+
+  EFI_STATUS install_protocol_interface(EFI_HANDLE* Handle, EFI_GUID* Protocol, EFI_INTERFACE_TYPE InterfaceType, VOID* Interface) {
     if (Handle == nullptr || Protocol == nullptr) {
       return EFI_INVALID_PARAMETER;
     }
     if (InterfaceType != EFI_NATIVE_INTERFACE) {
       return EFI_INVALID_PARAMETER;
     }
-    auto handle = machine.create_ptr<EFI_HANDLE>((std::uint64_t)Handle);
+    auto handle = guest_ptr<EFI_HANDLE>(Handle);
     if (*handle == nullptr) {
       auto [new_handle, ok] = handle_db.insert({(EFI_HANDLE)(handle_counter++), {}});
       if (!ok) {
@@ -301,7 +1691,8 @@ private:
       }
       *handle = new_handle->first;
     }
-    auto protocol = machine.create_ptr<EFI_GUID>((std::uint64_t)Protocol);
+    auto protocol = guest_ptr<const EFI_GUID>(Protocol);
+    // Kept as the guest's address, it is only handed back
     auto interface = machine.create_ptr<void>((std::uint64_t)Interface);
     handle_db[*handle].insert({*protocol, interface});
     return EFI_SUCCESS;
@@ -313,11 +1704,11 @@ private:
     if (VariableName == nullptr || VendorGuid == nullptr || DataSize == nullptr) {
       return EFI_INVALID_PARAMETER;
     }
-    std::u16string_view variable_name = machine.create_ptr<char16_t>((std::uint64_t)VariableName).get();
-    const EFI_GUID& vendor_guid = *machine.create_ptr<EFI_GUID>((std::uint64_t)VendorGuid);
-    UINTN& data_size = *machine.create_ptr<UINTN>((std::uint64_t)DataSize);
+    auto variable_name = guest_string(VariableName);
+    const EFI_GUID& vendor_guid = *guest_ptr<const EFI_GUID>(VendorGuid);
+    UINTN& data_size = *guest_ptr<UINTN>(DataSize);
     if (auto it = variables.find(vendor_guid); it != variables.end()) {
-      if (auto jt = it->second.find(std::u16string{variable_name}); jt != it->second.end()) {
+      if (auto jt = it->second.find(variable_name); jt != it->second.end()) {
         const auto& value = jt->second;
         if (data_size < value.size()) {
           return EFI_BUFFER_TOO_SMALL;
@@ -325,8 +1716,7 @@ private:
         if (Data == nullptr) {
           return EFI_INVALID_PARAMETER;
         }
-        auto data = machine.create_ptr<void>((std::uint64_t)Data);
-        std::memcpy(data.get(), value.data(), value.size());
+        address_space.gather((std::uint64_t)Data, value.size(), true).copy_from(std::as_bytes(std::span{value}));
         return EFI_SUCCESS;
       }
     }
@@ -334,13 +1724,34 @@ private:
   }
 
   EFI_STATUS allocate_pool(EFI_MEMORY_TYPE PoolType, UINTN Size, VOID** Buffer) {
-    auto alloc = allocate(Size);
-    *(machine.create_ptr<std::uint64_t>((std::uint64_t)Buffer)) = std::uint64_t{alloc};
+    auto& result = *guest_ptr<std::uint64_t>(Buffer);
+    auto regs = [&] { return machine.vcpu.get_regs(); };
+    try {
+      result = sanitizer ? sanitizer->allocate(Size, regs) : std::uint64_t{allocate(Size)};
+    } catch (const std::bad_alloc&) {
+      if (allocations) {
+        allocations->exhausted(Size);
+      }
+      return EFI_OUT_OF_RESOURCES;
+    }
+    if (allocations) {
+      allocations->allocated(result, Size, PoolType, regs);
+    }
     return EFI_SUCCESS;
   }
 
   EFI_STATUS free_pool(VOID* Buffer) {
-    deallocate(machine.create_ptr<void>((std::uint64_t)Buffer));
+    if (sanitizer) {
+      if (!sanitizer->free((std::uint64_t)Buffer, [&] { return machine.vcpu.get_regs(); })) {
+        return EFI_INVALID_PARAMETER;
+      }
+    } else {
+      // The size is stored in front of the allocation
+      deallocate((guest_ptr<std::uint64_t>((std::uint64_t*)Buffer - 1, 2) + 1).cast<void>());
+    }
+    if (allocations) {
+      allocations->freed((std::uint64_t)Buffer);
+    }
     return EFI_SUCCESS;
   }
 
@@ -349,15 +1760,72 @@ private:
   }
 
   EFI_STATUS output_string(EFI_SIMPLE_TEXT_OUT_PROTOCOL* This, CHAR16* String) {
-    std::u16string_view str = machine.create_ptr<char16_t>((std::uint64_t)String).get();
-    fmt::print("{}", std::wstring_convert<std::codecvt_utf8<char16_t>, char16_t>{}.to_bytes(str.begin(), str.end()));
+    auto str = guest_string(String);
+    fmt::print(console, "{}", std::wstring_convert<std::codecvt_utf8<char16_t>, char16_t>{}.to_bytes(str));
     return EFI_SUCCESS;
   }
 
-  EFI_STATUS get_rng(EFI_RNG_PROTOCOL*, EFI_RNG_ALGORITHM*, UINTN RNGValueLength, UINT8* RNGValue) {
+  EFI_STATUS get_rng(EFI_RNG_PROTOCOL* This, EFI_RNG_ALGORITHM* RNGAlgorithm, UINTN RNGValueLength, UINT8* RNGValue) {
+    if (This == nullptr || RNGValueLength == 0 || RNGValue == nullptr) {
+      return EFI_INVALID_PARAMETER;
+    }
+    if (RNGAlgorithm != nullptr && *guest_ptr<const EFI_GUID>(RNGAlgorithm) != EFI_GUID(EFI_RNG_ALGORITHM_RAW)) {
+      return EFI_UNSUPPORTED;
+    }
+    for (auto span : address_space.gather((std::uint64_t)RNGValue, RNGValueLength, true).spans) {
+      fill_entropy(span);
+    }
+    refill_entropy_pool();
     return EFI_SUCCESS;
   }
 
+  // The variable store as the application finds it: per variable its GUID,
+  // the lengths of its name and data and those
+  void exchange_variables() {
+    std::vector<std::byte> store;
+    auto append = [&](const void* data, std::size_t size) {
+      auto bytes = static_cast<const std::byte*>(data);
+      store.insert(store.end(), bytes, bytes + size);
+    };
+    for (const auto& [guid, names] : variables) {
+      for (const auto& [name, data] : names) {
+        std::uint64_t sizes[2] = {name.size(), data.size()};
+        append(&guid, sizeof(guid));
+        append(sizes, sizeof(sizes));
+        append(name.data(), name.size() * sizeof(char16_t));
+        append(data.data(), data.size());
+      }
+    }
+    journal->exchange(Journal::Kind::variables, store);
+    if (!journal->replaying()) {
+      return;
+    }
+
+    variables.clear();
+    std::span<const std::byte> rest = store;
+    auto take = [&](void* data, std::size_t size) {
+      if (size > rest.size()) {
+        throw std::runtime_error("the variables in the journal are malformed");
+      }
+      std::memcpy(data, rest.data(), size);
+      rest = rest.subspan(size);
+    };
+    while (!rest.empty()) {
+      EFI_GUID guid;
+      std::uint64_t sizes[2];
+      take(&guid, sizeof(guid));
+      take(sizes, sizeof(sizes));
+      if (sizes[0] > rest.size() || sizes[1] > rest.size()) {
+        throw std::runtime_error("the variables in the journal are malformed");
+      }
+      std::u16string name(sizes[0], u'\0');
+      std::vector<char> data(sizes[1]);
+      take(name.data(), name.size() * sizeof(char16_t));
+      take(data.data(), data.size());
+      variables[guid][std::move(name)] = std::move(data);
+    }
+  }
+
   EFI_STATUS set_variable(CHAR16* VariableName, EFI_GUID* VendorGuid, UINT32 Attributes, UINTN DataSize, VOID* Data) {
     // Attributes is not implemented
 
@@ -365,18 +1833,19 @@ private:
       return EFI_INVALID_PARAMETER;
     }
 
-    std::u16string_view variable_name = machine.create_ptr<char16_t>((std::uint64_t)VariableName).get();
+    auto variable_name = guest_string(VariableName);
     if (variable_name.size() == 0) {
       return EFI_INVALID_PARAMETER;
     }
 
-    const EFI_GUID& vendor_guid = *machine.create_ptr<EFI_GUID>((std::uint64_t)VendorGuid);
-    void* data = machine.create_ptr<void>((std::uint64_t)Data).get();
+    const EFI_GUID& vendor_guid = *guest_ptr<const EFI_GUID>(VendorGuid);
 
     if (DataSize != 0) {
-      variables[vendor_guid][std::u16string{variable_name}] = std::vector<char>(static_cast<char*>(data), static_cast<char*>(data)+DataSize);
+      std::vector<char> data(DataSize);
+      address_space.gather((std::uint64_t)Data, DataSize).copy_to(std::as_writable_bytes(std::span{data}));
+      variables[vendor_guid][variable_name] = std::move(data);
     } else {
-      variables[vendor_guid].erase(std::u16string{variable_name});
+      variables[vendor_guid].erase(variable_name);
     }
 
     return EFI_SUCCESS;
@@ -387,24 +1856,946 @@ private:
       // not implemented
       std::terminate();
     }
-    const auto& protocol = *machine.create_ptr<EFI_GUID>((std::uint64_t)Protocol);
+    if (Protocol == nullptr || NoHandles == nullptr || Buffer == nullptr) {
+      return EFI_INVALID_PARAMETER;
+    }
+    const auto& protocol = *guest_ptr<const EFI_GUID>(Protocol);
+    UINTN& no_handles = *guest_ptr<UINTN>(NoHandles);
     std::vector<EFI_HANDLE> handles;
     for (const auto& [handle, protos] : handle_db) {
       if (protos.contains(protocol)) {
         handles.push_back(handle);
       }
     }
-    allocate_pool(EFI_MEMORY_TYPE::EfiReservedMemoryType, sizeof(EFI_HANDLE)*handles.size(), (void**)Buffer);
-    auto* buffer = machine.create_ptr<EFI_HANDLE>((std::uint64_t)machine.create_ptr<EFI_HANDLE*>((std::uint64_t)Buffer)).get();
+    no_handles = 0;
+    if (handles.empty()) {
+      return EFI_NOT_FOUND;
+    }
+    auto status = allocate_pool(EFI_MEMORY_TYPE::EfiReservedMemoryType, sizeof(EFI_HANDLE)*handles.size(), (void**)Buffer);
+    if (status != EFI_SUCCESS) {
+      return status;
+    }
+    // allocate_pool hands out guest physical addresses
+    auto* buffer = machine.create_ptr<EFI_HANDLE>((std::uint64_t)*guest_ptr<EFI_HANDLE*>(Buffer)).get();
     std::copy(handles.begin(), handles.end(), buffer);
+    no_handles = handles.size();
     return EFI_SUCCESS;
   }
 
+  EFI_STATUS create_event(UINT32 Type, EFI_TPL NotifyTpl, EFI_EVENT_NOTIFY NotifyFunction, VOID* NotifyContext, EFI_EVENT* Event) {
+    return create_event_ex(Type, NotifyTpl, NotifyFunction, NotifyContext, nullptr, Event);
+  }
+
+  EFI_STATUS create_event_ex(UINT32 Type, EFI_TPL NotifyTpl, EFI_EVENT_NOTIFY NotifyFunction, const VOID* NotifyContext, const EFI_GUID* EventGroup, EFI_EVENT* Event) {
+    if (Event == nullptr) {
+      return EFI_INVALID_PARAMETER;
+    }
+    auto result = guest_ptr<EFI_EVENT>(Event);
+    ::Event event{
+      .type = Type,
+      .notify_tpl = NotifyTpl,
+      .notify_function = NotifyFunction,
+      .notify_context = const_cast<VOID*>(NotifyContext),
+    };
+    if (event.is_notify_signal() && event.is_notify_wait()) {
+      return EFI_INVALID_PARAMETER;
+    }
+    if (event.is_notify_signal() || event.is_notify_wait()) {
+      if (NotifyFunction == nullptr || NotifyTpl <= TPL_APPLICATION || NotifyTpl > TPL_HIGH_LEVEL) {
+        return EFI_INVALID_PARAMETER;
+      }
+    }
+    if (EventGroup != nullptr) {
+      event.group = *guest_ptr<const EFI_GUID>(EventGroup);
+    }
+    auto handle = (EFI_EVENT)(event_counter++);
+    if (event.is_timer()) {
+      auto& page = *machine.create_ptr<UIUTimerPage>(UIU_TIMER_PAGE_ADDR);
+      auto* free = std::ranges::find(page.timers, nullptr, &UIUTimerPage::Timer::event);
+      if (page.enabled && free != std::end(page.timers)) {
+        *free = {
+          .event = handle,
+          .notify_function = event.is_notify_signal() && !event.group ? NotifyFunction : nullptr,
+          .notify_context = event.notify_context,
+          .notify_tpl = NotifyTpl,
+        };
+        event.guest_timer = free - page.timers;
+      } else {
+        event.timer = TimerFD::create();
+        event_epoll.add(event.timer.get_fd(), (std::uint64_t)handle);
+      }
+    }
+    events.insert({handle, std::move(event)});
+    *result = handle;
+    return EFI_SUCCESS;
+  }
+
+  EFI_STATUS set_timer(EFI_EVENT Event, EFI_TIMER_DELAY Type, UINT64 TriggerTime) {
+    auto it = events.find(Event);
+    if (it == events.end() || !it->second.is_timer()) {
+      return EFI_INVALID_PARAMETER;
+    }
+    auto& event = it->second;
+    // TriggerTime is in units of 100ns
+    std::chrono::nanoseconds trigger_time{TriggerTime * 100};
+    if (event.guest_timer) {
+      return set_guest_timer(*event.guest_timer, Type, trigger_time);
+    }
+    switch (Type) {
+    case TimerCancel:
+      event.timer.set({});
+      break;
+    case TimerPeriodic:
+      if (trigger_time.count() == 0) {
+        trigger_time = ::Event::timer_tick;
+      }
+      event.timer.set(trigger_time, trigger_time);
+      break;
+    case TimerRelative:
+      // a zero value would disarm the timer, but it should fire right away
+      event.timer.set(std::max(trigger_time, std::chrono::nanoseconds{1}));
+      break;
+    default:
+      return EFI_INVALID_PARAMETER;
+    }
+    if (event.armed) {
+      armed_timers--;
+    }
+    event.armed = Type != TimerCancel;
+    event.periodic = Type == TimerPeriodic;
+    if (event.armed) {
+      armed_timers++;
+    }
+    return EFI_SUCCESS;
+  }
+
+  // start.efi reprograms the local APIC when SetTimer returns
+  EFI_STATUS set_guest_timer(std::uint32_t slot, EFI_TIMER_DELAY Type, std::chrono::nanoseconds trigger_time) {
+    auto& timer = machine.create_ptr<UIUTimerPage>(UIU_TIMER_PAGE_ADDR)->timers[slot];
+    const auto& clock = *machine.create_ptr<UIUClockPage>(UIU_CLOCK_PAGE_ADDR);
+    auto ticks = [&](std::chrono::nanoseconds duration) {
+      return std::max<std::uint64_t>(static_cast<unsigned __int128>(duration.count()) * clock.tsc_khz / 1'000'000, 1);
+    };
+    switch (Type) {
+    case TimerCancel:
+      timer.deadline = 0;
+      timer.period = 0;
+      break;
+    case TimerPeriodic:
+      if (trigger_time.count() == 0) {
+        trigger_time = ::Event::timer_tick;
+      }
+      timer.period = ticks(trigger_time);
+      timer.deadline = machine.vcpu.get_msr(IA32_TIME_STAMP_COUNTER) + timer.period;
+      break;
+    case TimerRelative:
+      timer.period = 0;
+      timer.deadline = machine.vcpu.get_msr(IA32_TIME_STAMP_COUNTER) + ticks(trigger_time);
+      break;
+    default:
+      return EFI_INVALID_PARAMETER;
+    }
+    return EFI_SUCCESS;
+  }
+
+  EFI_STATUS wait_for_event(UINTN NumberOfEvents, EFI_EVENT* Event, UINTN* Index) {
+    // Only the call right after the one that queued them finds it set,
+    // whichever way a call ends
+    bool notified = std::exchange(wait_notified, false);
+    if (NumberOfEvents == 0 || Event == nullptr || Index == nullptr) {
+      return EFI_INVALID_PARAMETER;
+    }
+    auto handles = guest_ptr<const EFI_EVENT>(Event, NumberOfEvents);
+    UINTN& index = *guest_ptr<UINTN>(Index);
+    collect_guest_timers();
+    if (armed_timers > 0) {
+      process_events(std::chrono::nanoseconds::zero());
+    }
+    for (UINTN i = 0; i < NumberOfEvents; i++) {
+      auto it = events.find(handles[i]);
+      if (it == events.end() || it->second.is_notify_signal()) {
+        return EFI_INVALID_PARAMETER;
+      }
+      if (it->second.signaled) {
+        it->second.signaled = false;
+        index = i;
+        return EFI_SUCCESS;
+      }
+    }
+
+    // Notification functions of EVT_NOTIFY_WAIT events get one chance to
+    // signal their event before and after every wakeup.
+    if (!notified) {
+      bool queued = false;
+      for (UINTN i = 0; i < NumberOfEvents; i++) {
+        const auto& event = events.at(handles[i]);
+        if (event.is_notify_wait()) {
+          queue_notification(handles[i], event);
+          queued = true;
+        }
+      }
+      if (queued) {
+        wait_notified = true;
+        return EFI_NOT_READY;
+      }
+    }
+
+    auto deadline = next_guest_deadline();
+    if (armed_timers == 0 && block_requests.empty() && deadline == 0) {
+      fmt::println("WaitForEvent() called without an armed timer or pending I/O, it would never return");
+      return EFI_UNSUPPORTED;
+    }
+    // The guest may have drawn a screen it is now waiting on
+    if (framebuffer) {
+      framebuffer->poll(true);
+    }
+    std::optional<std::chrono::nanoseconds> timeout;
+    if (deadline != 0) {
+      // Timers of start.efi expire in its interrupt handler once the vCPU
+      // runs again, until then the host sleeps
+      auto now = machine.vcpu.get_msr(IA32_TIME_STAMP_COUNTER);
+      if (deadline <= now) {
+        return EFI_NOT_READY;
+      }
+      const auto& clock = *machine.create_ptr<UIUClockPage>(UIU_CLOCK_PAGE_ADDR);
+      std::uint64_t nanoseconds = static_cast<unsigned __int128>(deadline - now) * clock.tsc_to_ns_mul >> 32;
+      timeout = std::chrono::nanoseconds{std::min<std::uint64_t>(nanoseconds, std::chrono::nanoseconds::max().count())};
+    }
+    process_events(timeout);
+    return EFI_NOT_READY;
+  }
+
+  EFI_STATUS signal_event(EFI_EVENT Event) {
+    if (!events.contains(Event)) {
+      return EFI_INVALID_PARAMETER;
+    }
+    signal(Event);
+    return EFI_SUCCESS;
+  }
+
+  EFI_STATUS close_event(EFI_EVENT Event) {
+    auto it = events.find(Event);
+    if (it == events.end()) {
+      return EFI_INVALID_PARAMETER;
+    }
+    if (it->second.armed) {
+      armed_timers--;
+    }
+    if (it->second.guest_timer) {
+      machine.create_ptr<UIUTimerPage>(UIU_TIMER_PAGE_ADDR)->timers[*it->second.guest_timer] = {};
+    }
+    events.erase(it);
+    std::erase_if(pending_notifications, [&](const auto& entry) { return entry.event == Event; });
+    return EFI_SUCCESS;
+  }
+
+  EFI_STATUS check_event(EFI_EVENT Event) {
+    auto it = events.find(Event);
+    if (it == events.end() || it->second.is_notify_signal()) {
+      return EFI_INVALID_PARAMETER;
+    }
+    collect_guest_timers();
+    if (armed_timers > 0) {
+      process_events(std::chrono::nanoseconds::zero());
+    }
+    if (it->second.signaled) {
+      it->second.signaled = false;
+      return EFI_SUCCESS;
+    }
+    if (it->second.is_notify_wait()) {
+      queue_notification(Event, it->second);
+    }
+    return EFI_NOT_READY;
+  }
+
+  EFI_STATUS stall(UINTN Microseconds) {
+    // Longer than microseconds can count is forever
+    auto end = wait_until(Microseconds <= std::uint64_t(std::chrono::microseconds::max().count())
+                              ? std::optional{std::chrono::microseconds{Microseconds}} : std::nullopt);
+    // Shorter stalls are not worth a trip through the Scheduler, but
+    // replay_calls ends all of them at once
+    if (slice_end && (Microseconds >= 1000 || *slice_end == std::chrono::steady_clock::time_point::min())) {
+      wait = Wait{end, false};
+      return EFI_SUCCESS;
+    }
+    if (placement.dedicated_core) {
+      while (std::chrono::steady_clock::now() < end) {
+      }
+      return EFI_SUCCESS;
+    }
+    std::this_thread::sleep_until(end);
+    return EFI_SUCCESS;
+  }
+
+  EFI_STATUS set_watchdog_timer(UINTN Timeout, UINT64, UINTN, CHAR16*) {
+    if (Timeout == 0) {
+      watchdog.reset();
+    } else {
+      watchdog = std::chrono::steady_clock::now() + std::chrono::seconds{Timeout};
+    }
+    set_alarm();
+    return EFI_SUCCESS;
+  }
+
+  EFI_STATUS poll_events() {
+    return EFI_SUCCESS;
+  }
+
+  EFI_STATUS get_block_device(UINTN Index, UIUBlockDevice* Device) {
+    if (Index >= block_devices.size()) {
+      return EFI_NOT_FOUND;
+    }
+    auto device = guest_ptr<UIUBlockDevice>(Device);
+    device->media = block_devices[Index].media();
+    device->id = Index;
+    return EFI_SUCCESS;
+  }
+
+  std::uint64_t block_device_id(std::uint64_t interface, std::size_t offset) {
+    return guest_ptr<const UIUBlockDevice>((const void*)(interface - offset))->id;
+  }
+
+  EFI_STATUS read_blocks(EFI_BLOCK_IO_PROTOCOL* This, UINT32 MediaId, EFI_LBA Lba, UINTN BufferSize, VOID* Buffer) {
+    auto id = block_device_id((std::uint64_t)This, offsetof(UIUBlockDevice, block_io));
+    return block_io(id, IORING_OP_READ, MediaId, Lba, nullptr, BufferSize, Buffer);
+  }
+
+  EFI_STATUS write_blocks(EFI_BLOCK_IO_PROTOCOL* This, UINT32 MediaId, EFI_LBA Lba, UINTN BufferSize, VOID* Buffer) {
+    auto id = block_device_id((std::uint64_t)This, offsetof(UIUBlockDevice, block_io));
+    return block_io(id, IORING_OP_WRITE, MediaId, Lba, nullptr, BufferSize, Buffer);
+  }
+
+  EFI_STATUS flush_blocks(EFI_BLOCK_IO_PROTOCOL* This) {
+    auto id = block_device_id((std::uint64_t)This, offsetof(UIUBlockDevice, block_io));
+    return block_io(id, IORING_OP_FSYNC, BlockDevice::media_id, 0, nullptr, 0, nullptr);
+  }
+
+  EFI_STATUS read_blocks_ex(EFI_BLOCK_IO2_PROTOCOL* This, UINT32 MediaId, EFI_LBA Lba, EFI_BLOCK_IO2_TOKEN* Token, UINTN BufferSize, VOID* Buffer) {
+    auto id = block_device_id((std::uint64_t)This, offsetof(UIUBlockDevice, block_io2));
+    return block_io(id, IORING_OP_READ, MediaId, Lba, Token, BufferSize, Buffer);
+  }
+
+  EFI_STATUS write_blocks_ex(EFI_BLOCK_IO2_PROTOCOL* This, UINT32 MediaId, EFI_LBA Lba, EFI_BLOCK_IO2_TOKEN* Token, UINTN BufferSize, VOID* Buffer) {
+    auto id = block_device_id((std::uint64_t)This, offsetof(UIUBlockDevice, block_io2));
+    return block_io(id, IORING_OP_WRITE, MediaId, Lba, Token, BufferSize, Buffer);
+  }
+
+  EFI_STATUS flush_blocks_ex(EFI_BLOCK_IO2_PROTOCOL* This, EFI_BLOCK_IO2_TOKEN* Token) {
+    auto id = block_device_id((std::uint64_t)This, offsetof(UIUBlockDevice, block_io2));
+    return block_io(id, IORING_OP_FSYNC, BlockDevice::media_id, 0, Token, 0, nullptr);
+  }
+
+  EFI_STATUS get_file_system(UINTN Index, UIUFileSystem* FileSystem) {
+    if (Index >= file_systems.size()) {
+      return EFI_NOT_FOUND;
+    }
+    guest_ptr<UIUFileSystem>(FileSystem)->id = Index;
+    return EFI_SUCCESS;
+  }
+
+  // nullptr if This names no file system, the file id is checked by it
+  HostFileSystem* file_system_of(EFI_FILE_PROTOCOL* This, std::uint64_t& id) {
+    auto file = guest_ptr<const UIUFile>(This);
+    id = file->id;
+    return file->file_system < file_systems.size() ? &file_systems[file->file_system] : nullptr;
+  }
+
+  EFI_STATUS open_volume(EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* This, UIUFile* Root) {
+    auto index = guest_ptr<const UIUFileSystem>(This)->id;
+    if (index >= file_systems.size()) {
+      return EFI_INVALID_PARAMETER;
+    }
+    auto root = guest_ptr<UIUFile>(Root);
+    root->file_system = index;
+    root->id = file_systems[index].open_volume();
+    return EFI_SUCCESS;
+  }
+
+  EFI_STATUS file_open(EFI_FILE_PROTOCOL* This, UIUFile* NewHandle, CHAR16* FileName, UINT64 OpenMode, UINT64 Attributes) {
+    if (FileName == nullptr) {
+      return EFI_INVALID_PARAMETER;
+    }
+    std::uint64_t id;
+    auto* file_system = file_system_of(This, id);
+    if (file_system == nullptr) {
+      return EFI_INVALID_PARAMETER;
+    }
+    auto name = guest_string(FileName);
+    auto new_handle = guest_ptr<UIUFile>(NewHandle);
+    new_handle->file_system = guest_ptr<const UIUFile>(This)->file_system;
+    return file_system->open(id, name, OpenMode, Attributes, new_handle->id);
+  }
+
+  EFI_STATUS file_close(EFI_FILE_PROTOCOL* This) {
+    std::uint64_t id;
+    auto* file_system = file_system_of(This, id);
+    if (file_system == nullptr) {
+      return EFI_INVALID_PARAMETER;
+    }
+    return file_system->close_file(id);
+  }
+
+  EFI_STATUS file_delete(EFI_FILE_PROTOCOL* This) {
+    std::uint64_t id;
+    auto* file_system = file_system_of(This, id);
+    if (file_system == nullptr) {
+      return EFI_INVALID_PARAMETER;
+    }
+    return file_system->delete_file(id);
+  }
+
+  EFI_STATUS file_read(EFI_FILE_PROTOCOL* This, UINTN* BufferSize, VOID* Buffer) {
+    if (BufferSize == nullptr) {
+      return EFI_INVALID_PARAMETER;
+    }
+    std::uint64_t id;
+    auto* file_system = file_system_of(This, id);
+    if (file_system == nullptr) {
+      return EFI_INVALID_PARAMETER;
+    }
+    UINTN& buffer_size = *guest_ptr<UINTN>(BufferSize);
+    // Registered io_uring buffers pin the pages that a remap replaces, so
+    // they cannot be used any more once a file is mapped into guest memory.
+    bool remapped = false;
+    auto status = with_guest_buffer(Buffer, buffer_size, true, [&](std::span<std::byte> buffer, bool direct) {
+      return file_system->read(id, buffer, direct, buffer_size, remapped);
+    });
+    if (remapped && io_uring_fixed_buffers) {
+      io_uring->unregister_buffers();
+      io_uring_fixed_buffers = false;
+    }
+    return status;
+  }
+
+  EFI_STATUS file_write(EFI_FILE_PROTOCOL* This, UINTN* BufferSize, VOID* Buffer) {
+    if (BufferSize == nullptr) {
+      return EFI_INVALID_PARAMETER;
+    }
+    std::uint64_t id;
+    auto* file_system = file_system_of(This, id);
+    if (file_system == nullptr) {
+      return EFI_INVALID_PARAMETER;
+    }
+    UINTN& buffer_size = *guest_ptr<UINTN>(BufferSize);
+    return with_guest_buffer(Buffer, buffer_size, false, [&](std::span<std::byte> buffer, bool) {
+      return file_system->write(id, buffer, buffer_size);
+    });
+  }
+
+  EFI_STATUS file_get_position(EFI_FILE_PROTOCOL* This, UINT64* Position) {
+    if (Position == nullptr) {
+      return EFI_INVALID_PARAMETER;
+    }
+    std::uint64_t id;
+    auto* file_system = file_system_of(This, id);
+    if (file_system == nullptr) {
+      return EFI_INVALID_PARAMETER;
+    }
+    return file_system->get_position(id, *guest_ptr<UINT64>(Position));
+  }
+
+  EFI_STATUS file_set_position(EFI_FILE_PROTOCOL* This, UINT64 Position) {
+    std::uint64_t id;
+    auto* file_system = file_system_of(This, id);
+    if (file_system == nullptr) {
+      return EFI_INVALID_PARAMETER;
+    }
+    return file_system->set_position(id, Position);
+  }
+
+  EFI_STATUS file_get_info(EFI_FILE_PROTOCOL* This, EFI_GUID* InformationType, UINTN* BufferSize, VOID* Buffer) {
+    if (InformationType == nullptr || BufferSize == nullptr) {
+      return EFI_INVALID_PARAMETER;
+    }
+    std::uint64_t id;
+    auto* file_system = file_system_of(This, id);
+    if (file_system == nullptr) {
+      return EFI_INVALID_PARAMETER;
+    }
+    const auto& information_type = *guest_ptr<const EFI_GUID>(InformationType);
+    UINTN& buffer_size = *guest_ptr<UINTN>(BufferSize);
+    if (information_type == EFI_GUID(EFI_FILE_INFO_ID)) {
+      return with_guest_buffer(Buffer, buffer_size, true, [&](std::span<std::byte> buffer, bool) {
+        return file_system->get_file_info(id, buffer, buffer_size);
+      });
+    } else if (information_type == EFI_GUID(EFI_FILE_SYSTEM_INFO_ID)) {
+      return with_guest_buffer(Buffer, buffer_size, true, [&](std::span<std::byte> buffer, bool) {
+        return file_system->get_file_system_info(buffer, buffer_size);
+      });
+    }
+    fmt::println("GetInfo: {} is not implemented", information_type);
+    return EFI_UNSUPPORTED;
+  }
+
+  EFI_STATUS file_set_info(EFI_FILE_PROTOCOL* This, EFI_GUID* InformationType, UINTN BufferSize, VOID* Buffer) {
+    if (InformationType == nullptr || Buffer == nullptr) {
+      return EFI_INVALID_PARAMETER;
+    }
+    std::uint64_t id;
+    auto* file_system = file_system_of(This, id);
+    if (file_system == nullptr) {
+      return EFI_INVALID_PARAMETER;
+    }
+    const auto& information_type = *guest_ptr<const EFI_GUID>(InformationType);
+    if (information_type == EFI_GUID(EFI_FILE_INFO_ID)) {
+      return with_guest_buffer(Buffer, BufferSize, false, [&](std::span<std::byte> buffer, bool) {
+        return file_system->set_file_info(id, buffer);
+      });
+    } else if (information_type == EFI_GUID(EFI_FILE_SYSTEM_INFO_ID)) {
+      return EFI_WRITE_PROTECTED;
+    }
+    fmt::println("SetInfo: {} is not implemented", information_type);
+    return EFI_UNSUPPORTED;
+  }
+
+  EFI_STATUS file_flush(EFI_FILE_PROTOCOL* This) {
+    std::uint64_t id;
+    auto* file_system = file_system_of(This, id);
+    if (file_system == nullptr) {
+      return EFI_INVALID_PARAMETER;
+    }
+    return file_system->flush(id);
+  }
+
+  struct CachedImage {
+    std::vector<std::byte> file;  // tells apart images with the same hash
+    PEImage image;
+    std::uint64_t base;
+    std::size_t module = Unwinder::no_module;  // in unwinder
+  };
+
+  struct LoadedImage {
+    CachedImage* cached;
+    std::uint64_t base;
+    MachinePtr<EFI_LOADED_IMAGE_PROTOCOL> loaded_image;
+    bool started = false;
+    bool shared = true;  // code pages are mapped from the cached copy
+  };
+
+  // Concatenates the MEDIA_FILEPATH_DP nodes of a device path. first_node is
+  // set to the first of them and size to the size from there to the end.
+  std::u16string device_path_file_path(std::uint64_t device_path, std::uint64_t& first_node, std::uint64_t& size) {
+    std::u16string path;
+    first_node = 0;
+    for (std::uint64_t node = device_path;; ) {
+      EFI_DEVICE_PATH header;
+      address_space.gather(node, sizeof(header)).copy_to(std::as_writable_bytes(std::span{&header, 1}));
+      std::uint64_t length = DevicePathNodeLength(&header);
+      if (length < sizeof(EFI_DEVICE_PATH)) {
+        return {};
+      }
+      if (IsDevicePathEnd(&header)) {
+        size = node + length - first_node;
+        return path;
+      }
+      if (DevicePathType(&header) == MEDIA_DEVICE_PATH && DevicePathSubType(&header) == MEDIA_FILEPATH_DP) {
+        if (first_node == 0) {
+          first_node = node;
+        }
+        if ((length - sizeof(EFI_DEVICE_PATH)) % sizeof(char16_t) != 0) {
+          return {};
+        }
+        std::u16string name((length - sizeof(EFI_DEVICE_PATH)) / sizeof(char16_t), u'\0');
+        address_space.gather(node + sizeof(EFI_DEVICE_PATH), name.size() * sizeof(char16_t)).copy_to(std::as_writable_bytes(std::span{name}));
+        if (auto end = name.find(u'\0'); end != std::u16string::npos) {
+          name.resize(end);
+        }
+        if (!path.empty() && !path.ends_with(u'\\') && !name.starts_with(u'\\')) {
+          path += u'\\';
+        }
+        path += name;
+      }
+      node += length;
+    }
+  }
+
+  // Images are parsed and relocated once, into a copy that stays in guest
+  // memory as long as uiu runs. Loads of the same image copy their writable
+  // pages from it and map the pages of code sections without relocations.
+  EFI_STATUS cached_image(std::span<const std::byte> source, CachedImage*& cached) {
+    auto key = std::hash<std::string_view>{}({reinterpret_cast<const char*>(source.data()), source.size()});
+    auto [first, last] = image_cache.equal_range(key);
+    for (auto it = first; it != last; ++it) {
+      if (std::ranges::equal(it->second.file, source)) {
+        cached = &it->second;
+        return EFI_SUCCESS;
+      }
+    }
+
+    PEImage image;
+    auto status = PEImage::parse(source, image);
+    if (status != EFI_SUCCESS) {
+      return status;
+    }
+    auto base = image_pages.allocate(image.size);
+    if (!base) {
+      return EFI_OUT_OF_RESOURCES;
+    }
+    image.load(machine.memory.subspan(*base, image.size), *base);
+    image.contents = {};
+    // The guest never runs this copy, writing to it is a bug.
+    machine.protect_memory(*base, image.size);
+    page_tables.set(*base, image.size, EFI_MEMORY_RO|EFI_MEMORY_XP);
+    auto it = image_cache.emplace(key, CachedImage{
+      .file = {source.begin(), source.end()},
+      .image = std::move(image),
+      .base = *base,
+    });
+    cached = &it->second;
+    return EFI_SUCCESS;
+  }
+
+  EFI_STATUS load_image(BOOLEAN BootPolicy, EFI_HANDLE ParentImageHandle, EFI_DEVICE_PATH* DevicePath, VOID* SourceBuffer, UINTN SourceSize, EFI_HANDLE* ImageHandle, EFI_SYSTEM_TABLE* SystemTable) {
+    if (ParentImageHandle == nullptr || ImageHandle == nullptr) {
+      return EFI_INVALID_PARAMETER;
+    }
+
+    std::vector<std::byte> file;
+    std::span<const std::byte> source;
+    EFI_HANDLE device_handle = nullptr;
+    std::uint64_t file_path = 0;
+    std::uint64_t file_path_size = 0;
+    std::u16string path;
+    if (DevicePath != nullptr) {
+      path = device_path_file_path((std::uint64_t)DevicePath, file_path, file_path_size);
+      if (SourceBuffer == nullptr) {
+        // The shared directories have no device paths, the first one that
+        // contains the file is used.
+        auto status = EFI_NOT_FOUND;
+        for (std::size_t i = 0; i < file_systems.size() && status != EFI_SUCCESS && !path.empty(); i++) {
+          status = file_systems[i].read_file(path, file);
+          if (status == EFI_SUCCESS) {
+            device_handle = file_system_handle(i);
+          }
+        }
+        if (status != EFI_SUCCESS) {
+          return status;
+        }
+        source = file;
+      }
+    }
+    if (SourceBuffer != nullptr) {
+      auto buffer = address_space.gather((std::uint64_t)SourceBuffer, SourceSize);
+      if (buffer.spans.size() == 1) {
+        source = buffer.spans[0];
+      } else {
+        file.resize(SourceSize);
+        buffer.copy_to(file);
+        source = file;
+      }
+    } else if (DevicePath == nullptr) {
+      return EFI_NOT_FOUND;
+    }
+
+    CachedImage* cached;
+    auto status = cached_image(source, cached);
+    if (status != EFI_SUCCESS) {
+      return status;
+    }
+    const auto& image = cached->image;
+    // The pool memory comes first, there is nothing to undo without it
+    MachinePtr<void> file_path_copy;
+    MachinePtr<EFI_LOADED_IMAGE_PROTOCOL> loaded_image;
+    try {
+      loaded_image = allocate(sizeof(EFI_LOADED_IMAGE_PROTOCOL)).cast<EFI_LOADED_IMAGE_PROTOCOL>();
+      if (file_path != 0) {
+        file_path_copy = allocate(file_path_size);
+      }
+    } catch (const std::bad_alloc&) {
+      if (loaded_image.get() != nullptr) {
+        deallocate(loaded_image.cast<void>());
+      }
+      return EFI_OUT_OF_RESOURCES;
+    }
+    auto base = image_pages.allocate(image.size);
+    if (!base) {
+      if (file_path_copy.get() != nullptr) {
+        deallocate(std::move(file_path_copy));
+      }
+      deallocate(loaded_image.cast<void>());
+      return EFI_OUT_OF_RESOURCES;
+    }
+    if (profiler || allocations || sanitizer) {
+      if (cached->module == Unwinder::no_module) {
+        auto name = std::wstring_convert<std::codecvt_utf8<char16_t>, char16_t>{}.to_bytes(path.substr(path.rfind(u'\\') + 1));
+        if (name.empty()) {
+          name = fmt::format("image@{:#x}", cached->base);
+        }
+        cached->module = unwinder.add_module(name, cached->file);
+      }
+      unwinder.map_module(cached->module, *base);
+    }
+    for (std::size_t page = 0, end; page < image.shared.size(); page = end) {
+      for (end = page; end < image.shared.size() && image.shared[end] == image.shared[page]; end++);
+      auto offset = page * PEImage::page_size;
+      auto length = (end - page) * PEImage::page_size;
+      if (image.shared[page]) {
+        machine.alias_memory(*base + offset, cached->base + offset, length, PROT_READ|PROT_EXEC);
+      } else {
+        std::memcpy(machine.memory.data() + *base + offset, machine.memory.data() + cached->base + offset, length);
+      }
+    }
+    image.relocate(machine.memory.subspan(*base, image.size), *base - cached->base);
+    page_tables.map_image(image, *base);
+
+    EFI_MEMORY_TYPE code_type = EfiLoaderCode;
+    EFI_MEMORY_TYPE data_type = EfiLoaderData;
+    if (image.subsystem == IMAGE_SUBSYSTEM_EFI_BOOT_SERVICE_DRIVER) {
+      code_type = EfiBootServicesCode;
+      data_type = EfiBootServicesData;
+    } else if (image.subsystem == IMAGE_SUBSYSTEM_EFI_RUNTIME_DRIVER) {
+      code_type = EfiRuntimeServicesCode;
+      data_type = EfiRuntimeServicesData;
+    }
+    if (file_path != 0) {
+      address_space.gather(file_path, file_path_size).copy_to({static_cast<std::byte*>(file_path_copy.get()), file_path_size});
+    }
+    *loaded_image = {
+      .Revision = EFI_LOADED_IMAGE_PROTOCOL_REVISION,
+      .ParentHandle = ParentImageHandle,
+      .SystemTable = SystemTable,
+      .DeviceHandle = device_handle,
+      .FilePath = file_path != 0 ? (EFI_DEVICE_PATH*)std::uint64_t{file_path_copy} : nullptr,
+      .ImageBase = (VOID*)*base,
+      .ImageSize = image.size,
+      .ImageCodeType = code_type,
+      .ImageDataType = data_type,
+    };
+
+    auto handle = (EFI_HANDLE)(handle_counter++);
+    handle_db[handle].insert({EFI_GUID(EFI_LOADED_IMAGE_PROTOCOL_GUID), loaded_image.cast<void>()});
+    images.emplace(handle, LoadedImage{
+      .cached = cached,
+      .base = *base,
+      .loaded_image = loaded_image,
+    });
+    *guest_ptr<EFI_HANDLE>(ImageHandle) = handle;
+    return EFI_SUCCESS;
+  }
+
+  EFI_HANDLE file_system_handle(std::size_t index) {
+    for (auto& [handle, protocols] : handle_db) {
+      if (auto it = protocols.find(EFI_GUID(EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID)); it != protocols.end()) {
+        if (it->second.cast<UIUFileSystem>()->id == index) {
+          return handle;
+        }
+      }
+    }
+    return nullptr;
+  }
+
+  EFI_STATUS start_image(EFI_HANDLE ImageHandle, EFI_IMAGE_ENTRY_POINT* EntryPoint) {
+    auto it = images.find(ImageHandle);
+    if (it == images.end() || it->second.started) {
+      return EFI_INVALID_PARAMETER;
+    }
+    it->second.started = true;
+    *guest_ptr<EFI_IMAGE_ENTRY_POINT>(EntryPoint) = (EFI_IMAGE_ENTRY_POINT)(it->second.base + it->second.cached->image.entry_point);
+    return EFI_SUCCESS;
+  }
+
+  // Called by start.efi when an entry point returned or called Exit.
+  // Applications and drivers that failed are unloaded.
+  EFI_STATUS image_returned(EFI_HANDLE ImageHandle, EFI_STATUS ExitStatus) {
+    auto it = images.find(ImageHandle);
+    if (it == images.end()) {
+      return EFI_INVALID_PARAMETER;
+    }
+    if (it->second.cached->image.subsystem == IMAGE_SUBSYSTEM_EFI_APPLICATION || EFI_ERROR(ExitStatus)) {
+      free_image(it);
+    }
+    return EFI_SUCCESS;
+  }
+
+  // Returns EFI_NOT_READY if start.efi has to call the image's Unload
+  // function first and then try again with UnloadCalled set.
+  EFI_STATUS unload_image(EFI_HANDLE ImageHandle, BOOLEAN UnloadCalled) {
+    auto it = images.find(ImageHandle);
+    if (it == images.end()) {
+      return EFI_INVALID_PARAMETER;
+    }
+    if (it->second.started && !UnloadCalled) {
+      return it->second.loaded_image->Unload != nullptr ? EFI_NOT_READY : EFI_UNSUPPORTED;
+    }
+    free_image(it);
+    return EFI_SUCCESS;
+  }
+
+  void free_image(std::unordered_map<EFI_HANDLE, LoadedImage>::iterator it) {
+    auto& [handle, image] = *it;
+    if (profiler || allocations || sanitizer) {
+      unwinder.unmap_module(image.base);
+    }
+    // Also drops the mappings of shared pages
+    machine.restore_memory(image.base, image.cached->image.size);
+    page_tables.set(image.base, image.cached->image.size, EFI_MEMORY_XP);
+    image_pages.free(image.base, image.cached->image.size);
+    if (image.loaded_image->FilePath != nullptr) {
+      deallocate(machine.create_ptr<void>((std::uint64_t)image.loaded_image->FilePath));
+    }
+    deallocate(image.loaded_image.cast<void>());
+    handle_db[handle].erase(EFI_GUID(EFI_LOADED_IMAGE_PROTOCOL_GUID));
+    if (handle_db[handle].empty()) {
+      handle_db.erase(handle);
+    }
+    images.erase(it);
+  }
+
+  EFI_STATUS get_graphics_output(UIUGraphicsOutput* Output) {
+    if (!framebuffer) {
+      return EFI_NOT_FOUND;
+    }
+    auto output = guest_ptr<UIUGraphicsOutput>(Output);
+    output->info = {
+      .Version = 0,
+      .HorizontalResolution = framebuffer->width,
+      .VerticalResolution = framebuffer->height,
+      .PixelFormat = PixelBlueGreenRedReserved8BitPerColor,
+      .PixelsPerScanLine = framebuffer->width,
+    };
+    output->mode = {
+      .MaxMode = 1,
+      .Mode = 0,
+      .Info = &Output->info,
+      .SizeOfInfo = sizeof(EFI_GRAPHICS_OUTPUT_MODE_INFORMATION),
+      .FrameBufferBase = Framebuffer::guest_address,
+      .FrameBufferSize = std::uint64_t{framebuffer->width} * framebuffer->height * 4,
+    };
+    return EFI_SUCCESS;
+  }
+
+  EFI_STATUS get_memory_attributes(UIUMemoryAttributeProtocol* This, EFI_PHYSICAL_ADDRESS BaseAddress, UINT64 Length, UINT64* Attributes) {
+    if (Attributes == nullptr || Length == 0 || BaseAddress % PageTables::page_size != 0 || Length % PageTables::page_size != 0) {
+      return EFI_INVALID_PARAMETER;
+    }
+    if (!page_tables.contains(BaseAddress, Length)) {
+      return EFI_NO_MAPPING;
+    }
+    auto attributes = page_tables.get(BaseAddress, Length);
+    if (!attributes) {
+      return EFI_NO_MAPPING;
+    }
+    *guest_ptr<UINT64>(Attributes) = *attributes;
+    return EFI_SUCCESS;
+  }
+
+  EFI_STATUS set_memory_attributes(UIUMemoryAttributeProtocol* This, EFI_PHYSICAL_ADDRESS BaseAddress, UINT64 Length, UINT64 Attributes) {
+    auto status = check_memory_attributes(BaseAddress, Length, Attributes);
+    if (status != EFI_SUCCESS) {
+      return status;
+    }
+    page_tables.change(BaseAddress, Length, Attributes, 0);
+    return EFI_SUCCESS;
+  }
+
+  EFI_STATUS clear_memory_attributes(UIUMemoryAttributeProtocol* This, EFI_PHYSICAL_ADDRESS BaseAddress, UINT64 Length, UINT64 Attributes) {
+    auto status = check_memory_attributes(BaseAddress, Length, Attributes);
+    if (status != EFI_SUCCESS) {
+      return status;
+    }
+    if (Attributes & EFI_MEMORY_RO) {
+      unshare_images(BaseAddress, Length);
+    }
+    page_tables.change(BaseAddress, Length, 0, Attributes);
+    return EFI_SUCCESS;
+  }
+
+  EFI_STATUS check_memory_attributes(EFI_PHYSICAL_ADDRESS BaseAddress, UINT64 Length, UINT64 Attributes) {
+    if (Attributes == 0 || (Attributes & ~PageTables::attribute_mask) != 0 || Length == 0 ||
+        BaseAddress % PageTables::page_size != 0 || Length % PageTables::page_size != 0) {
+      return EFI_INVALID_PARAMETER;
+    }
+    if (!page_tables.contains(BaseAddress, Length)) {
+      return EFI_UNSUPPORTED;
+    }
+    if (page_tables.overlaps_tables(BaseAddress, Length)) {
+      return EFI_ACCESS_DENIED;
+    }
+    // The host maps cached images read-only
+    for (const auto& [key, cached] : image_cache) {
+      if (BaseAddress < cached.base + cached.image.size && cached.base < BaseAddress + Length) {
+        return EFI_ACCESS_DENIED;
+      }
+    }
+    return EFI_SUCCESS;
+  }
+
+  // Images that are made writable get private copies of the pages that are
+  // mapped from their cached copy.
+  void unshare_images(std::uint64_t address, std::uint64_t size) {
+    for (auto& [handle, image] : images) {
+      auto image_size = image.cached->image.size;
+      if (!image.shared || image.base >= address + size || address >= image.base + image_size) {
+        continue;
+      }
+      auto memory = machine.memory.subspan(image.base, image_size);
+      std::vector<std::byte> copy(memory.begin(), memory.end());
+      machine.restore_memory(image.base, image_size);
+      std::ranges::copy(copy, memory.begin());
+      image.shared = false;
+    }
+  }
+
 public:
+  Placement placement;
   Machine machine;
+  PageTables page_tables;
+  AddressSpace address_space;
+  CPUModel cpu_model;
+  DeviceBus port_bus;
+  DeviceBus mmio_bus;  // for addresses outside of memslots
+  Serial serial;
   std::pmr::monotonic_buffer_resource mbr;
   std::pmr::unsynchronized_pool_resource upr;
   std::unordered_map<EFI_HANDLE, std::unordered_map<EFI_GUID, MachinePtr<void>>> handle_db;
   std::size_t handle_counter = 1;  // contains the next usable EFI_HANDLE
   std::unordered_map<EFI_GUID, std::unordered_map<std::u16string, std::vector<char>>> variables;
+  std::unordered_map<EFI_EVENT, Event> events;
+  std::size_t event_counter = 1;  // contains the next usable EFI_EVENT
+  Epoll event_epoll;
+  std::size_t armed_timers = 0;
+  bool wait_notified = false;  // the last WaitForEvent queued notify-wait functions
+  std::deque<UIUNotifyQueue::Entry> pending_notifications;
+  Entropy entropy;
+  std::vector<BlockDevice> block_devices;
+  std::optional<IOUring> io_uring;
+  bool io_uring_fixed_buffers = false;
+  EventFD block_io_completion;
+  static constexpr std::uint64_t block_io_completion_key = 0;  // never a valid EFI_EVENT
+  std::unordered_map<std::uint64_t, BlockRequest> block_requests;
+  std::uint64_t block_request_counter = 0;
+  std::unordered_map<std::uint64_t, BlockOperation> block_operations;
+  std::uint64_t block_operation_counter = 0;
+  std::vector<HostFileSystem> file_systems;
+  PageAllocator image_pages;
+  std::unordered_multimap<std::size_t, CachedImage> image_cache;
+  std::unordered_map<EFI_HANDLE, LoadedImage> images;
+  std::optional<Framebuffer> framebuffer;
+  Unwinder unwinder;  // of the images, for profiler, allocations and sanitizer
+  std::optional<Profiler> profiler;
+  std::optional<AllocationProfiler> allocations;
+  std::optional<HeapSanitizer> sanitizer;
+  std::optional<Coverage> coverage;
+  std::optional<Journal> journal;
+  std::optional<CallTrace> call_trace;
+  std::vector<std::uint64_t> dirty_pages;  // the bitmap of get_dirty_log, for call_trace
+  std::optional<VCPUCounters> counters;
+  std::optional<MSRs> msrs;
+  std::uint64_t start_entry_point = 0;
+  kvm_lapic_state lapic_at_reset;
+  std::uint64_t apic_base_at_reset;
+  bool sync_sregs = false;
+  std::FILE* console = stdout;  // receives OutputString
+  std::optional<EFI_STATUS> exit_status;  // set when the application exits
+  std::vector<HostFunction> host_functions;  // indexed by the ids of their stubs
+  std::optional<std::uint64_t> call_stack;  // where call puts its frames
+  std::optional<std::uint64_t> call_result;  // of the function that call called
+  Budget budget;
+  std::optional<std::chrono::steady_clock::time_point> slice_end;  // set by the Scheduler
+  std::optional<Wait> wait;  // set when run returns RunState::waiting
+  std::optional<std::chrono::steady_clock::time_point> watchdog;  // set by SetWatchdogTimer
+  bool running = false;  // between the first call of run and the end of the application
+  std::chrono::steady_clock::time_point started_at;
+  std::chrono::nanoseconds cpu_used{};  // by the vCPU thread before the current call of run
+  std::chrono::nanoseconds cpu_at_resume{};  // of the vCPU thread at the start of it
 };
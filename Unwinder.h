@@ -0,0 +1,261 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fmt/format.h>
+#include <map>
+#include <optional>
+#include <span>
+#include <string>
+#include <utility>
+#include <vector>
+
+extern "C" {
+#include <linux/kvm.h>
+}
+
+#include "Module.h"
+
+// The images in the guest, for walking and symbolizing the guest's stacks.
+// Stacks are unwound with the .pdata of the images, or along the frame
+// pointers in images without one, and symbolized with their COFF symbol
+// tables.
+class Unwinder {
+public:
+  static constexpr std::size_t no_module = -1;
+
+  struct Frame {
+    std::size_t module;
+    std::uint64_t address;  // RVA, or guest address without a module
+
+    auto operator<=>(const Frame&) const = default;
+  };
+
+  // Parses the unwind tables and symbols of a PE file. Returns no_module if
+  // it is not a valid image.
+  std::size_t add_module(std::string name, std::span<const std::byte> file) {
+    auto module = Module::parse(std::move(name), file);
+    if (!module) {
+      return no_module;
+    }
+    modules.push_back(std::move(*module));
+    return modules.size() - 1;
+  }
+
+  // Addresses in [base, base + image size) belong to module from now on
+  void map_module(std::size_t module, std::uint64_t base) {
+    if (module != no_module) {
+      mapped[base] = module;
+    }
+  }
+
+  void unmap_module(std::uint64_t base) {
+    mapped.erase(base);
+  }
+
+  // The stack of the guest at regs, innermost frame first
+  std::vector<Frame> walk(const kvm_regs& regs, std::span<const std::byte> memory, std::size_t max_depth) const {
+    std::uint64_t context[16] = {
+      regs.rax, regs.rcx, regs.rdx, regs.rbx, regs.rsp, regs.rbp, regs.rsi, regs.rdi,
+      regs.r8, regs.r9, regs.r10, regs.r11, regs.r12, regs.r13, regs.r14, regs.r15,
+    };
+    std::uint64_t rip = regs.rip;
+    std::vector<Frame> stack;
+    for (std::size_t depth = 0; depth < max_depth && rip != 0; depth++) {
+      // Return addresses point behind the call, which may be the start of
+      // another function.
+      std::uint64_t address = depth == 0 ? rip : rip - 1;
+      auto [module, rva] = resolve(address);
+      stack.push_back({module, module != no_module ? rva : address});
+      if (module == no_module || !unwind(modules[module], rva, rip, context, memory)) {
+        break;
+      }
+    }
+    return stack;
+  }
+
+  // The stack at a hypercall, without the frames of runtime on top of it,
+  // so that it starts where the application called into start.efi. At most
+  // depth frames.
+  std::vector<Frame> call_site(const kvm_regs& regs, std::span<const std::byte> memory, std::size_t depth) const {
+    auto stack = walk(regs, memory, depth + max_runtime_frames);
+    auto runtime_frames = std::ranges::find_if(stack, [&](const auto& frame) { return frame.module != runtime; });
+    if (runtime_frames != stack.end()) {
+      stack.erase(stack.begin(), runtime_frames);
+    }
+    if (stack.size() > depth) {
+      stack.resize(depth);
+    }
+    return stack;
+  }
+
+  // module`symbol, module+rva, or the address outside of the modules
+  std::string frame_name(const Frame& frame) const {
+    if (frame.module == no_module) {
+      return fmt::format("{:#x}", frame.address);
+    }
+    const auto& module = modules[frame.module];
+    const auto* symbol = module.symbol(frame.address);
+    if (symbol == nullptr) {
+      return fmt::format("{}+{:#x}", module.name, frame.address);
+    }
+    return fmt::format("{}`{}", module.name, symbol->name);
+  }
+
+  std::vector<Module> modules;
+  std::size_t runtime = no_module;  // start.efi
+
+private:
+  static constexpr std::size_t max_runtime_frames = 8;
+
+  using RuntimeFunction = Module::RuntimeFunction;
+
+  std::pair<std::size_t, std::uint64_t> resolve(std::uint64_t address) const {
+    auto it = mapped.upper_bound(address);
+    if (it == mapped.begin()) {
+      return {no_module, 0};
+    }
+    --it;
+    auto rva = address - it->first;
+    if (rva >= modules[it->second].image.size) {
+      return {no_module, 0};
+    }
+    return {it->second, rva};
+  }
+
+  // Replaces rip and context with the values in the caller of the function
+  // at rva, following RtlVirtualUnwind. Epilogs are not recognized, samples
+  // taken in one lose their caller.
+  static bool unwind(const Module& module, std::uint64_t rva, std::uint64_t& rip, std::uint64_t (&context)[16], std::span<const std::byte> memory) {
+    constexpr std::size_t rsp = 4;
+    constexpr std::size_t rbp = 5;
+    auto load = [&](std::uint64_t address) -> std::optional<std::uint64_t> {
+      if (address > memory.size() || memory.size() - address < sizeof(std::uint64_t)) {
+        return std::nullopt;
+      }
+      std::uint64_t value;
+      std::memcpy(&value, memory.data() + address, sizeof(value));
+      return value;
+    };
+
+    if (module.functions.empty()) {
+      // No unwind tables, assume frame pointers. Leaf functions that do not
+      // set one up lose their caller.
+      auto frame = context[rbp];
+      auto caller_rbp = load(frame);
+      auto return_address = load(frame + 8);
+      if (!caller_rbp || !return_address || frame < context[rsp]) {
+        return false;
+      }
+      context[rbp] = *caller_rbp;
+      context[rsp] = frame + 16;
+      rip = *return_address;
+      return true;
+    }
+
+    // Functions without unwind data are leaf functions that keep rsp as is
+    std::optional<RuntimeFunction> function;
+    if (const auto* primary = module.function(rva)) {
+      function = *primary;
+    }
+    std::uint64_t offset = function ? rva - function->begin : 0;
+    for (bool chained = false; function; chained = true) {
+      auto header = module.read<std::uint32_t>(function->unwind_info);
+      if (!header) {
+        return false;
+      }
+      std::uint8_t flags = (*header >> 3) & 0x1f;
+      std::uint8_t prolog_size = *header >> 8;
+      std::uint8_t code_count = *header >> 16;
+      std::uint8_t frame_register = (*header >> 24) & 0xf;
+      std::uint8_t frame_offset = *header >> 28;
+      std::uint64_t codes = function->unwind_info + 4;
+      auto slot = [&](std::size_t i) {
+        return module.read<std::uint16_t>(codes + 2 * i).value_or(0);
+      };
+
+      for (std::size_t i = 0; i < code_count; ) {
+        auto code = slot(i);
+        std::uint8_t code_offset = code & 0xff;
+        std::uint8_t op = (code >> 8) & 0xf;
+        std::uint8_t info = code >> 12;
+        std::size_t slots = 1;
+        switch (op) {
+        case 1: slots = info == 0 ? 2 : 3; break;  // UWOP_ALLOC_LARGE
+        case 4: slots = 2; break;  // UWOP_SAVE_NONVOL
+        case 5: slots = 3; break;  // UWOP_SAVE_NONVOL_FAR
+        case 6: slots = 2; break;  // UWOP_EPILOG
+        case 7: slots = 3; break;  // UWOP_SPARE_CODE
+        case 8: slots = 2; break;  // UWOP_SAVE_XMM128
+        case 9: slots = 3; break;  // UWOP_SAVE_XMM128_FAR
+        }
+        // Codes of a prolog that is still running were not executed yet
+        if (!chained && offset < prolog_size && code_offset > offset) {
+          i += slots;
+          continue;
+        }
+        std::optional<std::uint64_t> value = 0;
+        switch (op) {
+        case 0:  // UWOP_PUSH_NONVOL
+          value = load(context[rsp]);
+          context[info] = value.value_or(0);
+          context[rsp] += 8;
+          break;
+        case 1:  // UWOP_ALLOC_LARGE
+          context[rsp] += info == 0 ? slot(i + 1) * 8 : slot(i + 1) | std::uint32_t{slot(i + 2)} << 16;
+          break;
+        case 2:  // UWOP_ALLOC_SMALL
+          context[rsp] += info * 8 + 8;
+          break;
+        case 3:  // UWOP_SET_FPREG
+          context[rsp] = context[frame_register] - frame_offset * 16;
+          break;
+        case 4:  // UWOP_SAVE_NONVOL
+          value = load(context[rsp] + slot(i + 1) * 8);
+          context[info] = value.value_or(0);
+          break;
+        case 5:  // UWOP_SAVE_NONVOL_FAR
+          value = load(context[rsp] + (slot(i + 1) | std::uint32_t{slot(i + 2)} << 16));
+          context[info] = value.value_or(0);
+          break;
+        case 10: {  // UWOP_PUSH_MACHFRAME
+          auto frame = context[rsp] + (info == 1 ? 8 : 0);
+          auto return_address = load(frame);
+          auto stack = load(frame + 24);
+          if (!return_address || !stack) {
+            return false;
+          }
+          rip = *return_address;
+          context[rsp] = *stack;
+          return true;
+        }
+        }
+        if (!value) {
+          return false;
+        }
+        i += slots;
+      }
+
+      function.reset();
+      constexpr std::uint8_t chain_info = 4;  // UNW_FLAG_CHAININFO
+      if (flags & chain_info) {
+        function = module.read<RuntimeFunction>(codes + 2 * ((code_count + 1) & ~1));
+        if (!function) {
+          return false;
+        }
+      }
+    }
+
+    auto return_address = load(context[rsp]);
+    if (!return_address) {
+      return false;
+    }
+    rip = *return_address;
+    context[rsp] += 8;
+    return true;
+  }
+
+  std::map<std::uint64_t, std::size_t> mapped;  // base, module
+};
@@ -0,0 +1,272 @@
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <exception>
+#include <fmt/format.h>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <vector>
+
+extern "C" {
+#include <unistd.h>
+}
+
+#include "Image.h"
+#include "KVM.h"
+#include "UIU.h"
+#include "libuiu.h"
+
+static_assert(sizeof(uiu_guid) == sizeof(EFI_GUID));
+
+struct uiu_instance {
+  uiu_instance(KVM& kvm, PEImage start) : start(std::move(start)), uiu(kvm) {
+    uiu.prepare(this->start);
+  }
+
+  PEImage start;
+  UIU uiu;
+  std::unique_ptr<std::FILE, decltype(&std::fclose)> console{nullptr, &std::fclose};
+};
+
+namespace {
+
+thread_local std::string last_error;
+
+// Instances share the one open /dev/kvm
+KVM& kvm() {
+  static KVM kvm;
+  if (!kvm) {
+    throw std::system_error(errno, std::generic_category(), "/dev/kvm");
+  }
+  return kvm;
+}
+
+// Runs f, turning exceptions into -1 and last_error
+template <typename F>
+int guarded(F&& f) {
+  try {
+    f();
+    return 0;
+  } catch (const std::exception& e) {
+    last_error = e.what();
+    return -1;
+  } catch (...) {
+    last_error = "unknown exception";
+    return -1;
+  }
+}
+
+void check(const void* pointer, const char* name) {
+  if (pointer == nullptr) {
+    throw std::invalid_argument(std::string(name) + " is NULL");
+  }
+}
+
+EFI_GUID to_efi(const uiu_guid* guid) {
+  check(guid, "guid");
+  EFI_GUID result;
+  std::memcpy(&result, guid, sizeof(result));
+  return result;
+}
+
+// The guest memory behind a range of guest addresses
+GuestBuffer guest_buffer(UIU& uiu, std::uint64_t address, std::size_t size, bool write) {
+  uiu.address_space.update(uiu.machine.vcpu.get_sregs());
+  return uiu.address_space.gather(address, size, write);
+}
+
+}  // namespace
+
+extern "C" {
+
+unsigned uiu_api_version(void) {
+  return UIU_API_VERSION;
+}
+
+const char* uiu_last_error(void) {
+  return last_error.c_str();
+}
+
+uiu_instance* uiu_create(const void* start_efi, size_t size) {
+  uiu_instance* instance = nullptr;
+  guarded([&] {
+    check(start_efi, "start_efi");
+    PEImage start;
+    if (auto status = PEImage::parse({static_cast<const std::byte*>(start_efi), size}, start); status != EFI_SUCCESS) {
+      throw std::runtime_error(fmt::format("start.efi cannot be loaded: {:#x}", status));
+    }
+    instance = new uiu_instance(kvm(), std::move(start));
+  });
+  return instance;
+}
+
+void uiu_destroy(uiu_instance* instance) {
+  delete instance;
+}
+
+int uiu_set_console(uiu_instance* instance, int fd) {
+  return guarded([&] {
+    check(instance, "instance");
+    int copy = dup(fd);
+    if (copy == -1) {
+      throw std::system_error(errno, std::generic_category(), "dup");
+    }
+    std::unique_ptr<std::FILE, decltype(&std::fclose)> console{fdopen(copy, "w"), &std::fclose};
+    if (!console) {
+      close(copy);
+      throw std::system_error(errno, std::generic_category(), "fdopen");
+    }
+    instance->uiu.console = console.get();
+    instance->console = std::move(console);
+  });
+}
+
+int uiu_load_application(uiu_instance* instance, const void* image, size_t size, uint64_t* status) {
+  return guarded([&] {
+    check(instance, "instance");
+    check(image, "image");
+    check(status, "status");
+    PEImage application;
+    *status = PEImage::parse({static_cast<const std::byte*>(image), size}, application);
+    if (*status == EFI_SUCCESS) {
+      *status = instance->uiu.load_application(application);
+    }
+  });
+}
+
+int uiu_run(uiu_instance* instance, uint64_t* exit_status) {
+  return guarded([&] {
+    check(instance, "instance");
+    check(exit_status, "exit_status");
+    auto state = instance->uiu.run();
+    if (instance->console) {
+      std::fflush(instance->console.get());
+    }
+    if (!instance->uiu.exit_status) {
+      throw std::runtime_error(state == UIU::RunState::finished ? "the application did not exit" : "the application ran out of time");
+    }
+    *exit_status = *instance->uiu.exit_status;
+  });
+}
+
+int uiu_reset(uiu_instance* instance) {
+  return guarded([&] {
+    check(instance, "instance");
+    instance->uiu.reset();
+    instance->uiu.prepare(instance->start);
+  });
+}
+
+int uiu_call(uiu_instance* instance, uint64_t function, const uint64_t* args, size_t count, uint64_t* result) {
+  return guarded([&] {
+    check(instance, "instance");
+    check(result, "result");
+    if (count > 0) {
+      check(args, "args");
+    }
+    auto returned = instance->uiu.call(function, {args, count});
+    if (instance->console) {
+      std::fflush(instance->console.get());
+    }
+    if (!returned) {
+      throw std::runtime_error(fmt::format("the function at {:#x} did not return", function));
+    }
+    *result = *returned;
+  });
+}
+
+int uiu_locate_protocol(uiu_instance* instance, const uiu_guid* guid, uint64_t* interface) {
+  return guarded([&] {
+    check(instance, "instance");
+    check(interface, "interface");
+    auto found = instance->uiu.find_protocol(to_efi(guid));
+    if (!found) {
+      throw std::runtime_error("no handle has the protocol");
+    }
+    *interface = *found;
+  });
+}
+
+int uiu_call_protocol(uiu_instance* instance, const uiu_guid* guid, size_t offset, const uint64_t* args, size_t count, uint64_t* result) {
+  std::uint64_t interface;
+  if (uiu_locate_protocol(instance, guid, &interface) == -1) {
+    return -1;
+  }
+  std::uint64_t function;
+  if (uiu_read_memory(instance, interface + offset, &function, sizeof(function)) == -1) {
+    return -1;
+  }
+  std::vector<std::uint64_t> arguments;
+  auto status = guarded([&] {
+    arguments.push_back(interface);
+    if (count > 0) {
+      check(args, "args");
+      arguments.insert(arguments.end(), args, args + count);
+    }
+  });
+  if (status == -1) {
+    return -1;
+  }
+  return uiu_call(instance, function, arguments.data(), arguments.size(), result);
+}
+
+int uiu_install_protocol(uiu_instance* instance, const uiu_guid* guid, const uiu_host_member* members, size_t count, uint64_t* interface) {
+  return guarded([&] {
+    check(instance, "instance");
+    check(interface, "interface");
+    if (count > 0) {
+      check(members, "members");
+    }
+    std::vector<UIU::HostFunction> functions;
+    for (const auto& member : std::span{members, count}) {
+      check(reinterpret_cast<const void*>(member.function), "function");
+      functions.push_back({
+        .arguments = member.arguments,
+        .call = [function = member.function, context = member.context](std::span<const std::uint64_t> arguments) {
+          return function(context, arguments.data());
+        },
+      });
+    }
+    EFI_HANDLE handle;
+    *interface = instance->uiu.install_host_protocol(to_efi(guid), std::move(functions), handle);
+  });
+}
+
+int uiu_read_memory(uiu_instance* instance, uint64_t address, void* buffer, size_t size) {
+  return guarded([&] {
+    check(instance, "instance");
+    check(buffer, "buffer");
+    guest_buffer(instance->uiu, address, size, false).copy_to({static_cast<std::byte*>(buffer), size});
+  });
+}
+
+int uiu_write_memory(uiu_instance* instance, uint64_t address, const void* buffer, size_t size) {
+  return guarded([&] {
+    check(instance, "instance");
+    check(buffer, "buffer");
+    guest_buffer(instance->uiu, address, size, true).copy_from({static_cast<const std::byte*>(buffer), size});
+  });
+}
+
+int uiu_allocate(uiu_instance* instance, size_t size, uint64_t* address) {
+  return guarded([&] {
+    check(instance, "instance");
+    check(address, "address");
+    *address = std::uint64_t{instance->uiu.allocate(size)};
+  });
+}
+
+int uiu_free(uiu_instance* instance, uint64_t address) {
+  return guarded([&] {
+    check(instance, "instance");
+    // The size is stored in front of the allocation
+    auto& uiu = instance->uiu;
+    uiu.address_space.update(uiu.machine.vcpu.get_sregs());
+    uiu.deallocate((uiu.guest_ptr<std::uint64_t>((std::uint64_t*)address - 1, 2) + 1).cast<void>());
+  });
+}
+
+}
@@ -0,0 +1,93 @@
+#pragma once
+
+// The C interface of libuiu, which runs EFI applications in the calling
+// process. An instance is one VM with start.efi, it runs one application at
+// a time and can be reset for the next. Instances are not thread-safe, but
+// every thread may use instances of its own.
+//
+// Functions that return int return 0 on success and -1 on failure, after
+// which uiu_last_error describes it. Guest addresses are virtual addresses
+// of the guest.
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define UIU_API_VERSION 1
+
+typedef struct uiu_instance uiu_instance;
+
+// Laid out like EFI_GUID
+typedef struct {
+  uint32_t data1;
+  uint16_t data2;
+  uint16_t data3;
+  uint8_t data4[8];
+} uiu_guid;
+
+// A member of a protocol implemented by the host. args has the first
+// arguments of the guest's call, for UEFI protocols the interface and then
+// the others. The result goes to the guest's rax. Host functions must not
+// use the instance that calls them.
+typedef uint64_t (*uiu_host_function)(void* context, const uint64_t* args);
+
+typedef struct {
+  uiu_host_function function;
+  void* context;
+  size_t arguments;  // the number of arguments function reads
+} uiu_host_member;
+
+// UIU_API_VERSION of the library
+unsigned uiu_api_version(void);
+
+// Why the last call of the calling thread failed
+const char* uiu_last_error(void);
+
+// Creates an instance that runs applications with the start.efi image
+uiu_instance* uiu_create(const void* start_efi, size_t size);
+void uiu_destroy(uiu_instance* instance);
+
+// Output of the application goes to fd, which the instance duplicates.
+// Without a console it goes to stdout.
+int uiu_set_console(uiu_instance* instance, int fd);
+
+// Loads the application that uiu_run starts, status is that of the loader
+int uiu_load_application(uiu_instance* instance, const void* image, size_t size, uint64_t* status);
+
+// Runs the application until it exits, fails if it does not
+int uiu_run(uiu_instance* instance, uint64_t* exit_status);
+
+// Forgets the application and all it did, host protocols included, so
+// that the next one can be loaded
+int uiu_reset(uiu_instance* instance);
+
+// Calls the guest function at address with the Microsoft x64 calling
+// convention, after the application exited. The boot services stay usable
+// until uiu_reset. Fails if the function does not return, the instance
+// then needs uiu_reset.
+int uiu_call(uiu_instance* instance, uint64_t function, const uint64_t* args, size_t count, uint64_t* result);
+
+// Finds the interface of the first handle with the protocol
+int uiu_locate_protocol(uiu_instance* instance, const uiu_guid* guid, uint64_t* interface);
+
+// Calls the member at offset of the protocol's interface, with the
+// interface as the first argument and args after it
+int uiu_call_protocol(uiu_instance* instance, const uiu_guid* guid, size_t offset, const uint64_t* args, size_t count, uint64_t* result);
+
+// Installs a protocol on a new handle, with an interface that is a table of
+// function pointers, one per member, in the order given
+int uiu_install_protocol(uiu_instance* instance, const uiu_guid* guid, const uiu_host_member* members, size_t count, uint64_t* interface);
+
+int uiu_read_memory(uiu_instance* instance, uint64_t address, void* buffer, size_t size);
+int uiu_write_memory(uiu_instance* instance, uint64_t address, const void* buffer, size_t size);
+
+// Allocates guest memory from the pool of AllocatePool, until uiu_reset
+int uiu_allocate(uiu_instance* instance, size_t size, uint64_t* address);
+int uiu_free(uiu_instance* instance, uint64_t address);
+
+#ifdef __cplusplus
+}
+#endif
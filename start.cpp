@@ -1,5 +1,7 @@
 #include "API.h"
 
+void dispatch_notifications();
+
 template <UIUAPITag T>
 auto uiuapifn() {
   using Fn = UIUAPIFn<T>;
@@ -17,7 +19,9 @@ auto uiuapifn() {
           [nr] "r" (T)
         : "memory"
       );
-      return auto(result);
+      auto status = auto(result);
+      dispatch_notifications();
+      return status;
     };
   }(std::make_index_sequence<std::tuple_size_v<typename Fn::Args>>{});
 }
@@ -30,7 +34,845 @@ auto uiuapifn() {
   );
 }
 
+// The host changes the page tables in LoadImage, ImageReturned,
+// UnloadImage and the memory attribute protocol. It asks for a flush in the
+// notify queue when it changes them in other calls.
+void flush_tlb() {
+  std::uint64_t cr3;
+  asm volatile (
+      "mov %%cr3, %0;"
+      "mov %0, %%cr3;"
+    : "=r" (cr3)
+    :
+    : "memory"
+  );
+}
+
+// Runs the notification functions the host queued while handling a
+// hypercall. Notification functions may call boot services themselves, the
+// entries queued by those calls are picked up by the outermost loop.
+void dispatch_notifications() {
+  auto* queue = reinterpret_cast<UIUNotifyQueue*>(UIU_NOTIFY_QUEUE_ADDR);
+  if (queue->flush_tlb) {
+    queue->flush_tlb = 0;
+    flush_tlb();
+  }
+  if (queue->dispatching) {
+    return;
+  }
+  queue->dispatching = 1;
+  for (;;) {
+    if (queue->head == queue->tail) {
+      if (!queue->pending) {
+        break;
+      }
+      uiuapifn<UIUAPITag::PollEvents>()();
+      continue;
+    }
+    auto entry = queue->entries[queue->head % UIUNotifyQueue::size];
+    queue->head++;
+    entry.function(entry.event, entry.context);
+  }
+  queue->dispatching = 0;
+}
+
+static EFI_TPL current_tpl = TPL_APPLICATION;
+
+// The host returns EFI_NOT_READY whenever it queued notification functions
+// of EVT_NOTIFY_WAIT events or woke up from a timer, so they can run before
+// the events are checked again. Above TPL_APPLICATION they could not run,
+// and the timer interrupt is masked at TPL_HIGH_LEVEL.
+EFIAPI EFI_STATUS wait_for_event(UINTN NumberOfEvents, EFI_EVENT* Event, UINTN* Index) {
+  if (current_tpl != TPL_APPLICATION) {
+    return EFI_UNSUPPORTED;
+  }
+  for (;;) {
+    auto status = uiuapifn<UIUAPITag::WaitForEvent>()(NumberOfEvents, Event, Index);
+    if (status != EFI_NOT_READY) {
+      return status;
+    }
+  }
+}
+
+std::uint64_t rdtsc() {
+  std::uint32_t lo, hi;
+  asm volatile ("rdtsc" : "=a" (lo), "=d" (hi));
+  return (std::uint64_t{hi} << 32) | lo;
+}
+
+std::uint64_t rdmsr(std::uint32_t index) {
+  std::uint32_t lo, hi;
+  asm volatile ("rdmsr" : "=a" (lo), "=d" (hi) : "c" (index));
+  return (std::uint64_t{hi} << 32) | lo;
+}
+
+void wrmsr(std::uint32_t index, std::uint64_t value) {
+  asm volatile ("wrmsr" : : "c" (index), "a" (std::uint32_t(value)), "d" (std::uint32_t(value >> 32)) : "memory");
+}
+
+constexpr std::uint32_t IA32_APIC_BASE = 0x1b;
+constexpr std::uint32_t IA32_TSC_DEADLINE = 0x6e0;
+constexpr std::uint32_t X2APIC_EOI = 0x80b;
+constexpr std::uint32_t X2APIC_SVR = 0x80f;
+constexpr std::uint32_t X2APIC_LVT_TIMER = 0x832;
+
+constexpr std::uint8_t timer_vector = 0x20;
+constexpr std::uint8_t spurious_vector = 0xff;
+
+// Returns whether interrupts were enabled.
+bool disable_interrupts() {
+  std::uint64_t rflags;
+  asm volatile (
+      "pushf;"
+      "pop %0;"
+      "cli"
+    : "=r" (rflags)
+    :
+    : "memory"
+  );
+  return rflags & (1 << 9);
+}
+
+void enable_interrupts() {
+  asm volatile ("sti" : : : "memory");
+}
+
+// Programs the TSC-deadline timer for the earliest armed timer, with
+// interrupts disabled.
+void arm_timer_interrupt() {
+  const auto* page = reinterpret_cast<const UIUTimerPage*>(UIU_TIMER_PAGE_ADDR);
+  std::uint64_t next = 0;
+  for (const auto& timer : page->timers) {
+    if (timer.deadline != 0 && (next == 0 || timer.deadline < next)) {
+      next = timer.deadline;
+    }
+  }
+  // 0 disarms it
+  wrmsr(IA32_TSC_DEADLINE, next);
+}
+
+// Runs the notification functions of expired timers whose TPL is above the
+// current one, the highest first and each at its TPL. Called with interrupts
+// disabled, they are enabled while functions below TPL_HIGH_LEVEL run.
+void dispatch_timer_notifications() {
+  auto* page = reinterpret_cast<UIUTimerPage*>(UIU_TIMER_PAGE_ADDR);
+  for (;;) {
+    UIUTimerPage::Timer* next = nullptr;
+    for (auto& timer : page->timers) {
+      if (timer.expired && timer.notify_function != nullptr && timer.notify_tpl > current_tpl &&
+          (next == nullptr || timer.notify_tpl > next->notify_tpl)) {
+        next = &timer;
+      }
+    }
+    if (next == nullptr) {
+      return;
+    }
+    // The entry may change while the function runs
+    next->expired = 0;
+    auto function = next->notify_function;
+    auto event = next->event;
+    auto context = next->notify_context;
+    auto previous_tpl = current_tpl;
+    current_tpl = next->notify_tpl;
+    if (current_tpl < TPL_HIGH_LEVEL) {
+      enable_interrupts();
+    }
+    function(event, context);
+    disable_interrupts();
+    current_tpl = previous_tpl;
+  }
+}
+
+// Called by timer_interrupt. Periods that passed without an interrupt only
+// count once.
+extern "C" void handle_timer_interrupt() {
+  auto* page = reinterpret_cast<UIUTimerPage*>(UIU_TIMER_PAGE_ADDR);
+  auto now = rdtsc();
+  for (auto& timer : page->timers) {
+    if (timer.deadline == 0 || timer.deadline > now) {
+      continue;
+    }
+    timer.deadline = timer.period == 0 ? 0 : now + timer.period - (now - timer.deadline) % timer.period;
+    timer.expired = 1;
+    if (timer.notify_function == nullptr) {
+      page->expired = 1;
+    }
+  }
+  wrmsr(X2APIC_EOI, 0);
+  arm_timer_interrupt();
+  dispatch_timer_notifications();
+}
+
+// Size of the XSAVE area for the components in XCR0, 512 for FXSAVE
+extern "C" {
+[[gnu::visibility("hidden")]] std::uint64_t extended_state_size = 512;
+[[gnu::visibility("hidden")]] std::uint8_t use_xsave = 0;
+}
+
+// Interrupts arrive on the stack of the interrupted code, which has no red
+// zone. Everything the System V ABI lets handle_timer_interrupt clobber is
+// saved, and the extended state as well, as notification functions may use
+// AVX registers whose upper halves no ABI preserves.
+extern "C" [[gnu::naked]] void timer_interrupt() {
+  asm (
+      "push %rax;"
+      "push %rcx;"
+      "push %rdx;"
+      "push %rsi;"
+      "push %rdi;"
+      "push %r8;"
+      "push %r9;"
+      "push %r10;"
+      "push %r11;"
+      "push %rbp;"
+      "mov %rsp, %rbp;"
+      "sub extended_state_size(%rip), %rsp;"
+      "and $-64, %rsp;"
+      "cld;"
+      "cmpb $0, use_xsave(%rip);"
+      "je 1f;"
+      // XRSTOR faults on anything but zeroes after XSTATE_BV in the header
+      "lea 520(%rsp), %rdi;"
+      "xor %eax, %eax;"
+      "mov $7, %ecx;"
+      "rep stosq;"
+      "mov $-1, %eax;"
+      "mov $-1, %edx;"
+      "xsave64 (%rsp);"
+      "jmp 2f;"
+      "1: fxsave64 (%rsp);"
+      "2: call handle_timer_interrupt;"
+      "cmpb $0, use_xsave(%rip);"
+      "je 3f;"
+      "mov $-1, %eax;"
+      "mov $-1, %edx;"
+      "xrstor64 (%rsp);"
+      "jmp 4f;"
+      "3: fxrstor64 (%rsp);"
+      "4: mov %rbp, %rsp;"
+      "pop %rbp;"
+      "pop %r11;"
+      "pop %r10;"
+      "pop %r9;"
+      "pop %r8;"
+      "pop %rdi;"
+      "pop %rsi;"
+      "pop %rdx;"
+      "pop %rcx;"
+      "pop %rax;"
+      "iretq"
+  );
+}
+
+// The local APIC does not expect an EOI for these
+extern "C" [[gnu::naked]] void spurious_interrupt() {
+  asm ("iretq");
+}
+
+struct IDTGate {
+  std::uint16_t offset_low;
+  std::uint16_t selector;
+  std::uint8_t ist;
+  std::uint8_t type;
+  std::uint16_t offset_middle;
+  std::uint32_t offset_high;
+  std::uint32_t reserved;
+};
+
+static IDTGate idt[256];
+
+void set_interrupt_gate(std::uint8_t vector, void (*handler)()) {
+  auto address = reinterpret_cast<std::uint64_t>(handler);
+  idt[vector] = {
+    .offset_low = std::uint16_t(address),
+    .selector = 1 << 3,  // the code segment of uiu's GDT
+    .ist = 0,
+    .type = 0x8e,  // present interrupt gate
+    .offset_middle = std::uint16_t(address >> 16),
+    .offset_high = std::uint32_t(address >> 32),
+    .reserved = 0,
+  };
+}
+
+// Takes over the timers of events if the host enabled that. Exceptions get
+// no gates, so that they still shut down the vCPU, where uiu reports them.
+void enable_timer_interrupts() {
+  if (!reinterpret_cast<UIUTimerPage*>(UIU_TIMER_PAGE_ADDR)->enabled) {
+    return;
+  }
+  std::uint32_t eax, ebx, ecx, edx;
+  asm ("cpuid" : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (1), "c" (0));
+  if (ecx & (1 << 27)) {  // OSXSAVE
+    asm ("cpuid" : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx) : "a" (0xd), "c" (0));
+    extended_state_size = ebx;
+    use_xsave = 1;
+  }
+
+  set_interrupt_gate(timer_vector, &timer_interrupt);
+  set_interrupt_gate(spurious_vector, &spurious_interrupt);
+  struct [[gnu::packed]] {
+    std::uint16_t limit;
+    std::uint64_t base;
+  } idtr = {sizeof(idt) - 1, reinterpret_cast<std::uint64_t>(idt)};
+  asm volatile ("lidt %0" : : "m" (idtr));
+
+  // Enabled, in x2APIC mode
+  wrmsr(IA32_APIC_BASE, rdmsr(IA32_APIC_BASE) | (1 << 11) | (1 << 10));
+  wrmsr(X2APIC_SVR, 0x100 | spurious_vector);
+  wrmsr(X2APIC_LVT_TIMER, 2 << 17 | timer_vector);  // TSC-deadline mode
+  enable_interrupts();
+}
+
+// The host arms the timer in the timer page, the local APIC has to follow.
+EFIAPI EFI_STATUS set_timer(EFI_EVENT Event, EFI_TIMER_DELAY Type, UINT64 TriggerTime) {
+  auto status = uiuapifn<UIUAPITag::SetTimer>()(Event, Type, TriggerTime);
+  if (reinterpret_cast<UIUTimerPage*>(UIU_TIMER_PAGE_ADDR)->enabled) {
+    bool enabled = disable_interrupts();
+    arm_timer_interrupt();
+    if (enabled) {
+      enable_interrupts();
+    }
+  }
+  return status;
+}
+
+// TPL_HIGH_LEVEL disables interrupts. Lowering the TPL runs the timer
+// notifications it unblocks.
+EFIAPI EFI_TPL raise_tpl(EFI_TPL NewTpl) {
+  auto old_tpl = current_tpl;
+  if (NewTpl >= TPL_HIGH_LEVEL) {
+    disable_interrupts();
+  }
+  current_tpl = NewTpl;
+  return old_tpl;
+}
+
+EFIAPI VOID restore_tpl(EFI_TPL OldTpl) {
+  disable_interrupts();
+  current_tpl = OldTpl;
+  dispatch_timer_notifications();
+  if (OldTpl < TPL_HIGH_LEVEL) {
+    enable_interrupts();
+  }
+}
+
+EFIAPI EFI_STATUS get_time(EFI_TIME* Time, EFI_TIME_CAPABILITIES* Capabilities) {
+  if (Time == nullptr) {
+    return EFI_INVALID_PARAMETER;
+  }
+  const auto* clock = reinterpret_cast<const UIUClockPage*>(UIU_CLOCK_PAGE_ADDR);
+  std::uint64_t elapsed = static_cast<unsigned __int128>(rdtsc() - clock->tsc_base) * clock->tsc_to_ns_mul >> 32;
+  std::uint64_t now = clock->wall_clock_base + elapsed;
+  std::uint64_t seconds = now / 1'000'000'000;
+
+  // Days since 1970-01-01 to a date in the proleptic Gregorian calendar, see
+  // https://howardhinnant.github.io/date_algorithms.html#civil_from_days
+  std::uint64_t z = seconds / 86400 + 719468;
+  std::uint64_t era = z / 146097;
+  std::uint64_t doe = z - era * 146097;
+  std::uint64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  std::uint64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  std::uint64_t mp = (5 * doy + 2) / 153;
+  std::uint64_t day = doy - (153 * mp + 2) / 5 + 1;
+  std::uint64_t month = mp < 10 ? mp + 3 : mp - 9;
+  std::uint64_t year = yoe + era * 400 + (month <= 2);
+
+  Time->Year = year;
+  Time->Month = month;
+  Time->Day = day;
+  Time->Hour = seconds % 86400 / 3600;
+  Time->Minute = seconds % 3600 / 60;
+  Time->Second = seconds % 60;
+  Time->Pad1 = 0;
+  Time->Nanosecond = now % 1'000'000'000;
+  Time->TimeZone = EFI_UNSPECIFIED_TIMEZONE;
+  Time->Daylight = 0;
+  Time->Pad2 = 0;
+
+  if (Capabilities != nullptr) {
+    Capabilities->Resolution = 1'000'000'000;
+    Capabilities->Accuracy = 0;
+    Capabilities->SetsToZero = FALSE;
+  }
+  return EFI_SUCCESS;
+}
+
+EFIAPI EFI_STATUS get_next_monotonic_count(UINT64* Count) {
+  if (Count == nullptr) {
+    return EFI_INVALID_PARAMETER;
+  }
+  auto* clock = reinterpret_cast<UIUClockPage*>(UIU_CLOCK_PAGE_ADDR);
+  *Count = clock->monotonic_count++;
+  return EFI_SUCCESS;
+}
+
+EFIAPI EFI_STATUS get_next_high_monotonic_count(UINT32* HighCount) {
+  if (HighCount == nullptr) {
+    return EFI_INVALID_PARAMETER;
+  }
+  auto* clock = reinterpret_cast<UIUClockPage*>(UIU_CLOCK_PAGE_ADDR);
+  clock->monotonic_count = ((clock->monotonic_count >> 32) + 1) << 32;
+  *HighCount = clock->monotonic_count >> 32;
+  return EFI_SUCCESS;
+}
+
+void copy_memory(void* destination, const void* source, UINTN length) {
+  asm volatile (
+      "rep movsb"
+    : "+D" (destination), "+S" (source), "+c" (length)
+    :
+    : "memory"
+  );
+}
+
+void set_memory(void* buffer, UINTN length, UINT8 value) {
+  asm volatile (
+      "rep stosb"
+    : "+D" (buffer), "+c" (length)
+    : "a" (value)
+    : "memory"
+  );
+}
+
+// Like copy_memory, but destination and source may overlap.
+void move_memory(void* destination, const void* source, UINTN length) {
+  if (destination <= source || static_cast<char*>(destination) >= static_cast<const char*>(source) + length) {
+    copy_memory(destination, source, length);
+    return;
+  }
+  auto* last_destination = static_cast<char*>(destination) + length - 1;
+  auto* last_source = static_cast<const char*>(source) + length - 1;
+  asm volatile (
+      "std;"
+      "rep movsb;"
+      "cld"
+    : "+D" (last_destination), "+S" (last_source), "+c" (length)
+    :
+    : "memory"
+  );
+}
+
+// Stores two pixels at a time.
+void fill_pixels(UINT32* buffer, UINTN count, UINT32 pixel) {
+  std::uint64_t pixels = (std::uint64_t{pixel} << 32) | pixel;
+  UINTN quadwords = count / 2;
+  asm volatile (
+      "rep stosq"
+    : "+D" (buffer), "+c" (quadwords)
+    : "a" (pixels)
+    : "memory"
+  );
+  if (count % 2) {
+    *buffer = pixel;
+  }
+}
+
+EFIAPI EFI_STATUS get_rng_info(EFI_RNG_PROTOCOL* This, UINTN* RNGAlgorithmListSize, EFI_RNG_ALGORITHM* RNGAlgorithmList) {
+  if (This == nullptr || RNGAlgorithmListSize == nullptr) {
+    return EFI_INVALID_PARAMETER;
+  }
+  if (*RNGAlgorithmListSize < sizeof(EFI_RNG_ALGORITHM)) {
+    *RNGAlgorithmListSize = sizeof(EFI_RNG_ALGORITHM);
+    return EFI_BUFFER_TOO_SMALL;
+  }
+  if (RNGAlgorithmList == nullptr) {
+    return EFI_INVALID_PARAMETER;
+  }
+  RNGAlgorithmList[0] = EFI_RNG_ALGORITHM(EFI_RNG_ALGORITHM_RAW);
+  *RNGAlgorithmListSize = sizeof(EFI_RNG_ALGORITHM);
+  return EFI_SUCCESS;
+}
+
+// Requests for the default algorithm are served from the entropy pool while
+// it lasts, everything else goes to the host, which also refills the pool.
+EFIAPI EFI_STATUS get_rng(EFI_RNG_PROTOCOL* This, EFI_RNG_ALGORITHM* RNGAlgorithm, UINTN RNGValueLength, UINT8* RNGValue) {
+  auto* pool = reinterpret_cast<UIUEntropyPool*>(UIU_ENTROPY_POOL_ADDR);
+  if (This != nullptr && RNGAlgorithm == nullptr && RNGValue != nullptr && RNGValueLength != 0 &&
+      RNGValueLength <= sizeof(pool->bytes) - pool->offset) {
+    copy_memory(RNGValue, &pool->bytes[pool->offset], RNGValueLength);
+    set_memory(&pool->bytes[pool->offset], RNGValueLength, 0);
+    pool->offset += RNGValueLength;
+    return EFI_SUCCESS;
+  }
+  return uiuapifn<UIUAPITag::GetRNG>()(This, RNGAlgorithm, RNGValueLength, RNGValue);
+}
+
+EFIAPI EFI_STATUS block_reset(EFI_BLOCK_IO_PROTOCOL*, BOOLEAN) {
+  return EFI_SUCCESS;
+}
+
+EFIAPI EFI_STATUS block_reset_ex(EFI_BLOCK_IO2_PROTOCOL*, BOOLEAN) {
+  return EFI_SUCCESS;
+}
+
+// Installs EFI_BLOCK_IO_PROTOCOL and EFI_BLOCK_IO2_PROTOCOL on a new handle
+// for every block device the host provides.
+void install_block_devices() {
+  EFI_GUID block_io_guid = EFI_BLOCK_IO_PROTOCOL_GUID;
+  EFI_GUID block_io2_guid = EFI_BLOCK_IO2_PROTOCOL_GUID;
+  for (UINTN i = 0;; i++) {
+    UIUBlockDevice* device;
+    if (uiuapifn<UIUAPITag::AllocatePool>()(EfiBootServicesData, sizeof(UIUBlockDevice), (void**)&device) != EFI_SUCCESS) {
+      return;
+    }
+    if (uiuapifn<UIUAPITag::GetBlockDevice>()(i, device) != EFI_SUCCESS) {
+      uiuapifn<UIUAPITag::FreePool>()(device);
+      return;
+    }
+
+    device->block_io.Revision = EFI_BLOCK_IO_PROTOCOL_REVISION3;
+    device->block_io.Media = &device->media;
+    device->block_io.Reset = &block_reset;
+    device->block_io.ReadBlocks = uiuapifn<UIUAPITag::ReadBlocks>();
+    device->block_io.WriteBlocks = uiuapifn<UIUAPITag::WriteBlocks>();
+    device->block_io.FlushBlocks = uiuapifn<UIUAPITag::FlushBlocks>();
+
+    device->block_io2.Media = &device->media;
+    device->block_io2.Reset = &block_reset_ex;
+    device->block_io2.ReadBlocksEx = uiuapifn<UIUAPITag::ReadBlocksEx>();
+    device->block_io2.WriteBlocksEx = uiuapifn<UIUAPITag::WriteBlocksEx>();
+    device->block_io2.FlushBlocksEx = uiuapifn<UIUAPITag::FlushBlocksEx>();
+
+    EFI_HANDLE handle = nullptr;
+    uiuapifn<UIUAPITag::InstallProtocolInterface>()(&handle, &block_io_guid, EFI_NATIVE_INTERFACE, &device->block_io);
+    uiuapifn<UIUAPITag::InstallProtocolInterface>()(&handle, &block_io2_guid, EFI_NATIVE_INTERFACE, &device->block_io2);
+  }
+}
+
+EFIAPI EFI_STATUS file_open(EFI_FILE_PROTOCOL* This, EFI_FILE_PROTOCOL** NewHandle, CHAR16* FileName, UINT64 OpenMode, UINT64 Attributes);
+
+EFIAPI EFI_STATUS file_close(EFI_FILE_PROTOCOL* This) {
+  auto status = uiuapifn<UIUAPITag::FileClose>()(This);
+  uiuapifn<UIUAPITag::FreePool>()(This);
+  return status;
+}
+
+EFIAPI EFI_STATUS file_delete(EFI_FILE_PROTOCOL* This) {
+  auto status = uiuapifn<UIUAPITag::FileDelete>()(This);
+  uiuapifn<UIUAPITag::FreePool>()(This);
+  return status;
+}
+
+// Allocates a UIUFile, the host fills in its ids.
+UIUFile* allocate_file() {
+  UIUFile* file;
+  if (uiuapifn<UIUAPITag::AllocatePool>()(EfiBootServicesData, sizeof(UIUFile), (void**)&file) != EFI_SUCCESS) {
+    return nullptr;
+  }
+  file->file.Revision = EFI_FILE_PROTOCOL_REVISION;
+  file->file.Open = &file_open;
+  file->file.Close = &file_close;
+  file->file.Delete = &file_delete;
+  file->file.Read = uiuapifn<UIUAPITag::FileRead>();
+  file->file.Write = uiuapifn<UIUAPITag::FileWrite>();
+  file->file.GetPosition = uiuapifn<UIUAPITag::FileGetPosition>();
+  file->file.SetPosition = uiuapifn<UIUAPITag::FileSetPosition>();
+  file->file.GetInfo = uiuapifn<UIUAPITag::FileGetInfo>();
+  file->file.SetInfo = uiuapifn<UIUAPITag::FileSetInfo>();
+  file->file.Flush = uiuapifn<UIUAPITag::FileFlush>();
+  file->file.OpenEx = EFI_FILE_OPEN_EX(&trap);
+  file->file.ReadEx = EFI_FILE_READ_EX(&trap);
+  file->file.WriteEx = EFI_FILE_WRITE_EX(&trap);
+  file->file.FlushEx = EFI_FILE_FLUSH_EX(&trap);
+  return file;
+}
+
+EFIAPI EFI_STATUS file_open(EFI_FILE_PROTOCOL* This, EFI_FILE_PROTOCOL** NewHandle, CHAR16* FileName, UINT64 OpenMode, UINT64 Attributes) {
+  if (NewHandle == nullptr) {
+    return EFI_INVALID_PARAMETER;
+  }
+  auto* file = allocate_file();
+  if (file == nullptr) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+  auto status = uiuapifn<UIUAPITag::FileOpen>()(This, file, FileName, OpenMode, Attributes);
+  if (status != EFI_SUCCESS) {
+    uiuapifn<UIUAPITag::FreePool>()(file);
+    return status;
+  }
+  *NewHandle = &file->file;
+  return EFI_SUCCESS;
+}
+
+EFIAPI EFI_STATUS open_volume(EFI_SIMPLE_FILE_SYSTEM_PROTOCOL* This, EFI_FILE_PROTOCOL** Root) {
+  if (Root == nullptr) {
+    return EFI_INVALID_PARAMETER;
+  }
+  auto* file = allocate_file();
+  if (file == nullptr) {
+    return EFI_OUT_OF_RESOURCES;
+  }
+  auto status = uiuapifn<UIUAPITag::OpenVolume>()(This, file);
+  if (status != EFI_SUCCESS) {
+    uiuapifn<UIUAPITag::FreePool>()(file);
+    return status;
+  }
+  *Root = &file->file;
+  return EFI_SUCCESS;
+}
+
+// Installs EFI_SIMPLE_FILE_SYSTEM_PROTOCOL on a new handle for every
+// directory the host shares.
+void install_file_systems() {
+  EFI_GUID file_system_guid = EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_GUID;
+  for (UINTN i = 0;; i++) {
+    UIUFileSystem* file_system;
+    if (uiuapifn<UIUAPITag::AllocatePool>()(EfiBootServicesData, sizeof(UIUFileSystem), (void**)&file_system) != EFI_SUCCESS) {
+      return;
+    }
+    if (uiuapifn<UIUAPITag::GetFileSystem>()(i, file_system) != EFI_SUCCESS) {
+      uiuapifn<UIUAPITag::FreePool>()(file_system);
+      return;
+    }
+
+    file_system->file_system.Revision = EFI_SIMPLE_FILE_SYSTEM_PROTOCOL_REVISION;
+    file_system->file_system.OpenVolume = &open_volume;
+
+    EFI_HANDLE handle = nullptr;
+    uiuapifn<UIUAPITag::InstallProtocolInterface>()(&handle, &file_system_guid, EFI_NATIVE_INTERFACE, &file_system->file_system);
+  }
+}
+
+EFIAPI EFI_STATUS gop_query_mode(EFI_GRAPHICS_OUTPUT_PROTOCOL* This, UINT32 ModeNumber, UINTN* SizeOfInfo, EFI_GRAPHICS_OUTPUT_MODE_INFORMATION** Info) {
+  if (This == nullptr || ModeNumber >= This->Mode->MaxMode || SizeOfInfo == nullptr || Info == nullptr) {
+    return EFI_INVALID_PARAMETER;
+  }
+  auto status = uiuapifn<UIUAPITag::AllocatePool>()(EfiBootServicesData, This->Mode->SizeOfInfo, (void**)Info);
+  if (status != EFI_SUCCESS) {
+    return status;
+  }
+  copy_memory(*Info, This->Mode->Info, This->Mode->SizeOfInfo);
+  *SizeOfInfo = This->Mode->SizeOfInfo;
+  return EFI_SUCCESS;
+}
+
+EFIAPI EFI_STATUS gop_set_mode(EFI_GRAPHICS_OUTPUT_PROTOCOL* This, UINT32 ModeNumber) {
+  if (This == nullptr) {
+    return EFI_INVALID_PARAMETER;
+  }
+  if (ModeNumber >= This->Mode->MaxMode) {
+    return EFI_UNSUPPORTED;
+  }
+  fill_pixels(reinterpret_cast<UINT32*>(This->Mode->FrameBufferBase), This->Mode->FrameBufferSize / 4, 0);
+  return EFI_SUCCESS;
+}
+
+// Copies and fills rows with string instructions, the host only sees the
+// pages that were written.
+EFIAPI EFI_STATUS gop_blt(EFI_GRAPHICS_OUTPUT_PROTOCOL* This, EFI_GRAPHICS_OUTPUT_BLT_PIXEL* BltBuffer, EFI_GRAPHICS_OUTPUT_BLT_OPERATION BltOperation, UINTN SourceX, UINTN SourceY, UINTN DestinationX, UINTN DestinationY, UINTN Width, UINTN Height, UINTN Delta) {
+  if (This == nullptr || BltBuffer == nullptr || Width == 0 || Height == 0) {
+    return EFI_INVALID_PARAMETER;
+  }
+  const auto* info = This->Mode->Info;
+  auto* video = reinterpret_cast<char*>(This->Mode->FrameBufferBase);
+  UINTN stride = info->PixelsPerScanLine * sizeof(UINT32);
+  auto* buffer = reinterpret_cast<char*>(BltBuffer);
+  if (Delta == 0) {
+    Delta = Width * sizeof(EFI_GRAPHICS_OUTPUT_BLT_PIXEL);
+  }
+  auto fits = [&](UINTN x, UINTN y) {
+    return x <= info->HorizontalResolution && Width <= info->HorizontalResolution - x &&
+           y <= info->VerticalResolution && Height <= info->VerticalResolution - y;
+  };
+
+  switch (BltOperation) {
+  case EfiBltVideoFill: {
+    if (!fits(DestinationX, DestinationY)) {
+      return EFI_INVALID_PARAMETER;
+    }
+    UINT32 pixel = *reinterpret_cast<UINT32*>(BltBuffer);
+    for (UINTN y = 0; y < Height; y++) {
+      fill_pixels(reinterpret_cast<UINT32*>(video + (DestinationY + y) * stride) + DestinationX, Width, pixel);
+    }
+    return EFI_SUCCESS;
+  }
+  case EfiBltVideoToBltBuffer:
+    if (!fits(SourceX, SourceY)) {
+      return EFI_INVALID_PARAMETER;
+    }
+    for (UINTN y = 0; y < Height; y++) {
+      copy_memory(buffer + (DestinationY + y) * Delta + DestinationX * 4, video + (SourceY + y) * stride + SourceX * 4, Width * 4);
+    }
+    return EFI_SUCCESS;
+  case EfiBltBufferToVideo:
+    if (!fits(DestinationX, DestinationY)) {
+      return EFI_INVALID_PARAMETER;
+    }
+    for (UINTN y = 0; y < Height; y++) {
+      copy_memory(video + (DestinationY + y) * stride + DestinationX * 4, buffer + (SourceY + y) * Delta + SourceX * 4, Width * 4);
+    }
+    return EFI_SUCCESS;
+  case EfiBltVideoToVideo:
+    if (!fits(SourceX, SourceY) || !fits(DestinationX, DestinationY)) {
+      return EFI_INVALID_PARAMETER;
+    }
+    // Rows are moved bottom-up when the destination is below the source
+    for (UINTN i = 0; i < Height; i++) {
+      UINTN y = DestinationY > SourceY ? Height - 1 - i : i;
+      move_memory(video + (DestinationY + y) * stride + DestinationX * 4, video + (SourceY + y) * stride + SourceX * 4, Width * 4);
+    }
+    return EFI_SUCCESS;
+  default:
+    return EFI_INVALID_PARAMETER;
+  }
+}
+
+void install_graphics_output() {
+  UIUGraphicsOutput* output;
+  if (uiuapifn<UIUAPITag::AllocatePool>()(EfiBootServicesData, sizeof(UIUGraphicsOutput), (void**)&output) != EFI_SUCCESS) {
+    return;
+  }
+  if (uiuapifn<UIUAPITag::GetGraphicsOutput>()(output) != EFI_SUCCESS) {
+    uiuapifn<UIUAPITag::FreePool>()(output);
+    return;
+  }
+  output->gop.QueryMode = &gop_query_mode;
+  output->gop.SetMode = &gop_set_mode;
+  output->gop.Blt = &gop_blt;
+  output->gop.Mode = &output->mode;
+
+  EFI_GUID gop_guid = EFI_GRAPHICS_OUTPUT_PROTOCOL_GUID;
+  EFI_HANDLE handle = nullptr;
+  uiuapifn<UIUAPITag::InstallProtocolInterface>()(&handle, &gop_guid, EFI_NATIVE_INTERFACE, &output->gop);
+}
+
+static EFI_SYSTEM_TABLE* system_table;
+
+// One per running StartImage, Exit returns through it.
+struct ImageContext {
+  EFI_HANDLE handle;
+  void* jump_buffer[5];
+  // xmm6-xmm15 are callee-saved in the MS ABI, and the image that called Exit
+  // may have clobbered them.
+  alignas(16) std::uint8_t xmm[10][16];
+  EFI_STATUS status;
+  UINTN exit_data_size;
+  CHAR16* exit_data;
+  ImageContext* previous;
+};
+
+static ImageContext* current_image;
+
+EFIAPI EFI_STATUS load_image(BOOLEAN BootPolicy, EFI_HANDLE ParentImageHandle, EFI_DEVICE_PATH* DevicePath, VOID* SourceBuffer, UINTN SourceSize, EFI_HANDLE* ImageHandle) {
+  auto status = uiuapifn<UIUAPITag::LoadImage>()(BootPolicy, ParentImageHandle, DevicePath, SourceBuffer, SourceSize, ImageHandle, system_table);
+  flush_tlb();
+  return status;
+}
+
+EFIAPI EFI_STATUS start_image(EFI_HANDLE ImageHandle, UINTN* ExitDataSize, CHAR16** ExitData) {
+  EFI_IMAGE_ENTRY_POINT entry_point;
+  auto status = uiuapifn<UIUAPITag::StartImage>()(ImageHandle, &entry_point);
+  if (status != EFI_SUCCESS) {
+    return status;
+  }
+
+  ImageContext context;
+  context.handle = ImageHandle;
+  context.exit_data_size = 0;
+  context.exit_data = nullptr;
+  context.previous = current_image;
+  asm volatile (
+      "movdqa %%xmm6, 0x00(%0);"
+      "movdqa %%xmm7, 0x10(%0);"
+      "movdqa %%xmm8, 0x20(%0);"
+      "movdqa %%xmm9, 0x30(%0);"
+      "movdqa %%xmm10, 0x40(%0);"
+      "movdqa %%xmm11, 0x50(%0);"
+      "movdqa %%xmm12, 0x60(%0);"
+      "movdqa %%xmm13, 0x70(%0);"
+      "movdqa %%xmm14, 0x80(%0);"
+      "movdqa %%xmm15, 0x90(%0);"
+    :
+    : "r" (context.xmm)
+    : "memory"
+  );
+  current_image = &context;
+  if (__builtin_setjmp(context.jump_buffer) == 0) {
+    context.status = entry_point(ImageHandle, system_table);
+  } else {
+    asm volatile (
+        "movdqa 0x00(%0), %%xmm6;"
+        "movdqa 0x10(%0), %%xmm7;"
+        "movdqa 0x20(%0), %%xmm8;"
+        "movdqa 0x30(%0), %%xmm9;"
+        "movdqa 0x40(%0), %%xmm10;"
+        "movdqa 0x50(%0), %%xmm11;"
+        "movdqa 0x60(%0), %%xmm12;"
+        "movdqa 0x70(%0), %%xmm13;"
+        "movdqa 0x80(%0), %%xmm14;"
+        "movdqa 0x90(%0), %%xmm15;"
+      :
+      : "r" (context.xmm)
+      : "memory"
+    );
+  }
+  current_image = context.previous;
+
+  uiuapifn<UIUAPITag::ImageReturned>()(ImageHandle, context.status);
+  flush_tlb();
+  if (ExitDataSize != nullptr) {
+    *ExitDataSize = context.exit_data_size;
+  }
+  if (ExitData != nullptr) {
+    *ExitData = context.exit_data;
+  } else if (context.exit_data != nullptr) {
+    uiuapifn<UIUAPITag::FreePool>()(context.exit_data);
+  }
+  return context.status;
+}
+
+// Exit from the application uiu started ends the run.
+EFIAPI EFI_STATUS exit_image(EFI_HANDLE ImageHandle, EFI_STATUS ExitStatus, UINTN ExitDataSize, CHAR16* ExitData) {
+  if (current_image == nullptr) {
+    return uiuapifn<UIUAPITag::Exit>()(ExitStatus);
+  }
+  if (ImageHandle != current_image->handle) {
+    return EFI_INVALID_PARAMETER;
+  }
+  current_image->status = ExitStatus;
+  current_image->exit_data_size = ExitDataSize;
+  current_image->exit_data = ExitData;
+  __builtin_longjmp(current_image->jump_buffer, 1);
+}
+
+EFIAPI EFI_STATUS unload_image(EFI_HANDLE ImageHandle) {
+  auto status = uiuapifn<UIUAPITag::UnloadImage>()(ImageHandle, FALSE);
+  if (status != EFI_NOT_READY) {
+    flush_tlb();
+    return status;
+  }
+  EFI_GUID loaded_image_guid = EFI_LOADED_IMAGE_PROTOCOL_GUID;
+  EFI_LOADED_IMAGE* loaded_image;
+  status = uiuapifn<UIUAPITag::HandleProtocol>()(ImageHandle, &loaded_image_guid, (void**)&loaded_image);
+  if (status != EFI_SUCCESS) {
+    return status;
+  }
+  status = loaded_image->Unload(ImageHandle);
+  if (status != EFI_SUCCESS) {
+    return status;
+  }
+  status = uiuapifn<UIUAPITag::UnloadImage>()(ImageHandle, TRUE);
+  flush_tlb();
+  return status;
+}
+
+EFIAPI EFI_STATUS set_memory_attributes(UIUMemoryAttributeProtocol* This, EFI_PHYSICAL_ADDRESS BaseAddress, UINT64 Length, UINT64 Attributes) {
+  auto status = uiuapifn<UIUAPITag::SetMemoryAttributes>()(This, BaseAddress, Length, Attributes);
+  flush_tlb();
+  return status;
+}
+
+EFIAPI EFI_STATUS clear_memory_attributes(UIUMemoryAttributeProtocol* This, EFI_PHYSICAL_ADDRESS BaseAddress, UINT64 Length, UINT64 Attributes) {
+  auto status = uiuapifn<UIUAPITag::ClearMemoryAttributes>()(This, BaseAddress, Length, Attributes);
+  flush_tlb();
+  return status;
+}
+
 extern "C" [[noreturn]] EFIAPI void _start(EFI_STATUS (EFIAPI *efi_main)(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable)) {
+  // The vCPU may have run an earlier application with other page tables
+  flush_tlb();
+  enable_timer_interrupts();
+
   wchar_t vendor[] = L"UIU";
 
   SIMPLE_TEXT_OUTPUT_MODE out_mode = {};
@@ -56,8 +898,8 @@ extern "C" [[noreturn]] EFIAPI void _start(EFI_STATUS (EFIAPI *efi_main)(EFI_HAN
       .CRC32 = 0xbebebebe,  // TODO calculate this
     },
 
-    .RaiseTPL = EFI_RAISE_TPL(&trap),
-    .RestoreTPL = EFI_RESTORE_TPL(&trap),
+    .RaiseTPL = &raise_tpl,
+    .RestoreTPL = &restore_tpl,
 
     .AllocatePages = EFI_ALLOCATE_PAGES(&trap),
     .FreePages = EFI_FREE_PAGES(&trap),
@@ -65,12 +907,12 @@ extern "C" [[noreturn]] EFIAPI void _start(EFI_STATUS (EFIAPI *efi_main)(EFI_HAN
     .AllocatePool = uiuapifn<UIUAPITag::AllocatePool>(),  // 0x40
     .FreePool = uiuapifn<UIUAPITag::FreePool>(),  // 0x48
 
-    .CreateEvent = EFI_CREATE_EVENT(&trap),
-    .SetTimer = EFI_SET_TIMER(&trap),
-    .WaitForEvent = EFI_WAIT_FOR_EVENT(&trap),
-    .SignalEvent = EFI_SIGNAL_EVENT(&trap),
-    .CloseEvent = EFI_CLOSE_EVENT(&trap),
-    .CheckEvent = EFI_CHECK_EVENT(&trap),
+    .CreateEvent = uiuapifn<UIUAPITag::CreateEvent>(),
+    .SetTimer = &set_timer,
+    .WaitForEvent = &wait_for_event,
+    .SignalEvent = uiuapifn<UIUAPITag::SignalEvent>(),
+    .CloseEvent = uiuapifn<UIUAPITag::CloseEvent>(),
+    .CheckEvent = uiuapifn<UIUAPITag::CheckEvent>(),
 
     .InstallProtocolInterface = uiuapifn<UIUAPITag::InstallProtocolInterface>(),
     .ReinstallProtocolInterface = EFI_REINSTALL_PROTOCOL_INTERFACE(&trap),
@@ -81,15 +923,15 @@ extern "C" [[noreturn]] EFIAPI void _start(EFI_STATUS (EFIAPI *efi_main)(EFI_HAN
     .LocateDevicePath = EFI_LOCATE_DEVICE_PATH(&trap),
     .InstallConfigurationTable = EFI_INSTALL_CONFIGURATION_TABLE(&trap),
 
-    .LoadImage = EFI_IMAGE_LOAD(&trap),
-    .StartImage = EFI_IMAGE_START(&trap),
-    .Exit = EFI_EXIT(&trap),
-    .UnloadImage = EFI_IMAGE_UNLOAD(&trap),
+    .LoadImage = &load_image,
+    .StartImage = &start_image,
+    .Exit = &exit_image,
+    .UnloadImage = &unload_image,
     .ExitBootServices = EFI_EXIT_BOOT_SERVICES(&trap),
 
-    .GetNextMonotonicCount = EFI_GET_NEXT_MONOTONIC_COUNT(&trap),
-    .Stall = EFI_STALL(&trap),
-    .SetWatchdogTimer = EFI_SET_WATCHDOG_TIMER(&trap),
+    .GetNextMonotonicCount = &get_next_monotonic_count,
+    .Stall = uiuapifn<UIUAPITag::Stall>(),
+    .SetWatchdogTimer = uiuapifn<UIUAPITag::SetWatchdogTimer>(),
 
     .ConnectController = EFI_CONNECT_CONTROLLER(&trap),
     .DisconnectController = EFI_DISCONNECT_CONTROLLER(&trap),
@@ -108,7 +950,7 @@ extern "C" [[noreturn]] EFIAPI void _start(EFI_STATUS (EFIAPI *efi_main)(EFI_HAN
 
     .CopyMem = EFI_COPY_MEM(&trap),
     .SetMem = EFI_SET_MEM(&trap),
-    .CreateEventEx = EFI_CREATE_EVENT_EX(&trap),
+    .CreateEventEx = uiuapifn<UIUAPITag::CreateEventEx>(),
   };
 
   EFI_RUNTIME_SERVICES rs = {
@@ -118,7 +960,7 @@ extern "C" [[noreturn]] EFIAPI void _start(EFI_STATUS (EFIAPI *efi_main)(EFI_HAN
       .HeaderSize = sizeof(EFI_RUNTIME_SERVICES),
       .CRC32 = 0x23456789,  // TODO calculate this
     },
-    .GetTime = EFI_GET_TIME(&trap),
+    .GetTime = &get_time,
     .SetTime = EFI_SET_TIME(&trap),
     .GetWakeupTime = EFI_GET_WAKEUP_TIME(&trap),
     .SetWakeupTime = EFI_SET_WAKEUP_TIME(&trap),
@@ -130,7 +972,7 @@ extern "C" [[noreturn]] EFIAPI void _start(EFI_STATUS (EFIAPI *efi_main)(EFI_HAN
     .GetNextVariableName = EFI_GET_NEXT_VARIABLE_NAME(&trap),
     .SetVariable = uiuapifn<UIUAPITag::SetVariable>(),
 
-    .GetNextHighMonotonicCount = EFI_GET_NEXT_HIGH_MONO_COUNT(&trap),
+    .GetNextHighMonotonicCount = &get_next_high_monotonic_count,
     .ResetSystem = EFI_RESET_SYSTEM(&trap),
 
     .UpdateCapsule = EFI_UPDATE_CAPSULE(&trap),
@@ -159,10 +1001,11 @@ extern "C" [[noreturn]] EFIAPI void _start(EFI_STATUS (EFIAPI *efi_main)(EFI_HAN
     .NumberOfTableEntries = 0,
     .ConfigurationTable = 0,
   };
+  system_table = &st;
 
   EFI_RNG_PROTOCOL rng_proto = {
-    .GetInfo = EFI_RNG_GET_INFO(&trap),
-    .GetRNG = uiuapifn<UIUAPITag::GetRNG>(),
+    .GetInfo = &get_rng_info,
+    .GetRNG = &get_rng,
   };
 
   EFI_HANDLE handle = nullptr;
@@ -170,5 +1013,17 @@ extern "C" [[noreturn]] EFIAPI void _start(EFI_STATUS (EFIAPI *efi_main)(EFI_HAN
   EFI_GUID rng_guid = EFI_RNG_PROTOCOL_GUID;
   uiuapifn<UIUAPITag::InstallProtocolInterface>()(&handle, &rng_guid, EFI_NATIVE_INTERFACE, (void*)&rng_proto);
 
+  UIUMemoryAttributeProtocol memory_attribute_proto = {
+    .GetMemoryAttributes = uiuapifn<UIUAPITag::GetMemoryAttributes>(),
+    .SetMemoryAttributes = &set_memory_attributes,
+    .ClearMemoryAttributes = &clear_memory_attributes,
+  };
+  EFI_GUID memory_attribute_guid = UIU_MEMORY_ATTRIBUTE_PROTOCOL_GUID;
+  uiuapifn<UIUAPITag::InstallProtocolInterface>()(&handle, &memory_attribute_guid, EFI_NATIVE_INTERFACE, (void*)&memory_attribute_proto);
+
+  install_block_devices();
+  install_file_systems();
+  install_graphics_output();
+
   uiuapifn<UIUAPITag::Exit>()(efi_main(handle, &st));
 }
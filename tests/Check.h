@@ -0,0 +1,16 @@
+#pragma once
+
+#include <cstdlib>
+#include <fmt/format.h>
+#include <source_location>
+#include <string_view>
+
+// Ends the test with the condition that does not hold and where it is
+inline void check(bool condition, std::string_view what, std::source_location location = std::source_location::current()) {
+  if (!condition) {
+    fmt::println("{}:{}: check failed: {}", location.file_name(), location.line(), what);
+    std::exit(EXIT_FAILURE);
+  }
+}
+
+#define CHECK(condition) check((condition), #condition)
@@ -0,0 +1,117 @@
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <fcntl.h>
+#include <unistd.h>
+}
+
+#include "Check.h"
+#include "CowOverlay.h"
+
+struct Run {
+  int fd;
+  std::uint64_t offset;
+  std::uint64_t length;
+};
+
+static std::vector<Run> map(CowOverlay& overlay, std::uint64_t offset, std::uint64_t length, bool write) {
+  std::vector<Run> runs;
+  bool mapped = overlay.map(offset, length, write, [&](int fd, std::uint64_t offset, std::uint64_t length) {
+    runs.push_back({fd, offset, length});
+  });
+  CHECK(mapped);
+  return runs;
+}
+
+static std::byte read_byte(const Run& run, std::uint64_t offset = 0) {
+  std::byte value{};
+  CHECK(pread(run.fd, &value, 1, run.offset + offset) == 1);
+  return value;
+}
+
+int main() {
+  constexpr std::uint64_t cluster_size = CowOverlay::default_cluster_size;
+  constexpr std::uint64_t base_size = 16 * cluster_size;
+  auto directory = std::filesystem::temp_directory_path();
+  auto suffix = std::to_string(getpid());
+  auto base_path = (directory / ("uiu-cow-test-base-" + suffix)).string();
+  auto overlay_path = (directory / ("uiu-cow-test-overlay-" + suffix)).string();
+
+  int base = open(base_path.c_str(), O_RDWR|O_CREAT|O_TRUNC|O_CLOEXEC, 0644);
+  CHECK(base != -1);
+  std::vector<std::byte> contents(base_size, std::byte{0xab});
+  CHECK(pwrite(base, contents.data(), contents.size(), 0) == static_cast<ssize_t>(contents.size()));
+
+  std::uint64_t slot_1;  // where the first cluster in the overlay is
+  {
+    CowOverlay overlay(base_path, overlay_path);
+    CHECK(overlay.size() == base_size);
+
+    // Reads of untouched clusters go to the base, in one run
+    auto runs = map(overlay, 0, base_size, false);
+    CHECK(runs.size() == 1);
+    CHECK(runs[0].fd != overlay.get_overlay_fd() && runs[0].offset == 0 && runs[0].length == base_size);
+
+    // A partial write copies the rest of the cluster from the base
+    runs = map(overlay, cluster_size + 100, 10, true);
+    CHECK(runs.size() == 1);
+    CHECK(runs[0].fd == overlay.get_overlay_fd() && runs[0].length == 10);
+    slot_1 = runs[0].offset - 100;
+    CHECK(read_byte({runs[0].fd, slot_1, cluster_size}) == std::byte{0xab});
+    CHECK(read_byte({runs[0].fd, slot_1, cluster_size}, cluster_size - 1) == std::byte{0xab});
+
+    // The cached run of the base was split by the write
+    runs = map(overlay, 0, base_size, false);
+    CHECK(runs.size() == 3);
+    CHECK(runs[0].offset == 0 && runs[0].length == cluster_size);
+    CHECK(runs[1].fd == overlay.get_overlay_fd() && runs[1].offset == slot_1 && runs[1].length == cluster_size);
+    CHECK(runs[2].offset == 2 * cluster_size && runs[2].length == base_size - 2 * cluster_size);
+
+    // Clusters in consecutive slots are one run, whole writes copy nothing
+    map(overlay, 2 * cluster_size, 2 * cluster_size, true);
+    runs = map(overlay, cluster_size, 3 * cluster_size, false);
+    CHECK(runs.size() == 1);
+    CHECK(runs[0].offset == slot_1 && runs[0].length == 3 * cluster_size);
+
+    // Clusters in slots out of order are not
+    map(overlay, 6 * cluster_size, cluster_size, true);
+    map(overlay, 5 * cluster_size, cluster_size, true);
+    runs = map(overlay, 5 * cluster_size, 2 * cluster_size, false);
+    CHECK(runs.size() == 2);
+    CHECK(runs[0].offset == slot_1 + 4 * cluster_size && runs[1].offset == slot_1 + 3 * cluster_size);
+
+    // A copy that fails leaves the slot for the next cluster
+    CHECK(ftruncate(base, 0) == 0);
+    CHECK(!overlay.map(8 * cluster_size, 1, true, [](int, std::uint64_t, std::uint64_t) {}));
+    CHECK(pwrite(base, contents.data(), contents.size(), 0) == static_cast<ssize_t>(contents.size()));
+    runs = map(overlay, 8 * cluster_size, 1, true);
+    CHECK(runs.size() == 1 && runs[0].offset == slot_1 + 5 * cluster_size);
+  }
+
+  // The overlay keeps its clusters when it is opened again
+  {
+    CowOverlay overlay(base_path, overlay_path);
+    auto runs = map(overlay, cluster_size, cluster_size, false);
+    CHECK(runs.size() == 1 && runs[0].fd == overlay.get_overlay_fd() && runs[0].offset == slot_1);
+    runs = map(overlay, 9 * cluster_size, 1, true);
+    CHECK(runs.size() == 1 && runs[0].offset == slot_1 + 6 * cluster_size);
+  }
+
+  // Overlays of another base are refused
+  CHECK(ftruncate(base, base_size / 2) == 0);
+  bool refused = false;
+  try {
+    CowOverlay overlay(base_path, overlay_path);
+  } catch (const std::runtime_error&) {
+    refused = true;
+  }
+  CHECK(refused);
+
+  close(base);
+  std::filesystem::remove(base_path);
+  std::filesystem::remove(overlay_path);
+}
@@ -0,0 +1,77 @@
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+
+#include "Check.h"
+#include "KVM.h"
+#include "MockBackend.h"
+#include "UIU.h"
+
+constexpr std::uint64_t arguments = 0x1000'0000;
+constexpr std::uint64_t result = 0x1000'1000;
+
+static EFI_STATUS hypercall(UIU& uiu, UIUAPITag tag, std::initializer_list<std::uint64_t> args) {
+  std::memcpy(uiu.machine.memory.data() + arguments, std::data(args), args.size() * sizeof(std::uint64_t));
+  return uiu.hypercall(tag, arguments);
+}
+
+static std::uint64_t allocate(UIU& uiu, std::uint64_t size) {
+  CHECK(hypercall(uiu, UIUAPITag::AllocatePool, {EfiLoaderData, size, result}) == EFI_SUCCESS);
+  return *uiu.machine.create_ptr<std::uint64_t>(result);
+}
+
+int main() {
+  MockBackend backend;
+  KVM kvm{backend};
+  UIU uiu(kvm);
+  auto& sanitizer = uiu.attach_heap_sanitizer({.redzone = 16, .quarantine = 256});
+  auto* memory = uiu.machine.memory.data();
+  using enum UIUAPITag;
+
+  // Allocations used within their bounds are not reported
+  auto address = allocate(uiu, 100);
+  std::memset(memory + address, 1, 100);
+  CHECK(hypercall(uiu, FreePool, {address}) == EFI_SUCCESS);
+  CHECK(sanitizer.errors == 0);
+
+  // A write past the end is found by FreePool, which keeps the memory
+  address = allocate(uiu, 100);
+  memory[address + 100] = std::byte{1};
+  CHECK(hypercall(uiu, FreePool, {address}) == EFI_INVALID_PARAMETER);
+  CHECK(sanitizer.errors == 1);
+
+  // So is a write before the start
+  address = allocate(uiu, 24);
+  memory[address - 1] = std::byte{1};
+  CHECK(hypercall(uiu, FreePool, {address}) == EFI_INVALID_PARAMETER);
+  CHECK(sanitizer.errors == 2);
+
+  // Freeing twice, or what was not allocated
+  address = allocate(uiu, 32);
+  CHECK(hypercall(uiu, FreePool, {address}) == EFI_SUCCESS);
+  CHECK(hypercall(uiu, FreePool, {address}) == EFI_INVALID_PARAMETER);
+  CHECK(sanitizer.errors == 3);
+  CHECK(hypercall(uiu, FreePool, {address + 8}) == EFI_INVALID_PARAMETER);
+  CHECK(sanitizer.errors == 4);
+  CHECK(hypercall(uiu, FreePool, {0x1000}) == EFI_INVALID_PARAMETER);
+  CHECK(sanitizer.errors == 5);
+
+  // A write after free is found when the allocation leaves the quarantine
+  address = allocate(uiu, 64);
+  CHECK(hypercall(uiu, FreePool, {address}) == EFI_SUCCESS);
+  memory[address + 8] = std::byte{1};
+  CHECK(sanitizer.errors == 5);
+  for (int i = 0; i < 4; i++) {
+    CHECK(hypercall(uiu, FreePool, {allocate(uiu, 64)}) == EFI_SUCCESS);
+  }
+  CHECK(sanitizer.errors == 6);
+
+  // The check at exit finds the writes that no FreePool saw
+  address = allocate(uiu, 16);
+  memory[address + 16] = std::byte{1};
+  sanitizer.check();
+  CHECK(sanitizer.errors == 6);  // runs stop at their first error
+  sanitizer.errors = 0;
+  sanitizer.check();
+  CHECK(sanitizer.errors != 0);
+}
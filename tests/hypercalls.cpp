@@ -0,0 +1,77 @@
+#include <cstdint>
+#include <cstring>
+#include <initializer_list>
+
+#include "Check.h"
+#include "KVM.h"
+#include "MockBackend.h"
+#include "UIU.h"
+
+// Guest memory for the arguments of hypercalls and what they point to
+constexpr std::uint64_t arguments = 0x1000'0000;
+constexpr std::uint64_t scratch = 0x1000'1000;
+
+static EFI_STATUS hypercall(UIU& uiu, UIUAPITag tag, std::initializer_list<std::uint64_t> args) {
+  std::memcpy(uiu.machine.memory.data() + arguments, std::data(args), args.size() * sizeof(std::uint64_t));
+  return uiu.hypercall(tag, arguments);
+}
+
+template <typename T>
+static T& at(UIU& uiu, std::uint64_t address) {
+  return *uiu.machine.create_ptr<T>(address);
+}
+
+int main() {
+  MockBackend backend;
+  KVM kvm{backend};
+  UIU uiu(kvm);
+  using enum UIUAPITag;
+
+  // AllocatePool hands out guest addresses, until the pool is used up
+  auto& buffer = at<std::uint64_t>(uiu, scratch);
+  CHECK(hypercall(uiu, AllocatePool, {EfiLoaderData, 100, scratch}) == EFI_SUCCESS);
+  auto first = buffer;
+  CHECK(first >= 0x2000'0000 && first + 100 <= 0x3000'0000 && first % 8 == 0);
+  CHECK(hypercall(uiu, AllocatePool, {EfiLoaderData, 100, scratch}) == EFI_SUCCESS);
+  CHECK(buffer >= first + 100 || buffer + 100 <= first);
+  CHECK(hypercall(uiu, FreePool, {first}) == EFI_SUCCESS);
+  CHECK(hypercall(uiu, AllocatePool, {EfiLoaderData, 0x4000'0000, scratch}) == EFI_OUT_OF_RESOURCES);
+  // Guest pointers outside of memory fault instead of taking down uiu
+  CHECK(hypercall(uiu, AllocatePool, {EfiLoaderData, 100, 0x8000'0000}) == EFI_INVALID_PARAMETER);
+
+  // LocateHandleBuffer finds the handles of a protocol, in pool memory
+  EFI_GUID protocol = {0x12345678, 0x1234, 0x5678, {1, 2, 3, 4, 5, 6, 7, 8}};
+  at<EFI_GUID>(uiu, scratch + 0x10) = protocol;
+  std::uint64_t handles[2];
+  for (auto& handle : handles) {
+    at<std::uint64_t>(uiu, scratch + 0x20) = 0;
+    CHECK(hypercall(uiu, InstallProtocolInterface, {scratch + 0x20, scratch + 0x10, EFI_NATIVE_INTERFACE, 0x1234}) == EFI_SUCCESS);
+    handle = at<std::uint64_t>(uiu, scratch + 0x20);
+  }
+  auto& count = at<UINTN>(uiu, scratch + 0x28);
+  CHECK(hypercall(uiu, LocateHandleBuffer, {ByProtocol, scratch + 0x10, 0, scratch + 0x28, scratch}) == EFI_SUCCESS);
+  CHECK(count == 2);
+  auto* found = &at<std::uint64_t>(uiu, buffer);
+  CHECK((found[0] == handles[0] && found[1] == handles[1]) || (found[0] == handles[1] && found[1] == handles[0]));
+  at<EFI_GUID>(uiu, scratch + 0x10).Data1++;
+  CHECK(hypercall(uiu, LocateHandleBuffer, {ByProtocol, scratch + 0x10, 0, scratch + 0x28, scratch}) == EFI_NOT_FOUND);
+  CHECK(count == 0);
+  CHECK(hypercall(uiu, LocateHandleBuffer, {ByProtocol, 0, 0, scratch + 0x28, scratch}) == EFI_INVALID_PARAMETER);
+
+  // GetVariable returns what SetVariable stored
+  auto* name = &at<char16_t>(uiu, scratch + 0x100);
+  std::memcpy(name, u"Test", sizeof(u"Test"));
+  at<EFI_GUID>(uiu, scratch + 0x10) = protocol;
+  std::memcpy(&at<char>(uiu, scratch + 0x200), "value", 5);
+  CHECK(hypercall(uiu, SetVariable, {scratch + 0x100, scratch + 0x10, 0, 5, scratch + 0x200}) == EFI_SUCCESS);
+  auto& size = at<UINTN>(uiu, scratch + 0x28);
+  size = 4;
+  CHECK(hypercall(uiu, GetVariable, {scratch + 0x100, scratch + 0x10, 0, scratch + 0x28, scratch + 0x300}) == EFI_BUFFER_TOO_SMALL);
+  size = 16;
+  CHECK(hypercall(uiu, GetVariable, {scratch + 0x100, scratch + 0x10, 0, scratch + 0x28, scratch + 0x300}) == EFI_SUCCESS);
+  CHECK(std::memcmp(&at<char>(uiu, scratch + 0x300), "value", 5) == 0);
+  CHECK(hypercall(uiu, GetVariable, {scratch + 0x100, scratch + 0x10, 0, scratch + 0x28, 0}) == EFI_INVALID_PARAMETER);
+  name[0] = u'B';
+  CHECK(hypercall(uiu, GetVariable, {scratch + 0x100, scratch + 0x10, 0, scratch + 0x28, scratch + 0x300}) == EFI_NOT_FOUND);
+  CHECK(hypercall(uiu, GetVariable, {0, scratch + 0x10, 0, scratch + 0x28, scratch + 0x300}) == EFI_INVALID_PARAMETER);
+}
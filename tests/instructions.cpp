@@ -0,0 +1,55 @@
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <optional>
+#include <vector>
+
+#include "Check.h"
+#include "Instructions.h"
+
+static std::optional<Instruction> decode(std::initializer_list<std::uint8_t> bytes, std::uint64_t address = 0x1000) {
+  std::vector<std::byte> code;
+  for (auto b : bytes) {
+    code.push_back(std::byte{b});
+  }
+  return Instruction::decode(code, address);
+}
+
+static bool is(std::optional<Instruction> instruction, std::size_t length, Instruction::Flow flow) {
+  return instruction && instruction->length == length && instruction->flow == flow;
+}
+
+int main() {
+  using enum Instruction::Flow;
+
+  CHECK(is(decode({0x90}), 1, next));  // nop
+  CHECK(is(decode({0xc3}), 1, stop));  // ret
+  CHECK(is(decode({0xcc}), 1, stop));  // int3
+  CHECK(is(decode({0x0f, 0x0b}), 2, stop));  // ud2
+  CHECK(is(decode({0x48, 0x89, 0xe5}), 3, next));  // mov %rsp, %rbp
+  CHECK(is(decode({0x48, 0x83, 0xec, 0x28}), 4, next));  // sub $0x28, %rsp
+  CHECK(is(decode({0x48, 0x8b, 0x05, 0, 0, 0, 0}), 7, next));  // mov 0(%rip), %rax
+  CHECK(is(decode({0x48, 0x8b, 0x44, 0x24, 0x08}), 5, next));  // mov 8(%rsp), %rax
+  CHECK(is(decode({0xb8, 1, 0, 0, 0}), 5, next));  // mov $1, %eax
+  CHECK(is(decode({0x48, 0xb8, 1, 0, 0, 0, 0, 0, 0, 0}), 10, next));  // movabs $1, %rax
+  CHECK(is(decode({0x66, 0xb8, 1, 0}), 4, next));  // mov $1, %ax
+  CHECK(is(decode({0x66, 0xe7, 0xff}), 3, next));  // out %ax, $0xff
+  CHECK(is(decode({0xc5, 0xf8, 0x77}), 3, next));  // vzeroupper
+  CHECK(is(decode({0xff, 0xe0}), 2, stop));  // jmp *%rax
+
+  auto instruction = decode({0xeb, 0xfe});  // jmp .
+  CHECK(is(instruction, 2, jump));
+  CHECK(instruction->target == 0x1000);
+  instruction = decode({0x0f, 0x84, 0x10, 0, 0, 0});  // je .+0x16
+  CHECK(is(instruction, 6, branch));
+  CHECK(instruction->target == 0x1016);
+  instruction = decode({0xe8, 0xfb, 0xff, 0xff, 0xff});  // call .
+  CHECK(is(instruction, 5, call));
+  CHECK(instruction->target == 0x1000);
+
+  // Cut off, longer than 15 bytes, or invalid in 64-bit mode
+  CHECK(!decode({0x48, 0xb8, 1, 0}));
+  CHECK(!decode({}));
+  CHECK(!decode({0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x90}));
+  CHECK(!decode({0x06}));  // push %es
+}
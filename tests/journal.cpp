@@ -0,0 +1,82 @@
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <unistd.h>
+}
+
+#include "Check.h"
+#include "Journal.h"
+
+int main() {
+  auto path = (std::filesystem::temp_directory_path() / ("uiu-journal-test-" + std::to_string(getpid()))).string();
+
+  {
+    auto journal = Journal::record(path);
+    CHECK(!journal.replaying());
+    journal.expect(Journal::Kind::executable, std::uint64_t{0x1234});
+    std::uint64_t entropy = 0xdead'beef;
+    journal.exchange(Journal::Kind::entropy, entropy);
+    std::vector<std::uint32_t> expired(100, 7);  // more than 127 bytes, two bytes of size
+    journal.exchange(Journal::Kind::events, expired);
+    std::vector<std::uint32_t> none;
+    journal.exchange(Journal::Kind::events, none);
+    CHECK(journal.entries == 4);
+  }
+
+  {
+    auto journal = Journal::replay(path);
+    CHECK(journal.replaying());
+    journal.expect(Journal::Kind::executable, std::uint64_t{0x1234});
+    std::uint64_t entropy = 0;
+    journal.exchange(Journal::Kind::entropy, entropy);
+    CHECK(entropy == 0xdead'beef);
+    std::vector<std::uint32_t> expired;
+    journal.exchange(Journal::Kind::events, expired);
+    CHECK(expired == std::vector<std::uint32_t>(100, 7));
+    std::vector<std::uint32_t> none{1};
+    journal.exchange(Journal::Kind::events, none);
+    CHECK(none.empty());
+    CHECK(journal.finished());
+  }
+
+  // A replay that takes another path stops at the entry where it did
+  auto diverges = [&](auto&& replay) {
+    auto journal = Journal::replay(path);
+    try {
+      replay(journal);
+    } catch (const std::runtime_error& e) {
+      return std::string(e.what()).find("replay diverged at entry") != std::string::npos;
+    }
+    return false;
+  };
+  CHECK(diverges([](Journal& journal) { journal.expect(Journal::Kind::executable, std::uint64_t{0x4321}); }));
+  CHECK(diverges([](Journal& journal) { journal.expect(Journal::Kind::call, std::uint64_t{0x1234}); }));
+  CHECK(diverges([](Journal& journal) {
+    journal.expect(Journal::Kind::executable, std::uint64_t{0x1234});
+    std::uint32_t entropy;
+    journal.exchange(Journal::Kind::entropy, entropy);
+  }));
+
+  std::filesystem::resize_file(path, std::filesystem::file_size(path) - 1);
+  bool truncated = false;
+  try {
+    auto journal = Journal::replay(path);
+    journal.expect(Journal::Kind::executable, std::uint64_t{0x1234});
+    std::uint64_t entropy;
+    journal.exchange(Journal::Kind::entropy, entropy);
+    std::vector<std::uint32_t> expired;
+    journal.exchange(Journal::Kind::events, expired);
+    std::vector<std::uint32_t> none;
+    journal.exchange(Journal::Kind::events, none);
+  } catch (const std::runtime_error&) {
+    truncated = true;
+  }
+  CHECK(truncated);
+
+  std::filesystem::remove(path);
+}
@@ -0,0 +1,33 @@
+#include <cstdint>
+#include <vector>
+
+#include "Check.h"
+#include "Options.h"
+
+int main() {
+  CHECK(parse_number<std::uint32_t>("42") == 42u);
+  CHECK(parse_number<std::uint32_t>("0x2a") == 42u);
+  CHECK(parse_number<std::uint32_t>("0X2A") == 42u);
+  CHECK(parse_number<std::uint64_t>("0xffffffffffffffff") == UINT64_MAX);
+  CHECK(parse_number<double>("0.5") == 0.5);
+
+  // Whole values only, in range
+  CHECK(!parse_number<std::uint32_t>(""));
+  CHECK(!parse_number<std::uint32_t>("0x"));
+  CHECK(!parse_number<std::uint32_t>("42s"));
+  CHECK(!parse_number<std::uint32_t>(" 42"));
+  CHECK(!parse_number<std::uint32_t>("-1"));
+  CHECK(!parse_number<std::uint32_t>("4294967296"));
+  CHECK(!parse_number<double>("1e"));
+
+  CHECK(parse_cpu_list("3") == std::vector{3});
+  CHECK(parse_cpu_list("0-3,8") == (std::vector{0, 1, 2, 3, 8}));
+  CHECK(parse_cpu_list("2,1") == (std::vector{2, 1}));
+
+  CHECK(!parse_cpu_list(""));
+  CHECK(!parse_cpu_list("1,"));
+  CHECK(!parse_cpu_list("3-1"));
+  CHECK(!parse_cpu_list("1-"));
+  CHECK(!parse_cpu_list("a"));
+  CHECK(!parse_cpu_list("0x1"));
+}
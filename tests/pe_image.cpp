@@ -0,0 +1,132 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+#include <vector>
+
+#include "Check.h"
+#include "Image.h"
+
+// An EFI application with a page of headers and a page of code
+struct TestImage {
+  static constexpr std::uint32_t lfanew = 0x40;
+  static constexpr std::uint32_t section_table = lfanew + sizeof(IMAGE_NT_HEADERS);
+
+  TestImage() {
+    dos.e_magic = IMAGE_DOS_SIGNATURE;
+    dos.e_lfanew = lfanew;
+    nt.Signature = IMAGE_NT_SIGNATURE;
+    nt.FileHeader.Machine = IMAGE_FILE_MACHINE_AMD64;
+    nt.FileHeader.NumberOfSections = 1;
+    nt.FileHeader.SizeOfOptionalHeader = sizeof(IMAGE_OPTIONAL_HEADER);
+    nt.OptionalHeader.Magic = 0x20b;
+    nt.OptionalHeader.AddressOfEntryPoint = 0x1000;
+    nt.OptionalHeader.SectionAlignment = 0x1000;
+    nt.OptionalHeader.FileAlignment = 0x200;
+    nt.OptionalHeader.SizeOfImage = 0x2000;
+    nt.OptionalHeader.SizeOfHeaders = 0x200;
+    nt.OptionalHeader.Subsystem = IMAGE_SUBSYSTEM_EFI_APPLICATION;
+    nt.OptionalHeader.NumberOfRvaAndSizes = IMAGE_NUMBEROF_DIRECTORY_ENTRIES;
+    std::memcpy(text.Name, ".text", 5);
+    text.Misc.VirtualSize = 0x200;
+    text.VirtualAddress = 0x1000;
+    text.SizeOfRawData = 0x200;
+    text.PointerToRawData = 0x200;
+    text.Characteristics = IMAGE_SCN_CNT_CODE|IMAGE_SCN_MEM_EXECUTE|IMAGE_SCN_MEM_READ;
+  }
+
+  EFI_STATUS parse(PEImage& image, std::size_t file_size = 0x400) const {
+    std::vector<std::byte> file(file_size);
+    std::vector<std::byte> contents(0x400);
+    std::memcpy(contents.data(), &dos, sizeof(dos));
+    std::memcpy(contents.data() + lfanew, &nt, sizeof(nt));
+    std::memcpy(contents.data() + section_table, &text, sizeof(text));
+    contents[0x200] = std::byte{0xc3};  // ret
+    std::memcpy(file.data(), contents.data(), std::min(file.size(), contents.size()));
+    return PEImage::parse(file, image);
+  }
+
+  EFI_STATUS parse(std::size_t file_size = 0x400) const {
+    PEImage image;
+    return parse(image, file_size);
+  }
+
+  IMAGE_DOS_HEADER dos{};
+  IMAGE_NT_HEADERS nt{};
+  IMAGE_SECTION_HEADER text{};
+};
+
+int main() {
+  {
+    PEImage image;
+    CHECK(TestImage{}.parse(image) == EFI_SUCCESS);
+    CHECK(image.size == 0x2000);
+    CHECK(image.entry_point == 0x1000);
+    CHECK(image.contents.size() == 0x2000);
+    CHECK(image.contents[0x1000] == std::byte{0xc3});
+    CHECK(image.shared[1]);
+  }
+
+  // Files cut off in the DOS header, the PE header and the section table
+  CHECK(TestImage{}.parse(sizeof(IMAGE_DOS_HEADER) - 1) == EFI_LOAD_ERROR);
+  CHECK(TestImage{}.parse(TestImage::lfanew + 8) == EFI_LOAD_ERROR);
+  CHECK(TestImage{}.parse(TestImage::section_table + 8) == EFI_LOAD_ERROR);
+
+  TestImage image;
+  image.dos.e_magic = 0;
+  CHECK(image.parse() == EFI_LOAD_ERROR);
+
+  image = {};
+  image.dos.e_lfanew = 0x10000;
+  CHECK(image.parse() == EFI_LOAD_ERROR);
+
+  image = {};
+  image.nt.OptionalHeader.Magic = 0x10b;  // PE32
+  CHECK(image.parse() == EFI_LOAD_ERROR);
+
+  image = {};
+  image.nt.FileHeader.Machine = IMAGE_FILE_MACHINE_I386;
+  CHECK(image.parse() == EFI_UNSUPPORTED);
+
+  image = {};
+  image.nt.OptionalHeader.Subsystem = IMAGE_SUBSYSTEM_WINDOWS_CUI;
+  CHECK(image.parse() == EFI_UNSUPPORTED);
+
+  image = {};
+  image.nt.FileHeader.SizeOfOptionalHeader = 0x10;
+  CHECK(image.parse() == EFI_LOAD_ERROR);
+
+  image = {};
+  image.nt.FileHeader.NumberOfSections = 0xffff;
+  CHECK(image.parse() == EFI_LOAD_ERROR);
+
+  image = {};
+  image.nt.OptionalHeader.SizeOfHeaders = 0x800;
+  CHECK(image.parse() == EFI_LOAD_ERROR);
+
+  image = {};
+  image.nt.OptionalHeader.AddressOfEntryPoint = 0x2000;
+  CHECK(image.parse() == EFI_LOAD_ERROR);
+
+  // Sections outside of the image or the file
+  image = {};
+  image.text.VirtualAddress = 0x1800;
+  image.text.Misc.VirtualSize = 0x1000;
+  CHECK(image.parse() == EFI_LOAD_ERROR);
+
+  image = {};
+  image.text.PointerToRawData = 0x300;
+  CHECK(image.parse() == EFI_LOAD_ERROR);
+
+  image = {};
+  image.text.PointerToRawData = 0xffff'f000;
+  CHECK(image.parse() == EFI_LOAD_ERROR);
+
+  // Rejected before its contents are allocated
+  image = {};
+  image.nt.OptionalHeader.SizeOfImage = 0xffff'f000;
+  CHECK(image.parse() == EFI_OUT_OF_RESOURCES);
+  image.nt.OptionalHeader.SizeOfImage = PEImage::max_size + 1;
+  CHECK(image.parse() == EFI_OUT_OF_RESOURCES);
+}
@@ -0,0 +1,20 @@
+#include <efi.h>
+#include <efilib.h>
+
+// Pool memory is not executable, calling into it must end the run with a
+// page fault that uiu reports.
+EFI_STATUS
+EFIAPI
+efi_main(EFI_HANDLE ImageHandle, EFI_SYSTEM_TABLE *SystemTable) {
+  InitializeLib(ImageHandle, SystemTable);
+  UINT8 *code;
+  EFI_STATUS status = uefi_call_wrapper(BS->AllocatePool, 3, EfiLoaderData, 1, (VOID **)&code);
+  if (EFI_ERROR(status)) {
+    Print(L"AllocatePool: %r\n", status);
+    return status;
+  }
+  code[0] = 0xc3;  // ret
+  ((VOID (*)(VOID))code)();
+  Print(L"Pool memory is executable\n");
+  return EFI_ABORTED;
+}
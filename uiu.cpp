@@ -1,101 +1,532 @@
-#include <bit>
+#include <algorithm>
+#include <chrono>
+#include <csignal>
 #include <cstdint>
+#include <cstdio>
 #include <cstdlib>
+#include <filesystem>
 #include <fmt/format.h>
 #include <fstream>
+#include <functional>
 #include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
 #define GNU_EFI_USE_MS_ABI
 extern "C" {
 #include <efi.h>
 #include <x86_64/pe.h>
-#include <sys/mman.h>
+#include <getopt.h>
+#include <unistd.h>
 }
 
+#include "CallTrace.h"
+#include "Daemon.h"
+#include "Image.h"
 #include "KVM.h"
-#include "Machine.h"
-#include "Rflags.h"
+#include "MockBackend.h"
+#include "Options.h"
+#include "Placement.h"
 #include "UIU.h"
-#include "CR0.h"
-#include "CR3.h"
-#include "CR4.h"
-#include "EFER.h"
 
-
-// vvvvvvvvvvvvvvvvv PE LOADER vvvvvvvvvvvvvvvvvvvvv
-
-std::size_t load(std::ifstream ifs, void* base) {
-  IMAGE_DOS_HEADER dos_header;
-  if (!ifs.read(reinterpret_cast<char*>(&dos_header), sizeof(dos_header))) {
-    fmt::println("Unable to read DOS header");
-    std::terminate();
+// Reads a whole file, returns false if it cannot be read
+bool read_file(const std::string& path, std::vector<std::byte>& contents) {
+  std::ifstream file{path, std::ios::binary};
+  if (!file) {
+    return false;
   }
+  std::vector<char> bytes{std::istreambuf_iterator<char>{file}, {}};
+  auto span = std::as_bytes(std::span{bytes});
+  contents.assign(span.begin(), span.end());
+  return !file.bad();
+}
 
-  if (dos_header.e_magic != IMAGE_DOS_SIGNATURE) {
-    fmt::println("DOS header magic does not match");
-    std::terminate();
+// Reads and parses an image, printing why that failed
+bool read_image(const std::string& path, std::vector<std::byte>& contents, PEImage& image) {
+  if (!read_file(path, contents)) {
+    fmt::println("Unable to open file {}", path);
+    return false;
   }
-
-  ifs.seekg(dos_header.e_lfanew);
-
-  IMAGE_NT_HEADERS pe_header;
-  if (!ifs.read(reinterpret_cast<char*>(&pe_header), sizeof(pe_header))) {
-    fmt::println("Unable to read PE header");
-    std::terminate();
+  auto status = PEImage::parse(contents, image);
+  if (status != EFI_SUCCESS) {
+    fmt::println("Unable to load {}: {:#x}", path, status);
+    return false;
   }
+  return true;
+}
 
-  if (pe_header.Signature != IMAGE_NT_SIGNATURE) {
-    fmt::println("PE header magic does not match");
-    std::terminate();
+// Replays the hypercalls of --trace-calls on MockBackend and prints how long
+// their handlers took, per hypercall
+int bench_calls(const std::string& path, const PEImage& start, const PEImage& application, std::uint64_t executable) {
+  auto trace = CallTrace::replay(path, executable);
+  MockBackend backend;
+  backend.memory_address = trace.memory;
+  KVM kvm{backend};
+  UIU uiu(kvm);
+  // Output of the application would drown the results
+  std::unique_ptr<std::FILE, decltype(&std::fclose)> null{std::fopen("/dev/null", "w"), &std::fclose};
+  if (null) {
+    uiu.console = null.get();
+  }
+  uiu.prepare(start);
+  if (auto status = uiu.load_application(application); status != EFI_SUCCESS) {
+    fmt::println("Unable to load the executable: {:#x}", status);
+    return EXIT_FAILURE;
   }
 
-  ifs.seekg(dos_header.e_lfanew + 4 + sizeof(IMAGE_FILE_HEADER) + pe_header.FileHeader.SizeOfOptionalHeader);
-
-  std::vector<IMAGE_SECTION_HEADER> section_table;
-  section_table.resize(pe_header.FileHeader.NumberOfSections);
-  for (std::uint32_t i = 0; i < pe_header.FileHeader.NumberOfSections; i++) {
-    if (!ifs.read(reinterpret_cast<char*>(&section_table[i]), sizeof(IMAGE_SECTION_HEADER))) {
-      fmt::println("Unable to read section header #{}", i);
-      std::terminate();
-    }
+  struct Handler {
+    std::uint64_t calls = 0;
+    std::chrono::nanoseconds time{};
+  };
+  std::map<UIUAPITag, Handler> handlers;
+  Handler total;
+  uiu.replay_calls(trace, [&](UIUAPITag tag, std::chrono::nanoseconds time) {
+    auto& handler = handlers[tag];
+    handler.calls++;
+    handler.time += time;
+    total.calls++;
+    total.time += time;
+  });
+
+  auto row = [](std::string_view name, const Handler& handler) {
+    auto ns = handler.time.count();
+    fmt::println("{:<26} {:>10} {:>14} {:>10} {:>12.0f}", name, handler.calls, ns, ns / handler.calls,
+                 ns == 0 ? 0.0 : handler.calls * 1e9 / ns);
+  };
+  fmt::println("{:<26} {:>10} {:>14} {:>10} {:>12}", "hypercall", "calls", "ns", "ns/call", "calls/s");
+  for (const auto& [tag, handler] : handlers) {
+    row(format_as(tag), handler);
   }
-  void* mapping = base;
-  for (const auto& section : section_table) {
-    ifs.seekg(section.PointerToRawData);
-    // TODO assert that section.size_of_raw_data >= section.virtual_size
-    if (!ifs.read(reinterpret_cast<char*>(mapping) + section.VirtualAddress, section.SizeOfRawData)) {
-      fmt::println("loading section failed!");
-      std::terminate();
-    }
-    //fmt::println("name: {}", (char*)section.Name);
-    //fmt::println("  start: {:x}", section.VirtualAddress);
-    //fmt::println("  size: {:x}", section.SizeOfRawData);
-    //fmt::println("  characteristics: {:x}", section.Characteristics);
-    //fmt::println("  content: {:x} {:x} {:x} ...", ((char*)mapping)[0], ((char*)mapping)[1], ((char*)mapping)[2]);
-    //fmt::println("  pointer to relocations: {:x}", section.PointerToRelocations);
+  if (total.calls > 0) {
+    row("total", total);
   }
-
-  //fmt::println("address of entry point: {}", pe_header.OptionalHeader.AddressOfEntryPoint);
-  return pe_header.OptionalHeader.AddressOfEntryPoint;
+  return EXIT_SUCCESS;
 }
 
-// ^^^^^^^^^^^^^^^^^ PE LOADER ^^^^^^^^^^^^^^^^^^^^^
-
 void usage(int argc, char** argv) {
   const char* name = "uiu";
   if (argc > 0) {
     name = argv[0];
   }
-  fmt::println("Usage: {} <efi executable>", name);
+  fmt::println("Usage: {} [options] <efi executable>", name);
+  fmt::println("       {} --daemon <socket> [--instances <n>] [--cpus <list>] [--slice <ms>]", name);
+  fmt::println("       {} --connect <socket> <efi executable>", name);
+  fmt::println("");
+  fmt::println("Options:");
+  fmt::println("  --tsc-khz <khz>    run the guest TSC at a fixed frequency");
+  fmt::println("  --rng-seed <seed>  make EFI_RNG_PROTOCOL deterministic, for benchmarks only");
+  fmt::println("  --disk <path>      expose an image file or block device as EFI_BLOCK_IO_PROTOCOL");
+  fmt::println("  --disk-ro <path>   same as --disk, but read-only");
+  fmt::println("  --disk-cow <base>[:<overlay>]");
+  fmt::println("                     expose a writable copy-on-write view of base, keeping the");
+  fmt::println("                     changes in overlay, or in memory if no overlay is given");
+  fmt::println("  --dir <path>       expose a directory as EFI_SIMPLE_FILE_SYSTEM_PROTOCOL");
+  fmt::println("  --gop <width>x<height>");
+  fmt::println("                     provide EFI_GRAPHICS_OUTPUT_PROTOCOL with this resolution");
+  fmt::println("  --capture-dir <dir>");
+  fmt::println("                     write every changed frame to dir as a PPM file, implies --gop");
+  fmt::println("  --capture-stream <path>");
+  fmt::println("                     append every changed frame to a stream of PPM images, implies --gop");
+  fmt::println("  --profile <path>   sample the guest's stacks and write them to path as collapsed");
+  fmt::println("                     stacks for flamegraph.pl");
+  fmt::println("  --profile-hz <hz>  sampling rate of --profile, default 999");
+  fmt::println("  --alloc-profile <path>");
+  fmt::println("                     attribute AllocatePool to the guest's call sites, report the");
+  fmt::println("                     leaks at exit and write the live bytes to path as collapsed");
+  fmt::println("                     stacks, and to path.exhausted when the pool runs out");
+  fmt::println("  --alloc-profile-rate <bytes>");
+  fmt::println("                     walk the stack of one allocation per bytes on average,");
+  fmt::println("                     default 65536, 1 walks every one");
+  fmt::println("  --alloc-profile-depth <n>");
+  fmt::println("                     frames kept of each call site, default 1");
+  fmt::println("  --sanitize-heap    surround pool allocations with redzones and quarantine freed");
+  fmt::println("                     ones, report overflows, uses after free and bad frees");
+  fmt::println("  --sanitize-heap-guard-pages");
+  fmt::println("                     same, with a page that is not present after every allocation");
+  fmt::println("                     and quarantined ones not present, so that accesses fault");
+  fmt::println("  --heap-quarantine <bytes>");
+  fmt::println("                     size of the quarantine of --sanitize-heap, default 16 MiB");
+  fmt::println("  --coverage-bitmap <path>");
+  fmt::println("                     record which basic blocks of the executable run and write a");
+  fmt::println("                     bitmap of them to path, one bit per block in address order");
+  fmt::println("  --coverage-lcov <path>");
+  fmt::println("                     same, written as lcov tracefile with RVAs as line numbers");
+  fmt::println("  --coverage-drcov <path>");
+  fmt::println("                     same, written in the drcov format of DynamoRIO");
+  fmt::println("  --perf-counters    count cycles, instructions and cache, branch and dTLB misses");
+  fmt::println("                     of the guest and of each hypercall handler, report them at exit");
+  fmt::println("  --msrs <path>      emulate the MSRs listed in path, see MSRs.h for the format");
+  fmt::println("  --record <path>    log the random numbers, times, timer expirations and block I/O");
+  fmt::println("                     results the executable gets to path");
+  fmt::println("  --replay <path>    run the executable with the inputs logged by --record, given");
+  fmt::println("                     the same options, disks and directories");
+  fmt::println("  --trace-calls <path>");
+  fmt::println("                     write the hypercalls of the executable and the guest memory");
+  fmt::println("                     they see to path, for --bench-calls");
+  fmt::println("  --bench-calls <path>");
+  fmt::println("                     feed the hypercalls of --trace-calls to their handlers without");
+  fmt::println("                     running the executable or opening /dev/kvm, and report how");
+  fmt::println("                     long each took, given the same executable and no devices");
+  fmt::println("  --budget <s>       stop the executable after s seconds of wall-clock time");
+  fmt::println("  --cpu-budget <s>   stop the executable after s seconds of CPU time of its vCPU");
+  fmt::println("  --cpus <list>      pin the vCPU thread to the first CPU of list, like 0-3,8, or");
+  fmt::println("                     with --daemon run a worker on every CPU of list");
+  fmt::println("  --bind-memory      allocate guest memory on the NUMA node of the vCPU's CPU,");
+  fmt::println("                     needs --cpus");
+  fmt::println("  --dedicated-core   give every vCPU its CPU to itself: HLT and PAUSE do not exit");
+  fmt::println("                     and uiu busy-polls instead of sleeping, needs --cpus");
+  fmt::println("  --daemon <socket>  keep prepared instances and run the executables submitted");
+  fmt::println("                     with --connect, without any devices");
+  fmt::println("  --instances <n>    number of instances of --daemon, default one per CPU, or one");
+  fmt::println("                     per CPU of --cpus, may be more than there are workers");
+  fmt::println("  --slice <ms>       time a worker of --daemon runs an instance before it runs the");
+  fmt::println("                     next, default 10");
+  fmt::println("  --connect <socket> run the executable in the daemon listening on socket");
 }
 
-int main(int argc, char** argv) {
-  if (argc != 2) {
+// Errors that end a run, like files that cannot be opened or a replay that
+// diverged, are printed instead of aborting.
+int main(int argc, char** argv) try {
+  enum {
+    OPT_TSC_KHZ = 256,
+    OPT_RNG_SEED,
+    OPT_DISK,
+    OPT_DISK_RO,
+    OPT_DISK_COW,
+    OPT_DIR,
+    OPT_GOP,
+    OPT_CAPTURE_DIR,
+    OPT_CAPTURE_STREAM,
+    OPT_PROFILE,
+    OPT_PROFILE_HZ,
+    OPT_ALLOC_PROFILE,
+    OPT_ALLOC_PROFILE_RATE,
+    OPT_ALLOC_PROFILE_DEPTH,
+    OPT_SANITIZE_HEAP,
+    OPT_SANITIZE_HEAP_GUARD_PAGES,
+    OPT_HEAP_QUARANTINE,
+    OPT_COVERAGE_BITMAP,
+    OPT_COVERAGE_LCOV,
+    OPT_COVERAGE_DRCOV,
+    OPT_PERF_COUNTERS,
+    OPT_MSRS,
+    OPT_RECORD,
+    OPT_REPLAY,
+    OPT_TRACE_CALLS,
+    OPT_BENCH_CALLS,
+    OPT_BUDGET,
+    OPT_CPU_BUDGET,
+    OPT_CPUS,
+    OPT_BIND_MEMORY,
+    OPT_DEDICATED_CORE,
+    OPT_DAEMON,
+    OPT_INSTANCES,
+    OPT_SLICE,
+    OPT_CONNECT,
+  };
+  static const option long_options[] = {
+    {"tsc-khz", required_argument, nullptr, OPT_TSC_KHZ},
+    {"rng-seed", required_argument, nullptr, OPT_RNG_SEED},
+    {"disk", required_argument, nullptr, OPT_DISK},
+    {"disk-ro", required_argument, nullptr, OPT_DISK_RO},
+    {"disk-cow", required_argument, nullptr, OPT_DISK_COW},
+    {"dir", required_argument, nullptr, OPT_DIR},
+    {"gop", required_argument, nullptr, OPT_GOP},
+    {"capture-dir", required_argument, nullptr, OPT_CAPTURE_DIR},
+    {"capture-stream", required_argument, nullptr, OPT_CAPTURE_STREAM},
+    {"profile", required_argument, nullptr, OPT_PROFILE},
+    {"profile-hz", required_argument, nullptr, OPT_PROFILE_HZ},
+    {"alloc-profile", required_argument, nullptr, OPT_ALLOC_PROFILE},
+    {"alloc-profile-rate", required_argument, nullptr, OPT_ALLOC_PROFILE_RATE},
+    {"alloc-profile-depth", required_argument, nullptr, OPT_ALLOC_PROFILE_DEPTH},
+    {"sanitize-heap", no_argument, nullptr, OPT_SANITIZE_HEAP},
+    {"sanitize-heap-guard-pages", no_argument, nullptr, OPT_SANITIZE_HEAP_GUARD_PAGES},
+    {"heap-quarantine", required_argument, nullptr, OPT_HEAP_QUARANTINE},
+    {"coverage-bitmap", required_argument, nullptr, OPT_COVERAGE_BITMAP},
+    {"coverage-lcov", required_argument, nullptr, OPT_COVERAGE_LCOV},
+    {"coverage-drcov", required_argument, nullptr, OPT_COVERAGE_DRCOV},
+    {"perf-counters", no_argument, nullptr, OPT_PERF_COUNTERS},
+    {"msrs", required_argument, nullptr, OPT_MSRS},
+    {"record", required_argument, nullptr, OPT_RECORD},
+    {"replay", required_argument, nullptr, OPT_REPLAY},
+    {"trace-calls", required_argument, nullptr, OPT_TRACE_CALLS},
+    {"bench-calls", required_argument, nullptr, OPT_BENCH_CALLS},
+    {"budget", required_argument, nullptr, OPT_BUDGET},
+    {"cpu-budget", required_argument, nullptr, OPT_CPU_BUDGET},
+    {"cpus", required_argument, nullptr, OPT_CPUS},
+    {"bind-memory", no_argument, nullptr, OPT_BIND_MEMORY},
+    {"dedicated-core", no_argument, nullptr, OPT_DEDICATED_CORE},
+    {"daemon", required_argument, nullptr, OPT_DAEMON},
+    {"instances", required_argument, nullptr, OPT_INSTANCES},
+    {"slice", required_argument, nullptr, OPT_SLICE},
+    {"connect", required_argument, nullptr, OPT_CONNECT},
+    {},
+  };
+
+  std::optional<std::uint32_t> tsc_khz;
+  std::optional<std::uint64_t> rng_seed;
+  std::vector<std::pair<std::string, bool>> disks;  // path, read-only
+  std::vector<std::pair<std::string, std::string>> cow_disks;  // base, overlay
+  std::vector<std::string> dirs;
+  std::optional<std::pair<std::uint32_t, std::uint32_t>> gop;  // width, height
+  std::optional<std::string> capture_dir;
+  std::optional<std::string> capture_stream;
+  std::optional<std::string> profile;
+  std::uint32_t profile_hz = 999;
+  std::optional<std::string> alloc_profile;
+  std::uint64_t alloc_profile_rate = 65536;
+  std::size_t alloc_profile_depth = 1;
+  bool sanitize_heap = false;
+  HeapSanitizer::Options heap_sanitizer;
+  std::optional<std::string> coverage_bitmap;
+  std::optional<std::string> coverage_lcov;
+  std::optional<std::string> coverage_drcov;
+  bool perf_counters = false;
+  std::optional<std::string> msrs;
+  std::optional<std::string> record;
+  std::optional<std::string> replay;
+  std::optional<std::string> trace_calls;
+  std::optional<std::string> bench;
+  UIU::Budget budget;
+  std::vector<int> cpus;
+  bool bind_memory = false;
+  bool dedicated_core = false;
+  std::optional<std::string> daemon;
+  std::optional<std::size_t> instances;
+  std::chrono::milliseconds slice{10};
+  std::optional<std::string> connect;
+
+  for (int opt; (opt = getopt_long(argc, argv, "", long_options, nullptr)) != -1;) {
+    switch (opt) {
+    case OPT_TSC_KHZ:
+      tsc_khz = parse_number<std::uint32_t>(optarg);
+      if (!tsc_khz) {
+        usage(argc, argv);
+        return EXIT_FAILURE;
+      }
+      break;
+    case OPT_RNG_SEED:
+      rng_seed = parse_number<std::uint64_t>(optarg);
+      if (!rng_seed) {
+        usage(argc, argv);
+        return EXIT_FAILURE;
+      }
+      break;
+    case OPT_DISK:
+      disks.emplace_back(optarg, false);
+      break;
+    case OPT_DISK_RO:
+      disks.emplace_back(optarg, true);
+      break;
+    case OPT_DISK_COW: {
+      std::string_view arg = optarg;
+      auto colon = arg.find(':');
+      if (colon == arg.npos) {
+        cow_disks.emplace_back(arg, "");
+      } else {
+        cow_disks.emplace_back(arg.substr(0, colon), arg.substr(colon + 1));
+      }
+      break;
+    }
+    case OPT_DIR:
+      dirs.emplace_back(optarg);
+      break;
+    case OPT_GOP: {
+      std::string_view arg = optarg;
+      auto x = arg.find('x');
+      auto width = parse_number<std::uint32_t>(arg.substr(0, x));
+      auto height = x == arg.npos ? std::nullopt : parse_number<std::uint32_t>(arg.substr(x + 1));
+      if (!width || !height) {
+        usage(argc, argv);
+        return EXIT_FAILURE;
+      }
+      gop.emplace(*width, *height);
+      break;
+    }
+    case OPT_CAPTURE_DIR:
+      capture_dir = optarg;
+      break;
+    case OPT_CAPTURE_STREAM:
+      capture_stream = optarg;
+      break;
+    case OPT_PROFILE:
+      profile = optarg;
+      break;
+    case OPT_PROFILE_HZ:
+      profile_hz = parse_number<std::uint32_t>(optarg).value_or(0);
+      if (profile_hz == 0) {
+        usage(argc, argv);
+        return EXIT_FAILURE;
+      }
+      break;
+    case OPT_ALLOC_PROFILE:
+      alloc_profile = optarg;
+      break;
+    case OPT_ALLOC_PROFILE_RATE:
+      alloc_profile_rate = parse_number<std::uint64_t>(optarg).value_or(0);
+      if (alloc_profile_rate == 0) {
+        usage(argc, argv);
+        return EXIT_FAILURE;
+      }
+      break;
+    case OPT_ALLOC_PROFILE_DEPTH:
+      alloc_profile_depth = parse_number<std::size_t>(optarg).value_or(0);
+      if (alloc_profile_depth == 0) {
+        usage(argc, argv);
+        return EXIT_FAILURE;
+      }
+      break;
+    case OPT_SANITIZE_HEAP:
+      sanitize_heap = true;
+      break;
+    case OPT_SANITIZE_HEAP_GUARD_PAGES:
+      sanitize_heap = true;
+      heap_sanitizer.guard_pages = true;
+      break;
+    case OPT_HEAP_QUARANTINE:
+      if (auto quarantine = parse_number<std::uint64_t>(optarg)) {
+        heap_sanitizer.quarantine = *quarantine;
+      } else {
+        usage(argc, argv);
+        return EXIT_FAILURE;
+      }
+      break;
+    case OPT_COVERAGE_BITMAP:
+      coverage_bitmap = optarg;
+      break;
+    case OPT_COVERAGE_LCOV:
+      coverage_lcov = optarg;
+      break;
+    case OPT_COVERAGE_DRCOV:
+      coverage_drcov = optarg;
+      break;
+    case OPT_PERF_COUNTERS:
+      perf_counters = true;
+      break;
+    case OPT_MSRS:
+      msrs = optarg;
+      break;
+    case OPT_RECORD:
+      record = optarg;
+      break;
+    case OPT_REPLAY:
+      replay = optarg;
+      break;
+    case OPT_TRACE_CALLS:
+      trace_calls = optarg;
+      break;
+    case OPT_BENCH_CALLS:
+      bench = optarg;
+      break;
+    case OPT_BUDGET:
+    case OPT_CPU_BUDGET: {
+      auto seconds = parse_number<double>(optarg).value_or(0);
+      if (!(seconds > 0) || std::chrono::duration<double>{seconds} > std::chrono::nanoseconds::max()) {
+        usage(argc, argv);
+        return EXIT_FAILURE;
+      }
+      auto duration = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::duration<double>{seconds});
+      (opt == OPT_BUDGET ? budget.wall_clock : budget.cpu_time) = duration;
+      break;
+    }
+    case OPT_CPUS: {
+      auto list = parse_cpu_list(optarg);
+      if (!list || list->empty()) {
+        usage(argc, argv);
+        return EXIT_FAILURE;
+      }
+      cpus = std::move(*list);
+      break;
+    }
+    case OPT_BIND_MEMORY:
+      bind_memory = true;
+      break;
+    case OPT_DEDICATED_CORE:
+      dedicated_core = true;
+      break;
+    case OPT_DAEMON:
+      daemon = optarg;
+      break;
+    case OPT_INSTANCES:
+      instances = parse_number<std::size_t>(optarg).value_or(0);
+      if (*instances == 0) {
+        usage(argc, argv);
+        return EXIT_FAILURE;
+      }
+      break;
+    case OPT_SLICE:
+      slice = std::chrono::milliseconds{parse_number<std::uint32_t>(optarg).value_or(0)};
+      if (slice.count() == 0) {
+        usage(argc, argv);
+        return EXIT_FAILURE;
+      }
+      break;
+    case OPT_CONNECT:
+      connect = optarg;
+      break;
+    default:
+      usage(argc, argv);
+      return EXIT_FAILURE;
+    }
+  }
+  bool coverage = coverage_bitmap || coverage_lcov || coverage_drcov;
+  // A replay of the hypercalls has none of the devices
+  bool devices = !disks.empty() || !cow_disks.empty() || !dirs.empty() || gop || capture_dir || capture_stream || msrs;
+  if (daemon) {
+    if (optind != argc || connect || devices || profile || alloc_profile || sanitize_heap || coverage || perf_counters || record || replay || trace_calls || bench || tsc_khz || rng_seed) {
+      usage(argc, argv);
+      return EXIT_FAILURE;
+    }
+  } else if (optind != argc - 1 || (record && replay) || ((trace_calls || bench) && devices)) {
     usage(argc, argv);
     return EXIT_FAILURE;
   }
-  const char* filename = argv[1];
+  if (bench && (connect || trace_calls || record || replay || profile || alloc_profile || sanitize_heap || coverage || perf_counters || tsc_khz || !cpus.empty())) {
+    usage(argc, argv);
+    return EXIT_FAILURE;
+  }
+  if ((bind_memory || dedicated_core) && cpus.empty()) {
+    usage(argc, argv);
+    return EXIT_FAILURE;
+  }
+
+  if (connect) {
+    std::vector<std::byte> file;
+    if (!read_file(argv[optind], file)) {
+      fmt::println("Unable to open file {}", argv[optind]);
+      return EXIT_FAILURE;
+    }
+    auto reply = Daemon::submit(*connect, file, STDOUT_FILENO);
+    if (!reply.exited) {
+      fmt::println("{} did not exit: {:#x}", argv[optind], reply.status);
+      return EXIT_FAILURE;
+    }
+    return reply.status == EFI_SUCCESS ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+  std::vector<std::byte> start_file;
+  PEImage start;
+  if (!read_image("build/start.efi", start_file, start)) {
+    return EXIT_FAILURE;
+  }
+
+  if (bench) {
+    std::vector<std::byte> application_file;
+    PEImage application;
+    if (!read_image(argv[optind], application_file, application)) {
+      return EXIT_FAILURE;
+    }
+    std::string_view contents{reinterpret_cast<const char*>(application_file.data()), application_file.size()};
+    return bench_calls(*bench, start, application, std::hash<std::string_view>{}(contents));
+  }
 
   KVM kvm;
   if (!kvm) {
@@ -105,106 +536,196 @@ int main(int argc, char** argv) {
 
   fmt::println("api version = {}", kvm.get_api_version());
 
-  UIU uiu(kvm);
-
-  auto vm = kvm.create_vm();
+  if (dedicated_core) {
+    constexpr int exits = KVM_X86_DISABLE_EXITS_HLT|KVM_X86_DISABLE_EXITS_PAUSE;
+    if ((kvm.check_extension(KVM_CAP_X86_DISABLE_EXITS) & exits) != exits) {
+      fmt::println("KVM cannot leave HLT and PAUSE to the guest");
+      return EXIT_FAILURE;
+    }
+  }
+  auto placement = [&](std::size_t i) {
+    Placement placement{.bind_memory_to_node = bind_memory, .dedicated_core = dedicated_core};
+    if (!cpus.empty()) {
+      placement.cpu = cpus[i % cpus.size()];
+    }
+    return placement;
+  };
 
-  void* memory = uiu.machine.memory.data();
+  if (daemon) {
+    std::size_t workers = cpus.empty() ? std::max(1u, std::thread::hardware_concurrency()) : cpus.size();
+    if (!instances) {
+      instances = workers;
+    }
+    std::vector<Placement> placements;
+    for (std::size_t i = 0; i < *instances; i++) {
+      placements.push_back(placement(i));
+    }
+    std::vector<Placement> cores;
+    for (std::size_t i = 0; i < workers; i++) {
+      cores.push_back(placement(i));
+    }
+    // Clients that go away must not take the daemon with them
+    signal(SIGPIPE, SIG_IGN);
+    Daemon{kvm, *daemon, start, budget}.serve(placements, cores, slice);
+    return EXIT_SUCCESS;
+  }
 
-  kvm_userspace_memory_region region{
-    .slot = 0,
-    .guest_phys_addr = 0,
-    .memory_size = 0x4000'0000,
-    .userspace_addr = std::bit_cast<std::uint64_t>(memory),
-  };
-  uiu.machine.vm.set_user_memory_region(region);
-
-  auto sregs = uiu.machine.vcpu.get_sregs();
-  {
-    // See page 3041
-    /*std::uint64_t pml4_addr = 0x1000;
-    std::uint64_t* pml4 = (std::uint64_t*)((char*)memory + pml4_addr);
-    std::uint64_t pdpt_addr = 0x2000;
-    std::uint64_t* pdpt = (std::uint64_t*)((char*)memory + pdpt_addr);
-    std::uint64_t pd_addr = 0x3000;
-    std::uint64_t* pd = (std::uint64_t*)((char*)memory + pd_addr);
-    pml4[0] = 0x7 | pdpt_addr;
-    pdpt[0] = 0x7 | pd_addr;
-    pd[0] = 0x87;*/
-    std::uint64_t pml4_addr = 0xf1000;
-    std::uint64_t* pml4 = (std::uint64_t*)((char*)memory + pml4_addr);
-    std::uint64_t pdpt_addr = 0xf2000;
-    std::uint64_t* pdpt = (std::uint64_t*)((char*)memory + pdpt_addr);
-    pml4[0] = 0x7 | pdpt_addr;
-    pdpt[0] = 0x87;
-
-    sregs.cr0 = CR0{}.set_pe()
-                     .set_mp()
-                     .set_et()
-                     .set_ne()
-                     .set_wp()
-                     .set_am()
-                     .set_pg();
-
-    sregs.cr3 = pml4_addr;
-
-    sregs.cr4 = CR4{}.set_pae()
-                     .set_pge()
-                     .set_osfxsr()
-                     .set_osxmmexcpt();
-
-    sregs.efer = EFER{}.set_lme()
-                       .set_lma();
-
-    kvm_segment seg{
-      .base = 0,
-      .limit = 0x3fff'ffff,
-      .selector = 1<<3,
-      .type = 11,
-      .present = 1,
-      .dpl = 0,
-      .db = 0,
-      .s = 1,
-      .l = 1,
-      .g = 1,
-    };
-    sregs.cs = seg;
-    seg.type = 3;
-    seg.selector = 2<<3;
-    sregs.ds = sregs.es = sregs.fs = sregs.gs = sregs.ss = seg;
-  }
-  uiu.machine.vcpu.set_sregs(sregs);
-
-  // END KVM
-  //return EXIT_SUCCESS;
-
-  std::ifstream ifs{filename};
-  if (!ifs) {
-    fmt::println("Unable to open file {}", filename);
+  const char* filename = argv[optind];
+  std::vector<std::byte> application_file;
+  PEImage application;
+  if (!read_image(filename, application_file, application)) {
     return EXIT_FAILURE;
   }
 
-  //std::ifstream wrapper{"st/wrapper.efi"};
-  std::ifstream wrapper{"build/start.efi"};
-  if (!wrapper) {
-    fmt::println("Unable to open file st/wrapper.efi");
+  UIU uiu(kvm, placement(0));
+
+  if (tsc_khz) {
+    if (!kvm.check_extension(KVM_CAP_TSC_CONTROL)) {
+      fmt::println("KVM does not support setting the TSC frequency");
+      return EXIT_FAILURE;
+    }
+    uiu.machine.vcpu.set_tsc_khz(*tsc_khz);
+  }
+
+  if (rng_seed) {
+    uiu.entropy = Entropy(*rng_seed);
+  }
+
+  if (msrs) {
+    if (!kvm.check_extension(KVM_CAP_X86_USER_SPACE_MSR) || !kvm.check_extension(KVM_CAP_X86_MSR_FILTER)) {
+      fmt::println("KVM cannot pass MSR accesses to userspace");
+      return EXIT_FAILURE;
+    }
+    try {
+      uiu.emulate_msrs(MSRs::load(*msrs));
+    } catch (const std::runtime_error& e) {
+      fmt::println("{}", e.what());
+      return EXIT_FAILURE;
+    }
+  }
+
+  if (coverage) {
+    if (!kvm.check_extension(KVM_CAP_SET_GUEST_DEBUG)) {
+      fmt::println("KVM cannot set breakpoints in the guest");
+      return EXIT_FAILURE;
+    }
+    auto module = Module::parse(std::filesystem::path{filename}.filename().string(), application_file);
+    if (!module) {
+      fmt::println("Unable to parse {} for coverage", filename);
+      return EXIT_FAILURE;
+    }
+    uiu.attach_coverage(std::move(*module));
+  }
+
+  if (record || replay) {
+    auto& journal = uiu.attach_journal(record ? Journal::record(*record) : Journal::replay(*replay));
+    std::string_view contents{reinterpret_cast<const char*>(application_file.data()), application_file.size()};
+    journal.expect(Journal::Kind::executable, std::hash<std::string_view>{}(contents));
+  }
+
+  for (const auto& [path, read_only] : disks) {
+    uiu.attach_block_device(BlockDevice(path, read_only));
+  }
+  for (const auto& [base, overlay] : cow_disks) {
+    uiu.attach_block_device(BlockDevice(CowOverlay(base, overlay)));
+  }
+  for (const auto& path : dirs) {
+    uiu.attach_file_system(HostFileSystem(path));
+  }
+  if (!gop && (capture_dir || capture_stream)) {
+    gop.emplace(1024, 768);
+  }
+  if (gop) {
+    auto& framebuffer = uiu.attach_framebuffer(gop->first, gop->second);
+    if (capture_dir) {
+      framebuffer.capture_to_directory(*capture_dir);
+    }
+    if (capture_stream) {
+      framebuffer.capture_to_stream(*capture_stream);
+    }
+  }
+
+  uiu.prepare(start);
+  if (auto status = uiu.load_application(application); status != EFI_SUCCESS) {
+    fmt::println("Unable to load {}: {:#x}", filename, status);
     return EXIT_FAILURE;
   }
 
-  void* start = (char*)0x1'0000 + load(std::move(wrapper), (char*)memory + 0x1'0000);
-  void* efi_main_kvm = (char*)0x3800'0000 + load(std::move(ifs), (char*)memory + 0x3800'0000);
-  ((unsigned char*)memory)[0] = 0xf4;
+  if (profile) {
+    uiu.attach_profiler(profile_hz);
+  }
+  if (alloc_profile) {
+    uiu.attach_allocation_profiler(alloc_profile_rate, alloc_profile_depth);
+  }
+  if (sanitize_heap) {
+    uiu.attach_heap_sanitizer(heap_sanitizer);
+  }
+  if (profile || alloc_profile || sanitize_heap) {
+    uiu.unwinder.runtime = uiu.unwinder.add_module("start.efi", start_file);
+    uiu.unwinder.map_module(uiu.unwinder.runtime, UIU::start_base);
+    uiu.unwinder.map_module(uiu.unwinder.add_module(std::filesystem::path{filename}.filename().string(), application_file), UIU::application_base);
+  }
+
+  if (perf_counters) {
+    uiu.attach_perf_counters();
+  }
 
-  kvm_regs regs{
-    .rax = 2,
-    .rbx = 2,
-    .rcx = std::uint64_t(efi_main_kvm),
-    .rsp = 0x1fff'fff0,
-    .rip = std::uint64_t(start),
-    .rflags = Rflags{},
-  };
-  uiu.machine.vcpu.set_regs(regs);
+  if (trace_calls) {
+    std::string_view contents{reinterpret_cast<const char*>(application_file.data()), application_file.size()};
+    uiu.attach_call_trace(CallTrace::record(*trace_calls, std::hash<std::string_view>{}(contents), uiu.machine.memory.data()));
+  }
 
+  uiu.budget = budget;
   fmt::println("ENTERING VM");
-  uiu.run();
+  auto state = uiu.run();
+  if (state == UIU::RunState::out_of_budget) {
+    fmt::println("{} ran out of its budget", filename);
+  } else if (state == UIU::RunState::watchdog) {
+    fmt::println("The watchdog timer of {} expired", filename);
+  }
+
+  if (perf_counters) {
+    uiu.counters->report();
+  }
+
+  if (profile) {
+    uiu.profiler->write_collapsed(*profile);
+  }
+
+  if (alloc_profile) {
+    uiu.allocations->report();
+    uiu.allocations->write_snapshot(*alloc_profile, uiu.allocations->snapshot());
+    if (uiu.allocations->at_exhaustion) {
+      uiu.allocations->write_snapshot(*alloc_profile + ".exhausted", *uiu.allocations->at_exhaustion);
+    }
+  }
+
+  if (sanitize_heap) {
+    uiu.sanitizer->check();
+  }
+
+  if (replay && !uiu.journal->finished()) {
+    fmt::println("Replay: the run ended before the log did");
+  }
+
+  if (coverage) {
+    fmt::println("Coverage: {} of {} basic blocks", uiu.coverage->covered, uiu.coverage->size());
+    if (coverage_bitmap) {
+      uiu.coverage->write_bitmap(*coverage_bitmap);
+    }
+    if (coverage_lcov) {
+      uiu.coverage->write_lcov(*coverage_lcov);
+    }
+    if (coverage_drcov) {
+      uiu.coverage->write_drcov(*coverage_drcov);
+    }
+  }
+
+  if (sanitize_heap && uiu.sanitizer->errors != 0) {
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+} catch (const std::exception& e) {
+  fmt::println("{}", e.what());
+  return EXIT_FAILURE;
 }